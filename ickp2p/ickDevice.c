@@ -63,6 +63,9 @@ Remarks         : refactored from ickDiscoverRegistry
 #include "ickP2pInternal.h"
 #include "logutils.h"
 #include "ickDevice.h"
+#include "ickMainThread.h"
+#include "ickP2pCom.h"
+#include "ickPool.h"
 
 
 /*=========================================================================*\
@@ -80,7 +83,9 @@ Remarks         : refactored from ickDiscoverRegistry
 /*=========================================================================*\
   Private prototypes
 \*=========================================================================*/
-// none
+static const ickP2pWatermarks_t *_ickDeviceWatermarks( const ickDevice_t *device );
+static int _ickDeviceAboveHigh( const ickP2pWatermarks_t *marks, int cnt, size_t bytes );
+static int _ickDeviceBelowLow( const ickP2pWatermarks_t *marks, int cnt, size_t bytes );
 
 
 /*=========================================================================*\
@@ -106,6 +111,8 @@ ickDevice_t *_ickDeviceNew( const char *uuid )
     return NULL;
   }
   device->tCreation = _ickTimeNow();
+  device->shard     = -1;
+  device->wsiShard  = -1;
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -139,6 +146,7 @@ void _ickDeviceFree( ickDevice_t *device )
   Sfree( device->uuid );
   Sfree( device->location );
   Sfree( device->friendlyName );
+  Sfree( device->txBuffer );
   Sfree( device );
 }
 
@@ -150,22 +158,32 @@ void _ickDevicePurgeMessages( ickDevice_t *device )
 {
   ickMessage_t *msg, *next;
   int           num;
+  int           lane;
 
   debug( "_ickDevicePurgeMessages: uuid=\"%s\"", device->uuid );
 
 /*------------------------------------------------------------------------*\
     Delete unsent messages
 \*------------------------------------------------------------------------*/
-  if( device->outQueue ) {
-    for( num=0,msg=device->outQueue; msg; msg=next ) {
+  for( lane=0; lane<ICKP2P_PRIORITIES; lane++ ) {
+    if( !device->outQueue[lane] )
+      continue;
+    for( num=0,msg=device->outQueue[lane]; msg; msg=next ) {
       next = msg->next;
-      Sfree( msg->payload );
-      Sfree( msg )
+      __sync_sub_and_fetch( &device->ictx->outQueueCnt, 1 );
+      __sync_sub_and_fetch( &device->ictx->outQueueBytes, msg->size );
+      _ickDeviceFreeMessage( msg );
       num++;
     }
-    device->outQueue = NULL;
-    loginfo( "_ickDevicePurgeMessages: Deleted %d unsent messages in outQueue.", num );
+    device->outQueue[lane]     = NULL;
+    device->outQueueTail[lane] = NULL;
+    loginfo( "_ickDevicePurgeMessages: Deleted %d unsent messages in outQueue (priority %d).",
+             num, lane );
   }
+  device->outQueueCnt    = 0;
+  device->outQueueBytes  = 0;
+  device->outHighStreak  = 0;
+  device->outBusy        = 0;
 
 /*------------------------------------------------------------------------*\
     Delete undelivered messages
@@ -173,11 +191,13 @@ void _ickDevicePurgeMessages( ickDevice_t *device )
   if( device->inQueue ) {
     for( num=0,msg=device->inQueue; msg; msg=next ) {
       next = msg->next;
-      Sfree( msg->payload );
-      Sfree( msg )
+      _ickDeviceFreeMessage( msg );
       num++;
     }
-    device->inQueue = NULL;
+    device->inQueue      = NULL;
+    device->inQueueTail  = NULL;
+    device->inQueueCnt   = 0;
+    device->inQueueBytes = 0;
     loginfo( "_ickDevicePurgeMessages: Deleted %d undelivered messages in inQueue.", num );
   }
 
@@ -254,39 +274,67 @@ ickErrcode_t _ickDeviceSetName( ickDevice_t *device, const char *name )
 /*=========================================================================*\
   Add a message container to the output queue
     caller should lock the device
-    container needs to be allocated and will be freed when the message is destroyed
+    container needs to be allocated from the context message pool and will be
+    freed when the message is destroyed
     container must including LWS padding, while size does NOT include LWS padding
+    if buffer is not NULL, container points into this zero-copy buffer, which
+    is referenced by the message instead of the container being owned
     caller should free the payload in case an error code is returned
+    mFlags are kept to identify notifications for the overflow policy
+    priority selects the lane, see _ickDeviceOutQueue()
+    this does not check watermarks (see _ickDeviceOutBusy()) but marks the
+    device and the context as busy if a high watermark is reached
 \*=========================================================================*/
-ickErrcode_t _ickDeviceAddOutMessage( ickDevice_t *device, void *container, size_t size )
+ickErrcode_t _ickDeviceAddOutMessage( ickDevice_t *device, void *container, size_t size, ickMsgBuffer_t *buffer,
+                                      ickP2pMessageFlag_t mFlags, ickP2pPriority_t priority )
 {
-  ickMessage_t *message;
-  ickMessage_t *walk;
+  ickP2pContext_t *ictx = device->ictx;
+  ickMessage_t    *message;
   debug ( "_ickDeviceAddOutMessage (%s): %ld bytes", device->uuid, (long)size );
 
 /*------------------------------------------------------------------------*\
     Allocate and initialize message descriptor
 \*------------------------------------------------------------------------*/
-  message = calloc( 1, sizeof(ickMessage_t) );
+  message = _ickPoolAlloc( device->ictx->messagePool, sizeof(ickMessage_t) );
   if( !message ) {
     logerr( "_ickDeviceAddOutMessage: out of memory" );
     return ICKERR_NOMEM;
   }
+  memset( message, 0, sizeof(ickMessage_t) );
   message->tCreated = _ickTimeNow();
   message->payload  = container;
+  message->buffer   = buffer;
   message->size     = size;
   message->issued   = 0;
+  message->flags    = mFlags;
+  message->priority = priority;
 
 /*------------------------------------------------------------------------*\
-    Link to end of output queue
+    Link to end of output queue lane
 \*------------------------------------------------------------------------*/
-  if( !device->outQueue )
-    device->outQueue = message;
-  else {
-    for( walk=device->outQueue; walk->next; walk=walk->next );
-    message->prev = walk;
-    walk->next    = message;
+  message->prev = device->outQueueTail[priority];
+  if( device->outQueueTail[priority] )
+    device->outQueueTail[priority]->next = message;
+  else
+    device->outQueue[priority] = message;
+  device->outQueueTail[priority] = message;
+  device->outQueueCnt++;
+  device->outQueueBytes += size;
+
+/*------------------------------------------------------------------------*\
+    Update flow control state of device and context
+\*------------------------------------------------------------------------*/
+  __sync_add_and_fetch( &ictx->outQueueCnt, 1 );
+  __sync_add_and_fetch( &ictx->outQueueBytes, size );
+  if( !device->outBusy &&
+      _ickDeviceAboveHigh(_ickDeviceWatermarks(device),device->outQueueCnt,device->outQueueBytes) ) {
+    debug( "_ickDeviceAddOutMessage (%s): reached high watermark", device->uuid );
+    device->outBusy = 1;
   }
+  if( !ictx->outBusy &&
+      _ickDeviceAboveHigh(&ictx->globalWatermarks,ictx->outQueueCnt,ictx->outQueueBytes) &&
+      __sync_bool_compare_and_swap(&ictx->outBusy,0,1) )
+    debug( "_ickDeviceAddOutMessage (%s): reached global high watermark", device->uuid );
 
 /*------------------------------------------------------------------------*\
     That's it
@@ -304,17 +352,14 @@ ickErrcode_t _ickDeviceAddOutMessage( ickDevice_t *device, void *container, size
 \*=========================================================================*/
 ickErrcode_t _ickDeviceUnlinkOutMessage( ickDevice_t *device, ickMessage_t *message )
 {
-  ickMessage_t *walk;
+  ickP2pPriority_t lane = message->priority;
   debug( "_ickDeviceUnlinkOutMessage (%s): message %p (%ld bytes)",
          device->uuid, message, message->size );
 
 /*------------------------------------------------------------------------*\
     Check if member
 \*------------------------------------------------------------------------*/
-  for( walk=device->outQueue; walk->next; walk=walk->next )
-    if( walk==message )
-      break;
-  if( !walk ) {
+  if( message->prev ? message->prev->next!=message : device->outQueue[lane]!=message ) {
     logerr( "_ickDeviceUnlinkOutMessage (%s): message not member of output queue",
             device->uuid );
     return ICKERR_NOMEMBER;
@@ -325,10 +370,22 @@ ickErrcode_t _ickDeviceUnlinkOutMessage( ickDevice_t *device, ickMessage_t *mess
 \*------------------------------------------------------------------------*/
   if( message->next )
     message->next->prev = message->prev;
+  else
+    device->outQueueTail[lane] = message->prev;
   if( message->prev )
     message->prev->next = message->next;
   else
-    device->outQueue = message->next;
+    device->outQueue[lane] = message->next;
+  message->next = NULL;
+  message->prev = NULL;
+
+/*------------------------------------------------------------------------*\
+    Account for flow control
+\*------------------------------------------------------------------------*/
+  device->outQueueCnt--;
+  device->outQueueBytes -= message->size;
+  __sync_sub_and_fetch( &device->ictx->outQueueCnt, 1 );
+  __sync_sub_and_fetch( &device->ictx->outQueueBytes, message->size );
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -337,26 +394,163 @@ ickErrcode_t _ickDeviceUnlinkOutMessage( ickDevice_t *device, ickMessage_t *mess
 }
 
 
+/*=========================================================================*\
+  Check if the output queue of a device is busy
+    caller should lock the device
+    returns true if the device or the sum of all output queues reached
+    a high watermark and did not drain below the low watermark since.
+    If the global state is reset here (e.g. because queues were purged),
+    ICKDEVICE_DRAINED_GLOBAL is added to drained and the caller should
+    signal ICKP2P_DRAINED (after unlocking the device).
+\*=========================================================================*/
+int _ickDeviceOutBusy( ickDevice_t *device, int *drained )
+{
+/*------------------------------------------------------------------------*\
+    Device is busy
+\*------------------------------------------------------------------------*/
+  if( device->outBusy )
+    return 1;
+
+/*------------------------------------------------------------------------*\
+    Context is busy?
+\*------------------------------------------------------------------------*/
+  return _ickDeviceContextOutBusy( device->ictx, drained );
+}
+
+
+/*=========================================================================*\
+  Check if the sum of all output queues of a context is busy
+    no locking needed
+    returns true if the global high watermark was reached and the queues
+    did not drain below the low watermark since.
+    The thread resetting the busy state (here or in _ickDeviceCheckDrained())
+    is responsible for signaling, so ICKDEVICE_DRAINED_GLOBAL is added to
+    drained if the reset happens here.
+\*=========================================================================*/
+int _ickDeviceContextOutBusy( ickP2pContext_t *ictx, int *drained )
+{
+  if( !ictx->outBusy )
+    return 0;
+  if( !_ickDeviceBelowLow(&ictx->globalWatermarks,ictx->outQueueCnt,ictx->outQueueBytes) )
+    return 1;
+  if( __sync_bool_compare_and_swap(&ictx->outBusy,1,0) ) {
+    debug( "_ickDeviceContextOutBusy (%p): reached global low watermark", ictx );
+    *drained |= ICKDEVICE_DRAINED_GLOBAL;
+  }
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Account for a message sent from the output queue
+    caller should lock the device
+    Only sent messages count for scheduling of the priority lanes, dropped
+    or failed ones do not.
+\*=========================================================================*/
+void _ickDeviceMessageSent( ickDevice_t *device, const ickMessage_t *message )
+{
+  if( message->priority==ICKP2P_PRIORITY_HIGH )
+    device->outHighStreak++;
+  else
+    device->outHighStreak = 0;
+}
+
+
+/*=========================================================================*\
+  Drop the oldest notification from the output queue
+    caller should lock the device
+    messages already in transmission are not touched
+    returns true if a message was dropped
+\*=========================================================================*/
+int _ickDeviceDropOldestNotification( ickDevice_t *device )
+{
+  ickMessage_t *message;
+
+/*------------------------------------------------------------------------*\
+    Find oldest notification not yet issued
+\*------------------------------------------------------------------------*/
+  for( message=device->outQueue[ICKP2P_PRIORITY_NORMAL]; message; message=message->next ) {
+    if( !message->issued && (message->flags&ICKP2P_MESSAGEFLAG_NOTIFICATION) )
+      break;
+  }
+  if( !message )
+    return 0;
+
+/*------------------------------------------------------------------------*\
+    Unlink and free it
+\*------------------------------------------------------------------------*/
+  debug( "_ickDeviceDropOldestNotification (%s): dropping message %p (%ld bytes)",
+         device->uuid, message, (long)message->size );
+  _ickDeviceUnlinkOutMessage( device, message );
+  _ickDeviceFreeMessage( message );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return 1;
+}
+
+
+/*=========================================================================*\
+  Check if a busy output queue has drained
+    caller should lock the device
+    returns a combination of ICKDEVICE_DRAINED_DEVICE and
+    ICKDEVICE_DRAINED_GLOBAL, the caller should signal ICKP2P_DRAINED for
+    each of them (after unlocking the device)
+\*=========================================================================*/
+int _ickDeviceCheckDrained( ickDevice_t *device )
+{
+  ickP2pContext_t *ictx   = device->ictx;
+  int              result = 0;
+
+/*------------------------------------------------------------------------*\
+    Device queue reached low watermark?
+\*------------------------------------------------------------------------*/
+  if( device->outBusy &&
+      _ickDeviceBelowLow(_ickDeviceWatermarks(device),device->outQueueCnt,device->outQueueBytes) ) {
+    debug( "_ickDeviceCheckDrained (%s): reached low watermark", device->uuid );
+    device->outBusy = 0;
+    result |= ICKDEVICE_DRAINED_DEVICE;
+  }
+
+/*------------------------------------------------------------------------*\
+    Sum of queues reached global low watermark? Only one thread may win.
+\*------------------------------------------------------------------------*/
+  if( ictx->outBusy &&
+      _ickDeviceBelowLow(&ictx->globalWatermarks,ictx->outQueueCnt,ictx->outQueueBytes) &&
+      __sync_bool_compare_and_swap(&ictx->outBusy,1,0) ) {
+    debug( "_ickDeviceCheckDrained (%s): reached global low watermark", device->uuid );
+    result |= ICKDEVICE_DRAINED_GLOBAL;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return result;
+}
+
+
 /*=========================================================================*\
   Add a message container to the input queue
     caller should lock the device
-    container needs to be allocated and will be freed when the message is destroyed
+    container needs to be allocated from the context message pool and will be
+    freed when the message is destroyed
     caller should free the payload in case an error code is returned
 \*=========================================================================*/
 ickErrcode_t _ickDeviceAddInMessage( ickDevice_t *device, void *container, size_t size )
 {
   ickMessage_t *message;
-  ickMessage_t *walk;
   debug ( "_ickDeviceAddInMessage (%s): %ld bytes", device->uuid, (long)size );
 
 /*------------------------------------------------------------------------*\
     Allocate and initialize message descriptor
 \*------------------------------------------------------------------------*/
-  message = calloc( 1, sizeof(ickMessage_t) );
+  message = _ickPoolAlloc( device->ictx->messagePool, sizeof(ickMessage_t) );
   if( !message ) {
     logerr( "_ickDeviceAddInMessage: out of memory" );
     return ICKERR_NOMEM;
   }
+  memset( message, 0, sizeof(ickMessage_t) );
   message->tCreated = _ickTimeNow();
   message->payload  = container;
   message->size     = size;
@@ -365,13 +559,14 @@ ickErrcode_t _ickDeviceAddInMessage( ickDevice_t *device, void *container, size_
 /*------------------------------------------------------------------------*\
     Link to end of input queue
 \*------------------------------------------------------------------------*/
-  if( !device->inQueue )
+  message->prev = device->inQueueTail;
+  if( device->inQueueTail )
+    device->inQueueTail->next = message;
+  else
     device->inQueue = message;
-  else {
-    for( walk=device->inQueue; walk->next; walk=walk->next );
-    message->prev = walk;
-    walk->next    = message;
-  }
+  device->inQueueTail = message;
+  device->inQueueCnt++;
+  device->inQueueBytes += size;
 
 /*------------------------------------------------------------------------*\
     That's it
@@ -389,17 +584,13 @@ ickErrcode_t _ickDeviceAddInMessage( ickDevice_t *device, void *container, size_
 \*=========================================================================*/
 ickErrcode_t _ickDeviceUnlinkInMessage( ickDevice_t *device, ickMessage_t *message )
 {
-  ickMessage_t *walk;
   debug( "_ickDeviceUnlinkInMessage (%s): message %p (%ld bytes)",
          device->uuid, message, message->size );
 
 /*------------------------------------------------------------------------*\
     Check if member
 \*------------------------------------------------------------------------*/
-  for( walk=device->inQueue; walk->next; walk=walk->next )
-    if( walk==message )
-      break;
-  if( !walk ) {
+  if( message->prev ? message->prev->next!=message : device->inQueue!=message ) {
     logerr( "_ickDeviceUnlinkInMessage (%s): message not member of input queue",
             device->uuid );
     return ICKERR_NOMEMBER;
@@ -410,10 +601,16 @@ ickErrcode_t _ickDeviceUnlinkInMessage( ickDevice_t *device, ickMessage_t *messa
 \*------------------------------------------------------------------------*/
   if( message->next )
     message->next->prev = message->prev;
+  else
+    device->inQueueTail = message->prev;
   if( message->prev )
     message->prev->next = message->next;
   else
     device->inQueue = message->next;
+  message->next = NULL;
+  message->prev = NULL;
+  device->inQueueCnt--;
+  device->inQueueBytes -= message->size;
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -431,10 +628,17 @@ void _ickDeviceFreeMessage( ickMessage_t *message )
          message, message->size );
 
 /*------------------------------------------------------------------------*\
-    Free payload and descriptor
+    Free payload or drop reference to zero-copy buffer
+\*------------------------------------------------------------------------*/
+  if( message->buffer )
+    _ickMsgBufferRelease( message->buffer );
+  else
+    _ickPoolFree( message->payload );
+
+/*------------------------------------------------------------------------*\
+    Return descriptor to pool
 \*------------------------------------------------------------------------*/
-  Sfree( message->payload );
-  Sfree( message );
+  _ickPoolFree( message );
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -443,12 +647,33 @@ void _ickDeviceFreeMessage( ickMessage_t *message )
 
 
 /*=========================================================================*\
-  Get root of output queue
+  Get next message to transmit from the output queue
     caller should lock the device
+    A message in transmission is always continued since websocket fragments
+    of different messages must not be interleaved. Otherwise the high
+    priority lane is served first. If the context priority weight is set,
+    a pending normal message is served after that many high priority ones.
 \*=========================================================================*/
 ickMessage_t *_ickDeviceOutQueue( ickDevice_t *device )
 {
-  return device->outQueue;
+  ickMessage_t *high   = device->outQueue[ICKP2P_PRIORITY_HIGH];
+  ickMessage_t *normal = device->outQueue[ICKP2P_PRIORITY_NORMAL];
+  int           weight = device->ictx ? device->ictx->priorityWeight : 0;
+
+/*------------------------------------------------------------------------*\
+    Continue partially transmitted message
+\*------------------------------------------------------------------------*/
+  if( normal && normal->issued )
+    return normal;
+  if( high && high->issued )
+    return high;
+
+/*------------------------------------------------------------------------*\
+    Schedule lanes
+\*------------------------------------------------------------------------*/
+  if( high && (!normal || !weight || device->outHighStreak<weight) )
+    return high;
+  return normal;
 }
 
 
@@ -458,19 +683,7 @@ ickMessage_t *_ickDeviceOutQueue( ickDevice_t *device )
 \*=========================================================================*/
 int _ickDevicePendingOutMessages( ickDevice_t *device )
 {
-  ickMessage_t *message;
-  int           size;
-
-/*------------------------------------------------------------------------*\
-    Loop over output queue and count entries
-\*------------------------------------------------------------------------*/
-  for( size=0,message=device->outQueue; message; message=message->next )
-    size++;
-
-/*------------------------------------------------------------------------*\
-    Return result
-\*------------------------------------------------------------------------*/
-  return size;
+  return device->outQueueCnt;
 }
 
 
@@ -480,19 +693,7 @@ int _ickDevicePendingOutMessages( ickDevice_t *device )
 \*=========================================================================*/
 size_t _ickDevicePendingOutBytes( ickDevice_t *device )
 {
-  ickMessage_t *message;
-  size_t        size;
-
-/*------------------------------------------------------------------------*\
-    Loop over output queue and count bytes
-\*------------------------------------------------------------------------*/
-  for( size=0,message=device->outQueue; message; message=message->next )
-    size += message->size;
-
-/*------------------------------------------------------------------------*\
-    Return result
-\*------------------------------------------------------------------------*/
-  return size;
+  return device->outQueueBytes;
 }
 
 
@@ -502,19 +703,7 @@ size_t _ickDevicePendingOutBytes( ickDevice_t *device )
 \*=========================================================================*/
 int _ickDevicePendingInMessages( ickDevice_t *device )
 {
-  ickMessage_t *message;
-  int           size;
-
-/*------------------------------------------------------------------------*\
-    Loop over output queue and count entries
-\*------------------------------------------------------------------------*/
-  for( size=0,message=device->inQueue; message; message=message->next )
-    size++;
-
-/*------------------------------------------------------------------------*\
-    Return result
-\*------------------------------------------------------------------------*/
-  return size;
+  return device->inQueueCnt;
 }
 
 
@@ -524,19 +713,7 @@ int _ickDevicePendingInMessages( ickDevice_t *device )
 \*=========================================================================*/
 size_t _ickDevicePendingInBytes( ickDevice_t *device )
 {
-  ickMessage_t *message;
-  size_t        size;
-
-/*------------------------------------------------------------------------*\
-    Loop over output queue and count bytes
-\*------------------------------------------------------------------------*/
-  for( size=0,message=device->inQueue; message; message=message->next )
-    size += message->size;
-
-/*------------------------------------------------------------------------*\
-    Return result
-\*------------------------------------------------------------------------*/
-  return size;
+  return device->inQueueBytes;
 }
 
 
@@ -574,6 +751,42 @@ const char *_ickDeviceConnState2Str( ickDeviceConnState_t state )
 }
 
 
+/*=========================================================================*\
+  Get effective watermarks of a device
+\*=========================================================================*/
+static const ickP2pWatermarks_t *_ickDeviceWatermarks( const ickDevice_t *device )
+{
+  return device->ownWatermarks ? &device->watermarks : &device->ictx->deviceWatermarks;
+}
+
+
+/*=========================================================================*\
+  Check if a queue state reached a high watermark
+\*=========================================================================*/
+static int _ickDeviceAboveHigh( const ickP2pWatermarks_t *marks, int cnt, size_t bytes )
+{
+  if( marks->highMsgs && cnt>=marks->highMsgs )
+    return 1;
+  if( marks->highBytes && bytes>=marks->highBytes )
+    return 1;
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Check if a queue state is below all low watermarks in effect
+    limits without high watermark are ignored
+\*=========================================================================*/
+static int _ickDeviceBelowLow( const ickP2pWatermarks_t *marks, int cnt, size_t bytes )
+{
+  if( marks->highMsgs && cnt>marks->lowMsgs )
+    return 0;
+  if( marks->highBytes && bytes>marks->lowBytes )
+    return 0;
+  return 1;
+}
+
+
 /*=========================================================================*\
                                     END OF FILE
 \*=========================================================================*/
@@ -59,7 +59,10 @@ Remarks         : -
 /*=========================================================================*\
   Definition of constants
 \*=========================================================================*/
-// none
+
+// Results of _ickDeviceCheckDrained()
+#define ICKDEVICE_DRAINED_DEVICE  0x01
+#define ICKDEVICE_DRAINED_GLOBAL  0x02
 
 /*=========================================================================*\
   Macro and type definitions
@@ -68,15 +71,20 @@ Remarks         : -
 //
 // Descriptor for ickstream messages
 //
+struct _ickMsgBuffer;
+typedef struct _ickMsgBuffer ickMsgBuffer_t;
 struct _ickMessage;
 typedef struct _ickMessage ickMessage_t;
 struct _ickMessage {
   ickMessage_t        *next;
   ickMessage_t        *prev;
   double               tCreated;
-  unsigned char       *payload;    // strong
+  unsigned char       *payload;    // strong, weak if buffer is set
+  ickMsgBuffer_t      *buffer;     // referenced zero-copy buffer or NULL
   size_t               size;
   size_t               issued;
+  ickP2pMessageFlag_t  flags;
+  ickP2pPriority_t     priority;   // output queue lane
 };
 
 //
@@ -117,8 +125,18 @@ struct _ickDevice {
   ickP2pServicetype_t   services;
   char                 *friendlyName;    // strong
   ickP2pLevel_t         ickP2pLevel;
-  ickMessage_t         *outQueue;
+  ickMessage_t         *outQueue[ICKP2P_PRIORITIES];      // one lane per priority
+  ickMessage_t         *outQueueTail[ICKP2P_PRIORITIES];
+  int                   outHighStreak;   // high priority messages sent in a row
+  int                   outQueueCnt;
+  size_t                outQueueBytes;
+  ickP2pWatermarks_t    watermarks;      // only used if ownWatermarks is set
+  int                   ownWatermarks;
+  int                   outBusy;
   ickMessage_t         *inQueue;         // only used for servers
+  ickMessage_t         *inQueueTail;
+  int                   inQueueCnt;
+  size_t                inQueueBytes;
   double                tCreation;
   ickWGetContext_t     *wget;
   double                tXmlComplete;
@@ -132,9 +150,17 @@ struct _ickDevice {
   int                   nRx;
   int                   nRxSegmented;
   int                   nTx;
+  int                   nHeartbeats;
+  int                   nHeartbeatsSuppressed;
   double                tLastRx;
   double                tLastTx;
   struct libwebsocket  *wsi;            // weak
+  unsigned char        *txBuffer;       // strong, bounce buffer for fragments of shared payloads
+  size_t                txBufferSize;
+  int                   shard;          // reactor shard for outbound connections, -1: main thread
+  int                   wsiShard;       // reactor shard servicing wsi, -1: main thread
+  ickTimer_t           *heartbeatTimer; // weak, handle reset by timer management
+  ickTimer_t           *expireTimer;    // weak, handle reset by timer management
 };
 
 /*------------------------------------------------------------------------*\
@@ -164,8 +190,14 @@ void          _ickDeviceUnlock( ickDevice_t *device );
 
 ickErrcode_t  _ickDeviceSetLocation( ickDevice_t *device, const char *location );
 ickErrcode_t  _ickDeviceSetName( ickDevice_t *device, const char *name );
-ickErrcode_t  _ickDeviceAddOutMessage( ickDevice_t *device, void *container, size_t size );
+ickErrcode_t  _ickDeviceAddOutMessage( ickDevice_t *device, void *container, size_t size, ickMsgBuffer_t *buffer,
+                                       ickP2pMessageFlag_t mFlags, ickP2pPriority_t priority );
 ickErrcode_t  _ickDeviceUnlinkOutMessage( ickDevice_t *device, ickMessage_t *message );
+void          _ickDeviceMessageSent( ickDevice_t *device, const ickMessage_t *message );
+int           _ickDeviceOutBusy( ickDevice_t *device, int *drained );
+int           _ickDeviceContextOutBusy( ickP2pContext_t *ictx, int *drained );
+int           _ickDeviceDropOldestNotification( ickDevice_t *device );
+int           _ickDeviceCheckDrained( ickDevice_t *device );
 ickErrcode_t  _ickDeviceAddInMessage( ickDevice_t *device, void *container, size_t size );
 ickErrcode_t  _ickDeviceUnlinkInMessage( ickDevice_t *device, ickMessage_t *message );
 void          _ickDeviceFreeMessage( ickMessage_t *message );
@@ -0,0 +1,449 @@
+/*$*********************************************************************\
+
+Source File     : ickDispatch.c
+
+Description     : worker pool for message callbacks
+
+Comments        : -
+
+Called by       : message receive path (ickP2pCom.c) and main thread
+
+Calls           : message callbacks
+
+Date            : 17.10.2026
+
+Updates         : -
+
+Author          : //MAF
+
+Remarks         : Every worker owns a FIFO queue. Devices are mapped to
+                  workers by a hash of their UUID, so messages of one
+                  device are always handled in order of reception, while
+                  slow handlers for one device do not hold up the network
+                  threads or devices mapped to other workers.
+
+*************************************************************************
+ * Copyright (c) 2013, ickStream GmbH
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright 
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright 
+ *     notice, this list of conditions and the following disclaimer in the 
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of ickStream nor the names of its contributors 
+ *     may be used to endorse or promote products derived from this software 
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. 
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, 
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, 
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ickP2p.h"
+#include "ickP2pInternal.h"
+#include "logutils.h"
+#include "ickPool.h"
+#include "ickMainThread.h"
+#include "ickDescription.h"
+#include "ickDevice.h"
+#include "ickP2pCom.h"
+#include "ickDispatch.h"
+
+
+/*=========================================================================*\
+  Global symbols
+\*=========================================================================*/
+// none
+
+
+/*=========================================================================*\
+  Private definitions and symbols
+\*=========================================================================*/
+
+// A queued message, followed by the source uuid and the payload
+struct _ickDispatchJob;
+typedef struct _ickDispatchJob ickDispatchJob_t;
+struct _ickDispatchJob {
+  ickDispatchJob_t     *next;
+  long long             tQueued;        // usecs, monotonic
+  const char           *uuid;           // points into this allocation
+  const char           *payload;        // points into this allocation
+  size_t                pSize;
+  ickP2pServicetype_t   sourceService;
+  ickP2pServicetype_t   targetServices;
+  ickP2pMessageFlag_t   mFlags;
+};
+
+// A worker
+struct _ickDispatcher {
+  ickP2pContext_t      *ictx;           // weak
+  int                   id;
+  pthread_t             thread;
+  int                   running;
+  int                   terminate;
+  pthread_mutex_t       mutex;          // queue and statistics
+  pthread_cond_t        condQueued;
+  ickDispatchJob_t     *jobs;           // strong, FIFO
+  ickDispatchJob_t     *jobsTail;       // weak
+  int                   queued;
+  int                   highWater;
+  long                  dispatched;
+  long long             waitTotal;      // usecs
+  long long             waitMax;
+  long long             latencyTotal;
+  long long             latencyMax;
+};
+
+
+/*=========================================================================*\
+  Private prototypes
+\*=========================================================================*/
+static void      *_ickDispatcherThread( void *arg );
+static void       _ickDispatchFree( ickDispatcher_t *dispatchers, int cnt );
+static long long  _ickDispatchClock( void );
+
+
+/*=========================================================================*\
+  Get dispatcher statistics
+    Values are summed up over all workers, except for the maxima.
+    This is safe at any time, the workers are not stopped while their
+    statistics are collected.
+\*=========================================================================*/
+ickErrcode_t ickP2pGetDispatchStats( ickP2pContext_t *ictx, ickP2pDispatchStats_t *stats )
+{
+  ickDispatcher_t *dispatcher;
+  long long        waitTotal    = 0;
+  long long        waitMax      = 0;
+  long long        latencyTotal = 0;
+  long long        latencyMax   = 0;
+  int              i;
+
+/*------------------------------------------------------------------------*\
+    Collect values
+\*------------------------------------------------------------------------*/
+  memset( stats, 0, sizeof(ickP2pDispatchStats_t) );
+  stats->workers = ictx->dispatcherCnt;
+  pthread_mutex_lock( &ictx->dispatchMutex );
+  for( i=0; ictx->dispatchers&&i<ictx->dispatcherCnt; i++ ) {
+    dispatcher = ictx->dispatchers + i;
+    pthread_mutex_lock( &dispatcher->mutex );
+    stats->queued     += dispatcher->queued;
+    stats->dispatched += dispatcher->dispatched;
+    waitTotal         += dispatcher->waitTotal;
+    latencyTotal      += dispatcher->latencyTotal;
+    if( dispatcher->highWater>stats->highWater )
+      stats->highWater = dispatcher->highWater;
+    if( dispatcher->waitMax>waitMax )
+      waitMax = dispatcher->waitMax;
+    if( dispatcher->latencyMax>latencyMax )
+      latencyMax = dispatcher->latencyMax;
+    pthread_mutex_unlock( &dispatcher->mutex );
+  }
+  pthread_mutex_unlock( &ictx->dispatchMutex );
+
+/*------------------------------------------------------------------------*\
+    Convert to seconds
+\*------------------------------------------------------------------------*/
+  if( stats->dispatched ) {
+    stats->waitAvg    = waitTotal/1E6/stats->dispatched;
+    stats->latencyAvg = latencyTotal/1E6/stats->dispatched;
+  }
+  stats->waitMax    = waitMax/1E6;
+  stats->latencyMax = latencyMax/1E6;
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Start dispatch workers of a context
+    This is executed in the context of the main thread or shared loop.
+    returns 0 on success or -1 on error (ictx->error is set)
+\*=========================================================================*/
+int _ickDispatchStart( ickP2pContext_t *ictx )
+{
+  ickDispatcher_t *dispatchers;
+  ickDispatcher_t *dispatcher;
+  int              i;
+  int              rc;
+
+/*------------------------------------------------------------------------*\
+    Nothing to do?
+\*------------------------------------------------------------------------*/
+  if( !ictx->dispatcherCnt )
+    return 0;
+  debug( "_ickDispatchStart (%p): starting %d workers", ictx, ictx->dispatcherCnt );
+
+/*------------------------------------------------------------------------*\
+    Allocate descriptors
+\*------------------------------------------------------------------------*/
+  dispatchers = calloc( ictx->dispatcherCnt, sizeof(ickDispatcher_t) );
+  if( !dispatchers ) {
+    logerr( "_ickDispatchStart: out of memory" );
+    ictx->error = ICKERR_NOMEM;
+    return -1;
+  }
+  for( i=0; i<ictx->dispatcherCnt; i++ ) {
+    dispatcher = dispatchers + i;
+    dispatcher->ictx = ictx;
+    dispatcher->id   = i;
+    pthread_mutex_init( &dispatcher->mutex, NULL );
+    pthread_cond_init( &dispatcher->condQueued, NULL );
+  }
+
+/*------------------------------------------------------------------------*\
+    Start threads
+\*------------------------------------------------------------------------*/
+  for( i=0; i<ictx->dispatcherCnt; i++ ) {
+    dispatcher = dispatchers + i;
+    rc = pthread_create( &dispatcher->thread, NULL, _ickDispatcherThread, dispatcher );
+    if( rc ) {
+      logerr( "_ickDispatchStart: Unable to start worker thread: %s", strerror(rc) );
+      ictx->error = ICKERR_NOTHREAD;
+      _ickDispatchFree( dispatchers, ictx->dispatcherCnt );
+      return -1;
+    }
+    dispatcher->running = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Publish workers, that's all
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &ictx->dispatchMutex );
+  ictx->dispatchers = dispatchers;
+  pthread_mutex_unlock( &ictx->dispatchMutex );
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Stop and free all dispatch workers of a context
+    Messages already queued are handled before the workers terminate,
+    so the callback lists must still be valid.
+\*=========================================================================*/
+void _ickDispatchStop( ickP2pContext_t *ictx )
+{
+  ickDispatcher_t *dispatchers;
+
+/*------------------------------------------------------------------------*\
+    Detach workers, so statistics don't access them anymore
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &ictx->dispatchMutex );
+  dispatchers       = ictx->dispatchers;
+  ictx->dispatchers = NULL;
+  pthread_mutex_unlock( &ictx->dispatchMutex );
+  if( !dispatchers )
+    return;
+  debug( "_ickDispatchStop (%p): stopping %d workers", ictx, ictx->dispatcherCnt );
+
+/*------------------------------------------------------------------------*\
+    Stop and free them, that's all
+\*------------------------------------------------------------------------*/
+  _ickDispatchFree( dispatchers, ictx->dispatcherCnt );
+}
+
+
+/*=========================================================================*\
+  Terminate, join and free an array of dispatch workers
+\*=========================================================================*/
+static void _ickDispatchFree( ickDispatcher_t *dispatchers, int cnt )
+{
+  ickDispatcher_t  *dispatcher;
+  ickDispatchJob_t *job;
+  int               i;
+  int               rc;
+
+/*------------------------------------------------------------------------*\
+    Signal termination to all workers first...
+\*------------------------------------------------------------------------*/
+  for( i=0; i<cnt; i++ ) {
+    dispatcher = dispatchers + i;
+    pthread_mutex_lock( &dispatcher->mutex );
+    dispatcher->terminate = 1;
+    pthread_cond_signal( &dispatcher->condQueued );
+    pthread_mutex_unlock( &dispatcher->mutex );
+  }
+
+/*------------------------------------------------------------------------*\
+    ... then join and free them
+\*------------------------------------------------------------------------*/
+  for( i=0; i<cnt; i++ ) {
+    dispatcher = dispatchers + i;
+    if( dispatcher->running ) {
+      rc = pthread_join( dispatcher->thread, NULL );
+      if( rc )
+        logerr( "_ickDispatchFree: Unable to join worker thread: %s", strerror(rc) );
+    }
+    while( dispatcher->jobs ) {
+      job              = dispatcher->jobs;
+      dispatcher->jobs = job->next;
+      _ickPoolFree( job );
+    }
+    pthread_cond_destroy( &dispatcher->condQueued );
+    pthread_mutex_destroy( &dispatcher->mutex );
+  }
+  Sfree( dispatchers );
+}
+
+
+/*=========================================================================*\
+  Queue a message for the dispatcher of its source device
+    payload is the message without preamble, it is copied
+    returns 0 if the message was queued or -1 if there are no workers
+    or memory is short (the caller should dispatch synchronously then)
+\*=========================================================================*/
+int _ickDispatchSubmit( ickP2pContext_t *ictx, const char *uuid,
+                        ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                        const void *payload, size_t pSize, ickP2pMessageFlag_t mFlags )
+{
+  ickDispatcher_t  *dispatcher;
+  ickDispatchJob_t *job;
+  size_t            uSize;
+  char             *ptr;
+
+/*------------------------------------------------------------------------*\
+    Dispatching disabled?
+\*------------------------------------------------------------------------*/
+  dispatcher = ictx->dispatchers;
+  if( !dispatcher )
+    return -1;
+  dispatcher += _ickUuidHash(uuid)%ictx->dispatcherCnt;
+
+/*------------------------------------------------------------------------*\
+    Allocate and init job, keep the payload 0-terminated for string handlers
+\*------------------------------------------------------------------------*/
+  uSize = strlen( uuid ) + 1;
+  job   = _ickPoolAlloc( ictx->messagePool, sizeof(ickDispatchJob_t)+uSize+pSize+1 );
+  if( !job ) {
+    logerr( "_ickDispatchSubmit: out of memory" );
+    return -1;
+  }
+  ptr = (char *)(job+1);
+  memcpy( ptr, uuid, uSize );
+  job->uuid = ptr;
+  ptr += uSize;
+  memcpy( ptr, payload, pSize );
+  ptr[pSize] = 0;
+  job->payload        = ptr;
+  job->pSize          = pSize;
+  job->sourceService  = sourceService;
+  job->targetServices = targetServices;
+  job->mFlags         = mFlags;
+  job->next           = NULL;
+  job->tQueued        = _ickDispatchClock();
+
+/*------------------------------------------------------------------------*\
+    Append to queue and wake up worker
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &dispatcher->mutex );
+  if( dispatcher->jobsTail )
+    dispatcher->jobsTail->next = job;
+  else
+    dispatcher->jobs = job;
+  dispatcher->jobsTail = job;
+  if( ++dispatcher->queued>dispatcher->highWater )
+    dispatcher->highWater = dispatcher->queued;
+  pthread_cond_signal( &dispatcher->condQueued );
+  pthread_mutex_unlock( &dispatcher->mutex );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Worker thread
+\*=========================================================================*/
+static void *_ickDispatcherThread( void *arg )
+{
+  ickDispatcher_t  *dispatcher = arg;
+  ickP2pContext_t  *ictx       = dispatcher->ictx;
+  ickDispatchJob_t *job;
+  long long         tStart;
+  long long         wait;
+  long long         latency;
+
+  debug( "_ickDispatcherThread (%p): worker #%d starting", ictx, dispatcher->id );
+  PTHREADSETNAME( "ickP2PDispatch" );
+
+/*------------------------------------------------------------------------*\
+    Handle queued messages until terminated and the queue is empty
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &dispatcher->mutex );
+  for(;;) {
+    while( !dispatcher->jobs && !dispatcher->terminate )
+      pthread_cond_wait( &dispatcher->condQueued, &dispatcher->mutex );
+    job = dispatcher->jobs;
+    if( !job )
+      break;
+    dispatcher->jobs = job->next;
+    if( !dispatcher->jobs )
+      dispatcher->jobsTail = NULL;
+    dispatcher->queued--;
+    pthread_mutex_unlock( &dispatcher->mutex );
+
+    // Execute callbacks and measure
+    tStart = _ickDispatchClock();
+    _ickP2pDeliverMessage( ictx, job->uuid, job->sourceService, job->targetServices,
+                           job->payload, job->pSize, job->mFlags );
+    latency = _ickDispatchClock() - tStart;
+    wait    = tStart - job->tQueued;
+    _ickPoolFree( job );
+
+    // Update statistics
+    pthread_mutex_lock( &dispatcher->mutex );
+    dispatcher->dispatched++;
+    dispatcher->waitTotal    += wait;
+    dispatcher->latencyTotal += latency;
+    if( wait>dispatcher->waitMax )
+      dispatcher->waitMax = wait;
+    if( latency>dispatcher->latencyMax )
+      dispatcher->latencyMax = latency;
+  }
+  pthread_mutex_unlock( &dispatcher->mutex );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  debug( "_ickDispatcherThread (%p): worker #%d terminating", ictx, dispatcher->id );
+  return NULL;
+}
+
+
+/*=========================================================================*\
+  Get monotonic time in usecs
+\*=========================================================================*/
+static long long _ickDispatchClock( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+
+/*=========================================================================*\
+                                    END OF FILE
+\*=========================================================================*/
+
@@ -0,0 +1,84 @@
+/*$*********************************************************************\
+
+Header File     : ickDispatch.h
+
+Description     : Internal include file for message dispatch workers
+
+Comments        : -
+
+Date            : 17.10.2026
+
+Updates         : -
+
+Author          : //MAF
+
+Remarks         : -
+
+*************************************************************************
+ * Copyright (c) 2013, ickStream GmbH
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright 
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright 
+ *     notice, this list of conditions and the following disclaimer in the 
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of ickStream nor the names of its contributors 
+ *     may be used to endorse or promote products derived from this software 
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. 
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, 
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, 
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\************************************************************************/
+
+#ifndef __ICKDISPATCH_H
+#define __ICKDISPATCH_H
+
+
+/*=========================================================================*\
+  Includes required by definitions from this file
+\*=========================================================================*/
+#include <stddef.h>
+#include "ickP2p.h"
+
+
+/*=========================================================================*\
+  Definition of constants
+\*=========================================================================*/
+#define ICKDISPATCH_MAX     64    // max. number of dispatch workers
+
+
+/*=========================================================================*\
+  Macro and type definitions
+\*=========================================================================*/
+// none
+
+
+/*=========================================================================*\
+  Global symbols
+\*=========================================================================*/
+// none
+
+
+/*=========================================================================*\
+  Internal prototypes
+\*=========================================================================*/
+int   _ickDispatchStart( ickP2pContext_t *ictx );
+void  _ickDispatchStop( ickP2pContext_t *ictx );
+int   _ickDispatchSubmit( ickP2pContext_t *ictx, const char *uuid,
+                          ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                          const void *payload, size_t pSize, ickP2pMessageFlag_t mFlags );
+
+
+#endif /* __ICKDISPATCH_H */
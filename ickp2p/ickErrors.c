@@ -96,6 +96,7 @@ const char *ickStrError( ickErrcode_t code )
     case ICKERR_NOTCONNECTED:     return "Not connected";
     case ICKERR_ISCONNECTED:      return "Already connected";
     case ICKERR_LWSERR:           return "Libwebsockets error";
+    case ICKERR_BUSY:             return "Output queue busy";
 
     default:                 break;
   }
@@ -55,11 +55,13 @@ Remarks         : -
 #include <pthread.h>
 #include <poll.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <ctype.h>
 
 #include <libwebsockets.h>
 
@@ -74,6 +76,15 @@ Remarks         : -
 #include "ickWGet.h"
 #include "ickP2pDebug.h"
 #include "ickMainThread.h"
+#include "ickDispatch.h"
+
+#ifdef ICK_USEEPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef ICK_USEEVENTFD
+#include <stdint.h>
+#include <sys/timerfd.h>
+#endif
 
 
 /*=========================================================================*\
@@ -88,20 +99,68 @@ Remarks         : -
 #define ICKDISCOVERY_HEADER_SIZE_MAX    1536
 #define ICKPOLLIST_INITSIZE             10
 #define ICKPOLLIST_INCEMENT             10
+#define ICKEPOLL_MAXEVENTS              64
+#define ICKTIMER_HEAPARITY              4
+#define ICKTIMER_HEAPINCREMENT          32
 
 
 //
 // A timer descriptor
 //
 struct _ickTimer {
-  ickTimer_t     *prev;
-  ickTimer_t     *next;
-  struct timeval  time;
+  int             heapIdx;        // position in timer heap of context
+  long long       time;           // expiry, usecs on CLOCK_MONOTONIC
+  long            slack;          // millisecs execution might be deferred for coalescing
   long            interval;
   int             repeatCntr;
   void           *usrPtr;
   int             usrTag;
   ickTimerCb_t    callback;
+  ickTimer_t    **handle;         // weak, reset to NULL on deletion
+  ickP2pContext_t *ictx;          // weak
+  ickTimer_t     *nextDue;        // list of expired timers, if detached from heap
+  int             due;            // detached from heap for execution
+  int             cancelled;      // deleted while detached, freed by main thread
+  int             updated;        // rescheduled while detached
+};
+
+//
+// A shared event loop servicing several contexts in one thread
+//
+struct _ickP2pLoop {
+  pthread_t         thread;
+  pthread_mutex_t   mutex;
+  pthread_cond_t    condChanged;
+  int               epollFd;
+  int               breakPipe[2];
+  int               terminate;
+  int               dead;           // thread exited on error, no more attachments
+  ickP2pContext_t  *contexts;       // attached and running
+  ickP2pContext_t  *pending;        // waiting for init by loop thread
+  ickP2pContext_t  *detaching;      // currently shutting down
+};
+
+//
+// A reactor shard servicing the outbound web socket connections
+// of a subset of the devices (selected by UUID hash)
+//
+struct _ickShardRequest {
+  struct _ickShardRequest       *next;
+  char                          *uuid;             // strong
+};
+struct _ickShard {
+  ickP2pContext_t               *ictx;             // weak
+  int                            id;
+  pthread_t                      thread;
+  int                            running;
+  int                            terminate;
+  pthread_mutex_t                mutex;            // lws poll list and requests
+  int                            breakPipe[2];
+  struct libwebsocket_context   *lwsContext;       // strong
+  struct libwebsocket_protocols *lwsProtocols;     // strong
+  ickPolllist_t                  lwsPolllist;
+  ickPolllist_t                  pollList;
+  struct _ickShardRequest       *requests;         // strong, pending connects
 };
 
 //
@@ -118,8 +177,31 @@ typedef struct {
   Private prototypes
 \*=========================================================================*/
 
+static int  _ickMainThreadInit( ickP2pContext_t *ictx );
+static int  _ickMainThreadTimers( ickP2pContext_t *ictx );
+static int  _ickMainThreadWait( ickP2pContext_t *ictx, int timeout );
+static void _ickMainThreadProcess( ickP2pContext_t *ictx, int retval );
+static void _ickMainThreadCleanup( ickP2pContext_t *ictx );
+static void _ickMainThreadSignalReady( ickP2pContext_t *ictx );
 static void _ickServiceSsdpSocket( ickP2pContext_t *ictx, char *buffer, int sd );
 
+#ifdef ICK_USEEPOLL
+static void        *_ickLoopThread( void *arg );
+static ickErrcode_t _ickLoopBreak( ickP2pLoop_t *loop, char flag );
+static void         _ickLoopLock( ickP2pLoop_t *loop );
+static void         _ickLoopUnlock( ickP2pLoop_t *loop );
+static void         _ickLoopFree( ickP2pLoop_t *loop );
+#endif
+
+static int          _ickShardsStart( ickP2pContext_t *ictx );
+static void         _ickShardsStop( ickP2pContext_t *ictx );
+static void        *_ickShardThread( void *arg );
+static void         _ickShardProcessRequests( ickShard_t *shard );
+static ickShard_t  *_ickShardByLwsContext( const ickP2pContext_t *ictx, const struct libwebsocket_context *context );
+static ickErrcode_t _ickShardBreak( ickShard_t *shard, char flag );
+static void         _ickShardLock( ickShard_t *shard );
+static void         _ickShardUnlock( ickShard_t *shard );
+
 static int  _ickPolllistInit( ickPolllist_t *plist, int size, int increment );
 static void _ickPolllistClear( ickPolllist_t *plist );
 static void _ickPolllistFree( ickPolllist_t *plist );
@@ -129,15 +211,32 @@ static int  _ickPolllistAppend( ickPolllist_t *plist, const ickPolllist_t *plist
 static int  _ickPolllistSet( ickPolllist_t *plist, int fd, int events );
 static int  _ickPolllistUnset( ickPolllist_t *plist, int fd, int events );
 static int  _ickPolllistCheck( const ickPolllist_t *plist, int fd, int events );
+#ifdef ICK_USEEPOLL
+static int  _ickPolllistEvents( const ickPolllist_t *plist, int fd );
+#endif
 static int  _ickPolllistGetIndex( const ickPolllist_t *plist, int fd );
 
-static struct libwebsocket_context *_ickCreateLwsContext( ickP2pContext_t *ictx, const char *ifname, int *port );
+#ifdef ICK_USEEPOLL
+static int  _ickEpollInit( ickP2pContext_t *ictx );
+static void _ickEpollFree( ickP2pContext_t *ictx );
+static int  _ickEpollCtl( ickP2pContext_t *ictx, int op, int fd, int events );
+static int  _ickEpollWait( ickP2pContext_t *ictx, ickPolllist_t *plist, int timeout );
+#endif
+
+static struct libwebsocket_context *_ickCreateLwsContext( ickP2pContext_t *ictx, const char *ifname, int *port,
+                                                          struct libwebsocket_protocols **protocols );
 static int  _lwsHttpCb( struct libwebsocket_context *context,
                         struct libwebsocket *wsi,
                         enum libwebsocket_callback_reasons reason, void *user,
                         void *in, size_t len );
-static void _ickTimerLink( ickP2pContext_t *ictx, ickTimer_t *timer );
+static long long _ickTimerClock( void );
+static int  _ickTimerArm( ickP2pContext_t *ictx );
+static long long _ickTimerWakeup( ickP2pContext_t *ictx );
+static void _ickTimerWakeupScan( ickP2pContext_t *ictx, int idx, long long *wakeup );
+static int  _ickTimerLink( ickP2pContext_t *ictx, ickTimer_t *timer );
 static int  _ickTimerUnlink( ickP2pContext_t *ictx, ickTimer_t *timer );
+static void _ickTimerSiftUp( ickP2pContext_t *ictx, int idx );
+static void _ickTimerSiftDown( ickP2pContext_t *ictx, int idx );
 
 
 /*=========================================================================*\
@@ -149,18 +248,64 @@ static int  _ickTimerUnlink( ickP2pContext_t *ictx, ickTimer_t *timer );
 
 /*=========================================================================*\
   Ickstream main communication thread
+    This is used for all contexts that are not attached to a shared loop
 \*=========================================================================*/
 void *_ickMainThread( void *arg )
 {
-  ickP2pContext_t     *ictx = *(ickP2pContext_t**)arg;
-  ickPolllist_t        plist;
-  ickWGetContext_t    *wget, *wgetNext;
-  char                *buffer;
+  ickP2pContext_t *ictx = *(ickP2pContext_t**)arg;
+  int              timeout;
+  int              retval;
 
   debug( "ickp2p (%p): thread starting for \"%s\" \"%s\"",
          ictx, ictx->deviceName, ictx->deviceUuid );
   PTHREADSETNAME( "ickP2P" );
 
+/*------------------------------------------------------------------------*\
+    Init context, errors are reported to ickP2pResume() via ictx->error
+\*------------------------------------------------------------------------*/
+  if( _ickMainThreadInit(ictx) ) {
+    _ickMainThreadSignalReady( ictx );
+    return NULL;
+  }
+  _ickMainThreadSignalReady( ictx );
+
+/*------------------------------------------------------------------------*\
+    Run while not terminating
+\*------------------------------------------------------------------------*/
+  while( ictx->state<ICKLIB_TERMINATING ) {
+    timeout = _ickMainThreadTimers( ictx );
+    retval  = _ickMainThreadWait( ictx, timeout );
+    if( retval<0 )
+      break;
+    _ickMainThreadProcess( ictx, retval );
+  }
+  debug( "ickp2p (%p): thread terminating for \"%s\" \"%s\"",
+         ictx, ictx->deviceName, ictx->deviceUuid );
+
+/*------------------------------------------------------------------------*\
+    Wait till _ickMainThreadTerminate() is done with the context
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &ictx->endMutex );
+  pthread_mutex_unlock( &ictx->endMutex );
+
+/*------------------------------------------------------------------------*\
+    Shut down and destruct context, that's all
+\*------------------------------------------------------------------------*/
+  _ickMainThreadCleanup( ictx );
+  return NULL;
+}
+
+
+/*=========================================================================*\
+  Initialize main loop resources of a context
+    This is executed in the context of the main thread or shared loop.
+    Caller needs to signal condIsReady afterwards (_ickMainThreadSignalReady).
+    returns 0 on success or -1 on error (ictx->error is set)
+\*=========================================================================*/
+static int _ickMainThreadInit( ickP2pContext_t *ictx )
+{
+  debug( "_ickMainThreadInit (%p):", ictx );
+
 /*------------------------------------------------------------------------*\
     Reset error state
 \*------------------------------------------------------------------------*/
@@ -169,315 +314,515 @@ void *_ickMainThread( void *arg )
 /*------------------------------------------------------------------------*\
     Allocate buffers
 \*------------------------------------------------------------------------*/
-  buffer = malloc( ICKDISCOVERY_HEADER_SIZE_MAX );
-  if( !buffer ) {
+  ictx->ssdpBuffer = malloc( ICKDISCOVERY_HEADER_SIZE_MAX );
+  if( !ictx->ssdpBuffer ) {
     logerr( "ickp2p main thread: out of memory" );
     ictx->error = ICKERR_NOMEM;
-    pthread_cond_signal( &ictx->condIsReady );
-    return NULL;
+    return -1;
   }
-  if( _ickPolllistInit(&plist,ICKPOLLIST_INITSIZE,ICKPOLLIST_INCEMENT) ) {
+  if( _ickPolllistInit(&ictx->pollList,ICKPOLLIST_INITSIZE,ICKPOLLIST_INCEMENT) ) {
     logerr( "ickp2p main thread: out of memory" );
-    Sfree( buffer );
+    Sfree( ictx->ssdpBuffer );
     ictx->error = ICKERR_NOMEM;
-    pthread_cond_signal( &ictx->condIsReady );
-    return NULL;
+    return -1;
   }
   if( _ickPolllistInit(&ictx->lwsPolllist,ICKPOLLIST_INITSIZE,ICKPOLLIST_INCEMENT) ) {
     logerr( "ickp2p main thread: out of memory" );
-    Sfree( buffer );
-    _ickPolllistFree( &plist );
+    Sfree( ictx->ssdpBuffer );
+    _ickPolllistFree( &ictx->pollList );
     ictx->error = ICKERR_NOMEM;
-    pthread_cond_signal( &ictx->condIsReady );
-    return NULL;
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Try to set up epoll reactor, fall back to poll() on error.
+    Needs to be done before lws is initialized as the lws poll hooks
+    will directly register their sockets with the epoll instance.
+    Shared loops rely on the epoll descriptor, so there's no fallback.
+\*------------------------------------------------------------------------*/
+#ifdef ICK_USEEPOLL
+  if( _ickEpollInit(ictx) ) {
+    if( ictx->loop ) {
+      logerr( "ickp2p main thread: could not init epoll for shared loop" );
+      Sfree( ictx->ssdpBuffer );
+      _ickPolllistFree( &ictx->pollList );
+      _ickPolllistFree( &ictx->lwsPolllist );
+      ictx->error = ICKERR_GENERIC;
+      return -1;
+    }
+    logwarn( "ickp2p main thread: could not init epoll, falling back to poll()" );
   }
+#endif
 
 /*------------------------------------------------------------------------*\
     Init libwebsocket server
 \*------------------------------------------------------------------------*/
-  ictx->lwsContext = _ickCreateLwsContext( ictx, NULL, &ictx->lwsPort );
+  ictx->lwsContext = _ickCreateLwsContext( ictx, NULL, &ictx->lwsPort, &ictx->lwsProtocols );
   if( !ictx->lwsContext ) {
-    Sfree( buffer );
-    _ickPolllistFree( &plist );
+    Sfree( ictx->ssdpBuffer );
+    _ickPolllistFree( &ictx->pollList );
     _ickPolllistFree( &ictx->lwsPolllist );
+#ifdef ICK_USEEPOLL
+    _ickEpollFree( ictx );
+#endif
     ictx->error = ICKERR_LWSERR;
-    pthread_cond_signal( &ictx->condIsReady );
-    return NULL;
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Start message dispatch workers and reactor shards (if any)
+\*------------------------------------------------------------------------*/
+  if( _ickDispatchStart(ictx) || _ickShardsStart(ictx) ) {
+    _ickDispatchStop( ictx );
+    libwebsocket_context_destroy( ictx->lwsContext );
+    Sfree( ictx->lwsProtocols );
+    Sfree( ictx->ssdpBuffer );
+    _ickPolllistFree( &ictx->pollList );
+    _ickPolllistFree( &ictx->lwsPolllist );
+#ifdef ICK_USEEPOLL
+    _ickEpollFree( ictx );
+#endif
+    return -1;
   }
 
 /*------------------------------------------------------------------------*\
     We're up and running!
 \*------------------------------------------------------------------------*/
   ictx->state = ICKLIB_RUNNING;
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Signal end of initialization to ickP2pResume()
+    Lock the context to not get lost between check and wait of the waiter
+\*=========================================================================*/
+static void _ickMainThreadSignalReady( ickP2pContext_t *ictx )
+{
+  _ickLibLock( ictx );
   pthread_cond_signal( &ictx->condIsReady );
+  _ickLibUnlock( ictx );
+}
+
+
+/*=========================================================================*\
+  Execute all pending timers of a context
+    returns time interval to next timer in millisecs
+\*=========================================================================*/
+static int _ickMainThreadTimers( ickP2pContext_t *ictx )
+{
+  ickTimer_t  *timer;
+  ickTimer_t **tail;
+  long long    now;
+  int          timeout;
 
 /*------------------------------------------------------------------------*\
-    Run while not terminating
+    Detach all expired timers from heap, keep order of expiry
 \*------------------------------------------------------------------------*/
-  while( ictx->state<ICKLIB_TERMINATING ) {
-    ickInterface_t   *interface;
-    int               timeout;
-    int               retval;
-    int               perr;
-    int               i;
+  _ickTimerListLock( ictx );
+  now  = _ickTimerClock();
+  tail = &ictx->timersDue;
+  while( *tail )
+    tail = &(*tail)->nextDue;
+  while( ictx->timerCnt && ictx->timers[0]->time<=now ) {
+    timer = ictx->timers[0];
+    _ickTimerUnlink( ictx, timer );
+    timer->due     = 1;
+    timer->nextDue = NULL;
+    *tail = timer;
+    tail  = &timer->nextDue;
+  }
+  _ickTimerListUnlock( ictx );
 
 /*------------------------------------------------------------------------*\
-    Execute all pending timers
+    Execute detached timers without holding the timer list lock.
+    The timer being executed stays on the due list, so deletions and
+    updates from callbacks or other threads are flagged and applied here.
 \*------------------------------------------------------------------------*/
+  for(;;) {
     _ickTimerListLock( ictx );
-    while( ictx->timers ) {
-      struct timeval  now;
-      // Note: timer list might get modified by the callback
-      ickTimer_t     *timer = ictx->timers;
-
-      // Break if first timer is in future
-      gettimeofday( &now, NULL );
-      if( timer->time.tv_sec>now.tv_sec )
-        break;
-      if( timer->time.tv_sec==now.tv_sec && timer->time.tv_usec>now.tv_usec )
-        break;
+    timer = ictx->timersDue;
+    if( !timer ) {
+      _ickTimerListUnlock( ictx );
+      break;
+    }
+
+    // Deleted or rescheduled (e.g. refreshed expiry) before execution?
+    // Then skip callback, a rescheduled timer is relinked below.
+    // The handle stays valid while the callback runs, so the timer can
+    // still be cancelled (e.g. when its owner is freed by another thread)
+    // till the callback got the locks guarding the owner.
+    if( !timer->cancelled && !timer->updated ) {
+      _ickTimerListUnlock( ictx );
 
       // Execute timer callback
       debug( "ickp2p main thread (%p): executing timer %p", ictx, timer );
       timer->callback( timer, timer->usrPtr, timer->usrTag );
 
-      // Last execution of cyclic timer?
-      if( timer->repeatCntr==1 ) {
-        _ickTimerDelete( ictx, timer );
-        continue;
-      }
+      _ickTimerListLock( ictx );
+    }
+    ictx->timersDue = timer->nextDue;
+    timer->due      = 0;
+
+    // Deleted by callback or while executing?
+    if( timer->cancelled ) {
+      debug( "ickp2p main thread (%p): timer %p was cancelled", ictx, timer );
+      Sfree( timer );
+    }
 
-      // Decrement repeat counter
-      else if( timer->repeatCntr>0 )
-        timer->repeatCntr--;
+    // Last execution of cyclic timer (and not rescheduled)?
+    else if( !timer->updated && timer->repeatCntr==1 ) {
+      if( timer->handle )
+        *timer->handle = NULL;
+      Sfree( timer );
+    }
 
-      // Update timer with interval
+    // Reschedule, decrement repeat counter if not done by an update
+    else {
+      if( !timer->updated ) {
+        if( timer->repeatCntr>0 )
+          timer->repeatCntr--;
+        timer->time = _ickTimerClock() + timer->interval*1000LL;
+      }
+      timer->updated = 0;
       debug( "ickp2p main thread (%p): rescheduling timer %p (%.6fs)",
-             ictx, timer, timer->interval/1000.0 );
-      _ickTimerUpdate( ictx, timer, timer->interval, timer->repeatCntr );
+             ictx, timer, (timer->time-_ickTimerClock())/1000000.0 );
+      if( _ickTimerLink(ictx,timer) ) {
+        logerr( "ickp2p main thread (%p): out of memory, dropping timer %p", ictx, timer );
+        if( timer->handle )
+          *timer->handle = NULL;
+        Sfree( timer );
+      }
     }
+    _ickTimerListUnlock( ictx );
+  }
+
+/*------------------------------------------------------------------------*\
+    Timer descriptor available? Then just (re)arm it for the next timer
+\*------------------------------------------------------------------------*/
+  _ickTimerListLock( ictx );
+  timeout  = ICKMAINLOOP_TIMEOUT_MS;
+#ifdef ICK_USEEVENTFD
+  if( ictx->timerFd>=0 ) {
+    _ickTimerArm( ictx );
+    _ickTimerListUnlock( ictx );
+    return timeout;
+  }
+#endif
+
+/*------------------------------------------------------------------------*\
+    Calculate time interval to next (coalesced) timer wakeup
+\*------------------------------------------------------------------------*/
+  ictx->timerWakeup = _ickTimerWakeup( ictx );
+  if( ictx->timerWakeup ) {
+    long long delta = ictx->timerWakeup - _ickTimerClock();
+
+    // Round up, truncation would lead to busy polling for the last millisecond
+    timeout = delta>0 ? (int)((delta+999)/1000) : 0;
+    debug( "ickp2p main thread (%p): next timer wakeup in %.6fs",
+           ictx, delta/1000000.0 );
+    if( timeout<0 )
+      timeout = 0;
+    else if( timeout>ICKMAINLOOP_TIMEOUT_MS )
+      timeout  = ICKMAINLOOP_TIMEOUT_MS;
+  }
+  _ickTimerListUnlock( ictx );
 
 /*------------------------------------------------------------------------*\
-    Calculate time interval to next timer
+    That's all
 \*------------------------------------------------------------------------*/
-    timeout  = ICKMAINLOOP_TIMEOUT_MS;
-    if( ictx->timers ) {
-      struct timeval now;
-      gettimeofday( &now, NULL );
+  return timeout;
+}
+
+
+/*=========================================================================*\
+  Wait for events on the descriptors of a context
+    Ready descriptors are collected in ictx->pollList
+    timeout is in millisecs
+    returns number of ready descriptors, 0 on timeout or -1 on fatal errors
+\*=========================================================================*/
+static int _ickMainThreadWait( ickP2pContext_t *ictx, int timeout )
+{
+  ickPolllist_t  *plist = &ictx->pollList;
+  ickInterface_t *interface;
+  int             retval;
+  int             i;
 
-      timeout = (ictx->timers->time.tv_sec-now.tv_sec)*1000 +
-                (ictx->timers->time.tv_usec-now.tv_usec)/1000;
-      // debug( "ickp2p main thread: timer: %ld, %ld ", _timerList->time.tv_sec, _timerList->time.tv_usec);
-      // debug( "ickp2p main thread:   now: %ld, %ld ", now.tv_sec, now.tv_usec);
-      debug( "ickp2p main thread (%p): next timer %p in %.6fs",
-             ictx, ictx->timers, timeout/1000.0 );
-      if( timeout<0 )
-        timeout = 0;
-      else if( timeout>ICKMAINLOOP_TIMEOUT_MS )
-        timeout  = ICKMAINLOOP_TIMEOUT_MS;
+/*------------------------------------------------------------------------*\
+    Epoll mode: the interest set is persistent, we only need to register
+    new SSDP communication sockets (closed ones are removed by the kernel).
+    The poll list will be filled with the ready descriptors only.
+\*------------------------------------------------------------------------*/
+#ifdef ICK_USEEPOLL
+  if( ictx->epollFd>=0 ) {
+    for( interface=ictx->interfaces; interface; interface=interface->next ) {
+      if( interface->epollRegistered || interface->upnpComSocket<0 )
+        continue;
+      if( !_ickEpollCtl(ictx,EPOLL_CTL_ADD,interface->upnpComSocket,POLLIN) )
+        interface->epollRegistered = 1;
     }
-    _ickTimerListUnlock( ictx );
+    debug( "ickp2p main thread (%p): epolling (%d lws), timeout %.3fs...",
+            ictx, ictx->lwsPolllist.nfds, timeout/1000.0 );
+    return _ickEpollWait( ictx, plist, timeout );
+  }
+#endif
 
 /*------------------------------------------------------------------------*\
     First poll descriptor is always the help pipe to break the poll on timer updates
 \*------------------------------------------------------------------------*/
-    _ickPolllistClear( &plist );
-    _ickPolllistAdd( &plist, ictx->pollBreakPipe[0], POLLIN );
+  _ickPolllistClear( plist );
+  _ickPolllistAdd( plist, ictx->pollBreakPipe[0], POLLIN );
+#ifdef ICK_USEEVENTFD
+  if( ictx->timerFd>=0 )
+    _ickPolllistAdd( plist, ictx->timerFd, POLLIN );
+#endif
 
 /*------------------------------------------------------------------------*\
     Add SSDP listener and communication sockets
 \*------------------------------------------------------------------------*/
-    _ickPolllistAdd( &plist, ictx->upnpListenerSocket, POLLIN );
-    for( interface=ictx->interfaces; interface; interface=interface->next )
-      _ickPolllistAdd( &plist, interface->upnpComSocket, POLLIN );
+  _ickPolllistAdd( plist, ictx->upnpListenerSocket, POLLIN );
+  for( interface=ictx->interfaces; interface; interface=interface->next )
+    _ickPolllistAdd( plist, interface->upnpComSocket, POLLIN );
 
 /*------------------------------------------------------------------------*\
     Collect all http client instances context
 \*------------------------------------------------------------------------*/
 #if 0
-    _ickLibWGettersLock( ictx );
-    for( wget=ictx->wGetters; wget; wget=wget->next ) {
-      if( _ickPolllistAdd(&plist,_ickWGetSocket(wget),POLLIN) )
-        break;
-    }
-    _ickLibWGettersUnlock( ictx );
-    if( wget ) {
-      logerr( "ickp2p main thread: out of memory." );
+  _ickLibWGettersLock( ictx );
+  for( wget=ictx->wGetters; wget; wget=wget->next ) {
+    if( _ickPolllistAdd(plist,_ickWGetSocket(wget),POLLIN) )
       break;
-    }
+  }
+  _ickLibWGettersUnlock( ictx );
+  if( wget ) {
+    logerr( "ickp2p main thread: out of memory." );
+    return -1;
+  }
 #endif
 
 /*------------------------------------------------------------------------*\
     Merge sockets managed by libwebsockets
 \*------------------------------------------------------------------------*/
-    if( _ickPolllistAppend(&plist,&ictx->lwsPolllist) ) {
-      logerr( "ickp2p main thread: out of memory." );
-      break;
-    }
+  if( _ickPolllistAppend(plist,&ictx->lwsPolllist) ) {
+    logerr( "ickp2p main thread: out of memory." );
+    return -1;
+  }
 
 /*------------------------------------------------------------------------*\
     Do the polling...
 \*------------------------------------------------------------------------*/
-    debug( "ickp2p main thread (%p): polling %d sockets (%d lws), timeout %.3fs...",
-            ictx, plist.nfds, ictx->lwsPolllist.nfds, timeout/1000.0 );
-    for( i=0; i<plist.nfds; i++ )
-      debug( "ickp2p main thread (%p): poll list element #%d - %d (event mask 0x%02x)",
-             ictx, i, plist.fds[i].fd, plist.fds[i].events );
-    retval = poll( plist.fds, plist.nfds, timeout );
-    if( retval<0 ) {
-      logerr( "ickp2p main thread: poll failed (%s).", strerror(errno) );
-      break;
-    }
-    if( !retval ) {
-      debug( "ickp2p main thread (%p): timed out.", ictx );
-      continue;
-    }
-    for( i=0; i<plist.nfds; i++ )
-      debug( "ickp2p main thread (%p): poll list element #%d - %d (revent mask 0x%02x)",
-             ictx, i, plist.fds[i].fd, plist.fds[i].revents );
+  debug( "ickp2p main thread (%p): polling %d sockets (%d lws), timeout %.3fs...",
+          ictx, plist->nfds, ictx->lwsPolllist.nfds, timeout/1000.0 );
+  for( i=0; i<plist->nfds; i++ )
+    debug( "ickp2p main thread (%p): poll list element #%d - %d (event mask 0x%02x)",
+           ictx, i, plist->fds[i].fd, plist->fds[i].events );
+  retval = poll( plist->fds, plist->nfds, timeout );
+  if( retval<0 ) {
+    logerr( "ickp2p main thread: poll failed (%s).", strerror(errno) );
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return retval;
+}
+
+
+/*=========================================================================*\
+  Process the result of a wait cycle of a context
+    retval is the number of ready descriptors in ictx->pollList
+\*=========================================================================*/
+static void _ickMainThreadProcess( ickP2pContext_t *ictx, int retval )
+{
+  ickPolllist_t    *plist = &ictx->pollList;
+  char             *buffer = ictx->ssdpBuffer;
+  ickInterface_t   *interface;
+  ickWGetContext_t *wget, *wgetNext;
+  int               handled = 0;
+  int               i;
+
+/*------------------------------------------------------------------------*\
+    Idle lws descriptors are not serviced anymore, so explicitly trigger
+    the (once per second) timeout processing of libwebsockets
+\*------------------------------------------------------------------------*/
+  libwebsocket_service_fd( ictx->lwsContext, NULL );
+
+  if( !retval ) {
+    debug( "ickp2p main thread (%p): timed out.", ictx );
+    return;
+  }
+  for( i=0; i<plist->nfds; i++ )
+    debug( "ickp2p main thread (%p): poll list element #%d - %d (revent mask 0x%02x)",
+           ictx, i, plist->fds[i].fd, plist->fds[i].revents );
+
+/*------------------------------------------------------------------------*\
+    Was there a break request?
+    The pending flag is reset before any requested work (interface changes,
+    callback inventory, submissions, loopback deliveries) is processed, so
+    requests issued meanwhile are either covered below or trigger a new
+    wakeup.
+\*------------------------------------------------------------------------*/
+  if( _ickPolllistCheck(plist,ictx->pollBreakPipe[0],POLLIN)>0 ) {
+#ifdef ICK_USEEVENTFD
+    uint64_t cnt;
+    ssize_t  len = read( ictx->pollBreakPipe[0], &cnt, sizeof(cnt) );
+#else
+    ssize_t  len = read( ictx->pollBreakPipe[0], buffer, ICKDISCOVERY_HEADER_SIZE_MAX );
+#endif
+    if( len<0 && errno!=EAGAIN )
+      logerr( "ickp2p main thread: Unable to read break request pipe: %s",
+               strerror(errno) );
+    else
+      debug( "ickp2p main thread (%p): received break requests", ictx );
+    __sync_lock_release( &ictx->breakPending );
+    handled++;
+  }
 
 /*------------------------------------------------------------------------*\
     Process changes in interface list
 \*------------------------------------------------------------------------*/
-    _ickTimerListLock( ictx );
-    _ickLibInterfaceListLock( ictx );
+  _ickTimerListLock( ictx );
+  _ickLibInterfaceListLock( ictx );
 
-    // Delete interfaces
-    for( interface=ictx->interfaces; interface; interface=interface->next ) {
-      if( interface->shutdownMode==ICKP2P_INTSHUTDOWN_NONE )
-        continue;
-      if( interface->shutdownMode==ICKP2P_INTSHUTDOWN_PROACTIVE )
-        _ssdpByebyeInterface( ictx, interface );
-      _ickLibInterfaceUnlink( ictx, interface );
-      _ickLibInterfaceDestruct( interface );
-    }
+  // Delete interfaces
+  for( interface=ictx->interfaces; interface; interface=interface->next ) {
+    if( interface->shutdownMode==ICKP2P_INTSHUTDOWN_NONE )
+      continue;
+    if( interface->shutdownMode==ICKP2P_INTSHUTDOWN_PROACTIVE )
+      _ssdpByebyeInterface( ictx, interface );
+    _ickLibInterfaceUnlink( ictx, interface );
+    _ickLibInterfaceDestruct( interface );
+  }
 
-    // Announce any newly registered interfaces
-    for( interface=ictx->interfaces; interface; interface=interface->next ) {
-      if( !interface->announcedBootId )
-        break;
-    }
-    if( interface )
-      _ssdpNewInterface( ictx );
+  // Announce any newly registered interfaces
+  for( interface=ictx->interfaces; interface; interface=interface->next ) {
+    if( !interface->announcedBootId )
+      break;
+  }
+  if( interface )
+    _ssdpNewInterface( ictx );
 
-    _ickLibInterfaceListUnlock( ictx );
-    _ickTimerListUnlock( ictx );
+  _ickLibInterfaceListUnlock( ictx );
+  _ickTimerListUnlock( ictx );
 
 /*------------------------------------------------------------------------*\
-    Detect any newly registered callbacks and send current device states
+    Detect any newly registered callbacks and send current device states,
+    free replaced callback lists
 \*------------------------------------------------------------------------*/
-    struct _cblist *cb;
-    perr = pthread_mutex_lock( &ictx->discoveryCbsMutex );
-    if( perr )
-      logerr( "ickp2p main thread: cannot lock discovery mutex (%s)", strerror(perr) );
+  _ickLibExecDiscoveryInventory( ictx );
+  _ickLibCbReclaim( ictx );
 
-    for( cb=ictx->discoveryCbs; cb; cb=cb->next ) {
-      ickDevice_t *device;
-      if( !cb->isNew )
-        continue;
-      cb->isNew = 0;
-      _ickLibDeviceListLock( ictx );
-      for( device=ictx->deviceList; device; device=device->next ) {
-        ((ickP2pDiscoveryCb_t)cb->callback)( ictx, device->uuid, ICKP2P_INVENTORY, device->services );
-        if( device->wsi || device->connectionState==ICKDEVICE_LOOPBACK )
-          ((ickP2pDiscoveryCb_t)cb->callback)( ictx, device->uuid, ICKP2P_CONNECTED, device->services );
-      }
-      _ickLibDeviceListUnlock( ictx );
-    }
-    perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
-    if( perr )
-      logerr( "ickp2p main thread: cannot unlock discovery mutex (%s)", strerror(perr) );
+/*------------------------------------------------------------------------*\
+    Resolve messages submitted by application threads
+\*------------------------------------------------------------------------*/
+  _ickP2pProcessSubmissions( ictx );
 
 /*------------------------------------------------------------------------*\
-    First execute loop back deliveries
+    Execute loop back deliveries
 \*------------------------------------------------------------------------*/
-    while( ictx->deviceLoopback && ictx->deviceLoopback->outQueue ) {
-      _ickDeliverLoopbackMessage( ictx );
-    }
+  while( ictx->deviceLoopback && _ickDevicePendingOutMessages(ictx->deviceLoopback) ) {
+    _ickDeliverLoopbackMessage( ictx );
+  }
 
 /*------------------------------------------------------------------------*\
-    Was there a break request?
+    Timer descriptor expired? Timers are executed in the next cycle.
 \*------------------------------------------------------------------------*/
-    if( plist.fds[0].revents&POLLIN ) {
-      ssize_t len = read( plist.fds[0].fd, buffer, ICKDISCOVERY_HEADER_SIZE_MAX );
-      if( len<0 )
-        logerr( "ickp2p main thread: Unable to read break request pipe: %s",
-                 strerror(errno) );
-      else
-        debug( "ickp2p main thread (%p): received break requests (\"%.*s\")",
-                ictx, (int)len, buffer );
-      if( retval==1 )
-        continue;
-    }
-//    if( ictx->state==ICKLIB_TERMINATING )
-//      break;
+#ifdef ICK_USEEVENTFD
+  if( ictx->timerFd>=0 && _ickPolllistCheck(plist,ictx->timerFd,POLLIN)>0 ) {
+    uint64_t cnt;
+    if( read(ictx->timerFd,&cnt,sizeof(cnt))<0 && errno!=EAGAIN )
+      logerr( "ickp2p main thread: Unable to read timer descriptor: %s",
+               strerror(errno) );
+    _ickTimerListLock( ictx );
+    ictx->timerWakeup = 0;
+    _ickTimerListUnlock( ictx );
+    handled++;
+  }
+#endif
+  if( handled && retval==handled )
+    return;
+//  if( ictx->state==ICKLIB_TERMINATING )
+//    return;
 
 /*------------------------------------------------------------------------*\
     Process incoming data from SSDP socket
 \*------------------------------------------------------------------------*/
-    _ickLibLock( ictx );
-    for( interface=ictx->interfaces; interface; interface=interface->next ) {
-      if( _ickPolllistCheck(&plist,interface->upnpComSocket,POLLIN)>0 )
-        _ickServiceSsdpSocket( ictx, buffer, interface->upnpComSocket );
-    }
-    if( _ickPolllistCheck(&plist,ictx->upnpListenerSocket,POLLIN)>0 )
-      _ickServiceSsdpSocket( ictx, buffer, ictx->upnpListenerSocket );
-    _ickLibUnlock( ictx );
+  _ickLibLock( ictx );
+  for( interface=ictx->interfaces; interface; interface=interface->next ) {
+    if( _ickPolllistCheck(plist,interface->upnpComSocket,POLLIN)>0 )
+      _ickServiceSsdpSocket( ictx, buffer, interface->upnpComSocket );
+  }
+  if( _ickPolllistCheck(plist,ictx->upnpListenerSocket,POLLIN)>0 )
+    _ickServiceSsdpSocket( ictx, buffer, ictx->upnpListenerSocket );
+  _ickLibUnlock( ictx );
 
 /*------------------------------------------------------------------------*\
     Process http client sockets
 \*------------------------------------------------------------------------*/
-    _ickLibWGettersLock( ictx );
-    for( wget=ictx->wGetters; wget; wget=wgetNext ) {
-      wgetNext = wget->next;
-/*    int fd = _ickWGetSocket( wget );
+  _ickLibWGettersLock( ictx );
+  for( wget=ictx->wGetters; wget; wget=wgetNext ) {
+    wgetNext = wget->next;
+/*  int fd = _ickWGetSocket( wget );
 
-      i = _ickPolllistGetIndex( &plist, fd );
-      if( i<0 ) {
-        logwarn( "ickp2p main thread: wget socket %d not in plist", fd );
-        continue;
-      }
-      debug( "ickp2p main thread: servicing wget socket %d (event mask 0x%02x)",
-             plist.fds[i].fd, plist.fds[i].revents );
-      irc = _ickWGetServiceFd( wget, &plist.fds[i] );
-*/    // For the time beeing just check the state of the separate thread
-      if( _ickWGetServiceFd(wget,NULL) ) {
-        ickDevice_t *device = _ickWGetUserData( wget );
-
-        // unlink HTTP client from list of getters and destroy
-        _ickLibWGettersRemove( ictx, wget );
-        _ickWGetDestroy( wget );
-
-        // If the device is complete, initiate web socket connection
-        if( device->friendlyName && !device->wsi && device->doConnect )
-          _ickWebSocketOpen( ictx->lwsContext, device );
-      }
+    i = _ickPolllistGetIndex( plist, fd );
+    if( i<0 ) {
+      logwarn( "ickp2p main thread: wget socket %d not in plist", fd );
+      continue;
     }
-    _ickLibWGettersUnlock( ictx );
+    debug( "ickp2p main thread: servicing wget socket %d (event mask 0x%02x)",
+           plist->fds[i].fd, plist->fds[i].revents );
+    irc = _ickWGetServiceFd( wget, &plist->fds[i] );
+*/  // For the time beeing just check the state of the separate thread
+    if( _ickWGetServiceFd(wget,NULL) ) {
+      ickDevice_t *device = _ickWGetUserData( wget );
+
+      // unlink HTTP client from list of getters and destroy
+      _ickLibWGettersRemove( ictx, wget );
+      _ickWGetDestroy( wget );
+
+      // If the device is complete, initiate web socket connection
+      if( device->friendlyName && !device->wsi && device->doConnect )
+        _ickShardConnect( ictx, device );
+    }
+  }
+  _ickLibWGettersUnlock( ictx );
 
 /*------------------------------------------------------------------------*\
     Service libwebsockets descriptors
 \*------------------------------------------------------------------------*/
-    for( i=0; i<plist.nfds; i++ ) {
-      // Is this member of the lws set?
-      if( _ickPolllistGetIndex(&ictx->lwsPolllist,plist.fds[i].fd)<0 )
-        continue;
-      debug( "ickp2p main thread (%p): calling libwebsocket_service_fd(%p,%d), event mask 0x%02x",
-             ictx, ictx->lwsContext, plist.fds[i].fd, plist.fds[i].revents );
-      if( libwebsocket_service_fd(ictx->lwsContext, &plist.fds[i])<0 ) {
-        logerr( "ickp2p main thread: libwebsocket_service_fd returned an error." );
-        break;
-      }
+  for( i=0; i<plist->nfds; i++ ) {
+    // Anything to do?
+    if( !plist->fds[i].revents )
+      continue;
+    // Is this member of the lws set?
+    if( _ickPolllistGetIndex(&ictx->lwsPolllist,plist->fds[i].fd)<0 )
+      continue;
+    debug( "ickp2p main thread (%p): calling libwebsocket_service_fd(%p,%d), event mask 0x%02x",
+           ictx, ictx->lwsContext, plist->fds[i].fd, plist->fds[i].revents );
+    if( libwebsocket_service_fd(ictx->lwsContext, &plist->fds[i])<0 ) {
+      logerr( "ickp2p main thread: libwebsocket_service_fd returned an error." );
+      break;
     }
+  }
 
-  } //  while( icklib->state<ICKLIB_TERMINATING )
-  debug( "ickp2p (%p): thread terminating for \"%s\" \"%s\"",
-         ictx, ictx->deviceName, ictx->deviceUuid );
+}
+
+
+/*=========================================================================*\
+  Shut down main loop resources of a context and destruct it
+    This is executed in the context of the main thread or shared loop.
+    The context descriptor must not be used afterwards.
+\*=========================================================================*/
+static void _ickMainThreadCleanup( ickP2pContext_t *ictx )
+{
+  debug( "_ickMainThreadCleanup (%p):", ictx );
 
 /*------------------------------------------------------------------------*\
-    Get rid of libwebsocket context
+    Stop reactor shards and get rid of libwebsocket context
     This will close all connections send disconnected messages
 \*------------------------------------------------------------------------*/
+  _ickShardsStop( ictx );
   libwebsocket_context_destroy( ictx->lwsContext );
   Sfree( ictx->lwsProtocols );
 
@@ -488,19 +833,29 @@ void *_ickMainThread( void *arg )
 \*------------------------------------------------------------------------*/
   _ickSsdpEndDiscovery( ictx );
 
+/*------------------------------------------------------------------------*\
+    Stop dispatch workers, this will handle all messages still queued
+\*------------------------------------------------------------------------*/
+  _ickDispatchStop( ictx );
+
 /*------------------------------------------------------------------------*\
     Clean up
 \*------------------------------------------------------------------------*/
-  Sfree( buffer );
-  _ickPolllistFree( &plist );
+  Sfree( ictx->ssdpBuffer );
+  _ickPolllistFree( &ictx->pollList );
   _ickPolllistFree( &ictx->lwsPolllist );
+#ifdef ICK_USEEPOLL
+  _ickEpollFree( ictx );
+#endif
 
 /*------------------------------------------------------------------------*\
     Clear all remaining timer
 \*------------------------------------------------------------------------*/
   _ickTimerListLock( ictx );
-  while( ictx->timers )
-    _ickTimerDelete( ictx, ictx->timers );
+  while( ictx->timerCnt )
+    _ickTimerDelete( ictx, ictx->timers[ictx->timerCnt-1] );
+  Sfree( ictx->timers );
+  ictx->timerSize = 0;
   _ickTimerListUnlock( ictx );
 
 /*------------------------------------------------------------------------*\
@@ -521,7 +876,6 @@ void *_ickMainThread( void *arg )
     Destruct context, that's all
 \*------------------------------------------------------------------------*/
   _ickLibDestruct( ictx );
-  return NULL;
 }
 
 
@@ -587,13 +941,29 @@ static void _ickServiceSsdpSocket( ickP2pContext_t *ictx, char *buffer, int sd )
 \*=========================================================================*/
 ickErrcode_t _ickMainThreadBreak( ickP2pContext_t *ictx, char flag )
 {
+#ifdef ICK_USEEVENTFD
+  uint64_t one = 1;
+#endif
+
+/*------------------------------------------------------------------------*\
+    Coalesce: nothing to do if a wakeup is already outstanding
+\*------------------------------------------------------------------------*/
+  if( __sync_lock_test_and_set(&ictx->breakPending,1) ) {
+    debug( "_ickMainThreadBreak (%p): break request '%c' coalesced", ictx, flag );
+    return ICKERR_SUCCESS;
+  }
   debug( "_ickMainThreadBreak (%p): sending break request '%c'", ictx, flag );
 
 /*------------------------------------------------------------------------*\
     Try to send flag
 \*------------------------------------------------------------------------*/
+#ifdef ICK_USEEVENTFD
+  if( write(ictx->pollBreakPipe[1],&one,sizeof(one))<0 ) {
+#else
   if( write(ictx->pollBreakPipe[1],&flag,1)<0 ) {
+#endif
     logerr( "_ickMainThreadBreak: Unable to write to poll break pipe: %s", strerror(errno) );
+    __sync_lock_release( &ictx->breakPending );
     return ICKERR_GENERIC;
   }
 
@@ -604,56 +974,1000 @@ ickErrcode_t _ickMainThreadBreak( ickP2pContext_t *ictx, char flag )
 }
 
 
-#pragma mark -- Libwebsocket init and HTTP handler
-
-
 /*=========================================================================*\
-  Create a libwebsocket instance
+  Request termination of a running context
+    The thread (or shared loop) destructs the context as soon as it sees
+    the state. So the state is published under a lock the thread acquires
+    before cleanup, and the context is not touched after unlocking.
 \*=========================================================================*/
-static struct libwebsocket_context *_ickCreateLwsContext( ickP2pContext_t *ictx, const char *ifname, int *port )
+ickErrcode_t _ickMainThreadTerminate( ickP2pContext_t *ictx, ickP2pEndCb_t callback )
 {
-  struct libwebsocket_context *lwsContext;
-  struct lws_context_creation_info info;
-  memset( &info, 0, sizeof(info) );
+  ickErrcode_t irc;
+  debug( "_ickMainThreadTerminate (%p): loop %p", ictx, ictx->loop );
+
+/*------------------------------------------------------------------------*\
+    Attached to a shared loop: the loop thread locks the loop before
+    cleanup and is woken up via the loop's break pipe
+\*------------------------------------------------------------------------*/
+#ifdef ICK_USEEPOLL
+  if( ictx->loop ) {
+    ickP2pLoop_t *loop = ictx->loop;
+    _ickLoopLock( loop );
+    ictx->cbEnd = callback;
+    ictx->state = ICKLIB_TERMINATING;
+    irc = _ickLoopBreak( loop, 'X' );
+    _ickLoopUnlock( loop );
+    return irc;
+  }
+#endif
 
 /*------------------------------------------------------------------------*\
-    Try to guess a free port
-      fixme: libwebsockets should be patched to accept port=-1 for
-             autoselecting a port
+    Own main thread: it waits for endMutex before cleanup
 \*------------------------------------------------------------------------*/
-#ifdef CONTEXT_PORT_CHOOSE_FREE
-  info.port = CONTEXT_PORT_CHOOSE_FREE;
-#else
-  info.port = _ickIpGetFreePort( ifname );
-  if( info.port<0 )
-    info.port = 49152 + random()%10000;
-  *port = info.port;
-#endif
+  pthread_mutex_lock( &ictx->endMutex );
+  ictx->cbEnd = callback;
+  ictx->state = ICKLIB_TERMINATING;
+  irc = _ickMainThreadBreak( ictx, 'X' );
+  pthread_mutex_unlock( &ictx->endMutex );
+
+/*------------------------------------------------------------------------*\
+    That's it
+\*------------------------------------------------------------------------*/
+  return irc;
+}
+
+
+#pragma mark -- Shared event loops
+
+
+#ifdef ICK_USEEPOLL
+
+/*=========================================================================*\
+  Create a shared event loop
+    Contexts attached to a loop (see ickP2pSetLoop()) are all serviced by
+    the loop's thread instead of having a dedicated main thread each.
+    Applications might create a small number of loops and distribute
+    their contexts among them.
+    returns loop descriptor or NULL on error (with *error set if not NULL)
+\*=========================================================================*/
+ickP2pLoop_t *ickP2pLoopCreate( ickErrcode_t *error )
+{
+  ickP2pLoop_t       *loop;
+  struct epoll_event  ev;
+  int                 rc;
+  debug( "ickP2pLoopCreate:" );
+
+/*------------------------------------------------------------------------*\
+    Allocate and initialize loop descriptor
+\*------------------------------------------------------------------------*/
+  loop = calloc( 1, sizeof(ickP2pLoop_t) );
+  if( !loop ) {
+    logerr( "ickP2pLoopCreate: out of memory." );
+    if( error )
+      *error = ICKERR_NOMEM;
+    return NULL;
+  }
+  loop->breakPipe[0] = -1;
+  loop->breakPipe[1] = -1;
+  pthread_mutex_init( &loop->mutex, NULL );
+  pthread_cond_init( &loop->condChanged, NULL );
+
+/*------------------------------------------------------------------------*\
+    Create epoll instance and break pipe
+\*------------------------------------------------------------------------*/
+  loop->epollFd = epoll_create1( EPOLL_CLOEXEC );
+  if( loop->epollFd<0 || pipe(loop->breakPipe) ) {
+    logerr( "ickP2pLoopCreate: could not create descriptors (%s).", strerror(errno) );
+    _ickLoopFree( loop );
+    if( error )
+      *error = ICKERR_NOSOCKET;
+    return NULL;
+  }
+  memset( &ev, 0, sizeof(ev) );
+  ev.events   = EPOLLIN;
+  ev.data.ptr = loop;
+  if( epoll_ctl(loop->epollFd,EPOLL_CTL_ADD,loop->breakPipe[0],&ev) ) {
+    logerr( "ickP2pLoopCreate: could not register break pipe (%s).", strerror(errno) );
+    _ickLoopFree( loop );
+    if( error )
+      *error = ICKERR_NOSOCKET;
+    return NULL;
+  }
+
+/*------------------------------------------------------------------------*\
+    Start loop thread
+\*------------------------------------------------------------------------*/
+  rc = pthread_create( &loop->thread, NULL, _ickLoopThread, loop );
+  if( rc ) {
+    logerr( "ickP2pLoopCreate: Unable to start loop thread: %s", strerror(rc) );
+    _ickLoopFree( loop );
+    if( error )
+      *error = ICKERR_NOTHREAD;
+    return NULL;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's it
+\*------------------------------------------------------------------------*/
+  debug( "ickP2pLoopCreate: created loop %p", loop );
+  if( error )
+    *error = ICKERR_SUCCESS;
+  return loop;
+}
+
+
+/*=========================================================================*\
+  Stop and destroy a shared event loop
+    All attached contexts must have been ended before.
+    Must not be called from within a callback executed by the loop.
+\*=========================================================================*/
+ickErrcode_t ickP2pLoopDestroy( ickP2pLoop_t *loop )
+{
+  int rc;
+  debug( "ickP2pLoopDestroy (%p):", loop );
+
+/*------------------------------------------------------------------------*\
+    Refuse to destroy while contexts are still attached
+\*------------------------------------------------------------------------*/
+  _ickLoopLock( loop );
+  if( loop->contexts || loop->pending || loop->detaching ) {
+    _ickLoopUnlock( loop );
+    logwarn( "ickP2pLoopDestroy (%p): there are still contexts attached", loop );
+    return ICKERR_WRONGSTATE;
+  }
+  loop->terminate = 1;
+  _ickLoopUnlock( loop );
+
+/*------------------------------------------------------------------------*\
+    Break loop thread and wait for termination
+\*------------------------------------------------------------------------*/
+  _ickLoopBreak( loop, 'X' );
+  rc = pthread_join( loop->thread, NULL );
+  if( rc ) {
+    logerr( "ickP2pLoopDestroy: Unable to join loop thread: %s", strerror(rc) );
+    return ICKERR_GENERIC;
+  }
+
+/*------------------------------------------------------------------------*\
+    Free resources, that's all
+\*------------------------------------------------------------------------*/
+  _ickLoopFree( loop );
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Request attachment of a context to its shared loop
+    Initialization will be done asynchronously by the loop thread,
+    which signals ictx->condIsReady when done (like _ickMainThread())
+\*=========================================================================*/
+ickErrcode_t _ickLoopAttach( ickP2pContext_t *ictx )
+{
+  ickP2pLoop_t *loop = ictx->loop;
+  debug( "_ickLoopAttach (%p): loop %p", ictx, loop );
+
+/*------------------------------------------------------------------------*\
+    Queue context for init by loop thread, unless the thread is gone
+\*------------------------------------------------------------------------*/
+  _ickLoopLock( loop );
+  if( loop->dead ) {
+    _ickLoopUnlock( loop );
+    logerr( "_ickLoopAttach (%p): loop %p is not running", ictx, loop );
+    return ICKERR_NOTHREAD;
+  }
+  ictx->loopNext = loop->pending;
+  loop->pending  = ictx;
+  _ickLoopUnlock( loop );
+
+/*------------------------------------------------------------------------*\
+    Wake up loop thread, that's all
+\*------------------------------------------------------------------------*/
+  return _ickLoopBreak( loop, 'A' );
+}
+
+
+/*=========================================================================*\
+  Wait till a terminating context was shut down and destructed by its loop
+    The context descriptor is only used as an id here.
+\*=========================================================================*/
+void _ickLoopWaitDetached( ickP2pLoop_t *loop, const ickP2pContext_t *ictx )
+{
+  ickP2pContext_t *walk;
+  int              perr;
+  debug( "_ickLoopWaitDetached (%p): loop %p", ictx, loop );
+
+/*------------------------------------------------------------------------*\
+    Wait till context is neither member of the loop nor in shutdown
+\*------------------------------------------------------------------------*/
+  _ickLoopLock( loop );
+  for(;;) {
+    for( walk=loop->contexts; walk&&walk!=ictx; walk=walk->loopNext );
+    if( !walk && loop->detaching!=ictx )
+      break;
+    perr = pthread_cond_wait( &loop->condChanged, &loop->mutex );
+    if( perr ) {
+      logerr( "_ickLoopWaitDetached: %s", strerror(perr) );
+      break;
+    }
+  }
+  _ickLoopUnlock( loop );
+}
+
+
+/*=========================================================================*\
+  The shared loop thread
+\*=========================================================================*/
+static void *_ickLoopThread( void *arg )
+{
+  ickP2pLoop_t       *loop = arg;
+  ickP2pContext_t    *ictx, *next, **pptr;
+  struct epoll_event  events[ICKEPOLL_MAXEVENTS];
+  struct epoll_event  ev;
+  char                buffer[64];
+  int                 timeout, t;
+  int                 n, i;
+
+  debug( "_ickLoopThread (%p): starting", loop );
+  PTHREADSETNAME( "ickP2PLoop" );
+
+/*------------------------------------------------------------------------*\
+    Run till loop is destroyed
+\*------------------------------------------------------------------------*/
+  while( !loop->terminate ) {
+
+/*------------------------------------------------------------------------*\
+    Init pending contexts and register their epoll instances
+\*------------------------------------------------------------------------*/
+    for(;;) {
+      _ickLoopLock( loop );
+      ictx = loop->pending;
+      if( ictx ) {
+        loop->pending  = ictx->loopNext;
+        ictx->loopNext = loop->contexts;
+        loop->contexts = ictx;
+      }
+      _ickLoopUnlock( loop );
+      if( !ictx )
+        break;
+
+      // Unlink again on errors before ickP2pResume() gets signaled
+      if( _ickMainThreadInit(ictx) ) {
+        _ickLoopLock( loop );
+        loop->contexts = ictx->loopNext;
+        _ickLoopUnlock( loop );
+        _ickMainThreadSignalReady( ictx );
+        continue;
+      }
+      memset( &ev, 0, sizeof(ev) );
+      ev.events   = EPOLLIN;
+      ev.data.ptr = ictx;
+      if( epoll_ctl(loop->epollFd,EPOLL_CTL_ADD,ictx->epollFd,&ev) ) {
+        logerr( "_ickLoopThread (%p): could not register context %p (%s)",
+                loop, ictx, strerror(errno) );
+        ictx->state = ICKLIB_TERMINATING;
+      }
+      _ickMainThreadSignalReady( ictx );
+    }
+
+/*------------------------------------------------------------------------*\
+    Shut down terminating contexts
+\*------------------------------------------------------------------------*/
+    for( pptr=&loop->contexts; *pptr; ) {
+      ictx = *pptr;
+      if( ictx->state<ICKLIB_TERMINATING ) {
+        pptr = &ictx->loopNext;
+        continue;
+      }
+      debug( "_ickLoopThread (%p): context %p terminating", loop, ictx );
+      epoll_ctl( loop->epollFd, EPOLL_CTL_DEL, ictx->epollFd, NULL );
+      _ickLoopLock( loop );
+      *pptr = ictx->loopNext;
+      loop->detaching = ictx;
+      _ickLoopUnlock( loop );
+      _ickMainThreadCleanup( ictx );
+      _ickLoopLock( loop );
+      loop->detaching = NULL;
+      pthread_cond_broadcast( &loop->condChanged );
+      _ickLoopUnlock( loop );
+    }
+
+/*------------------------------------------------------------------------*\
+    Execute timers of all contexts and get next wakeup.
+    The member list is only modified by this thread, so no need to lock
+    it for reading. Callbacks might therefore use the loop API.
+\*------------------------------------------------------------------------*/
+    timeout = ICKMAINLOOP_TIMEOUT_MS;
+    for( ictx=loop->contexts; ictx; ictx=ictx->loopNext ) {
+      t = _ickMainThreadTimers( ictx );
+      if( t<timeout )
+        timeout = t;
+    }
+
+/*------------------------------------------------------------------------*\
+    Wait for any context's epoll instance to become ready
+\*------------------------------------------------------------------------*/
+    debug( "_ickLoopThread (%p): epolling, timeout %.3fs...", loop, timeout/1000.0 );
+    n = epoll_wait( loop->epollFd, events, ICKEPOLL_MAXEVENTS, timeout );
+    if( n<0 && errno!=EINTR ) {
+      logerr( "_ickLoopThread (%p): epoll_wait failed (%s).", loop, strerror(errno) );
+      break;
+    }
+
+/*------------------------------------------------------------------------*\
+    Service ready contexts
+\*------------------------------------------------------------------------*/
+    for( i=0; i<n; i++ ) {
+      if( events[i].data.ptr==loop ) {
+        if( read(loop->breakPipe[0],buffer,sizeof(buffer))<0 )
+          logerr( "_ickLoopThread: Unable to read break pipe: %s", strerror(errno) );
+        continue;
+      }
+      ictx = events[i].data.ptr;
+      if( ictx->state>=ICKLIB_TERMINATING )
+        continue;
+      t = _ickMainThreadWait( ictx, 0 );
+      if( t<0 ) {
+        ictx->state = ICKLIB_TERMINATING;
+        continue;
+      }
+      _ickMainThreadProcess( ictx, t );
+    }
+
+  }  // while( !loop->terminate )
+
+/*------------------------------------------------------------------------*\
+    Fatal error: refuse further attachments, fail pending initializations
+    (ickP2pResume() is waiting for them) and shut down all remaining contexts
+\*------------------------------------------------------------------------*/
+  _ickLoopLock( loop );
+  loop->dead = 1;
+  while( loop->pending ) {
+    ictx          = loop->pending;
+    loop->pending = ictx->loopNext;
+    ictx->error   = ICKERR_NOTHREAD;
+    _ickMainThreadSignalReady( ictx );
+  }
+  for( ictx=loop->contexts; ictx; ictx=next ) {
+    next = ictx->loopNext;
+    loop->detaching = ictx;
+    loop->contexts  = next;
+    ictx->state     = ICKLIB_TERMINATING;
+    _ickLoopUnlock( loop );
+    _ickMainThreadCleanup( ictx );
+    _ickLoopLock( loop );
+  }
+  loop->detaching = NULL;
+  pthread_cond_broadcast( &loop->condChanged );
+  _ickLoopUnlock( loop );
+
+  debug( "_ickLoopThread (%p): terminating", loop );
+  return NULL;
+}
+
+
+/*=========================================================================*\
+  Wake up a loop thread
+\*=========================================================================*/
+static ickErrcode_t _ickLoopBreak( ickP2pLoop_t *loop, char flag )
+{
+  debug( "_ickLoopBreak (%p): sending break request '%c'", loop, flag );
+
+  if( write(loop->breakPipe[1],&flag,1)<0 ) {
+    logerr( "_ickLoopBreak: Unable to write to break pipe: %s", strerror(errno) );
+    return ICKERR_GENERIC;
+  }
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Lock a loop descriptor
+\*=========================================================================*/
+static void _ickLoopLock( ickP2pLoop_t *loop )
+{
+  int perr;
+  debug ( "_ickLoopLock (%p): locking...", loop );
+  perr = pthread_mutex_lock( &loop->mutex );
+  if( perr )
+    logerr( "_ickLoopLock: %s", strerror(perr) );
+  debug ( "_ickLoopLock (%p): locked", loop );
+}
+
+
+/*=========================================================================*\
+  Unlock a loop descriptor
+\*=========================================================================*/
+static void _ickLoopUnlock( ickP2pLoop_t *loop )
+{
+  int perr;
+  debug ( "_ickLoopUnlock (%p): unlocked", loop );
+  perr = pthread_mutex_unlock( &loop->mutex );
+  if( perr )
+    logerr( "_ickLoopUnlock: %s", strerror(perr) );
+}
+
+
+/*=========================================================================*\
+  Free a loop descriptor (thread must not be running)
+\*=========================================================================*/
+static void _ickLoopFree( ickP2pLoop_t *loop )
+{
+  int i;
+  debug( "_ickLoopFree (%p):", loop );
+
+  if( loop->epollFd>=0 )
+    close( loop->epollFd );
+  for( i=0; i<2; i++ ) {
+    if( loop->breakPipe[i]>=0 )
+      close( loop->breakPipe[i] );
+  }
+  pthread_mutex_destroy( &loop->mutex );
+  pthread_cond_destroy( &loop->condChanged );
+  Sfree( loop );
+}
+
+
+#else  /* ICK_USEEPOLL */
+
+/*=========================================================================*\
+  Shared loops need epoll support
+\*=========================================================================*/
+ickP2pLoop_t *ickP2pLoopCreate( ickErrcode_t *error )
+{
+  logerr( "ickP2pLoopCreate: shared loops are not supported on this platform" );
+  if( error )
+    *error = ICKERR_NOTIMPLEMENTED;
+  return NULL;
+}
+
+ickErrcode_t ickP2pLoopDestroy( ickP2pLoop_t *loop )
+{
+  return ICKERR_NOTIMPLEMENTED;
+}
+
+ickErrcode_t _ickLoopAttach( ickP2pContext_t *ictx )
+{
+  return ICKERR_NOTIMPLEMENTED;
+}
+
+void _ickLoopWaitDetached( ickP2pLoop_t *loop, const ickP2pContext_t *ictx )
+{
+}
+
+#endif  /* ICK_USEEPOLL */
+
+
+#pragma mark -- Reactor shards
+
+
+/*=========================================================================*\
+  Start reactor shards of a context
+    Every shard has its own thread and libwebsockets client context
+    (without listener) and services the outbound web socket connections
+    of the devices hashed to it. SSDP, HTTP and inbound connections stay
+    with the main thread.
+    This is executed in the context of the main thread or shared loop.
+    returns 0 on success or -1 on error (ictx->error is set)
+\*=========================================================================*/
+static int _ickShardsStart( ickP2pContext_t *ictx )
+{
+  ickShard_t *shard;
+  int         i;
+  int         rc;
+
+/*------------------------------------------------------------------------*\
+    Nothing to do?
+\*------------------------------------------------------------------------*/
+  if( !ictx->shardCnt )
+    return 0;
+  debug( "_ickShardsStart (%p): starting %d shards", ictx, ictx->shardCnt );
+
+/*------------------------------------------------------------------------*\
+    Allocate shard descriptors
+\*------------------------------------------------------------------------*/
+  ictx->shards = calloc( ictx->shardCnt, sizeof(ickShard_t) );
+  if( !ictx->shards ) {
+    logerr( "_ickShardsStart: out of memory" );
+    ictx->error = ICKERR_NOMEM;
+    return -1;
+  }
+
+  for( i=0; i<ictx->shardCnt; i++ ) {
+    shard = ictx->shards + i;
+    shard->ictx         = ictx;
+    shard->id           = i;
+    shard->breakPipe[0] = -1;
+    shard->breakPipe[1] = -1;
+    pthread_mutex_init( &shard->mutex, NULL );
+  }
+
+/*------------------------------------------------------------------------*\
+    Allocate resources and start shards one by one
+\*------------------------------------------------------------------------*/
+  for( i=0; i<ictx->shardCnt; i++ ) {
+    shard = ictx->shards + i;
+
+    // Descriptors and poll lists
+    if( pipe(shard->breakPipe) ) {
+      logerr( "_ickShardsStart: could not create break pipe (%s).", strerror(errno) );
+      ictx->error = ICKERR_NOSOCKET;
+      break;
+    }
+    if( _ickPolllistInit(&shard->pollList,ICKPOLLIST_INITSIZE,ICKPOLLIST_INCEMENT) ||
+        _ickPolllistInit(&shard->lwsPolllist,ICKPOLLIST_INITSIZE,ICKPOLLIST_INCEMENT) ) {
+      logerr( "_ickShardsStart: out of memory" );
+      ictx->error = ICKERR_NOMEM;
+      break;
+    }
+
+    // Client only lws context. There is no listener, so lws will not register
+    // any descriptor before we know the context pointer (see _lwsHttpCb())
+    shard->lwsContext = _ickCreateLwsContext( ictx, NULL, NULL, &shard->lwsProtocols );
+    if( !shard->lwsContext ) {
+      ictx->error = ICKERR_LWSERR;
+      break;
+    }
+
+    // Start thread
+    rc = pthread_create( &shard->thread, NULL, _ickShardThread, shard );
+    if( rc ) {
+      logerr( "_ickShardsStart: Unable to start shard thread: %s", strerror(rc) );
+      libwebsocket_context_destroy( shard->lwsContext );
+      shard->lwsContext = NULL;
+      ictx->error = ICKERR_NOTHREAD;
+      break;
+    }
+    shard->running = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    On error stop and free all shards started so far
+\*------------------------------------------------------------------------*/
+  if( i<ictx->shardCnt ) {
+    _ickShardsStop( ictx );
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Stop and free all reactor shards of a context
+    This will close all outbound connections.
+    Caller must not hold the timer or device list locks, since the
+    connection close handlers of the shards need them.
+\*=========================================================================*/
+static void _ickShardsStop( ickP2pContext_t *ictx )
+{
+  ickShard_t              *shard;
+  struct _ickShardRequest *request;
+  int                      i, j;
+  int                      rc;
+
+  if( !ictx->shards )
+    return;
+  debug( "_ickShardsStop (%p): stopping %d shards", ictx, ictx->shardCnt );
+
+/*------------------------------------------------------------------------*\
+    Signal termination to all running shards first...
+\*------------------------------------------------------------------------*/
+  for( i=0; i<ictx->shardCnt; i++ ) {
+    shard = ictx->shards + i;
+    if( !shard->running )
+      continue;
+    shard->terminate = 1;
+    _ickShardBreak( shard, 'X' );
+  }
+
+/*------------------------------------------------------------------------*\
+    ... then join and free them
+\*------------------------------------------------------------------------*/
+  for( i=0; i<ictx->shardCnt; i++ ) {
+    shard = ictx->shards + i;
+    if( shard->running ) {
+      rc = pthread_join( shard->thread, NULL );
+      if( rc )
+        logerr( "_ickShardsStop: Unable to join shard thread: %s", strerror(rc) );
+    }
+    while( shard->requests ) {
+      request         = shard->requests;
+      shard->requests = request->next;
+      Sfree( request->uuid );
+      Sfree( request );
+    }
+    for( j=0; j<2; j++ ) {
+      if( shard->breakPipe[j]>=0 )
+        close( shard->breakPipe[j] );
+    }
+    _ickPolllistFree( &shard->pollList );
+    _ickPolllistFree( &shard->lwsPolllist );
+    Sfree( shard->lwsProtocols );
+    pthread_mutex_destroy( &shard->mutex );
+  }
+
+/*------------------------------------------------------------------------*\
+    Free array, that's all
+\*------------------------------------------------------------------------*/
+  Sfree( ictx->shards );
+}
+
+
+/*=========================================================================*\
+  A reactor shard thread
+\*=========================================================================*/
+static void *_ickShardThread( void *arg )
+{
+  ickShard_t    *shard = arg;
+  ickPolllist_t *plist = &shard->pollList;
+  char           buffer[64];
+  int            retval;
+  int            rc;
+  int            i;
+
+  debug( "_ickShardThread (%p): shard #%d starting", shard->ictx, shard->id );
+  PTHREADSETNAME( "ickP2PShard" );
+
+/*------------------------------------------------------------------------*\
+    Run till context is shut down
+\*------------------------------------------------------------------------*/
+  while( !shard->terminate ) {
+
+/*------------------------------------------------------------------------*\
+    Initiate requested connections
+\*------------------------------------------------------------------------*/
+    _ickShardProcessRequests( shard );
+
+/*------------------------------------------------------------------------*\
+    Collect break pipe and lws descriptors.
+    The lws set is locked as writable callbacks might be booked by other threads.
+\*------------------------------------------------------------------------*/
+    _ickPolllistClear( plist );
+    _ickPolllistAdd( plist, shard->breakPipe[0], POLLIN );
+    _ickShardLock( shard );
+    rc = _ickPolllistAppend( plist, &shard->lwsPolllist );
+    _ickShardUnlock( shard );
+    if( rc ) {
+      logerr( "_ickShardThread: out of memory." );
+      break;
+    }
+
+/*------------------------------------------------------------------------*\
+    Wait for events
+\*------------------------------------------------------------------------*/
+    retval = poll( plist->fds, plist->nfds, ICKMAINLOOP_TIMEOUT_MS );
+    if( retval<0 ) {
+      if( errno==EINTR )
+        continue;
+      logerr( "_ickShardThread: poll failed (%s).", strerror(errno) );
+      break;
+    }
+
+/*------------------------------------------------------------------------*\
+    Trigger lws timeout processing
+\*------------------------------------------------------------------------*/
+    libwebsocket_service_fd( shard->lwsContext, NULL );
+    if( !retval )
+      continue;
+
+/*------------------------------------------------------------------------*\
+    Was there a break request?
+\*------------------------------------------------------------------------*/
+    if( _ickPolllistCheck(plist,shard->breakPipe[0],POLLIN)>0 ) {
+      if( read(shard->breakPipe[0],buffer,sizeof(buffer))<0 )
+        logerr( "_ickShardThread: Unable to read break request pipe: %s",
+                strerror(errno) );
+    }
+
+/*------------------------------------------------------------------------*\
+    Service libwebsockets descriptors. Only this thread adds or removes
+    lws descriptors, so no need to lock for the membership check.
+\*------------------------------------------------------------------------*/
+    for( i=0; i<plist->nfds; i++ ) {
+      if( !plist->fds[i].revents )
+        continue;
+      if( _ickPolllistGetIndex(&shard->lwsPolllist,plist->fds[i].fd)<0 )
+        continue;
+      debug( "_ickShardThread (%p): shard #%d servicing %d, event mask 0x%02x",
+             shard->ictx, shard->id, plist->fds[i].fd, plist->fds[i].revents );
+      if( libwebsocket_service_fd(shard->lwsContext,&plist->fds[i])<0 ) {
+        logerr( "_ickShardThread: libwebsocket_service_fd returned an error." );
+        break;
+      }
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Close all connections of this shard (executes the close handlers)
+\*------------------------------------------------------------------------*/
+  debug( "_ickShardThread (%p): shard #%d terminating", shard->ictx, shard->id );
+  libwebsocket_context_destroy( shard->lwsContext );
+  shard->lwsContext = NULL;
+  return NULL;
+}
+
+
+/*=========================================================================*\
+  Open requested outbound connections of a shard
+    This must be called from the shard thread.
+    Requests carry UUIDs, so devices that vanished meanwhile are skipped.
+\*=========================================================================*/
+static void _ickShardProcessRequests( ickShard_t *shard )
+{
+  ickP2pContext_t         *ictx = shard->ictx;
+  struct _ickShardRequest *requests, *request;
+  ickDevice_t             *device;
+
+/*------------------------------------------------------------------------*\
+    Take over list of requests
+\*------------------------------------------------------------------------*/
+  _ickShardLock( shard );
+  requests        = shard->requests;
+  shard->requests = NULL;
+  _ickShardUnlock( shard );
+
+/*------------------------------------------------------------------------*\
+    Process all requests
+\*------------------------------------------------------------------------*/
+  while( requests ) {
+    request  = requests;
+    requests = request->next;
+
+    _ickLibDeviceListLock( ictx );
+    device = _ickLibDeviceFindByUuid( ictx, request->uuid );
+    if( !device ) {
+      debug( "_ickShardProcessRequests (%s): device vanished", request->uuid );
+    }
+    else if( device->wsi || device->connectionState!=ICKDEVICE_NOTCONNECTED ) {
+      debug( "_ickShardProcessRequests (%s): already connected or connecting (%s)",
+             request->uuid, _ickDeviceConnState2Str(device->connectionState) );
+    }
+    else
+      _ickWebSocketOpen( shard->lwsContext, device );
+    _ickLibDeviceListUnlock( ictx );
+
+    Sfree( request->uuid );
+    Sfree( request );
+  }
+}
+
+
+/*=========================================================================*\
+  Get shard index for a device UUID
+    returns -1 if sharding is disabled
+\*=========================================================================*/
+int _ickShardForUuid( const ickP2pContext_t *ictx, const char *uuid )
+{
+  if( !ictx->shardCnt || !uuid )
+    return -1;
+  return (int)(_ickUuidHash(uuid)%ictx->shardCnt);
+}
+
+
+/*=========================================================================*\
+  Hash a device UUID (used to map devices to shards and dispatchers)
+\*=========================================================================*/
+unsigned long _ickUuidHash( const char *uuid )
+{
+  unsigned long hash = 2166136261UL;
+
+/*------------------------------------------------------------------------*\
+    FNV-1a, case insensitive as UUIDs might be submitted in either case
+\*------------------------------------------------------------------------*/
+  while( *uuid ) {
+    hash ^= (unsigned char)tolower( (unsigned char)*uuid++ );
+    hash *= 16777619UL;
+    hash &= 0xffffffffUL;
+  }
+
+  return hash;
+}
+
+
+/*=========================================================================*\
+  Get shard index of a lws context
+    returns -1 if this is the main lws context (or unknown)
+\*=========================================================================*/
+int _ickShardIndex( const ickP2pContext_t *ictx, const struct libwebsocket_context *context )
+{
+  int i;
+
+  if( !ictx->shards )
+    return -1;
+  for( i=0; i<ictx->shardCnt; i++ ) {
+    if( ictx->shards[i].lwsContext==context )
+      return i;
+  }
+  return -1;
+}
+
+
+/*=========================================================================*\
+  Initiate outbound web socket connection to a device
+    Sharded devices are connected asynchronously by their shard.
+    Caller should lock the device list, this must be called from the main thread
+\*=========================================================================*/
+ickErrcode_t _ickShardConnect( ickP2pContext_t *ictx, ickDevice_t *device )
+{
+  ickShard_t              *shard;
+  struct _ickShardRequest *request;
+
+/*------------------------------------------------------------------------*\
+    Not sharded: connect directly via main context
+\*------------------------------------------------------------------------*/
+  if( !ictx->shards || device->shard<0 || device->shard>=ictx->shardCnt )
+    return _ickWebSocketOpen( ictx->lwsContext, device );
+  shard = ictx->shards + device->shard;
+  debug( "_ickShardConnect (%s): requesting connect from shard #%d", device->uuid, shard->id );
+
+/*------------------------------------------------------------------------*\
+    Create request
+\*------------------------------------------------------------------------*/
+  request = calloc( 1, sizeof(struct _ickShardRequest) );
+  if( !request ) {
+    logerr( "_ickShardConnect: out of memory" );
+    return ICKERR_NOMEM;
+  }
+  request->uuid = strdup( device->uuid );
+  if( !request->uuid ) {
+    logerr( "_ickShardConnect: out of memory" );
+    Sfree( request );
+    return ICKERR_NOMEM;
+  }
+
+/*------------------------------------------------------------------------*\
+    Queue request and wake up shard, that's all
+\*------------------------------------------------------------------------*/
+  _ickShardLock( shard );
+  request->next   = shard->requests;
+  shard->requests = request;
+  _ickShardUnlock( shard );
+  return _ickShardBreak( shard, 'C' );
+}
+
+
+/*=========================================================================*\
+  Book a writable callback for the wsi of a device
+    Wakes up the servicing shard, the main thread needs to be broken by caller
+\*=========================================================================*/
+void _ickShardBookWritable( ickP2pContext_t *ictx, ickDevice_t *device )
+{
+  ickShard_t *shard;
+
+  if( !device->wsi )
+    return;
+
+/*------------------------------------------------------------------------*\
+    Serviced by main thread?
+\*------------------------------------------------------------------------*/
+  if( !ictx->shards || device->wsiShard<0 || device->wsiShard>=ictx->shardCnt ) {
+    libwebsocket_callback_on_writable( ictx->lwsContext, device->wsi );
+    return;
+  }
+
+/*------------------------------------------------------------------------*\
+    Book on shard context and wake up shard thread
+\*------------------------------------------------------------------------*/
+  shard = ictx->shards + device->wsiShard;
+  libwebsocket_callback_on_writable( shard->lwsContext, device->wsi );
+  _ickShardBreak( shard, 'w' );
+}
+
+
+/*=========================================================================*\
+  Get shard for a lws context
+    returns NULL if this is the main lws context
+\*=========================================================================*/
+static ickShard_t *_ickShardByLwsContext( const ickP2pContext_t *ictx, const struct libwebsocket_context *context )
+{
+  int i = _ickShardIndex( ictx, context );
+  return i<0 ? NULL : ictx->shards+i;
+}
+
+
+/*=========================================================================*\
+  Wake up a shard thread
+\*=========================================================================*/
+static ickErrcode_t _ickShardBreak( ickShard_t *shard, char flag )
+{
+  debug( "_ickShardBreak (%p): sending break request '%c' to shard #%d",
+         shard->ictx, flag, shard->id );
+
+  if( write(shard->breakPipe[1],&flag,1)<0 ) {
+    logerr( "_ickShardBreak: Unable to write to break pipe: %s", strerror(errno) );
+    return ICKERR_GENERIC;
+  }
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Lock a shard descriptor
+\*=========================================================================*/
+static void _ickShardLock( ickShard_t *shard )
+{
+  int perr;
+  debug ( "_ickShardLock (%p): locking #%d...", shard->ictx, shard->id );
+  perr = pthread_mutex_lock( &shard->mutex );
+  if( perr )
+    logerr( "_ickShardLock: %s", strerror(perr) );
+  debug ( "_ickShardLock (%p): locked #%d", shard->ictx, shard->id );
+}
+
+
+/*=========================================================================*\
+  Unlock a shard descriptor
+\*=========================================================================*/
+static void _ickShardUnlock( ickShard_t *shard )
+{
+  int perr;
+  debug ( "_ickShardUnlock (%p): unlocked #%d", shard->ictx, shard->id );
+  perr = pthread_mutex_unlock( &shard->mutex );
+  if( perr )
+    logerr( "_ickShardUnlock: %s", strerror(perr) );
+}
+
+
+#pragma mark -- Libwebsocket init and HTTP handler
+
+
+/*=========================================================================*\
+  Create a libwebsocket instance
+    port      - if NULL, a client only context without listener is created
+    protocols - receives protocol list of instance (strong)
+\*=========================================================================*/
+static struct libwebsocket_context *_ickCreateLwsContext( ickP2pContext_t *ictx, const char *ifname, int *port,
+                                                          struct libwebsocket_protocols **protocols )
+{
+  struct libwebsocket_context *lwsContext;
+  struct lws_context_creation_info info;
+  memset( &info, 0, sizeof(info) );
+
+/*------------------------------------------------------------------------*\
+    Try to guess a free port
+      fixme: libwebsockets should be patched to accept port=-1 for
+             autoselecting a port
+\*------------------------------------------------------------------------*/
+  if( !port )
+    info.port = CONTEXT_PORT_NO_LISTEN;
+  else {
+#ifdef CONTEXT_PORT_CHOOSE_FREE
+    info.port = CONTEXT_PORT_CHOOSE_FREE;
+#else
+    info.port = _ickIpGetFreePort( ifname );
+    if( info.port<0 )
+      info.port = 49152 + random()%10000;
+    *port = info.port;
+#endif
+  }
 
 /*------------------------------------------------------------------------*\
     Create protocol list for each instance as lws stores the context in it
 \*------------------------------------------------------------------------*/
-  ictx->lwsProtocols = calloc( 3, sizeof(struct libwebsocket_protocols) );
-  if( !ictx->lwsProtocols ) {
+  *protocols = calloc( 3, sizeof(struct libwebsocket_protocols) );
+  if( !*protocols ) {
     logerr( "_ickCreateLwsContext: Out of memory." );
     return NULL;
   }
 
   // first protocol must always be HTTP handler
-  ictx->lwsProtocols[0].name                  = "http-only";
-  ictx->lwsProtocols[0].callback              = _lwsHttpCb;
-  ictx->lwsProtocols[0].per_session_data_size = sizeof( _ickLwsHttpData_t );
+  (*protocols)[0].name                  = "http-only";
+  (*protocols)[0].callback              = _lwsHttpCb;
+  (*protocols)[0].per_session_data_size = sizeof( _ickLwsHttpData_t );
 
   // the icktream protocol
-  ictx->lwsProtocols[1].name                  = ICKP2P_WS_PROTOCOLNAME;
-  ictx->lwsProtocols[1].callback              = _lwsP2pCb;
-  ictx->lwsProtocols[1].per_session_data_size = sizeof( _ickLwsP2pData_t );
+  (*protocols)[1].name                  = ICKP2P_WS_PROTOCOLNAME;
+  (*protocols)[1].callback              = _lwsP2pCb;
+  (*protocols)[1].per_session_data_size = sizeof( _ickLwsP2pData_t );
 
 /*------------------------------------------------------------------------*\
     Setup rest of configuration vector
 \*------------------------------------------------------------------------*/
   info.iface                    = ifname;
-  info.protocols                = ictx->lwsProtocols;
+  info.protocols                = *protocols;
   info.ssl_cert_filepath        = NULL;
   info.ssl_private_key_filepath = NULL;
   info.gid                      = -1;
@@ -672,14 +1986,16 @@ static struct libwebsocket_context *_ickCreateLwsContext( ickP2pContext_t *ictx,
     Try to create the context
 \*------------------------------------------------------------------------*/
   lwsContext = libwebsocket_create_context( &info );
-  if( !lwsContext )
+  if( !lwsContext ) {
     logerr( "_ickCreateLwsContext: Could not get LWS context (%s:%d)", ifname, info.port );
+    Sfree( *protocols );
+  }
 
 /*------------------------------------------------------------------------*\
     Get port in patched library version
 \*------------------------------------------------------------------------*/
 #ifdef CONTEXT_PORT_CHOOSE_FREE
-  else
+  else if( port )
     *port = libwebsocket_get_listen_port( lwsContext );
 #endif
 
@@ -700,6 +2016,7 @@ static int _lwsHttpCb( struct libwebsocket_context *context,
 {
   ickP2pContext_t      *ictx = libwebsocket_context_user( context );
   _ickLwsHttpData_t    *psd = (_ickLwsHttpData_t*) user;
+  ickShard_t           *shard;
   int                   retval = 0;
   int                   fd, sd;
   size_t                remain;
@@ -932,8 +2249,19 @@ static int _lwsHttpCb( struct libwebsocket_context *context,
       fd = (int)(long)in;
       debug( "_lwsHttpCb: adding socket %d (mask 0x%02x)",
              fd, (int)(long)len );
-      if( _ickPolllistAdd(&ictx->lwsPolllist,fd,(int)(long)len) )
+      shard = _ickShardByLwsContext( ictx, context );
+      if( shard ) {
+        _ickShardLock( shard );
+        if( _ickPolllistAdd(&shard->lwsPolllist,fd,(int)(long)len) )
+          retval = -1;
+        _ickShardUnlock( shard );
+      }
+      else if( _ickPolllistAdd(&ictx->lwsPolllist,fd,(int)(long)len) )
+        retval = -1;
+#ifdef ICK_USEEPOLL
+      else if( _ickEpollCtl(ictx,EPOLL_CTL_ADD,fd,(int)(long)len) )
         retval = -1;
+#endif
       break;
 
 /*------------------------------------------------------------------------*\
@@ -942,8 +2270,19 @@ static int _lwsHttpCb( struct libwebsocket_context *context,
     case LWS_CALLBACK_DEL_POLL_FD:
       fd = (int)(long)in;
       debug( "_lwsHttpCb: removing socket %d", fd );
-      if( _ickPolllistRemove(&ictx->lwsPolllist,fd) )
+      shard = _ickShardByLwsContext( ictx, context );
+      if( shard ) {
+        _ickShardLock( shard );
+        if( _ickPolllistRemove(&shard->lwsPolllist,fd) )
+          retval = -1;
+        _ickShardUnlock( shard );
+      }
+      else if( _ickPolllistRemove(&ictx->lwsPolllist,fd) )
         retval = -1;
+#ifdef ICK_USEEPOLL
+      else
+        _ickEpollCtl( ictx, EPOLL_CTL_DEL, fd, 0 );
+#endif
       break;
 
 /*------------------------------------------------------------------------*\
@@ -952,15 +2291,37 @@ static int _lwsHttpCb( struct libwebsocket_context *context,
     case LWS_CALLBACK_SET_MODE_POLL_FD:
       fd = (int)(long)in;
       debug( "_lwsHttpCb: set events for socket %d (mask 0x%02x)", fd, (int)(long)len );
-      if( _ickPolllistSet(&ictx->lwsPolllist,fd,(int)(long)len) )
+      shard = _ickShardByLwsContext( ictx, context );
+      if( shard ) {
+        _ickShardLock( shard );
+        if( _ickPolllistSet(&shard->lwsPolllist,fd,(int)(long)len) )
+          retval = -1;
+        _ickShardUnlock( shard );
+      }
+      else if( _ickPolllistSet(&ictx->lwsPolllist,fd,(int)(long)len) )
+        retval = -1;
+#ifdef ICK_USEEPOLL
+      else if( _ickEpollCtl(ictx,EPOLL_CTL_MOD,fd,_ickPolllistEvents(&ictx->lwsPolllist,fd)) )
         retval = -1;
+#endif
       break;
 
     case LWS_CALLBACK_CLEAR_MODE_POLL_FD:
       fd = (int)(long)in;
       debug( "_lwsHttpCb: clear events for socket %d (mask 0x%02x)", fd, (int)(long)len );
-      if( _ickPolllistUnset(&ictx->lwsPolllist,fd,(int)(long)len) )
+      shard = _ickShardByLwsContext( ictx, context );
+      if( shard ) {
+        _ickShardLock( shard );
+        if( _ickPolllistUnset(&shard->lwsPolllist,fd,(int)(long)len) )
+          retval = -1;
+        _ickShardUnlock( shard );
+      }
+      else if( _ickPolllistUnset(&ictx->lwsPolllist,fd,(int)(long)len) )
+        retval = -1;
+#ifdef ICK_USEEPOLL
+      else if( _ickEpollCtl(ictx,EPOLL_CTL_MOD,fd,_ickPolllistEvents(&ictx->lwsPolllist,fd)) )
         retval = -1;
+#endif
       break;
 
 /*------------------------------------------------------------------------*\
@@ -1010,11 +2371,13 @@ static int _ickPolllistInit( ickPolllist_t *plist, int size, int increment )
   }
 
 /*------------------------------------------------------------------------*\
-    Init indexes
+    Init indexes, the fd lookup table is allocated on demand
 \*------------------------------------------------------------------------*/
   plist->nfds      = 0;
   plist->size      = size;
   plist->increment = increment;
+  plist->index     = NULL;
+  plist->indexSize = 0;
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -1031,9 +2394,12 @@ static void _ickPolllistClear( ickPolllist_t *plist )
   debug( "_ickPolllistClear (%p): ", plist );
 
 /*------------------------------------------------------------------------*\
-    reset index
+    reset lookup table entries of all members and index
 \*------------------------------------------------------------------------*/
-  plist->nfds = 0;
+  while( plist->nfds>0 ) {
+    plist->nfds--;
+    plist->index[plist->fds[plist->nfds].fd] = -1;
+  }
 
 }
 
@@ -1046,9 +2412,11 @@ static void _ickPolllistFree( ickPolllist_t *plist )
   debug( "_ickPolllistFree (%p): ", plist );
 
 /*------------------------------------------------------------------------*\
-    Free array
+    Free arrays
 \*------------------------------------------------------------------------*/
   Sfree( plist->fds );
+  Sfree( plist->index );
+  plist->indexSize = 0;
 }
 
 
@@ -1071,6 +2439,30 @@ static int _ickPolllistAdd( ickPolllist_t *plist, int fd, int events )
     return 0;
   }
 
+/*------------------------------------------------------------------------*\
+    Need to extend lookup table?
+\*------------------------------------------------------------------------*/
+  if( fd<0 ) {
+    logerr( "_ickPolllistAdd: invalid fd %d", fd );
+    return -1;
+  }
+  if( fd>=plist->indexSize ) {
+    int  newSize = plist->indexSize ? plist->indexSize : ICKPOLLIST_INITSIZE;
+    int *index;
+    int  i;
+    while( newSize<=fd )
+      newSize *= 2;
+    index = realloc( plist->index, newSize*sizeof(int) );
+    if( !index ) {
+      logerr( "_ickPolllistAdd: out of memory" );
+      return -1;
+    }
+    for( i=plist->indexSize; i<newSize; i++ )
+      index[i] = -1;
+    plist->index     = index;
+    plist->indexSize = newSize;
+  }
+
 /*------------------------------------------------------------------------*\
     Need to extend array?
 \*------------------------------------------------------------------------*/
@@ -1091,6 +2483,7 @@ static int _ickPolllistAdd( ickPolllist_t *plist, int fd, int events )
   plist->fds[plist->nfds].fd      = fd;
   plist->fds[plist->nfds].events  = events;
   plist->fds[plist->nfds].revents = 0;
+  plist->index[fd] = plist->nfds;
   plist->nfds++;
 
 /*------------------------------------------------------------------------*\
@@ -1121,8 +2514,11 @@ static int _ickPolllistRemove( ickPolllist_t *plist, int fd )
 /*------------------------------------------------------------------------*\
     Replace this entry with the last one
 \*------------------------------------------------------------------------*/
-  if( idx!=plist->nfds-1 )
+  if( idx!=plist->nfds-1 ) {
     memcpy( &plist->fds[idx], &plist->fds[plist->nfds-1], sizeof(struct pollfd) );
+    plist->index[plist->fds[idx].fd] = idx;
+  }
+  plist->index[fd] = -1;
   plist->nfds--;
 
 /*------------------------------------------------------------------------*\
@@ -1150,35 +2546,188 @@ static int _ickPolllistAppend( ickPolllist_t *plist, const ickPolllist_t *plista
   }
 
 /*------------------------------------------------------------------------*\
-    That's all
+    That's all
+\*------------------------------------------------------------------------*/
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Set event type for poll list element
+    Note: the bits in event are ored to the bits already set
+    returns -1 on error (fd not member)
+\*=========================================================================*/
+static int _ickPolllistSet( ickPolllist_t *plist, int fd, int events )
+{
+  int idx;
+  debug( "_ickPolllistSet (%p): fd=%d, events=%d", plist, fd, events );
+
+/*------------------------------------------------------------------------*\
+    Get list entry
+\*------------------------------------------------------------------------*/
+  idx = _ickPolllistGetIndex( plist, fd );
+  if( idx<0 ) {
+    logwarn( "_ickPolllistSet: fd %d not element", fd );
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Set requested bits
+\*------------------------------------------------------------------------*/
+  plist->fds[idx].events |= events;
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return 0;
+}
+
+
+/*=========================================================================*\
+  Unset event type for poll list element
+    Note: only the bits in event are reset
+    returns -1 on error (fd not member)
+\*=========================================================================*/
+static int _ickPolllistUnset( ickPolllist_t *plist, int fd, int events )
+{
+  int idx;
+  debug( "_ickPolllistUnset (%p): fd=%d, events=%d", plist, fd, events );
+
+/*------------------------------------------------------------------------*\
+    Get list entry
+\*------------------------------------------------------------------------*/
+  idx = _ickPolllistGetIndex( plist, fd );
+  if( idx<0 ) {
+    logwarn( "_ickPolllistUnset: fd %d not element", fd );
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Set requested bists
+\*------------------------------------------------------------------------*/
+  plist->fds[idx].events &= ~events;
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return 0;
+}
+
+
+
+/*=========================================================================*\
+  Check a socket of a poll list for one or more condition
+    returns -1 on error (fd not member)
+             Bit vector of conditions met
+\*=========================================================================*/
+static int _ickPolllistCheck( const ickPolllist_t *plist, int fd, int events )
+{
+  int idx;
+
+/*------------------------------------------------------------------------*\
+    Get list entry
+\*------------------------------------------------------------------------*/
+  idx = _ickPolllistGetIndex( plist, fd );
+  if( idx<0 ) {
+    // Not an error in epoll mode, the list contains only the ready descriptors
+    debug( "_ickPolllistCheck (%p): fd %d not element", plist, fd );
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Return result
+\*------------------------------------------------------------------------*/
+  debug( "_ickPolllistCheck (%p): fd=%d, events=0x%02x (have: 0x%02x)", 
+         plist, fd, events, plist->fds[idx].revents );
+  return plist->fds[idx].revents & events;
+}
+
+
+#ifdef ICK_USEEPOLL
+/*=========================================================================*\
+  Get event mask of a socket in a poll list
+    returns -1 on error (fd not member)
+\*=========================================================================*/
+static int _ickPolllistEvents( const ickPolllist_t *plist, int fd )
+{
+  int idx;
+
+/*------------------------------------------------------------------------*\
+    Get list entry
+\*------------------------------------------------------------------------*/
+  idx = _ickPolllistGetIndex( plist, fd );
+  if( idx<0 ) {
+    logwarn( "_ickPolllistEvents: fd %d not element", fd );
+    return -1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Return mask
+\*------------------------------------------------------------------------*/
+  return plist->fds[idx].events;
+}
+#endif
+
+
+/*=========================================================================*\
+  Search a socket descriptor in list
+    This is a lookup in the fd indexed table, so constant time
+    return index if found, -1 otherwhise
+\*=========================================================================*/
+static int _ickPolllistGetIndex( const ickPolllist_t *plist, int fd )
+{
+  debug( "_ickPolllistGetIndex (%p): fd=%d", plist, fd );
+
+/*------------------------------------------------------------------------*\
+    Out of range of lookup table?
+\*------------------------------------------------------------------------*/
+  if( fd<0 || fd>=plist->indexSize )
+    return -1;
+
+/*------------------------------------------------------------------------*\
+    Return slot (-1 if not a member)
 \*------------------------------------------------------------------------*/
-  return 0;
+  return plist->index[fd];
 }
 
 
+#pragma mark -- Epoll reactor
+
+
+#ifdef ICK_USEEPOLL
+
 /*=========================================================================*\
-  Set event type for poll list element
-    Note: the bits in event are ored to the bits already set
-    returns -1 on error (fd not member)
+  Create epoll instance and register static descriptors (break pipe and
+    SSDP listener). Interface and lws sockets are registered on the fly.
+    returns 0 on success or -1 on error (ictx->epollFd is -1 in this case)
 \*=========================================================================*/
-static int _ickPolllistSet( ickPolllist_t *plist, int fd, int events )
+static int _ickEpollInit( ickP2pContext_t *ictx )
 {
-  int idx;
-  debug( "_ickPolllistSet (%p): fd=%d, events=%d", plist, fd, events );
+  debug( "_ickEpollInit (%p):", ictx );
 
 /*------------------------------------------------------------------------*\
-    Get list entry
+    Create instance
 \*------------------------------------------------------------------------*/
-  idx = _ickPolllistGetIndex( plist, fd );
-  if( idx<0 ) {
-    logwarn( "_ickPolllistSet: fd %d not element", fd );
+  ictx->epollFd = epoll_create1( EPOLL_CLOEXEC );
+  if( ictx->epollFd<0 ) {
+    logerr( "_ickEpollInit: epoll_create1 failed (%s)", strerror(errno) );
     return -1;
   }
 
 /*------------------------------------------------------------------------*\
-    Set requested bits
+    Add break pipe and SSDP listener
 \*------------------------------------------------------------------------*/
-  plist->fds[idx].events |= events;
+  if( _ickEpollCtl(ictx,EPOLL_CTL_ADD,ictx->pollBreakPipe[0],POLLIN) ||
+      _ickEpollCtl(ictx,EPOLL_CTL_ADD,ictx->upnpListenerSocket,POLLIN) ) {
+    _ickEpollFree( ictx );
+    return -1;
+  }
+#ifdef ICK_USEEVENTFD
+  if( ictx->timerFd>=0 && _ickEpollCtl(ictx,EPOLL_CTL_ADD,ictx->timerFd,POLLIN) ) {
+    _ickEpollFree( ictx );
+    return -1;
+  }
+#endif
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -1188,87 +2737,112 @@ static int _ickPolllistSet( ickPolllist_t *plist, int fd, int events )
 
 
 /*=========================================================================*\
-  Unset event type for poll list element
-    Note: only the bits in event are reset
-    returns -1 on error (fd not member)
+  Close epoll instance
 \*=========================================================================*/
-static int _ickPolllistUnset( ickPolllist_t *plist, int fd, int events )
+static void _ickEpollFree( ickP2pContext_t *ictx )
 {
-  int idx;
-  debug( "_ickPolllistUnset (%p): fd=%d, events=%d", plist, fd, events );
-
-/*------------------------------------------------------------------------*\
-    Get list entry
-\*------------------------------------------------------------------------*/
-  idx = _ickPolllistGetIndex( plist, fd );
-  if( idx<0 ) {
-    logwarn( "_ickPolllistUnset: fd %d not element", fd );
-    return -1;
-  }
-
-/*------------------------------------------------------------------------*\
-    Set requested bists
-\*------------------------------------------------------------------------*/
-  plist->fds[idx].events &= ~events;
+  ickInterface_t *interface;
+  debug( "_ickEpollFree (%p): fd=%d", ictx, ictx->epollFd );
 
 /*------------------------------------------------------------------------*\
-    That's all
+    Close descriptor, interfaces need to be reregistered on next init
 \*------------------------------------------------------------------------*/
-  return 0;
+  if( ictx->epollFd>=0 )
+    close( ictx->epollFd );
+  ictx->epollFd = -1;
+  for( interface=ictx->interfaces; interface; interface=interface->next )
+    interface->epollRegistered = 0;
 }
 
 
-
 /*=========================================================================*\
-  Check a socket of a poll list for one or more condition
-    returns -1 on error (fd not member)
-             Bit vector of conditions met
+  Add, modify or remove a descriptor in the epoll interest set
+    events is a poll() event mask (POLLIN etc. use the same bits as EPOLLIN etc.)
+    This is a no-op if we're in poll() mode.
+    returns 0 on success or -1 on error
 \*=========================================================================*/
-static int _ickPolllistCheck( const ickPolllist_t *plist, int fd, int events )
+static int _ickEpollCtl( ickP2pContext_t *ictx, int op, int fd, int events )
 {
-  int idx;
+  struct epoll_event ev;
+  debug( "_ickEpollCtl (%p): op=%d fd=%d mask 0x%02x", ictx, op, fd, events );
 
 /*------------------------------------------------------------------------*\
-    Get list entry
+    Poll mode?
 \*------------------------------------------------------------------------*/
-  idx = _ickPolllistGetIndex( plist, fd );
-  if( idx<0 ) {
-    logwarn( "_ickPolllistCheck: fd %d not element", fd );
-    return -1;
-  }
+  if( ictx->epollFd<0 )
+    return 0;
 
 /*------------------------------------------------------------------------*\
-    Return result
+    Modify interest set
 \*------------------------------------------------------------------------*/
-  debug( "_ickPolllistCheck (%p): fd=%d, events=0x%02x (have: 0x%02x)", 
-         plist, fd, events, plist->fds[idx].revents );
-  return plist->fds[idx].revents & events;
+  memset( &ev, 0, sizeof(ev) );
+  ev.events  = (uint32_t)events;
+  ev.data.fd = fd;
+  if( !epoll_ctl(ictx->epollFd,op,fd,&ev) )
+    return 0;
+
+/*------------------------------------------------------------------------*\
+    Duplicate registrations just update the event mask (as in poll list)
+\*------------------------------------------------------------------------*/
+  if( op==EPOLL_CTL_ADD && errno==EEXIST && !epoll_ctl(ictx->epollFd,EPOLL_CTL_MOD,fd,&ev) )
+    return 0;
+
+/*------------------------------------------------------------------------*\
+    Descriptors might already be closed on removal, that's ok
+\*------------------------------------------------------------------------*/
+  if( op==EPOLL_CTL_DEL && (errno==EBADF||errno==ENOENT) )
+    return 0;
+  logerr( "_ickEpollCtl (%p): epoll_ctl(%d,%d) failed (%s)",
+          ictx, op, fd, strerror(errno) );
+  return -1;
 }
 
 
 /*=========================================================================*\
-  Search a socket descriptor in list
-    return index if found, -1 otherwhise
+  Wait for events and collect ready descriptors in poll list
+    This list will contain only the ready descriptors with their revents set,
+    so it can be processed like a poll() result.
+    returns number of ready descriptors, 0 on timeout or -1 on error
 \*=========================================================================*/
-static int _ickPolllistGetIndex( const ickPolllist_t *plist, int fd )
+static int _ickEpollWait( ickP2pContext_t *ictx, ickPolllist_t *plist, int timeout )
 {
-  int i;
-  debug( "_ickPolllistGetIndex (%p): fd=%d", plist, fd );
+  struct epoll_event events[ICKEPOLL_MAXEVENTS];
+  int                n, i;
 
 /*------------------------------------------------------------------------*\
-    Check all members
+    Wait for events, ignore signals
 \*------------------------------------------------------------------------*/
-  for( i=0; i<plist->nfds; i++ ) {
-    if( plist->fds[i].fd==fd )
-      return i;
+  n = epoll_wait( ictx->epollFd, events, ICKEPOLL_MAXEVENTS, timeout );
+  if( n<0 && errno==EINTR )
+    n = 0;
+  if( n<0 ) {
+    logerr( "ickp2p main thread: epoll_wait failed (%s).", strerror(errno) );
+    return -1;
   }
 
 /*------------------------------------------------------------------------*\
-    Not found
+    Copy ready descriptors to poll list
 \*------------------------------------------------------------------------*/
-  return -1;
+  _ickPolllistClear( plist );
+  for( i=0; i<n; i++ ) {
+    int fd = events[i].data.fd;
+    int mask = _ickPolllistGetIndex( &ictx->lwsPolllist, fd )<0 ? POLLIN :
+                                     _ickPolllistEvents( &ictx->lwsPolllist, fd );
+    if( _ickPolllistAdd(plist,fd,mask) )
+      return -1;
+    plist->fds[plist->nfds-1].revents = (short)events[i].events;
+    debug( "ickp2p main thread (%p): ready element #%d - %d (revent mask 0x%02x)",
+           ictx, i, fd, events[i].events );
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return n;
 }
 
+#endif  /* ICK_USEEPOLL */
+
 
 #pragma mark -- Timer management
 
@@ -1283,6 +2857,9 @@ void _ickTimerListLock( ickP2pContext_t *ictx )
   perr = pthread_mutex_lock( &ictx->timersMutex );
   if( perr )
     logerr( "_ickTimerListLock: %s", strerror(perr) );
+#ifdef ICK_DEBUG
+  ictx->timersLockStart = _ickTimerClock();
+#endif
   debug ( "_ickTimerListLock (%p): locked", ictx );
 }
 
@@ -1292,7 +2869,17 @@ void _ickTimerListLock( ickP2pContext_t *ictx )
 \*=========================================================================*/
 void _ickTimerListUnlock( ickP2pContext_t *ictx )
 {
-  int perr;
+  int       perr;
+#ifdef ICK_DEBUG
+  long long held = _ickTimerClock() - ictx->timersLockStart;
+
+  // Update lock hold time statistics
+  ictx->timersLockCnt++;
+  ictx->timersLockTotal += held;
+  if( held>ictx->timersLockMax )
+    ictx->timersLockMax = held;
+#endif
+
   debug ( "_ickTimerListUnlock (%p): unlocked", ictx );
   perr = pthread_mutex_unlock( &ictx->timersMutex );
   if( perr )
@@ -1300,16 +2887,83 @@ void _ickTimerListUnlock( ickP2pContext_t *ictx )
 }
 
 
+/*=========================================================================*\
+  Get timer list lock hold time statistics
+    times are in seconds, any output pointer might be NULL
+    statistics are only collected in debug builds (ICK_DEBUG)
+\*=========================================================================*/
+void _ickTimerListLockStats( ickP2pContext_t *ictx, long *cnt, double *avg, double *max )
+{
+  _ickTimerListLock( ictx );
+  if( cnt )
+    *cnt = ictx->timersLockCnt;
+  if( avg )
+    *avg = ictx->timersLockCnt ? ictx->timersLockTotal/1E6/ictx->timersLockCnt : 0;
+  if( max )
+    *max = ictx->timersLockMax/1E6;
+  _ickTimerListUnlock( ictx );
+}
+
+
+/*=========================================================================*\
+  Get context of a timer
+\*=========================================================================*/
+ickP2pContext_t *_ickTimerGetContext( const ickTimer_t *timer )
+{
+  return timer->ictx;
+}
+
+
+/*=========================================================================*\
+  Get interval of a timer (in millisecs)
+\*=========================================================================*/
+long _ickTimerGetInterval( const ickTimer_t *timer )
+{
+  return timer->interval;
+}
+
+
+/*=========================================================================*\
+  Check if a timer was deleted while detached for execution
+    Timer callbacks run without the timer list lock, so they need to check
+    this before accessing their data. The caller must hold the timer list lock
+    or any other lock that is held while the timer is deleted.
+\*=========================================================================*/
+int _ickTimerIsCancelled( const ickTimer_t *timer )
+{
+  return timer->cancelled;
+}
+
+
 /*=========================================================================*\
   Create a timer
     interval is in millisecs
     Timer list must be locked by caller
 \*=========================================================================*/
-ickErrcode_t _ickTimerAdd( ickP2pContext_t *ictx, long interval, int repeat, ickTimerCb_t callback, void *data, int tag )
+ickErrcode_t _ickTimerAdd( ickP2pContext_t *ictx, long interval, int repeat, ickTimerCb_t callback, void *data, int tag, ickTimer_t **handle )
+{
+  return _ickTimerAddWithSlack( ictx, interval, 0, repeat, callback, data, tag, handle );
+}
+
+
+/*=========================================================================*\
+  Create a timer that might be deferred by up to slack millisecs
+    Expirations within the slack window of a timer are coalesced to one
+    wakeup of the main loop and executed in one batch.
+    interval is in millisecs
+    If handle is not NULL it is set to the new timer and reset to NULL when
+    the timer is deleted, so it must stay valid for the lifetime of the timer.
+    Note: the handle is reset after the last execution of a timer, so the
+          timer stays cancellable while its callback waits for locks.
+          Callbacks freeing the owner of the handle need to delete their
+          timer first (see _ickDeviceExpireTimerCb()).
+    Timer list must be locked by caller
+\*=========================================================================*/
+ickErrcode_t _ickTimerAddWithSlack( ickP2pContext_t *ictx, long interval, long slack, int repeat, ickTimerCb_t callback, void *data, int tag, ickTimer_t **handle )
 {
   ickTimer_t *timer;
-  debug( "_ickTimerAdd (%p): interval=%ld, repeat=%d, cp=%p, data=%p, tag=%d",
-         ictx, interval, repeat, callback, data, tag );
+  debug( "_ickTimerAdd (%p): interval=%ld, slack=%ld, repeat=%d, cp=%p, data=%p, tag=%d, handle=%p",
+         ictx, interval, slack, repeat, callback, data, tag, handle );
 
 /*------------------------------------------------------------------------*\
     Create and init timer structure
@@ -1326,20 +2980,23 @@ ickErrcode_t _ickTimerAdd( ickP2pContext_t *ictx, long interval, int repeat, ick
   timer->usrPtr     = data;
   timer->interval   = interval;
   timer->repeatCntr = repeat;
+  timer->handle     = handle;
+  timer->ictx       = ictx;
+  timer->slack      = slack>0 ? slack : 0;
 
   // calculate execution timestamp
-  gettimeofday( &timer->time, NULL );
-  timer->time.tv_sec  += interval/1000;
-  timer->time.tv_usec += (interval%1000)*1000;
-  while( timer->time.tv_usec>1000000UL ) {
-    timer->time.tv_usec -= 1000000UL;
-    timer->time.tv_sec++;
-  }
+  timer->time = _ickTimerClock() + interval*1000LL;
 
 /*------------------------------------------------------------------------*\
-    link timer to list
+    link timer to heap
 \*------------------------------------------------------------------------*/
-  _ickTimerLink( ictx, timer );
+  if( _ickTimerLink(ictx,timer) ) {
+    logerr( "_ickTimerAdd: out of memory" );
+    Sfree( timer );
+    return ICKERR_NOMEM;
+  }
+  if( handle )
+    *handle = timer;
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -1348,33 +3005,6 @@ ickErrcode_t _ickTimerAdd( ickP2pContext_t *ictx, long interval, int repeat, ick
 }
 
 
-/*=========================================================================*\
-  Find a timer by vector (callback,data,tag)
-    If callback is NULL, it is not used for comparison
-    Timer list must be locked by caller
-\*=========================================================================*/
-ickTimer_t *_ickTimerFind( ickP2pContext_t *ictx, ickTimerCb_t callback, const void *data, int tag )
-{
-  ickTimer_t *walk;
-  debug( "_ickTimerFind (%p): cb=%p data=%p tag=%d", ictx, callback, data, tag );
-
-
-/*------------------------------------------------------------------------*\
-    Find list entry with same id vector
-\*------------------------------------------------------------------------*/
-  for( walk=ictx->timers; walk; walk=walk->next ) {
-    if( walk->usrPtr==data && walk->usrTag==tag && (!callback||walk->callback==callback) )
-      break;
-  }
-
-/*------------------------------------------------------------------------*\
-    Return result
-\*------------------------------------------------------------------------*/
-  debug( "_ickTimerFind (%p): result=%p", ictx, walk );
-  return walk;
-}
-
-
 /*=========================================================================*\
   Update timer settings
     interval is in millisecs
@@ -1385,9 +3015,24 @@ ickErrcode_t _ickTimerUpdate( ickP2pContext_t *ictx, ickTimer_t *timer, long int
   debug( "_ickTimerUpdate (%p): timer=%p, interval=%ld, repeat=%d", ictx, timer, interval, repeat );
 
 /*------------------------------------------------------------------------*\
-    unlink timer
+    Detached for execution? Main thread will relink it with new settings
 \*------------------------------------------------------------------------*/
-  if( _ickTimerUnlink(ictx,timer) ) {
+  if( timer->due ) {
+    if( timer->cancelled ) {
+      logerr( "_ickTimerUpdate (%p): timer was deleted.", ictx );
+      return ICKERR_INVALID;
+    }
+    timer->interval   = interval;
+    timer->repeatCntr = repeat;
+    timer->time       = _ickTimerClock() + interval*1000LL;
+    timer->updated    = 1;
+    return ICKERR_SUCCESS;
+  }
+
+/*------------------------------------------------------------------------*\
+    Be defensive: check if timer is heap element
+\*------------------------------------------------------------------------*/
+  if( timer->heapIdx<0 || timer->heapIdx>=ictx->timerCnt || ictx->timers[timer->heapIdx]!=timer ) {
     logerr( "_ickTimerUpdate (%p): invalid timer.", ictx );
     return ICKERR_INVALID;
   }
@@ -1397,18 +3042,15 @@ ickErrcode_t _ickTimerUpdate( ickP2pContext_t *ictx, ickTimer_t *timer, long int
 \*------------------------------------------------------------------------*/
   timer->interval   = interval;
   timer->repeatCntr = repeat;
-  gettimeofday( &timer->time, NULL );
-  timer->time.tv_sec  += interval/1000;
-  timer->time.tv_usec += (interval%1000)*1000;
-  while( timer->time.tv_usec>1000000UL ) {
-    timer->time.tv_usec -= 1000000UL;
-    timer->time.tv_sec++;
-  }
+  timer->time       = _ickTimerClock() + interval*1000LL;
 
 /*------------------------------------------------------------------------*\
-    link timer to list
+    Restore heap order in place, rearm or break main loop if wakeup is too late
 \*------------------------------------------------------------------------*/
-  _ickTimerLink( ictx, timer );
+  _ickTimerSiftUp( ictx, timer->heapIdx );
+  _ickTimerSiftDown( ictx, timer->heapIdx );
+  if( (!ictx->timerWakeup || timer->time+timer->slack*1000LL<ictx->timerWakeup) && _ickTimerArm(ictx) )
+    _ickMainThreadBreak( ictx, 'T' );
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -1425,6 +3067,17 @@ ickErrcode_t _ickTimerDelete( ickP2pContext_t *ictx, ickTimer_t *timer )
 {
   debug( "_ickTimerDelete (%p): %p", ictx, timer );
 
+/*------------------------------------------------------------------------*\
+    Detached for execution? Just flag, main thread will free descriptor
+\*------------------------------------------------------------------------*/
+  if( timer->due ) {
+    if( timer->handle )
+      *timer->handle = NULL;
+    timer->handle    = NULL;
+    timer->cancelled = 1;
+    return ICKERR_SUCCESS;
+  }
+
 /*------------------------------------------------------------------------*\
     Unlink timer
 \*------------------------------------------------------------------------*/
@@ -1434,8 +3087,10 @@ ickErrcode_t _ickTimerDelete( ickP2pContext_t *ictx, ickTimer_t *timer )
   }
 
 /*------------------------------------------------------------------------*\
-    Free descriptor, that's all
+    Invalidate handle, free descriptor, that's all
 \*------------------------------------------------------------------------*/
+  if( timer->handle )
+    *timer->handle = NULL;
   Sfree( timer );
   return ICKERR_SUCCESS;
 }
@@ -1448,31 +3103,46 @@ ickErrcode_t _ickTimerDelete( ickP2pContext_t *ictx, ickTimer_t *timer )
 \*=========================================================================*/
 void _ickTimerDeleteAll( ickP2pContext_t *ictx, ickTimerCb_t callback, const void *data, int tag )
 {
-  ickTimer_t *walk, *next;
+  ickTimer_t *walk;
+  int         i, n;
   debug( "_ickTimerDeleteAll (%p): cb=%p data=%p tag=%d", ictx, callback, data, tag );
 
 /*------------------------------------------------------------------------*\
-    Find list entries with same id vector
+    Flag matching timers detached for execution
 \*------------------------------------------------------------------------*/
-  for( walk=ictx->timers; walk; walk=next ) {
-    next = walk->next;
+  for( walk=ictx->timersDue; walk; walk=walk->nextDue ) {
+    if( walk->usrPtr==data && walk->usrTag==tag && (!callback||walk->callback==callback) )
+      _ickTimerDelete( ictx, walk );
+  }
 
-    // no match?
-    if( walk->usrPtr!=data || walk->usrTag!=tag || (callback&&walk->callback!=callback) )
-      continue;
+/*------------------------------------------------------------------------*\
+    Free heap entries with same id vector and compact the array
+\*------------------------------------------------------------------------*/
+  for( i=0,n=0; i<ictx->timerCnt; i++ ) {
+    walk = ictx->timers[i];
 
-    // unlink
-    if( next )
-      next->prev = walk->prev;
-    if( walk->prev )
-      walk->prev->next = next;
-    else
-      ictx->timers = next;
+    // no match: keep
+    if( walk->usrPtr!=data || walk->usrTag!=tag || (callback&&walk->callback!=callback) ) {
+      walk->heapIdx     = n;
+      ictx->timers[n++] = walk;
+      continue;
+    }
 
-    // and free
+    // invalidate handle and free
     debug( "_ickTimerDeleteAll (%p): deleted timer %p", ictx, walk );
+    if( walk->handle )
+      *walk->handle = NULL;
     Sfree( walk );
   }
+  if( n==ictx->timerCnt )
+    return;
+  ictx->timerCnt = n;
+
+/*------------------------------------------------------------------------*\
+    Rebuild heap order (bottom up, linear in heap size)
+\*------------------------------------------------------------------------*/
+  for( i=(n-2)/ICKTIMER_HEAPARITY; n>1 && i>=0; i-- )
+    _ickTimerSiftDown( ictx, i );
 
 /*------------------------------------------------------------------------*\
     That's all
@@ -1481,72 +3151,167 @@ void _ickTimerDeleteAll( ickP2pContext_t *ictx, ickTimerCb_t callback, const voi
 
 
 /*=========================================================================*\
-  Link a timer to list
+  Get monotonic time for timer management in usecs
+    Not affected by changes of the wall clock
+\*=========================================================================*/
+static long long _ickTimerClock( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+
+/*=========================================================================*\
+  Arm timer descriptor for the next coalesced timer wakeup (or disarm it)
+    Timer list must be locked by caller
+    Returns 0 on success, -1 if there is no timer descriptor
+\*=========================================================================*/
+static int _ickTimerArm( ickP2pContext_t *ictx )
+{
+#ifdef ICK_USEEVENTFD
+  struct itimerspec its;
+  long long         expiry;
+
+/*------------------------------------------------------------------------*\
+    No descriptor or nothing changed?
+\*------------------------------------------------------------------------*/
+  if( ictx->timerFd<0 )
+    return -1;
+  expiry = _ickTimerWakeup( ictx );
+  if( expiry==ictx->timerWakeup )
+    return 0;
+
+/*------------------------------------------------------------------------*\
+    Set absolute expiry, a zero value disarms
+\*------------------------------------------------------------------------*/
+  memset( &its, 0, sizeof(its) );
+  its.it_value.tv_sec  = expiry/1000000;
+  its.it_value.tv_nsec = (expiry%1000000)*1000;
+  if( timerfd_settime(ictx->timerFd,TFD_TIMER_ABSTIME,&its,NULL) ) {
+    logerr( "_ickTimerArm (%p): timerfd_settime failed (%s)", ictx, strerror(errno) );
+    return -1;
+  }
+  ictx->timerWakeup = expiry;
+  debug( "_ickTimerArm (%p): armed for %lld", ictx, expiry );
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+
+/*=========================================================================*\
+  Get time for the next main loop wakeup, this is the earliest latest
+    execution time (expiry plus slack) of all timers
+    Timer list must be locked by caller
+    Returns 0 if there are no timers
+\*=========================================================================*/
+static long long _ickTimerWakeup( ickP2pContext_t *ictx )
+{
+  long long wakeup;
+
+  if( !ictx->timerCnt )
+    return 0;
+  wakeup = ictx->timers[0]->time + ictx->timers[0]->slack*1000LL;
+  _ickTimerWakeupScan( ictx, 0, &wakeup );
+  return wakeup;
+}
+
+
+/*=========================================================================*\
+  Recursively minimize wakeup time for a heap branch
+    Since children never expire earlier than their parents, only timers
+    expiring before the current wakeup candidate need to be visited.
+    Timer list must be locked by caller
+\*=========================================================================*/
+static void _ickTimerWakeupScan( ickP2pContext_t *ictx, int idx, long long *wakeup )
+{
+  ickTimer_t *timer = ictx->timers[idx];
+  long long   latest;
+  int         i;
+
+  if( timer->time>=*wakeup )
+    return;
+  latest = timer->time + timer->slack*1000LL;
+  if( latest<*wakeup )
+    *wakeup = latest;
+
+  for( i=idx*ICKTIMER_HEAPARITY+1; i<=idx*ICKTIMER_HEAPARITY+ICKTIMER_HEAPARITY && i<ictx->timerCnt; i++ )
+    _ickTimerWakeupScan( ictx, i, wakeup );
+}
+
+
+/*=========================================================================*\
+  Link a timer to heap
     Timer list must be locked by caller
+    Returns 0 on success, -1 if heap could not be extended
 \*=========================================================================*/
-static void _ickTimerLink( ickP2pContext_t *ictx, ickTimer_t *timer )
+static int _ickTimerLink( ickP2pContext_t *ictx, ickTimer_t *timer )
 {
-  ickTimer_t *walk, *last;
   debug( "_ickTimerLink (%p): %p", ictx, timer );
 
 /*------------------------------------------------------------------------*\
-    Find list entry with time stamp larger than the new one
+    Extend heap array if necessary
 \*------------------------------------------------------------------------*/
-  for( last=NULL,walk=ictx->timers; walk; last=walk,walk=walk->next ) {
-    if( walk->time.tv_sec>timer->time.tv_sec )
-      break;
-    if( walk->time.tv_sec==timer->time.tv_sec && walk->time.tv_usec>timer->time.tv_usec)
-      break;
+  if( ictx->timerCnt>=ictx->timerSize ) {
+    int          size   = ictx->timerSize+ICKTIMER_HEAPINCREMENT;
+    ickTimer_t **timers = realloc( ictx->timers, size*sizeof(ickTimer_t*) );
+    if( !timers )
+      return -1;
+    ictx->timers    = timers;
+    ictx->timerSize = size;
   }
 
 /*------------------------------------------------------------------------*\
-    Link new element
+    Append as leaf and move up to position
 \*------------------------------------------------------------------------*/
-  timer->next = walk;
-  if( walk )
-    walk->prev = timer;
-  timer->prev = last;
-  if( last )
-    last->next = timer;
-  else {
-    ictx->timers = timer;
+  timer->heapIdx = ictx->timerCnt;
+  ictx->timers[ictx->timerCnt++] = timer;
+  _ickTimerSiftUp( ictx, timer->heapIdx );
 
-    // If root was changed write to help pipe to break main loop poll timer
+/*------------------------------------------------------------------------*\
+    If planned wakeup is too late rearm timer descriptor or
+    write to help pipe to break main loop poll timer
+\*------------------------------------------------------------------------*/
+  if( (!ictx->timerWakeup || timer->time+timer->slack*1000LL<ictx->timerWakeup) && _ickTimerArm(ictx) )
     _ickMainThreadBreak( ictx, 'T' );
-  }
 
 /*------------------------------------------------------------------------*\
     That's all
 \*------------------------------------------------------------------------*/
+  return 0;
 }
 
 
 /*=========================================================================*\
-  Unlink a timer from list
+  Unlink a timer from heap
     Timer list must be locked by caller, the timer descriptor is not freed
     Returns 0 on success
 \*=========================================================================*/
 static int _ickTimerUnlink( ickP2pContext_t *ictx, ickTimer_t *timer )
 {
-  ickTimer_t *walk;
+  int         idx = timer->heapIdx;
+  ickTimer_t *last;
   debug( "_ickTimerUnlink (%p): %p", ictx, timer );
 
 /*------------------------------------------------------------------------*\
-    Be defensive: check it timer is list element
+    Be defensive: check if timer is heap element
 \*------------------------------------------------------------------------*/
-  for( walk=ictx->timers; walk&&walk!=timer; walk=walk->next );
-  if( !walk )
+  if( idx<0 || idx>=ictx->timerCnt || ictx->timers[idx]!=timer )
     return -1;
 
 /*------------------------------------------------------------------------*\
-    Unlink
+    Replace by last leaf and restore heap order
 \*------------------------------------------------------------------------*/
-  if( timer->next )
-    timer->next->prev = timer->prev;
-  if( timer->prev )
-    timer->prev->next = timer->next;
-  else
-    ictx->timers = timer->next;
+  last = ictx->timers[--ictx->timerCnt];
+  timer->heapIdx = -1;
+  if( last!=timer ) {
+    last->heapIdx     = idx;
+    ictx->timers[idx] = last;
+    _ickTimerSiftUp( ictx, idx );
+    _ickTimerSiftDown( ictx, last->heapIdx );
+  }
 
 /*------------------------------------------------------------------------*\
     That's all (No need to inform main loop in this case...)
@@ -1555,6 +3320,60 @@ static int _ickTimerUnlink( ickP2pContext_t *ictx, ickTimer_t *timer )
 }
 
 
+/*=========================================================================*\
+  Move a heap element towards the root until its parent is not later
+    Timer list must be locked by caller
+\*=========================================================================*/
+static void _ickTimerSiftUp( ickP2pContext_t *ictx, int idx )
+{
+  ickTimer_t *timer = ictx->timers[idx];
+
+  while( idx>0 ) {
+    int         pidx   = (idx-1)/ICKTIMER_HEAPARITY;
+    ickTimer_t *parent = ictx->timers[pidx];
+    if( parent->time<=timer->time )
+      break;
+    parent->heapIdx   = idx;
+    ictx->timers[idx] = parent;
+    idx = pidx;
+  }
+
+  timer->heapIdx    = idx;
+  ictx->timers[idx] = timer;
+}
+
+
+/*=========================================================================*\
+  Move a heap element towards the leaves until no child is earlier
+    Timer list must be locked by caller
+\*=========================================================================*/
+static void _ickTimerSiftDown( ickP2pContext_t *ictx, int idx )
+{
+  ickTimer_t *timer = ictx->timers[idx];
+
+  for(;;) {
+    int first = idx*ICKTIMER_HEAPARITY+1;
+    int min   = -1;
+    int i;
+
+    // Find earliest child
+    for( i=first; i<first+ICKTIMER_HEAPARITY && i<ictx->timerCnt; i++ ) {
+      if( min<0 || ictx->timers[i]->time<ictx->timers[min]->time )
+        min = i;
+    }
+    if( min<0 || ictx->timers[min]->time>=timer->time )
+      break;
+
+    ictx->timers[min]->heapIdx = idx;
+    ictx->timers[idx]          = ictx->timers[min];
+    idx = min;
+  }
+
+  timer->heapIdx    = idx;
+  ictx->timers[idx] = timer;
+}
+
+
 /*=========================================================================*\
                                     END OF FILE
 \*=========================================================================*/
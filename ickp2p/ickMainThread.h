@@ -56,6 +56,7 @@ Remarks         : -
   Definition of constants
 \*=========================================================================*/
 #define ICKMAINLOOP_TIMEOUT_MS 1000
+#define ICKSHARD_MAX           64
 
 
 /*=========================================================================*\
@@ -86,14 +87,28 @@ typedef void (*ickTimerCb_t)( const ickTimer_t *timer, void *data, int tag );
 \*=========================================================================*/
 void         *_ickMainThread( void *arg );
 ickErrcode_t  _ickMainThreadBreak( ickP2pContext_t *ictx, char flag );
+ickErrcode_t  _ickMainThreadTerminate( ickP2pContext_t *ictx, ickP2pEndCb_t callback );
+
+ickErrcode_t  _ickLoopAttach( ickP2pContext_t *ictx );
+void          _ickLoopWaitDetached( ickP2pLoop_t *loop, const ickP2pContext_t *ictx );
+
+int           _ickShardForUuid( const ickP2pContext_t *ictx, const char *uuid );
+unsigned long _ickUuidHash( const char *uuid );
+int           _ickShardIndex( const ickP2pContext_t *ictx, const struct libwebsocket_context *context );
+ickErrcode_t  _ickShardConnect( ickP2pContext_t *ictx, ickDevice_t *device );
+void          _ickShardBookWritable( ickP2pContext_t *ictx, ickDevice_t *device );
 
 
 ickErrcode_t  _ickMainThreadAddWGet( ickWGetContext_t *ickWGet );
 
 void          _ickTimerListLock( ickP2pContext_t *ictx );
 void          _ickTimerListUnlock( ickP2pContext_t *ictx );
-ickErrcode_t  _ickTimerAdd( ickP2pContext_t *ictx, long interval, int repeat, ickTimerCb_t callback, void *data, int tag );
-ickTimer_t   *_ickTimerFind( ickP2pContext_t *ictx, ickTimerCb_t callback, const void *data, int tag );
+void          _ickTimerListLockStats( ickP2pContext_t *ictx, long *cnt, double *avg, double *max );
+ickP2pContext_t *_ickTimerGetContext( const ickTimer_t *timer );
+long          _ickTimerGetInterval( const ickTimer_t *timer );
+int           _ickTimerIsCancelled( const ickTimer_t *timer );
+ickErrcode_t  _ickTimerAdd( ickP2pContext_t *ictx, long interval, int repeat, ickTimerCb_t callback, void *data, int tag, ickTimer_t **handle );
+ickErrcode_t  _ickTimerAddWithSlack( ickP2pContext_t *ictx, long interval, long slack, int repeat, ickTimerCb_t callback, void *data, int tag, ickTimer_t **handle );
 ickErrcode_t  _ickTimerUpdate( ickP2pContext_t *ictx, ickTimer_t *timer, long interval, int repeat );
 ickErrcode_t  _ickTimerDelete( ickP2pContext_t *ictx, ickTimer_t *timer );
 void          _ickTimerDeleteAll( ickP2pContext_t *ictx, ickTimerCb_t callback, const void *data, int tag );
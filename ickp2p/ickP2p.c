@@ -69,6 +69,15 @@ Remarks         : -
 #include "ickWGet.h"
 #include "ickDevice.h"
 #include "ickMainThread.h"
+#include "ickDescription.h"
+#include "ickP2pCom.h"
+#include "ickPool.h"
+#include "ickDispatch.h"
+
+#ifdef ICK_USEEVENTFD
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 
 /*=========================================================================*\
@@ -79,7 +88,9 @@ Remarks         : -
 /*=========================================================================*\
   Private prototypes
 \*=========================================================================*/
-// none
+static ickErrcode_t _ickLibCbListAdd( ickP2pContext_t *ictx, struct _cblist *volatile *list, void *callback, int isNew );
+static ickErrcode_t _ickLibCbListRemove( ickP2pContext_t *ictx, struct _cblist *volatile *list, void *callback );
+static void         _ickLibCbRetire( ickP2pContext_t *ictx, struct _cblist *old );
 
 
 #pragma mark -- Global functions not bound to an inckStream context
@@ -180,14 +191,23 @@ ickP2pContext_t *ickP2pCreate( const char *deviceName, const char *deviceUuid,
   ictx->lifetime           = lifetime>0?lifetime:ICKSSDP_DEFAULTLIFETIME;
   ictx->ickServices        = services;
   ictx->upnpListenerSocket = -1;
+  ictx->pollBreakPipe[0]   = -1;
+  ictx->pollBreakPipe[1]   = -1;
+#ifdef ICK_USEEPOLL
+  ictx->epollFd            = -1;
+#endif
+#ifdef ICK_USEEVENTFD
+  ictx->timerFd            = -1;
+#endif
 
 /*------------------------------------------------------------------------*\
     Init mutexes and conditions
 \*------------------------------------------------------------------------*/
   pthread_mutex_init( &ictx->mutex, NULL );
   pthread_cond_init( &ictx->condIsReady, NULL );
-  pthread_mutex_init( &ictx->discoveryCbsMutex, NULL );
-  pthread_mutex_init( &ictx->messageCbsMutex, NULL );
+  pthread_mutex_init( &ictx->callbacksMutex, NULL );
+  pthread_mutex_init( &ictx->dispatchMutex, NULL );
+  pthread_mutex_init( &ictx->endMutex, NULL );
   pthread_mutex_init( &ictx->timersMutex, NULL );
   pthread_mutex_init( &ictx->wGettersMutex, NULL );
   pthread_mutexattr_init( &attr );
@@ -221,6 +241,17 @@ ickP2pContext_t *ickP2pCreate( const char *deviceName, const char *deviceUuid,
     return NULL;
   }
 
+/*------------------------------------------------------------------------*\
+    Create pool for message descriptors and containers
+\*------------------------------------------------------------------------*/
+  ictx->messagePool = _ickPoolCreate();
+  if( !ictx->messagePool ) {
+    _ickLibDestruct( ictx );
+    if( error )
+      *error = ICKERR_NOMEM;
+    return NULL;
+  }
+
 /*------------------------------------------------------------------------*\
     Create and init SSDP listener socket bound to all interfaces
 \*------------------------------------------------------------------------*/
@@ -234,9 +265,15 @@ ickP2pContext_t *ickP2pCreate( const char *deviceName, const char *deviceUuid,
   }
 
 /*------------------------------------------------------------------------*\
-    Create pipe for poll breaking
+    Create pipe (or eventfd) for poll breaking
 \*------------------------------------------------------------------------*/
+#ifdef ICK_USEEVENTFD
+  ictx->pollBreakPipe[0] = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC );
+  ictx->pollBreakPipe[1] = ictx->pollBreakPipe[0];
+  rc = ictx->pollBreakPipe[0]<0 ? -1 : 0;
+#else
   rc = pipe( ictx->pollBreakPipe );
+#endif
   if( rc ) {
     logerr( "ickP2pInit: Unable to start main thread: %s", strerror(errno) );
     _ickLibDestruct( ictx );
@@ -245,6 +282,15 @@ ickP2pContext_t *ickP2pCreate( const char *deviceName, const char *deviceUuid,
     return NULL;
   }
 
+/*------------------------------------------------------------------------*\
+    Create timer descriptor, fall back to poll timeouts on errors
+\*------------------------------------------------------------------------*/
+#ifdef ICK_USEEVENTFD
+  ictx->timerFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC );
+  if( ictx->timerFd<0 )
+    logwarn( "ickP2pInit: Unable to create timer descriptor: %s", strerror(errno) );
+#endif
+
 /*------------------------------------------------------------------------*\
     That's it
 \*------------------------------------------------------------------------*/
@@ -300,12 +346,22 @@ ickErrcode_t ickP2pResume( ickP2pContext_t *ictx )
     ictx->upnpConfigId = (long)time(NULL);
 
 /*------------------------------------------------------------------------*\
-    Create thread for ickstream communication mainloop
+    Attach to shared loop or create thread for ickstream communication mainloop
 \*------------------------------------------------------------------------*/
-  rc = pthread_create( &ictx->thread, NULL, _ickMainThread, &ictx );
-  if( rc ) {
-    logerr( "ickP2pResume: Unable to start main thread: %s", strerror(rc) );
-    return ICKERR_NOTHREAD;
+  if( ictx->loop ) {
+    rc  = 0;
+    irc = _ickLoopAttach( ictx );
+    if( irc ) {
+      logerr( "ickP2pResume: Unable to attach to loop: %s", ickStrError(irc) );
+      return irc;
+    }
+  }
+  else {
+    rc = pthread_create( &ictx->thread, NULL, _ickMainThread, &ictx );
+    if( rc ) {
+      logerr( "ickP2pResume: Unable to start main thread: %s", strerror(rc) );
+      return ICKERR_NOTHREAD;
+    }
   }
 
 /*------------------------------------------------------------------------*\
@@ -318,7 +374,7 @@ ickErrcode_t ickP2pResume( ickP2pContext_t *ictx )
   gettimeofday( &now, NULL );
   abstime.tv_sec  = now.tv_sec + 5;
   abstime.tv_nsec = now.tv_usec*1000UL;
-  while( ictx->state!=ICKLIB_RUNNING ) {
+  while( ictx->state!=ICKLIB_RUNNING && !ictx->error ) {
     rc = pthread_cond_timedwait( &ictx->condIsReady, &ictx->mutex, &abstime );
     if( rc )
       break;
@@ -389,7 +445,9 @@ ickErrcode_t ickP2pSuspend( ickP2pContext_t *ictx )
 \*=========================================================================*/
 ickErrcode_t ickP2pEnd( ickP2pContext_t *ictx, ickP2pEndCb_t callback )
 {
-  int rc;
+  ickP2pLoop_t *loop;
+  pthread_t     thread;
+  int           rc;
 
 /*------------------------------------------------------------------------*\
     Not yet running?
@@ -410,17 +468,20 @@ ickErrcode_t ickP2pEnd( ickP2pContext_t *ictx, ickP2pEndCb_t callback )
 
 /*------------------------------------------------------------------------*\
     Store callback for asynchronous shutdown and request thread termination
+    The context might be destructed as soon as this returns.
 \*------------------------------------------------------------------------*/
   debug( "ickP2pEnd (%p): %s", ictx, callback?"asynchronous":"synchronous" );
-  ictx->cbEnd = callback;
-  ictx->state = ICKLIB_TERMINATING;
-  _ickMainThreadBreak( ictx, 'X' );
+  loop   = ictx->loop;
+  thread = ictx->thread;
+  _ickMainThreadTerminate( ictx, callback );
 
 /*------------------------------------------------------------------------*\
     Wait for actual thread termination in synchronous mode
 \*------------------------------------------------------------------------*/
-  if( !callback ) {
-    rc = pthread_join( ictx->thread, NULL );
+  if( !callback && loop )
+    _ickLoopWaitDetached( loop, ictx );
+  else if( !callback ) {
+    rc = pthread_join( thread, NULL );
     if( rc ) {
       logerr( "ickP2pEnd: Unable to join main thread: %s", strerror(rc) );
       return ICKERR_GENERIC;
@@ -497,19 +558,27 @@ void _ickLibDestruct( ickP2pContext_t *ictx )
   }
   ictx->interfaces = NULL;
 
+/*------------------------------------------------------------------------*\
+    Stop dispatch workers (if still running), they use the callback lists
+\*------------------------------------------------------------------------*/
+  _ickDispatchStop( ictx );
+
 /*------------------------------------------------------------------------*\
     Free call back lists
 \*------------------------------------------------------------------------*/
-  for( walkCb=ictx->discoveryCbs; walkCb; walkCb=nextCb ) {
-    nextCb = walkCb->next;
-    Sfree( walkCb );
-  }
-  ictx->discoveryCbs = NULL;
-  for( walkCb=ictx->messageCbs; walkCb; walkCb=nextCb ) {
-    nextCb = walkCb->next;
+  Sfree( ictx->discoveryCbs );
+  Sfree( ictx->messageCbs );
+  Sfree( ictx->streamCbs );
+  for( walkCb=ictx->cbRetired; walkCb; walkCb=nextCb ) {
+    nextCb = walkCb->retired;
     Sfree( walkCb );
   }
-  ictx->messageCbs = NULL;
+  ictx->cbRetired = NULL;
+
+/*------------------------------------------------------------------------*\
+    Free submission ring and messages not yet resolved
+\*------------------------------------------------------------------------*/
+  _ickP2pFreeSubmissions( ictx );
 
 /*------------------------------------------------------------------------*\
     Free strong string references
@@ -519,25 +588,41 @@ void _ickLibDestruct( ickP2pContext_t *ictx )
   Sfree( ictx->deviceUuid );
   Sfree( ictx->upnpFolder );
 
+/*------------------------------------------------------------------------*\
+    Free timer heap (descriptors are deleted by the main thread)
+\*------------------------------------------------------------------------*/
+  Sfree( ictx->timers );
+
+/*------------------------------------------------------------------------*\
+    Free message pool (all messages are gone with the devices)
+\*------------------------------------------------------------------------*/
+  if( ictx->messagePool )
+    _ickPoolDestroy( ictx->messagePool );
+
 /*------------------------------------------------------------------------*\
     Delete mutex and condition
 \*------------------------------------------------------------------------*/
   pthread_mutex_destroy( &ictx->mutex );
   pthread_cond_destroy( &ictx->condIsReady );
-  pthread_mutex_destroy( &ictx->discoveryCbsMutex );
-  pthread_mutex_destroy( &ictx->messageCbsMutex );
+  pthread_mutex_destroy( &ictx->callbacksMutex );
+  pthread_mutex_destroy( &ictx->dispatchMutex );
+  pthread_mutex_destroy( &ictx->endMutex );
   pthread_mutex_destroy( &ictx->timersMutex );
   pthread_mutex_destroy( &ictx->wGettersMutex );
   pthread_mutex_destroy( &ictx->deviceListMutex );
   pthread_mutex_destroy( &ictx->interfaceListMutex );
 
 /*------------------------------------------------------------------------*\
-    Close help pipe for breaking polls
+    Close help pipe for breaking polls (an eventfd is used for both ends)
 \*------------------------------------------------------------------------*/
   for( i=0; i<2; i++ ) {
-    if( ictx->pollBreakPipe[i]>=0 )
+    if( ictx->pollBreakPipe[i]>=0 && (!i||ictx->pollBreakPipe[1]!=ictx->pollBreakPipe[0]) )
       close( ictx->pollBreakPipe[i] );
   }
+#ifdef ICK_USEEVENTFD
+  if( ictx->timerFd>=0 )
+    close( ictx->timerFd );
+#endif
 
 /*------------------------------------------------------------------------*\
     Free context descriptor
@@ -548,269 +633,440 @@ void _ickLibDestruct( ickP2pContext_t *ictx )
 
 #pragma mark -- Call backs
 
+/*
+  Callback lists are immutable snapshots that are replaced as a whole by
+  registration and removal (serialized by callbacksMutex). Dispatching
+  threads do not lock, they only enter the current callback epoch
+  (_ickLibCbEnter()/_ickLibCbLeave()). A replaced snapshot is freed as
+  soon as the epoch advanced twice, which is possible only after all
+  readers that might still see it have left.
+*/
+
 
 /*=========================================================================*\
   Add a discovery callback
 \*=========================================================================*/
 ickErrcode_t ickP2pRegisterDiscoveryCallback( ickP2pContext_t *ictx, ickP2pDiscoveryCb_t callback )
 {
-  int             perr;
-  struct _cblist *new;
+  ickErrcode_t irc;
   debug( "ickP2pRegisterDiscoveryCallback (%p): %p", ictx, callback );
 
 /*------------------------------------------------------------------------*\
-    Lock list of callbacks
+    Add to list, new callbacks get an inventory from the main thread
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_lock( &ictx->discoveryCbsMutex );
-  if( perr )
-    logerr( "ickP2pRegisterDiscoveryCallback: cannot lock callback list mutex (%s)",
-            strerror(perr) );
+  irc = _ickLibCbListAdd( ictx, &ictx->discoveryCbs, callback, ictx->state!=ICKLIB_CREATED );
+  if( irc )
+    return irc;
 
 /*------------------------------------------------------------------------*\
-    Avoid double subscriptions
+    Signal main thread, that's all
 \*------------------------------------------------------------------------*/
-  for( new=ictx->discoveryCbs; new; new=new->next ) {
-    if( new->callback!=callback )
-      continue;
-    logwarn( "ickP2pRegisterDiscoveryCallback: callback already registered." );
-    perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
-    if( perr )
-      logerr( "ickP2pRegisterDiscoveryCallback: cannot unlock callback list mutex (%s)",
-              strerror(perr) );
-    return ICKERR_SUCCESS;
+  if( ictx->state!=ICKLIB_CREATED ) {
+    ictx->cbInventoryPending = 1;
+    _ickMainThreadBreak( ictx, 'l' );
   }
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Remove a discovery callback
+    Dispatches already in progress in other threads might still execute
+    the callback after this returns.
+\*=========================================================================*/
+ickErrcode_t ickP2pRemoveDiscoveryCallback( ickP2pContext_t *ictx, ickP2pDiscoveryCb_t callback )
+{
+  debug( "ickP2pRemoveDiscoveryCallback (%p): %p", ictx, callback );
+  return _ickLibCbListRemove( ictx, &ictx->discoveryCbs, callback );
+}
+
+
+/*=========================================================================*\
+  Add a messaging callback
+\*=========================================================================*/
+ickErrcode_t ickP2pRegisterMessageCallback( ickP2pContext_t *ictx, ickP2pMessageCb_t callback )
+{
+  debug( "ickP2pRegisterMessageCallback (%p): %p", ictx, callback );
+  return _ickLibCbListAdd( ictx, &ictx->messageCbs, callback, 0 );
+}
+
+
+/*=========================================================================*\
+  Remove a messaging callback
+    Dispatches already in progress in other threads might still execute
+    the callback after this returns.
+\*=========================================================================*/
+ickErrcode_t ickP2pRemoveMessageCallback( ickP2pContext_t *ictx, ickP2pMessageCb_t callback )
+{
+  debug( "ickP2pRemoveMessageCallback (%p): %p", ictx, callback );
+  return _ickLibCbListRemove( ictx, &ictx->messageCbs, callback );
+}
+
+
+/*=========================================================================*\
+  Add a streaming message callback
+    Fragmented messages exceeding the stream threshold (see
+    ickP2pSetStreamThreshold()) are passed in chunks to these callbacks
+    instead of being reassembled for the message callbacks.
+    Stream callbacks are executed synchronously by the receiving thread,
+    also if message dispatch workers are configured.
+\*=========================================================================*/
+ickErrcode_t ickP2pRegisterStreamCallback( ickP2pContext_t *ictx, ickP2pStreamCb_t callback )
+{
+  debug( "ickP2pRegisterStreamCallback (%p): %p", ictx, callback );
+  return _ickLibCbListAdd( ictx, &ictx->streamCbs, callback, 0 );
+}
+
+
+/*=========================================================================*\
+  Remove a streaming message callback
+    Dispatches already in progress in other threads might still execute
+    the callback after this returns.
+\*=========================================================================*/
+ickErrcode_t ickP2pRemoveStreamCallback( ickP2pContext_t *ictx, ickP2pStreamCb_t callback )
+{
+  debug( "ickP2pRemoveStreamCallback (%p): %p", ictx, callback );
+  return _ickLibCbListRemove( ictx, &ictx->streamCbs, callback );
+}
+
+
+/*=========================================================================*\
+  Enter callback epoch
+    Callback list snapshots read after this stay valid until
+    _ickLibCbLeave() is called with the returned epoch.
+    Might be nested, never blocks.
+\*=========================================================================*/
+long _ickLibCbEnter( ickP2pContext_t *ictx )
+{
+  long epoch;
 
 /*------------------------------------------------------------------------*\
-    Allocate and init new list element
+    Register as reader of the current epoch, retry if the epoch advanced
+    in the meantime (the atomic increment is a full barrier)
 \*------------------------------------------------------------------------*/
-  new = calloc( 1, sizeof(struct _cblist) );
-  if( !new ) {
-    logerr( "ickP2pRegisterDiscoveryCallback: out of memory" );
-    perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
-    if( perr )
-      logerr( "ickP2pRegisterDiscoveryCallback: cannot unlock callback list mutex (%s)",
-              strerror(perr) );
-    return ICKERR_NOMEM;
+  for(;;) {
+    epoch = ictx->cbEpoch;
+    __sync_add_and_fetch( &ictx->cbReaders[epoch&1], 1 );
+    if( ictx->cbEpoch==epoch )
+      return epoch;
+    __sync_sub_and_fetch( &ictx->cbReaders[epoch&1], 1 );
   }
-  new->callback = callback;
-  if( ictx->state!=ICKLIB_CREATED )
-    new->isNew = 1;
+}
 
-/*------------------------------------------------------------------------*\
-    Add to linked list
-\*------------------------------------------------------------------------*/
-  new->next = ictx->discoveryCbs;
-  if( new->next )
-    new->next->prev = new;
-  ictx->discoveryCbs = new;
 
-/*------------------------------------------------------------------------*\
-    Unlock list, signal main thread, that's all
-\*------------------------------------------------------------------------*/
-  perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
+/*=========================================================================*\
+  Leave callback epoch
+\*=========================================================================*/
+void _ickLibCbLeave( ickP2pContext_t *ictx, long epoch )
+{
+  __sync_sub_and_fetch( &ictx->cbReaders[epoch&1], 1 );
+}
+
+
+/*=========================================================================*\
+  Free replaced callback list snapshots that are no longer in use
+    This is cheap if there is nothing to reclaim
+\*=========================================================================*/
+void _ickLibCbReclaim( ickP2pContext_t *ictx )
+{
+  int perr;
+
+  if( !ictx->cbRetired )
+    return;
+
+  perr = pthread_mutex_lock( &ictx->callbacksMutex );
   if( perr )
-    logerr( "ickP2pRegisterDiscoveryCallback: cannot unlock callback list mutex (%s)",
+    logerr( "_ickLibCbReclaim: cannot lock callback list mutex (%s)",
+            strerror(perr) );
+  _ickLibCbRetire( ictx, NULL );
+  perr = pthread_mutex_unlock( &ictx->callbacksMutex );
+  if( perr )
+    logerr( "_ickLibCbReclaim: cannot unlock callback list mutex (%s)",
             strerror(perr) );
-  _ickMainThreadBreak( ictx, 'l' );
-  return ICKERR_SUCCESS;
 }
 
 
 /*=========================================================================*\
-  Remove a discovery callback
+  Send inventory to newly registered discovery callbacks
+    This is executed in the context of the main thread
 \*=========================================================================*/
-ickErrcode_t ickP2pRemoveDiscoveryCallback( ickP2pContext_t *ictx, ickP2pDiscoveryCb_t callback )
+void _ickLibExecDiscoveryInventory( ickP2pContext_t *ictx )
 {
-  int             perr;
-  struct _cblist *walk;
-  debug( "ickP2pRemoveDiscoveryCallback (%p): %p", ictx, callback );
+  const struct _cblist *cbs;
+  struct _cblist       *live;
+  ickDevice_t          *device;
+  long                  epoch;
+  int                   isNew;
+  int                   perr;
+  int                   i, j;
 
 /*------------------------------------------------------------------------*\
-    Lock list of callbacks
+    Anything to do?
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_lock( &ictx->discoveryCbsMutex );
-  if( perr )
-    logerr( "ickP2pRemoveDiscoveryCallback: cannot lock callback list mutex (%s)",
-            strerror(perr) );
+  if( !__sync_lock_test_and_set(&ictx->cbInventoryPending,0) )
+    return;
 
 /*------------------------------------------------------------------------*\
-    Find entry, check if member
+    Find new callbacks in current snapshot.
+    The snapshot might be replaced concurrently (and the copy would still
+    carry the isNew flag), so the flag is read and reset on the entry of
+    the live list under the writer lock. Callbacks no longer found there
+    were removed meanwhile and are skipped.
 \*------------------------------------------------------------------------*/
-  for( walk=ictx->discoveryCbs; walk; walk=walk->next )
-    if( walk->callback==callback )
+  epoch = _ickLibCbEnter( ictx );
+  cbs   = ictx->discoveryCbs;
+  for( i=0; cbs&&i<cbs->cnt; i++ ) {
+    perr = pthread_mutex_lock( &ictx->callbacksMutex );
+    if( perr )
+      logerr( "_ickLibExecDiscoveryInventory: cannot lock callback list mutex (%s)",
+              strerror(perr) );
+    live  = ictx->discoveryCbs;
+    isNew = 0;
+    for( j=0; live&&j<live->cnt; j++ ) {
+      if( live->entries[j].callback!=cbs->entries[i].callback )
+        continue;
+      isNew = live->entries[j].isNew;
+      live->entries[j].isNew = 0;
       break;
-  if( !walk ) {
-    logerr( "ickP2pRemoveDiscoveryCallback: callback is not registered." );
-    perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
+    }
+    perr = pthread_mutex_unlock( &ictx->callbacksMutex );
     if( perr )
-      logerr( "ickP2pRemoveDiscoveryCallback: cannot unlock callback list mutex (%s)",
+      logerr( "_ickLibExecDiscoveryInventory: cannot unlock callback list mutex (%s)",
               strerror(perr) );
-    return ICKERR_NOMEMBER;
+    if( !isNew )
+      continue;
+
+    // Send current device states
+    _ickLibDeviceListLock( ictx );
+    for( device=ictx->deviceList; device; device=device->next ) {
+      ((ickP2pDiscoveryCb_t)cbs->entries[i].callback)( ictx, device->uuid, ICKP2P_INVENTORY, device->services );
+      if( device->wsi || device->connectionState==ICKDEVICE_LOOPBACK )
+        ((ickP2pDiscoveryCb_t)cbs->entries[i].callback)( ictx, device->uuid, ICKP2P_CONNECTED, device->services );
+    }
+    _ickLibDeviceListUnlock( ictx );
   }
+  _ickLibCbLeave( ictx, epoch );
+}
 
-/*------------------------------------------------------------------------*\
-    Unlink and destruct
-\*------------------------------------------------------------------------*/
-  if( walk->next )
-    walk->next->prev = walk->prev;
-  if( walk->prev )
-    walk->prev->next = walk->next;
-  else
-    ictx->discoveryCbs = walk->next;
-  Sfree( walk );
+
+/*=========================================================================*\
+  Execute a discovery callback
+    dev may be NULL for context wide events (ICKP2P_DRAINED)
+\*=========================================================================*/
+void _ickLibExecDiscoveryCallback( ickP2pContext_t *ictx, const ickDevice_t *dev, ickP2pDeviceState_t change, ickP2pServicetype_t type )
+{
+  const struct _cblist *cbs;
+  long                  epoch;
+  int                   i;
+  debug( "_ickLibExecDiscoveryCallback (%p): \"%s\" change=%d (%s) services=%d",
+         ictx, dev?dev->uuid:"(all)", change, ickLibDeviceState2Str(change), type );
 
 /*------------------------------------------------------------------------*\
-    Unlock list, that's all
+   Execute all registered callbacks of current snapshot
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
-  if( perr )
-    logerr( "ickP2pRemoveDiscoveryCallback: cannot unlock callback list mutex (%s)",
-            strerror(perr) );
-  return ICKERR_SUCCESS;
+  epoch = _ickLibCbEnter( ictx );
+  cbs   = ictx->discoveryCbs;
+  for( i=0; cbs&&i<cbs->cnt; i++ )
+    ((ickP2pDiscoveryCb_t)cbs->entries[i].callback)( ictx, dev?dev->uuid:NULL, change, type );
+  _ickLibCbLeave( ictx, epoch );
 }
 
 
 /*=========================================================================*\
-  Add a messaging callback
+  Add a callback to a list
+    The new callback is put in front of a copy of the current snapshot,
+    which replaces the latter.
 \*=========================================================================*/
-ickErrcode_t ickP2pRegisterMessageCallback( ickP2pContext_t *ictx, ickP2pMessageCb_t callback )
+static ickErrcode_t _ickLibCbListAdd( ickP2pContext_t *ictx, struct _cblist *volatile *list, void *callback, int isNew )
 {
-  int             perr;
+  struct _cblist *old;
   struct _cblist *new;
-  debug( "ickP2pRegisterMessageCallback (%p): %p", ictx, callback );
+  int             cnt;
+  int             perr;
+  int             i;
 
 /*------------------------------------------------------------------------*\
-    Lock list of callbacks
+    Lock writers
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_lock( &ictx->messageCbsMutex );
+  perr = pthread_mutex_lock( &ictx->callbacksMutex );
   if( perr )
-    logerr( "ickP2pRegisterMessageCallback: cannot lock callback list mutex (%s)",
+    logerr( "_ickLibCbListAdd: cannot lock callback list mutex (%s)",
             strerror(perr) );
+  old = *list;
+  cnt = old ? old->cnt : 0;
 
 /*------------------------------------------------------------------------*\
     Avoid double subscriptions
 \*------------------------------------------------------------------------*/
-  for( new=ictx->messageCbs; new; new=new->next ) {
-    if( new->callback!=callback )
+  for( i=0; i<cnt; i++ ) {
+    if( old->entries[i].callback!=callback )
       continue;
-    logwarn( "ickP2pRegisterMessageCallback: callback already registered." );
-    perr = pthread_mutex_unlock( &ictx->messageCbsMutex );
+    logwarn( "_ickLibCbListAdd: callback already registered." );
+    perr = pthread_mutex_unlock( &ictx->callbacksMutex );
     if( perr )
-      logerr( "ickP2pRegisterMessageCallback: cannot unlock callback list mutex (%s)",
+      logerr( "_ickLibCbListAdd: cannot unlock callback list mutex (%s)",
               strerror(perr) );
     return ICKERR_SUCCESS;
   }
 
 /*------------------------------------------------------------------------*\
-    Allocate and init new list element
+    Allocate and init new snapshot
 \*------------------------------------------------------------------------*/
-  new = calloc( 1, sizeof(struct _cblist) );
+  new = calloc( 1, sizeof(struct _cblist)+(cnt+1)*sizeof(struct _cbentry) );
   if( !new ) {
-    logerr( "ickP2pRegisterMessageCallback: out of memory" );
-    perr = pthread_mutex_unlock( &ictx->messageCbsMutex );
+    logerr( "_ickLibCbListAdd: out of memory" );
+    perr = pthread_mutex_unlock( &ictx->callbacksMutex );
     if( perr )
-      logerr( "ickP2pRegisterMessageCallback: cannot unlock callback list mutex (%s)",
+      logerr( "_ickLibCbListAdd: cannot unlock callback list mutex (%s)",
               strerror(perr) );
     return ICKERR_NOMEM;
   }
-  new->callback = callback;
+  new->cnt                 = cnt + 1;
+  new->entries[0].callback = callback;
+  new->entries[0].isNew    = isNew;
+  if( cnt )
+    memcpy( new->entries+1, old->entries, cnt*sizeof(struct _cbentry) );
 
 /*------------------------------------------------------------------------*\
-    Add to linked list
+    Publish new snapshot and retire old one
 \*------------------------------------------------------------------------*/
-  new->next = ictx->messageCbs;
-  if( new->next )
-    new->next->prev = new;
-  ictx->messageCbs = new;
+  __sync_synchronize();
+  *list = new;
+  _ickLibCbRetire( ictx, old );
 
 /*------------------------------------------------------------------------*\
-    Unlock list, that's all
+    Unlock writers, that's all
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_unlock( &ictx->messageCbsMutex );
+  perr = pthread_mutex_unlock( &ictx->callbacksMutex );
   if( perr )
-    logerr( "ickP2pRegisterMessageCallback: cannot unlock callback list mutex (%s)",
+    logerr( "_ickLibCbListAdd: cannot unlock callback list mutex (%s)",
             strerror(perr) );
   return ICKERR_SUCCESS;
 }
 
 
 /*=========================================================================*\
-  Remove a messaging callback
+  Remove a callback from a list
+    The current snapshot is replaced by a copy without the callback.
 \*=========================================================================*/
-ickErrcode_t ickP2pRemoveMessageCallback( ickP2pContext_t *ictx, ickP2pMessageCb_t callback )
+static ickErrcode_t _ickLibCbListRemove( ickP2pContext_t *ictx, struct _cblist *volatile *list, void *callback )
 {
+  struct _cblist *old;
+  struct _cblist *new = NULL;
+  int             cnt;
   int             perr;
-  struct _cblist *walk;
-  debug( "ickP2pRemoveMessageCallback (%p): %p", ictx, callback );
+  int             i;
 
 /*------------------------------------------------------------------------*\
-    Lock list of callbacks
+    Lock writers
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_lock( &ictx->messageCbsMutex );
+  perr = pthread_mutex_lock( &ictx->callbacksMutex );
   if( perr )
-    logerr( "ickP2pRemoveMessageCallback: cannot lock callback list mutex (%s)",
+    logerr( "_ickLibCbListRemove: cannot lock callback list mutex (%s)",
             strerror(perr) );
+  old = *list;
+  cnt = old ? old->cnt : 0;
 
 /*------------------------------------------------------------------------*\
     Find entry, check if member
 \*------------------------------------------------------------------------*/
-  for( walk=ictx->messageCbs; walk; walk=walk->next )
-    if( walk->callback==callback )
+  for( i=0; i<cnt; i++ )
+    if( old->entries[i].callback==callback )
       break;
-  if( !walk ) {
-    logerr( "ickP2pRemoveMessageCallback: callback is not registered." );
-    perr = pthread_mutex_unlock( &ictx->messageCbsMutex );
+  if( i>=cnt ) {
+    logerr( "_ickLibCbListRemove: callback is not registered." );
+    perr = pthread_mutex_unlock( &ictx->callbacksMutex );
     if( perr )
-      logerr( "ickP2pRemoveMessageCallback: cannot unlock callback list mutex (%s)",
+      logerr( "_ickLibCbListRemove: cannot unlock callback list mutex (%s)",
               strerror(perr) );
     return ICKERR_NOMEMBER;
   }
 
 /*------------------------------------------------------------------------*\
-    Unlink and destruct
+    Create new snapshot without the entry (an empty list is NULL)
 \*------------------------------------------------------------------------*/
-  if( walk->next )
-    walk->next->prev = walk->prev;
-  if( walk->prev )
-    walk->prev->next = walk->next;
-  else
-    ictx->messageCbs = walk->next;
-  Sfree( walk );
+  if( cnt>1 ) {
+    new = calloc( 1, sizeof(struct _cblist)+(cnt-1)*sizeof(struct _cbentry) );
+    if( !new ) {
+      logerr( "_ickLibCbListRemove: out of memory" );
+      perr = pthread_mutex_unlock( &ictx->callbacksMutex );
+      if( perr )
+        logerr( "_ickLibCbListRemove: cannot unlock callback list mutex (%s)",
+                strerror(perr) );
+      return ICKERR_NOMEM;
+    }
+    new->cnt = cnt - 1;
+    memcpy( new->entries, old->entries, i*sizeof(struct _cbentry) );
+    memcpy( new->entries+i, old->entries+i+1, (cnt-i-1)*sizeof(struct _cbentry) );
+  }
+
+/*------------------------------------------------------------------------*\
+    Publish new snapshot and retire old one
+\*------------------------------------------------------------------------*/
+  __sync_synchronize();
+  *list = new;
+  _ickLibCbRetire( ictx, old );
 
 /*------------------------------------------------------------------------*\
-    Unlock list, that's all
+    Unlock writers, that's all
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_unlock( &ictx->messageCbsMutex );
+  perr = pthread_mutex_unlock( &ictx->callbacksMutex );
   if( perr )
-    logerr( "ickP2pRemoveMessageCallback: cannot unlock callback list mutex (%s)",
+    logerr( "_ickLibCbListRemove: cannot unlock callback list mutex (%s)",
             strerror(perr) );
   return ICKERR_SUCCESS;
 }
 
 
 /*=========================================================================*\
-  Execute a discovery callback
+  Retire a replaced snapshot (might be NULL), advance epoch and
+  free all retired snapshots no reader can see anymore
+    Caller must hold callbacksMutex
 \*=========================================================================*/
-void _ickLibExecDiscoveryCallback( ickP2pContext_t *ictx, const ickDevice_t *dev, ickP2pDeviceState_t change, ickP2pServicetype_t type )
+static void _ickLibCbRetire( ickP2pContext_t *ictx, struct _cblist *old )
 {
-  int             perr;
-  struct _cblist *walk;
-  debug( "_ickLibExecDiscoveryCallback (%p): \"%s\" change=%d (%s) services=%d",
-         ictx, dev->uuid, change, ickLibDeviceState2Str(change), type );
+  struct _cblist **walk;
+  struct _cblist  *cbs;
+  long             epoch;
+  int              i;
 
 /*------------------------------------------------------------------------*\
-   Lock list mutex and execute all registered callbacks
+    Queue snapshot, new readers will see the replacement
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_lock( &ictx->discoveryCbsMutex );
-  if( perr )
-    logerr( "_ickLibExecDiscoveryCallback: cannot lock callback list mutex (%s)",
-            strerror(perr) );
-  for( walk=ictx->discoveryCbs; walk; walk=walk->next )
-    ((ickP2pDiscoveryCb_t)walk->callback)( ictx, dev->uuid, change, type );
-  perr = pthread_mutex_unlock( &ictx->discoveryCbsMutex );
-  if( perr )
-    logerr( "_ickLibExecDiscoveryCallback: cannot unlock callback list mutex (%s)",
-            strerror(perr) );
+  __sync_synchronize();
+  epoch = ictx->cbEpoch;
+  if( old ) {
+    old->epoch     = epoch;
+    old->retired   = ictx->cbRetired;
+    ictx->cbRetired = old;
+  }
+
+/*------------------------------------------------------------------------*\
+    Try to advance the epoch (at most twice): this is possible if no
+    reader is left in the previous epoch, which has the same parity
+    as the next one.
+\*------------------------------------------------------------------------*/
+  for( i=0; i<2; i++ ) {
+    if( ictx->cbReaders[(epoch+1)&1] )
+      break;
+    epoch++;
+    ictx->cbEpoch = epoch;
+    __sync_synchronize();
+  }
+
+/*------------------------------------------------------------------------*\
+    Readers of epoch e might see snapshots retired in e, so these can be
+    freed if the epoch is at least e+2 (no readers of e or before left)
+\*------------------------------------------------------------------------*/
+  for( walk=&ictx->cbRetired; *walk; ) {
+    cbs = *walk;
+    if( cbs->epoch+2>epoch ) {
+      walk = &cbs->retired;
+      continue;
+    }
+    *walk = cbs->retired;
+    Sfree( cbs );
+  }
 }
 
 
@@ -829,6 +1085,7 @@ const char *ickLibDeviceState2Str( ickP2pDeviceState_t change )
     case ICKP2P_TERMINATE:    return "terminating";
     case ICKP2P_INVENTORY:    return "inventory";
     case ICKP2P_ERROR:        return "error";
+    case ICKP2P_DRAINED:      return "drained";
   }
 
   return "Invalid device state";
@@ -1227,6 +1484,110 @@ ickErrcode_t ickP2pUpnpLoopback( ickP2pContext_t *ictx, int enable )
 }
 
 
+/*=========================================================================*\
+    Attach context to a shared event loop (see ickP2pLoopCreate())
+      Needs to be done before the context is resumed for the first time.
+      loop==NULL reverts to a dedicated main thread for this context.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetLoop( ickP2pContext_t *ictx, ickP2pLoop_t *loop )
+{
+  debug( "ickP2pSetLoop (%p): %p", ictx, loop );
+
+/*------------------------------------------------------------------------*\
+    Check state
+\*------------------------------------------------------------------------*/
+  if( ictx->state!=ICKLIB_CREATED ) {
+    logwarn( "ickP2pSetLoop: wrong state (%d)", ictx->state );
+    return ICKERR_WRONGSTATE;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store loop in context
+\*------------------------------------------------------------------------*/
+  ictx->loop = loop;
+
+/*------------------------------------------------------------------------*\
+  That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+    Set number of reactor shards
+      Outbound web socket connections will be distributed (by device UUID)
+      among this number of threads, each of them doing the framing,
+      reassembly and message callbacks for its connections.
+      Needs to be done before the context is resumed for the first time.
+      shards==0 (default) services all connections by the main thread.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetReactorShards( ickP2pContext_t *ictx, int shards )
+{
+  debug( "ickP2pSetReactorShards (%p): %d", ictx, shards );
+
+/*------------------------------------------------------------------------*\
+    Check state and parameter
+\*------------------------------------------------------------------------*/
+  if( ictx->state!=ICKLIB_CREATED ) {
+    logwarn( "ickP2pSetReactorShards: wrong state (%d)", ictx->state );
+    return ICKERR_WRONGSTATE;
+  }
+  if( shards<0 || shards>ICKSHARD_MAX ) {
+    logwarn( "ickP2pSetReactorShards: invalid number of shards (%d)", shards );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store value in context
+\*------------------------------------------------------------------------*/
+  ictx->shardCnt = shards;
+
+/*------------------------------------------------------------------------*\
+  That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Set number of message dispatch workers
+    Messages are handed over to a pool of worker threads that execute
+    the message callbacks, so slow handlers do not block network
+    processing. Messages from one device are always handled by the same
+    worker in order of reception.
+    Stream callbacks are not dispatched (see ickP2pRegisterStreamCallback()),
+    so streamed messages might overtake dispatched ones of the same device.
+    0 (default) executes the callbacks synchronously in the receiving thread.
+    This is possible only before ickP2pResume() is called for the first time.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetDispatchWorkers( ickP2pContext_t *ictx, int workers )
+{
+  debug( "ickP2pSetDispatchWorkers (%p): %d", ictx, workers );
+
+/*------------------------------------------------------------------------*\
+    Check state and parameter
+\*------------------------------------------------------------------------*/
+  if( ictx->state!=ICKLIB_CREATED ) {
+    logwarn( "ickP2pSetDispatchWorkers: wrong state (%d)", ictx->state );
+    return ICKERR_WRONGSTATE;
+  }
+  if( workers<0 || workers>ICKDISPATCH_MAX ) {
+    logwarn( "ickP2pSetDispatchWorkers: invalid number of workers (%d)", workers );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store value in context
+\*------------------------------------------------------------------------*/
+  ictx->dispatcherCnt = workers;
+
+/*------------------------------------------------------------------------*\
+  That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
 /*=========================================================================*\
     Rename device
 \*=========================================================================*/
@@ -1301,6 +1662,24 @@ int ickP2pGetLwsPort( const ickP2pContext_t *ictx )
 }
 
 
+/*=========================================================================*\
+  Get number of reactor shards
+\*=========================================================================*/
+int ickP2pGetReactorShards( const ickP2pContext_t *ictx )
+{
+  return ictx->shardCnt;
+}
+
+
+/*=========================================================================*\
+  Get number of message dispatch workers
+\*=========================================================================*/
+int ickP2pGetDispatchWorkers( const ickP2pContext_t *ictx )
+{
+  return ictx->dispatcherCnt;
+}
+
+
 /*=========================================================================*\
   Get current boot ID
 \*=========================================================================*/
@@ -1476,6 +1855,32 @@ int ickP2pGetDeviceMessagesReceived( const ickP2pContext_t *ictx, const char *uu
 }
 
 
+/*=========================================================================*\
+  Get number of heartbeats sent to a device
+    returns -1 on error (uuid unknown)
+\*=========================================================================*/
+int ickP2pGetDeviceHeartbeatsSent( const ickP2pContext_t *ictx, const char *uuid )
+{
+  ickDevice_t *device = _ickLibDeviceFindByUuid( ictx, uuid );
+  if( !device )
+    return -1;
+  return device->nHeartbeats;
+}
+
+
+/*=========================================================================*\
+  Get number of heartbeats suppressed due to traffic on the link to a device
+    returns -1 on error (uuid unknown)
+\*=========================================================================*/
+int ickP2pGetDeviceHeartbeatsSuppressed( const ickP2pContext_t *ictx, const char *uuid )
+{
+  ickDevice_t *device = _ickLibDeviceFindByUuid( ictx, uuid );
+  if( !device )
+    return -1;
+  return device->nHeartbeatsSuppressed;
+}
+
+
 /*=========================================================================*\
   Get creation time of a device (time_t plus fractional seconds)
     returns -1.0 on error (uuid unknown)
@@ -1559,9 +1964,10 @@ void _ickLibDeviceAdd( ickP2pContext_t *ictx, ickDevice_t *device )
   ictx->deviceList = device;
 
 /*------------------------------------------------------------------------*\
-     Associate device with this context
+     Associate device with this context and reactor shard
 \*------------------------------------------------------------------------*/
-  device->ictx = ictx;
+  device->ictx  = ictx;
+  device->shard = _ickShardForUuid( ictx, device->uuid );
 
 /*------------------------------------------------------------------------*\
      That's all
@@ -52,6 +52,7 @@ Remarks         : -
 \*=========================================================================*/
 #include <stdio.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 /*=========================================================================*\
   Definition of constants
@@ -82,6 +83,7 @@ typedef enum {
   ICKERR_NOTCONNECTED,
   ICKERR_ISCONNECTED,
   ICKERR_LWSERR,
+  ICKERR_BUSY,
   ICKERR_MAX
 } ickErrcode_t;
 
@@ -103,9 +105,37 @@ typedef enum {
   ICKP2P_EXPIRED,
   ICKP2P_TERMINATE,
   ICKP2P_INVENTORY,
-  ICKP2P_ERROR
+  ICKP2P_ERROR,
+  ICKP2P_DRAINED          // output queue below low watermark, uuid is NULL for global watermarks
 } ickP2pDeviceState_t;
 
+// Priority of messages in the output queues
+typedef enum {
+  ICKP2P_PRIORITY_NORMAL = 0,
+  ICKP2P_PRIORITY_HIGH,
+  ICKP2P_PRIORITIES
+} ickP2pPriority_t;
+
+// Chunk position for streaming message callback (can be combined)
+typedef enum {
+  ICKP2P_STREAM_CONTINUE = 0,
+  ICKP2P_STREAM_BEGIN    = 0x01,
+  ICKP2P_STREAM_END      = 0x02,
+  ICKP2P_STREAM_ABORT    = 0x04    // connection lost, no more chunks
+} ickP2pStreamMode_t;
+
+// Handling of messages submitted to a busy output queue
+typedef enum {
+  ICKP2P_OVERFLOW_REJECT = 0,
+  ICKP2P_OVERFLOW_DROPOLDESTNOTIFICATION
+} ickP2pOverflowPolicy_t;
+
+// Delivery of messages addressed to ourselves (loopback device)
+typedef enum {
+  ICKP2P_LOOPBACK_QUEUED = 0,
+  ICKP2P_LOOPBACK_DIRECT
+} ickP2pLoopbackMode_t;
+
 // Service types
 typedef enum {
   ICKP2P_SERVICE_NONE              = -1,
@@ -138,6 +168,40 @@ typedef struct {
 struct _ickP2pContext;
 typedef struct _ickP2pContext ickP2pContext_t;
 
+struct _ickP2pLoop;
+typedef struct _ickP2pLoop ickP2pLoop_t;
+
+
+// An entry for ickP2pSendBatch()
+typedef struct {
+  const char          *uuid;            // NULL: notification
+  ickP2pServicetype_t  targetServices;
+  ickP2pServicetype_t  sourceService;
+  const char          *payload;
+  size_t               pSize;           // 0: payload is a 0-terminated string
+  ickErrcode_t         result;          // set by ickP2pSendBatch()
+} ickP2pBatchEntry_t;
+
+// Output queue watermarks, 0 disables a limit
+typedef struct {
+  size_t               highBytes;       // queue gets busy at or above this
+  size_t               lowBytes;        // ... and drains at or below this
+  int                  highMsgs;
+  int                  lowMsgs;
+} ickP2pWatermarks_t;
+
+// Message dispatcher statistics (see ickP2pSetDispatchWorkers()), times in seconds
+typedef struct {
+  int                  workers;         // 0: messages are dispatched synchronously
+  int                  queued;          // current queue depth (all workers)
+  int                  highWater;       // max. queue depth of a single worker
+  long                 dispatched;
+  double               waitAvg;         // queued until handlers were called
+  double               waitMax;
+  double               latencyAvg;      // time spent in message handlers
+  double               latencyMax;
+} ickP2pDispatchStats_t;
+
 
 /*------------------------------------------------------------------------*\
   Macros
@@ -151,7 +215,9 @@ typedef struct _ickP2pContext ickP2pContext_t;
 typedef void  (*ickP2pEndCb_t)( ickP2pContext_t *ictx );
 typedef void  (*ickP2pDiscoveryCb_t)( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t change, ickP2pServicetype_t type );
 typedef void  (*ickP2pMessageCb_t)( ickP2pContext_t *ictx, const char *sourceUuid, ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices, const char *message, size_t mSize, ickP2pMessageFlag_t mFlags );
+typedef void  (*ickP2pStreamCb_t)( ickP2pContext_t *ictx, const char *sourceUuid, ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices, ickP2pMessageFlag_t mFlags, const char *chunk, size_t cSize, size_t offset, int mode );
 typedef int   (*ickP2pConnectMatrixCb_t)( ickP2pContext_t *ictx, ickP2pServicetype_t localServices, ickP2pServicetype_t remoteServices );
+typedef void  (*ickP2pMsgBufferReleaseCb_t)( ickP2pContext_t *ictx, void *payload, void *userData );
 typedef void  (*ickP2pLogFacility_t)( const char *file, int line, int prio, const char * format, ... );
 
 
@@ -183,15 +249,38 @@ ickErrcode_t         ickP2pResume( ickP2pContext_t *ictx );
 ickErrcode_t         ickP2pSuspend( ickP2pContext_t *ictx );
 ickErrcode_t         ickP2pEnd( ickP2pContext_t *ictx, ickP2pEndCb_t callback );
 
+// Shared event loops (optional, by default every context has its own thread)
+ickP2pLoop_t        *ickP2pLoopCreate( ickErrcode_t *error );
+ickErrcode_t         ickP2pLoopDestroy( ickP2pLoop_t *loop );
+ickErrcode_t         ickP2pSetLoop( ickP2pContext_t *ictx, ickP2pLoop_t *loop );
+
+// Reactor shards (optional, by default all connections are serviced by the main thread)
+ickErrcode_t         ickP2pSetReactorShards( ickP2pContext_t *ictx, int shards );
+
+// Message dispatch workers (optional, by default message callbacks are executed by the receiving thread)
+// Stream callbacks are always executed by the receiving thread, so with dispatch workers streamed and
+// reassembled messages of a device are not necessarily delivered in order of reception.
+ickErrcode_t         ickP2pSetDispatchWorkers( ickP2pContext_t *ictx, int workers );
+
 // Context configuration
 ickErrcode_t         ickP2pAddInterface( ickP2pContext_t *ictx, const char *ifname, const char *hostname );
 ickErrcode_t         ickP2pDeleteInterface( ickP2pContext_t *ictx, const char *ifname, int proactive );
 ickErrcode_t         ickP2pUpnpLoopback( ickP2pContext_t *ictx, int enable );
 ickErrcode_t         ickP2pSetConnectMatrix( ickP2pContext_t *ictx, ickP2pConnectMatrixCb_t matrixCb );
+ickErrcode_t         ickP2pSetFragmentSize( ickP2pContext_t *ictx, size_t size );
+ickErrcode_t         ickP2pSetWatermarks( ickP2pContext_t *ictx, const char *uuid, const ickP2pWatermarks_t *marks );
+ickErrcode_t         ickP2pSetGlobalWatermarks( ickP2pContext_t *ictx, const ickP2pWatermarks_t *marks );
+ickErrcode_t         ickP2pSetOverflowPolicy( ickP2pContext_t *ictx, ickP2pOverflowPolicy_t policy );
+ickErrcode_t         ickP2pSetPriorityWeight( ickP2pContext_t *ictx, int weight );
+ickErrcode_t         ickP2pSetStreamThreshold( ickP2pContext_t *ictx, size_t threshold );
+ickErrcode_t         ickP2pSetSubmissionRing( ickP2pContext_t *ictx, int size );
+ickErrcode_t         ickP2pSetLoopbackMode( ickP2pContext_t *ictx, ickP2pLoopbackMode_t mode );
 ickErrcode_t         ickP2pRegisterDiscoveryCallback( ickP2pContext_t *ictx, ickP2pDiscoveryCb_t callback );
 ickErrcode_t         ickP2pRemoveDiscoveryCallback( ickP2pContext_t *ictx, ickP2pDiscoveryCb_t callback );
 ickErrcode_t         ickP2pRegisterMessageCallback( ickP2pContext_t *ictx, ickP2pMessageCb_t callback );
 ickErrcode_t         ickP2pRemoveMessageCallback( ickP2pContext_t *ictx,ickP2pMessageCb_t callback );
+ickErrcode_t         ickP2pRegisterStreamCallback( ickP2pContext_t *ictx, ickP2pStreamCb_t callback );
+ickErrcode_t         ickP2pRemoveStreamCallback( ickP2pContext_t *ictx, ickP2pStreamCb_t callback );
 
 
 // Get context features
@@ -203,6 +292,12 @@ const char          *ickP2pGetDeviceUuid( const ickP2pContext_t *ictx );
 const char          *ickP2pGetUpnpFolder( const ickP2pContext_t *ictx );
 int                  ickP2pGetLifetime( const ickP2pContext_t *ictx );
 int                  ickP2pGetLwsPort( const ickP2pContext_t *ictx );
+size_t               ickP2pGetFragmentSize( const ickP2pContext_t *ictx );
+int                  ickP2pGetReactorShards( const ickP2pContext_t *ictx );
+int                  ickP2pGetDispatchWorkers( const ickP2pContext_t *ictx );
+int                  ickP2pGetSubmissionRing( const ickP2pContext_t *ictx );
+ickP2pLoopbackMode_t ickP2pGetLoopbackMode( const ickP2pContext_t *ictx );
+ickErrcode_t         ickP2pGetDispatchStats( ickP2pContext_t *ictx, ickP2pDispatchStats_t *stats );
 int                  ickP2pGetUpnpPort( const ickP2pContext_t *ictx );
 int                  ickP2pGetUpnpLoopback( const ickP2pContext_t *ictx );
 long                 ickP2pGetBootId( const ickP2pContext_t *ictx );
@@ -219,12 +314,27 @@ int                  ickP2pGetDeviceConnect( const ickP2pContext_t *ictx, const
 int                  ickP2pGetDeviceMessagesPending( const ickP2pContext_t *ictx, const char *uuid );
 int                  ickP2pGetDeviceMessagesSent( const ickP2pContext_t *ictx, const char *uuid );
 int                  ickP2pGetDeviceMessagesReceived( const ickP2pContext_t *ictx, const char *uuid );
+int                  ickP2pGetDeviceHeartbeatsSent( const ickP2pContext_t *ictx, const char *uuid );
+int                  ickP2pGetDeviceHeartbeatsSuppressed( const ickP2pContext_t *ictx, const char *uuid );
 double               ickP2pGetDeviceTimeCreated( const ickP2pContext_t *ictx, const char *uuid );
 double               ickP2pGetDeviceTimeConnected( const ickP2pContext_t *ictx, const char *uuid );
 
 // Messaging
 ickErrcode_t         ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid, ickP2pServicetype_t targetServices,
                                     ickP2pServicetype_t sourceService, const char *payload, size_t pSize );
+ickErrcode_t         ickP2pSendPriorityMsg( ickP2pContext_t *ictx, const char *uuid, ickP2pServicetype_t targetServices,
+                                            ickP2pServicetype_t sourceService, const char *payload, size_t pSize,
+                                            ickP2pPriority_t priority );
+ickErrcode_t         ickP2pSendBatch( ickP2pContext_t *ictx, ickP2pBatchEntry_t *entries, int count );
+ickErrcode_t         ickP2pSendMsgV( ickP2pContext_t *ictx, const char *uuid, ickP2pServicetype_t targetServices,
+                                     ickP2pServicetype_t sourceService, const struct iovec *iov, int iovcnt );
+
+// Zero-copy messaging
+void                *ickP2pAllocMsgBuffer( ickP2pContext_t *ictx, size_t size );
+ickErrcode_t         ickP2pFreeMsgBuffer( ickP2pContext_t *ictx, void *payload );
+ickErrcode_t         ickP2pSendMsgBuffer( ickP2pContext_t *ictx, const char *uuid, ickP2pServicetype_t targetServices,
+                                          ickP2pServicetype_t sourceService, void *payload, size_t pSize,
+                                          ickP2pMsgBufferReleaseCb_t releaseCb, void *userData );
 
 // Debugging API - needs to be build in at compile time
 ickErrcode_t         ickP2pSetHttpDebugging( ickP2pContext_t *ictx, int enable );
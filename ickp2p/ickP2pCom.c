@@ -50,6 +50,9 @@ Remarks         : refactored from ickP2PComm.c
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <libwebsockets.h>
 
 #include "ickP2p.h"
@@ -60,6 +63,8 @@ Remarks         : refactored from ickP2PComm.c
 #include "ickDevice.h"
 #include "ickSSDP.h"
 #include "ickP2pCom.h"
+#include "ickPool.h"
+#include "ickDispatch.h"
 
 
 /*=========================================================================*\
@@ -77,7 +82,43 @@ Remarks         : refactored from ickP2PComm.c
 /*=========================================================================*\
   Private prototypes
 \*=========================================================================*/
-static int   _ickP2pComTransmit( struct libwebsocket *wsi, ickMessage_t *message );
+static ickErrcode_t    _ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
+                                       ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                       const struct iovec *iov, int iovcnt, size_t mSize,
+                                       ickP2pMessageFlag_t mFlags, ickMsgBuffer_t *buffer,
+                                       ickP2pPriority_t priority );
+static ickErrcode_t    _ickP2pQueueMsg( ickP2pContext_t *ictx, const char *uuid,
+                                        ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                        const struct iovec *iov, int iovcnt, size_t mSize,
+                                        ickP2pMessageFlag_t mFlags, ickMsgBuffer_t *buffer,
+                                        ickP2pPriority_t priority );
+static ickErrcode_t    _ickP2pSubmitMsg( ickP2pContext_t *ictx, const char *uuid,
+                                         ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                         const struct iovec *iov, int iovcnt, size_t mSize,
+                                         ickP2pMessageFlag_t mFlags, ickMsgBuffer_t *buffer,
+                                         ickP2pPriority_t priority );
+static ickErrcode_t    _ickP2pSendLoopback( ickP2pContext_t *ictx, const char *uuid,
+                                            ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                            const struct iovec *iov, int iovcnt, size_t mSize,
+                                            ickP2pMessageFlag_t mFlags );
+static void            _ickP2pGather( void *dest, const struct iovec *iov, int iovcnt );
+static char           *_ickP2pWritePreamble( char *ptr, ickP2pLevel_t p2pLevel,
+                                             ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                             ickP2pMessageFlag_t mFlags );
+static size_t          _ickMsgBufferOffset( void );
+static ickMsgBuffer_t *_ickMsgBufferAlloc( ickP2pContext_t *ictx, size_t size );
+static ickMsgBuffer_t *_ickMsgBufferFromPayload( void *payload );
+static int   _ickP2pComTransmit( struct libwebsocket *wsi, ickDevice_t *device, ickMessage_t *message, size_t fragSize );
+static size_t _ickP2pComFragmentSize( ickP2pContext_t *ictx, struct libwebsocket *wsi );
+static int   _ickP2pComChoked( struct libwebsocket *wsi );
+static ickErrcode_t _ickP2pComCheckWatermarks( const ickP2pWatermarks_t *marks );
+static void  _ickP2pComSignalDrained( ickP2pContext_t *ictx, ickDevice_t *device, int drained );
+static size_t _ickP2pReadPreamble( const unsigned char *ptr, size_t size, ickP2pServicetype_t *targetServices,
+                                   ickP2pServicetype_t *sourceService, ickP2pMessageFlag_t *mFlags );
+static int   _ickP2pComStreamBegin( ickP2pContext_t *ictx, ickDevice_t *device, _ickLwsP2pData_t *psd,
+                                    const unsigned char *in, size_t len );
+static void  _ickP2pExecStreamCallback( ickP2pContext_t *ictx, const ickDevice_t *device, _ickLwsP2pData_t *psd,
+                                        const void *chunk, size_t cSize, int mode );
 static char *_ickLwsDupToken( struct libwebsocket *wsi, enum lws_token_indexes h );
 #ifdef ICK_DEBUG
 static void  _ickLwsDumpHeaders( struct libwebsocket *wsi );
@@ -99,61 +140,872 @@ static void  _ickLwsDumpHeaders( struct libwebsocket *wsi );
 ickErrcode_t ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
                             ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
                             const char *message, size_t mSize )
+{
+  return ickP2pSendPriorityMsg( ictx, uuid, targetServices, sourceService,
+                                message, mSize, ICKP2P_PRIORITY_NORMAL );
+}
+
+
+/*=========================================================================*\
+  Send an ickstream message with a priority
+    ictx           - ickstream context
+    uuid           - uuid of target, if NULL all known ickstream devices are
+                     addressed
+    targetServices - services at target to address
+    sourceService  - sending service
+    message        - the message
+    mSize          - size of message, if 0 the message is interpreted
+                     as a 0-terminated string
+    priority       - ICKP2P_PRIORITY_HIGH messages are queued in a separate
+                     lane and transmitted before pending normal messages
+                     (see ickP2pSetPriorityWeight()), a message already in
+                     transmission is always completed first
+\*=========================================================================*/
+ickErrcode_t ickP2pSendPriorityMsg( ickP2pContext_t *ictx, const char *uuid,
+                                    ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                    const char *message, size_t mSize, ickP2pPriority_t priority )
 {
   ickP2pMessageFlag_t mFlags = ICKP2P_MESSAGEFLAG_NONE;
-  ickErrcode_t        irc    = ICKERR_SUCCESS;
-  ickDevice_t        *device;
+  struct iovec        iov;
+
+/*------------------------------------------------------------------------*\
+    Check priority
+\*------------------------------------------------------------------------*/
+  if( priority<0 || priority>=ICKP2P_PRIORITIES ) {
+    logwarn( "ickP2pSendPriorityMsg: invalid priority %d", priority );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Determine size if payload is a string
+\*------------------------------------------------------------------------*/
+  if( !mSize ) {
+    mFlags |= ICKP2P_MESSAGEFLAG_STRING;
+    mSize   = strlen( message ) + 1;
+  }
+
+  debug( "ickP2pSendMsg: target=\"%s\" targetServices=0x%02x sourceServices=0x%02x size=%ld priority=%d",
+         uuid?uuid:"<Notification>", targetServices, sourceService, (long)mSize, priority );
+
+/*------------------------------------------------------------------------*\
+    Queue copies of the message
+\*------------------------------------------------------------------------*/
+  iov.iov_base = (void *)message;
+  iov.iov_len  = mSize;
+  return _ickP2pSendMsg( ictx, uuid, targetServices, sourceService,
+                         &iov, 1, mSize, mFlags, NULL, priority );
+}
+
+
+/*=========================================================================*\
+  Send an ickstream message assembled from several segments
+    ictx           - ickstream context
+    uuid           - uuid of target, if NULL all known ickstream devices are
+                     addressed
+    targetServices - services at target to address
+    sourceService  - sending service
+    iov            - the message segments
+    iovcnt         - number of segments
+    The segments are gathered directly into the (shared) transmission
+    container, so the caller does not need to concatenate them. They can
+    be reused as soon as this function returns.
+\*=========================================================================*/
+ickErrcode_t ickP2pSendMsgV( ickP2pContext_t *ictx, const char *uuid,
+                             ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                             const struct iovec *iov, int iovcnt )
+{
+  size_t mSize;
+  int    i;
+
+/*------------------------------------------------------------------------*\
+    Determine message size
+\*------------------------------------------------------------------------*/
+  if( !iov || iovcnt<=0 ) {
+    logerr( "ickP2pSendMsgV: no segments" );
+    return ICKERR_INVALID;
+  }
+  for( mSize=0,i=0; i<iovcnt; i++ )
+    mSize += iov[i].iov_len;
+  if( !mSize ) {
+    logerr( "ickP2pSendMsgV: empty message" );
+    return ICKERR_INVALID;
+  }
+
+  debug( "ickP2pSendMsgV: target=\"%s\" targetServices=0x%02x sourceServices=0x%02x segments=%d size=%ld",
+         uuid?uuid:"<Notification>", targetServices, sourceService, iovcnt, (long)mSize );
+
+/*------------------------------------------------------------------------*\
+    Queue message
+\*------------------------------------------------------------------------*/
+  return _ickP2pSendMsg( ictx, uuid, targetServices, sourceService,
+                         iov, iovcnt, mSize, ICKP2P_MESSAGEFLAG_NONE, NULL, ICKP2P_PRIORITY_NORMAL );
+}
+
+
+/*=========================================================================*\
+  Send a batch of ickstream messages
+    ictx           - ickstream context
+    entries        - the messages, result is set for every entry
+    count          - number of entries
+    The device list is locked once for all entries and the main thread is
+    woken up once. Entries are processed in order, failing entries don't
+    stop the batch. With ICKP2P_LOOPBACK_DIRECT messages to ourselves are
+    delivered after the device list was unlocked.
+  returns ICKERR_SUCCESS or the error of the first failing entry
+\*=========================================================================*/
+ickErrcode_t ickP2pSendBatch( ickP2pContext_t *ictx, ickP2pBatchEntry_t *entries, int count )
+{
+  ickErrcode_t irc = ICKERR_SUCCESS;
+  int          queued = 0;
+  int          loopback = 0;
+  int          i;
+
+  debug( "ickP2pSendBatch (%p): %d entries", ictx, count );
+
+/*------------------------------------------------------------------------*\
+    Lock device list once (not needed for submissions via ring)
+\*------------------------------------------------------------------------*/
+  if( !ictx->submissions )
+    _ickLibDeviceListLock( ictx );
+
+/*------------------------------------------------------------------------*\
+    Queue all entries
+\*------------------------------------------------------------------------*/
+  for( i=0; i<count; i++ ) {
+    ickP2pBatchEntry_t  *entry  = entries + i;
+    ickP2pMessageFlag_t  mFlags = ICKP2P_MESSAGEFLAG_NONE;
+    size_t               mSize  = entry->pSize;
+    struct iovec         iov;
+
+    // Determine size if payload is a string
+    if( !mSize ) {
+      mFlags |= ICKP2P_MESSAGEFLAG_STRING;
+      mSize   = strlen( entry->payload ) + 1;
+    }
+
+    // Messages to ourselves only are delivered later
+    entry->result = ICKERR_SUCCESS;
+    if( ictx->loopbackMode==ICKP2P_LOOPBACK_DIRECT &&
+        (!entry->uuid || !strcmp(entry->uuid,ictx->deviceUuid)) ) {
+      loopback++;
+      if( entry->uuid )
+        continue;
+    }
+
+    // Queue or submit message
+    iov.iov_base  = (void *)entry->payload;
+    iov.iov_len   = mSize;
+    if( ictx->submissions )
+      entry->result = _ickP2pSubmitMsg( ictx, entry->uuid, entry->targetServices, entry->sourceService,
+                                        &iov, 1, mSize, mFlags, NULL, ICKP2P_PRIORITY_NORMAL );
+    else
+      entry->result = _ickP2pQueueMsg( ictx, entry->uuid, entry->targetServices, entry->sourceService,
+                                       &iov, 1, mSize, mFlags, NULL, ICKP2P_PRIORITY_NORMAL );
+    if( !entry->result )
+      queued++;
+  }
+
+/*------------------------------------------------------------------------*\
+    Unlock device list and break polling in main thread once
+\*------------------------------------------------------------------------*/
+  if( !ictx->submissions ) {
+    _ickLibDeviceListUnlock( ictx );
+    if( queued )
+      _ickMainThreadBreak( ictx, 'm' );
+  }
+
+/*------------------------------------------------------------------------*\
+    Deliver messages to ourselves without holding any locks, keep the
+    first error of notifications (rejected submissions are not delivered)
+\*------------------------------------------------------------------------*/
+  for( i=0; loopback && i<count; i++ ) {
+    ickP2pBatchEntry_t  *entry  = entries + i;
+    ickP2pMessageFlag_t  mFlags = ICKP2P_MESSAGEFLAG_NONE;
+    size_t               mSize  = entry->pSize;
+    ickErrcode_t         lrc;
+    struct iovec         iov;
+
+    if( entry->uuid && strcmp(entry->uuid,ictx->deviceUuid) )
+      continue;
+    loopback--;
+    if( !entry->uuid && ictx->submissions && entry->result )
+      continue;
+    if( !mSize ) {
+      mFlags |= ICKP2P_MESSAGEFLAG_STRING;
+      mSize   = strlen( entry->payload ) + 1;
+    }
+    iov.iov_base = (void *)entry->payload;
+    iov.iov_len  = mSize;
+    lrc = _ickP2pSendLoopback( ictx, entry->uuid, entry->targetServices, entry->sourceService,
+                               &iov, 1, mSize, mFlags );
+    if( !entry->result )
+      entry->result = lrc;
+  }
+
+/*------------------------------------------------------------------------*\
+    Get error of first failing entry, that's all
+\*------------------------------------------------------------------------*/
+  for( i=0; !irc && i<count; i++ )
+    irc = entries[i].result;
+  return irc;
+}
+
+
+/*=========================================================================*\
+  Allocate a buffer for zero-copy messaging
+    ictx           - ickstream context
+    size           - capacity of the payload area
+    The returned pointer addresses the payload area. LWS padding and
+    preamble headroom are reserved in front of and after it.
+    The buffer is either handed over by ickP2pSendMsgBuffer() or
+    freed by ickP2pFreeMsgBuffer().
+  returns NULL on error
+\*=========================================================================*/
+void *ickP2pAllocMsgBuffer( ickP2pContext_t *ictx, size_t size )
+{
+  ickMsgBuffer_t *buffer;
+
+  debug( "ickP2pAllocMsgBuffer (%p): size=%ld", ictx, (long)size );
+
+/*------------------------------------------------------------------------*\
+    Allocate buffer, that's all
+\*------------------------------------------------------------------------*/
+  buffer = _ickMsgBufferAlloc( ictx, size );
+  if( !buffer )
+    return NULL;
+  return buffer->payload;
+}
+
+
+/*=========================================================================*\
+  Free a zero-copy buffer that was not (or is no longer) owned by the library
+    ictx           - ickstream context
+    payload        - payload area as returned by ickP2pAllocMsgBuffer()
+\*=========================================================================*/
+ickErrcode_t ickP2pFreeMsgBuffer( ickP2pContext_t *ictx, void *payload )
+{
+  ickMsgBuffer_t *buffer;
+  debug( "ickP2pFreeMsgBuffer (%p): %p", ictx, payload );
+
+/*------------------------------------------------------------------------*\
+    Get and check header
+\*------------------------------------------------------------------------*/
+  buffer = _ickMsgBufferFromPayload( payload );
+  if( !buffer || buffer->ictx!=ictx ) {
+    logerr( "ickP2pFreeMsgBuffer (%p): not a message buffer (%p)", ictx, payload );
+    return ICKERR_INVALID;
+  }
+  if( buffer->refCnt ) {
+    logerr( "ickP2pFreeMsgBuffer (%p): buffer %p still in use", ictx, payload );
+    return ICKERR_WRONGSTATE;
+  }
+
+/*------------------------------------------------------------------------*\
+    Free, that's all
+\*------------------------------------------------------------------------*/
+  Sfree( buffer );
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Send an ickstream message without copying the payload
+    ictx           - ickstream context
+    uuid           - uuid of target, if NULL all known ickstream devices are
+                     addressed
+    targetServices - services at target to address
+    sourceService  - sending service
+    payload        - payload area as returned by ickP2pAllocMsgBuffer()
+    pSize          - size of message, if 0 the message is interpreted
+                     as a 0-terminated string
+    releaseCb      - called once the last fragment of the last queued message
+                     was written (or the messages were discarded), might be
+                     executed before this function returns. If NULL the
+                     buffer is freed by the library.
+    userData       - passed to releaseCb
+    Unless the buffer itself is rejected, ownership is transferred to the
+    library, also on error.
+    The payload must not be modified until the release callback was
+    executed, its content is undefined afterwards (websocket client
+    connections mask payloads in place). The preamble is written to the
+    buffer's headroom; devices requiring a different preamble receive a
+    copy of the payload.
+\*=========================================================================*/
+ickErrcode_t ickP2pSendMsgBuffer( ickP2pContext_t *ictx, const char *uuid,
+                                  ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                  void *payload, size_t pSize,
+                                  ickP2pMsgBufferReleaseCb_t releaseCb, void *userData )
+{
+  ickP2pMessageFlag_t  mFlags = ICKP2P_MESSAGEFLAG_NONE;
+  ickMsgBuffer_t      *buffer;
+  ickErrcode_t         irc;
+  struct iovec         iov;
+
+/*------------------------------------------------------------------------*\
+    Get and check header
+\*------------------------------------------------------------------------*/
+  buffer = _ickMsgBufferFromPayload( payload );
+  if( !buffer || buffer->ictx!=ictx || buffer->refCnt ) {
+    logerr( "ickP2pSendMsgBuffer (%p): not an unused message buffer (%p)", ictx, payload );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Determine size if payload is a string
+\*------------------------------------------------------------------------*/
+  if( !pSize ) {
+    mFlags |= ICKP2P_MESSAGEFLAG_STRING;
+    pSize   = strnlen( payload, buffer->size );
+    if( pSize<buffer->size )
+      pSize++;
+  }
+
+  debug( "ickP2pSendMsgBuffer: target=\"%s\" targetServices=0x%02x sourceServices=0x%02x size=%ld",
+         uuid?uuid:"<Notification>", targetServices, sourceService, (long)pSize );
+
+/*------------------------------------------------------------------------*\
+    Take over buffer, the senders reference is dropped at the end
+\*------------------------------------------------------------------------*/
+  buffer->releaseCb   = releaseCb;
+  buffer->userData    = userData;
+  buffer->preambleLen = 0;
+  buffer->shared      = 0;
+  buffer->refCnt      = 1;
+
+/*------------------------------------------------------------------------*\
+    Payload must fit
+\*------------------------------------------------------------------------*/
+  if( pSize>buffer->size ) {
+    logerr( "ickP2pSendMsgBuffer: payload size exceeds buffer (%ld>%ld bytes)",
+            (long)pSize, (long)buffer->size );
+    irc = ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Queue message(s)
+\*------------------------------------------------------------------------*/
+  else {
+    iov.iov_base = payload;
+    iov.iov_len  = pSize;
+    irc = _ickP2pSendMsg( ictx, uuid, targetServices, sourceService,
+                          &iov, 1, pSize, mFlags, buffer, ICKP2P_PRIORITY_NORMAL );
+  }
+
+/*------------------------------------------------------------------------*\
+    Drop senders reference, that's all
+\*------------------------------------------------------------------------*/
+  _ickMsgBufferRelease( buffer );
+  return irc;
+}
+
+
+/*=========================================================================*\
+  Set size of websocket fragments for transmissions
+    ictx           - ickstream context
+    size           - fragment size in bytes, 0 (default) adapts the size to
+                     the free space in the socket send buffer
+    This can be changed at any time and affects the next write.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetFragmentSize( ickP2pContext_t *ictx, size_t size )
+{
+  debug( "ickP2pSetFragmentSize (%p): %ld", ictx, (long)size );
+
+/*------------------------------------------------------------------------*\
+    Check range
+\*------------------------------------------------------------------------*/
+  if( size && (size<ICKP2P_MINFRAGMENTSIZE||size>ICKP2P_MAXFRAGMENTSIZE) ) {
+    logwarn( "ickP2pSetFragmentSize: size out of range (%ld not in %d..%d)",
+             (long)size, ICKP2P_MINFRAGMENTSIZE, ICKP2P_MAXFRAGMENTSIZE );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store, that's all
+\*------------------------------------------------------------------------*/
+  ictx->lwsFragmentSize = size;
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Get configured size of websocket fragments, 0 if adaptive
+\*=========================================================================*/
+size_t ickP2pGetFragmentSize( const ickP2pContext_t *ictx )
+{
+  return ictx->lwsFragmentSize;
+}
+
+
+/*=========================================================================*\
+  Set watermarks for output queues of devices
+    ictx           - ickstream context
+    uuid           - device to configure, if NULL the default for all
+                     devices without individual watermarks is set
+    marks          - the watermarks, NULL resets a device to the default
+                     or disables the default
+    Once a queue reached a high watermark, ickP2pSendMsg() and friends
+    return ICKERR_BUSY (or apply the overflow policy) until the queue
+    drained to the low watermarks, which is signaled by ICKP2P_DRAINED.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetWatermarks( ickP2pContext_t *ictx, const char *uuid, const ickP2pWatermarks_t *marks )
+{
+  ickDevice_t  *device;
+  ickErrcode_t  irc;
+  int           drained;
+  debug( "ickP2pSetWatermarks (%p): uuid=%s", ictx, uuid?uuid:"(default)" );
+
+/*------------------------------------------------------------------------*\
+    Check consistency
+\*------------------------------------------------------------------------*/
+  if( marks && (irc=_ickP2pComCheckWatermarks(marks)) )
+    return irc;
+
+/*------------------------------------------------------------------------*\
+    Set default for all devices
+\*------------------------------------------------------------------------*/
+  if( !uuid ) {
+    if( marks )
+      ictx->deviceWatermarks = *marks;
+    else
+      memset( &ictx->deviceWatermarks, 0, sizeof(ickP2pWatermarks_t) );
+    return ICKERR_SUCCESS;
+  }
+
+/*------------------------------------------------------------------------*\
+    Find device
+\*------------------------------------------------------------------------*/
+  _ickLibDeviceListLock( ictx );
+  device = _ickLibDeviceFindByUuid( ictx, uuid );
+  if( !device ) {
+    _ickLibDeviceListUnlock( ictx );
+    return ICKERR_NODEVICE;
+  }
+
+/*------------------------------------------------------------------------*\
+    Set individual watermarks, queue might be drained with respect to them
+\*------------------------------------------------------------------------*/
+  _ickDeviceLock( device );
+  if( marks )
+    device->watermarks = *marks;
+  device->ownWatermarks = marks!=NULL;
+  drained = _ickDeviceCheckDrained( device );
+  _ickDeviceUnlock( device );
+  _ickP2pComSignalDrained( ictx, device, drained );
+  _ickLibDeviceListUnlock( ictx );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Set watermarks for the sum of all output queues
+    ictx           - ickstream context
+    marks          - the watermarks, NULL disables global limits
+    Draining to the global low watermarks is signaled by ICKP2P_DRAINED
+    with a NULL uuid to the discovery callbacks.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetGlobalWatermarks( ickP2pContext_t *ictx, const ickP2pWatermarks_t *marks )
+{
+  ickErrcode_t irc;
+  debug( "ickP2pSetGlobalWatermarks (%p): %s", ictx, marks?"set":"disable" );
+
+/*------------------------------------------------------------------------*\
+    Check consistency
+\*------------------------------------------------------------------------*/
+  if( marks && (irc=_ickP2pComCheckWatermarks(marks)) )
+    return irc;
+
+/*------------------------------------------------------------------------*\
+    Store, a busy state is reevaluated by the next submission or transmission
+\*------------------------------------------------------------------------*/
+  if( marks )
+    ictx->globalWatermarks = *marks;
+  else
+    memset( &ictx->globalWatermarks, 0, sizeof(ickP2pWatermarks_t) );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Set policy for messages submitted to busy output queues
+    ictx           - ickstream context
+    policy         - ICKP2P_OVERFLOW_REJECT (default): return ICKERR_BUSY
+                     ICKP2P_OVERFLOW_DROPOLDESTNOTIFICATION: replace the
+                     oldest pending notification of the device by the new
+                     message, reject if there is none
+\*=========================================================================*/
+ickErrcode_t ickP2pSetOverflowPolicy( ickP2pContext_t *ictx, ickP2pOverflowPolicy_t policy )
+{
+  debug( "ickP2pSetOverflowPolicy (%p): %d", ictx, policy );
+
+/*------------------------------------------------------------------------*\
+    Check range
+\*------------------------------------------------------------------------*/
+  if( policy!=ICKP2P_OVERFLOW_REJECT && policy!=ICKP2P_OVERFLOW_DROPOLDESTNOTIFICATION ) {
+    logwarn( "ickP2pSetOverflowPolicy: invalid policy %d", policy );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store, that's all
+\*------------------------------------------------------------------------*/
+  ictx->overflowPolicy = policy;
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Set threshold for streaming of received messages
+    ictx           - ickstream context
+    threshold      - fragmented messages are reassembled up to this size,
+                     larger ones are passed in chunks to the stream
+                     callbacks (if any are registered)
+    Messages queued for devices connecting as server are always
+    reassembled.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetStreamThreshold( ickP2pContext_t *ictx, size_t threshold )
+{
+  debug( "ickP2pSetStreamThreshold (%p): %ld", ictx, (long)threshold );
+  ictx->streamThreshold = threshold;
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Set scheduling of output queue priority lanes
+    ictx           - ickstream context
+    weight         - 0 (default): strict priority, pending high priority
+                     messages are always transmitted first
+                     >0: a pending normal message is transmitted after
+                     weight high priority messages in a row
+\*=========================================================================*/
+ickErrcode_t ickP2pSetPriorityWeight( ickP2pContext_t *ictx, int weight )
+{
+  debug( "ickP2pSetPriorityWeight (%p): %d", ictx, weight );
+
+/*------------------------------------------------------------------------*\
+    Check range
+\*------------------------------------------------------------------------*/
+  if( weight<0 ) {
+    logwarn( "ickP2pSetPriorityWeight: invalid weight %d", weight );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store, that's all
+\*------------------------------------------------------------------------*/
+  ictx->priorityWeight = weight;
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Set size of the submission ring
+    ictx           - ickstream context
+    size           - number of slots (rounded up to a power of 2),
+                     0 (default) disables the ring
+    With a submission ring ickP2pSendMsg() and friends do not touch the
+    device list or output queues. Messages are copied to a ring slot (a
+    lock-free multi producer, single consumer queue) and resolved and
+    queued by the main thread in one batch per loop cycle. A full ring
+    is reported as ICKERR_BUSY. Per device errors (unknown or unconnected
+    targets, busy output queues) can only be detected by the main thread,
+    such messages are dropped with a warning.
+    This is possible only before ickP2pResume() is called for the first time.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetSubmissionRing( ickP2pContext_t *ictx, int size )
+{
+  unsigned long slots;
+  unsigned long i;
+  debug( "ickP2pSetSubmissionRing (%p): %d", ictx, size );
+
+/*------------------------------------------------------------------------*\
+    Check state and parameter
+\*------------------------------------------------------------------------*/
+  if( ictx->state!=ICKLIB_CREATED ) {
+    logwarn( "ickP2pSetSubmissionRing: wrong state (%d)", ictx->state );
+    return ICKERR_WRONGSTATE;
+  }
+  if( size<0 || size>ICKP2P_MAXSUBMISSIONS ) {
+    logwarn( "ickP2pSetSubmissionRing: invalid size (%d)", size );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Get rid of former ring
+\*------------------------------------------------------------------------*/
+  _ickP2pFreeSubmissions( ictx );
+  if( !size )
+    return ICKERR_SUCCESS;
+
+/*------------------------------------------------------------------------*\
+    Allocate ring, a slot is free for position p if its sequence is p
+\*------------------------------------------------------------------------*/
+  for( slots=1; slots<(unsigned long)size; slots<<=1 )
+    ;
+  ictx->submissions = calloc( slots, sizeof(ickSubmission_t) );
+  if( !ictx->submissions ) {
+    logerr( "ickP2pSetSubmissionRing: out of memory" );
+    return ICKERR_NOMEM;
+  }
+  for( i=0; i<slots; i++ )
+    ictx->submissions[i].seq = i;
+  ictx->submissionMask = slots - 1;
+  ictx->submissionTail = 0;
+  ictx->submissionHead = 0;
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Get size of submission ring (0: disabled)
+\*=========================================================================*/
+int ickP2pGetSubmissionRing( const ickP2pContext_t *ictx )
+{
+  return ictx->submissions ? (int)ictx->submissionMask+1 : 0;
+}
+
+
+/*=========================================================================*\
+  Set delivery mode for messages addressed to ourselves
+    ictx           - ickstream context
+    mode           - ICKP2P_LOOPBACK_QUEUED (default): messages are queued
+                     for the loopback device and delivered by the main thread
+                     ICKP2P_LOOPBACK_DIRECT: message callbacks are executed
+                     synchronously by the sending thread before ickP2pSendMsg()
+                     and friends return (no allocation, queueing or wakeup of
+                     the main thread). Dispatch workers and the submission
+                     ring are bypassed, callbacks sending to ourselves recurse.
+    This is possible only before ickP2pResume() is called for the first time.
+\*=========================================================================*/
+ickErrcode_t ickP2pSetLoopbackMode( ickP2pContext_t *ictx, ickP2pLoopbackMode_t mode )
+{
+  debug( "ickP2pSetLoopbackMode (%p): %d", ictx, mode );
 
 /*------------------------------------------------------------------------*\
-    Determine size if payload is a string
+    Check state and parameter
 \*------------------------------------------------------------------------*/
-  if( !mSize ) {
-    mFlags |= ICKP2P_MESSAGEFLAG_STRING;
-    mSize   = strlen( message ) + 1;
+  if( ictx->state!=ICKLIB_CREATED ) {
+    logwarn( "ickP2pSetLoopbackMode: wrong state (%d)", ictx->state );
+    return ICKERR_WRONGSTATE;
+  }
+  if( mode!=ICKP2P_LOOPBACK_QUEUED && mode!=ICKP2P_LOOPBACK_DIRECT ) {
+    logwarn( "ickP2pSetLoopbackMode: invalid mode %d", mode );
+    return ICKERR_INVALID;
+  }
+
+/*------------------------------------------------------------------------*\
+    Store, that's all
+\*------------------------------------------------------------------------*/
+  ictx->loopbackMode = mode;
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Get delivery mode for messages addressed to ourselves
+\*=========================================================================*/
+ickP2pLoopbackMode_t ickP2pGetLoopbackMode( const ickP2pContext_t *ictx )
+{
+  return ictx->loopbackMode;
+}
+
+
+/*=========================================================================*\
+  Default ickstream connection matrix
+\*=========================================================================*/
+int ickP2pDefaultConnectMatrixCb( ickP2pContext_t *ictx, ickP2pServicetype_t localServices, ickP2pServicetype_t remoteServices )
+{
+  debug( "ickP2pDefaultConnectMatrixCb (%p): local=0x%02x remote=0x%02x", ictx, localServices, remoteServices);
+
+/*------------------------------------------------------------------------*\
+    Debug always connects
+\*------------------------------------------------------------------------*/
+  if( (localServices&ICKP2P_SERVICE_DEBUG) || (remoteServices&ICKP2P_SERVICE_DEBUG) )
+    return 1;
+
+/*------------------------------------------------------------------------*\
+    Servers connect to controllers and players
+\*------------------------------------------------------------------------*/
+  if( localServices&ICKP2P_SERVICE_SERVER_GENERIC ) {
+    if( (remoteServices&ICKP2P_SERVICE_CONTROLLER) || (remoteServices&ICKP2P_SERVICE_PLAYER) )
+      return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Controller connect to servers and players
+\*------------------------------------------------------------------------*/
+  if( localServices&ICKP2P_SERVICE_CONTROLLER ) {
+    if( (remoteServices&ICKP2P_SERVICE_SERVER_GENERIC) || (remoteServices&ICKP2P_SERVICE_PLAYER) )
+      return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Players connect to servers and controllers
+\*------------------------------------------------------------------------*/
+  // I'm a player, so I want to connect to controllers and servers
+  if( localServices&ICKP2P_SERVICE_PLAYER ) {
+    if( (remoteServices&ICKP2P_SERVICE_SERVER_GENERIC) || (remoteServices&ICKP2P_SERVICE_CONTROLLER) )
+      return 1;
   }
 
-  debug( "ickP2pSendMsg: target=\"%s\" targetServices=0x%02x sourceServices=0x%02x size=%ld",
-         uuid?uuid:"<Notification>", targetServices, sourceService, (long)mSize );
+/*------------------------------------------------------------------------*\
+   No connection wanted
+\*------------------------------------------------------------------------*/
+ return 0;
+}
+
+
+#pragma mark -- internal functions
+
+
+/*=========================================================================*\
+  Send an ickstream message to one or all devices
+    see _ickP2pQueueMsg(), this locks the device list and breaks the main
+    loop afterwards
+\*=========================================================================*/
+static ickErrcode_t _ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
+                                    ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                    const struct iovec *iov, int iovcnt, size_t mSize,
+                                    ickP2pMessageFlag_t mFlags, ickMsgBuffer_t *buffer,
+                                    ickP2pPriority_t priority )
+{
+  ickErrcode_t irc;
+  ickErrcode_t lrc;
+  int          loopback;
+
+/*------------------------------------------------------------------------*\
+    Deliver directly to ourselves if this is the only target
+\*------------------------------------------------------------------------*/
+  loopback = ictx->loopbackMode==ICKP2P_LOOPBACK_DIRECT && (!uuid || !strcmp(uuid,ictx->deviceUuid));
+  if( loopback && uuid )
+    return _ickP2pSendLoopback( ictx, uuid, targetServices, sourceService,
+                                iov, iovcnt, mSize, mFlags );
+
+/*------------------------------------------------------------------------*\
+    Hand over to main thread if there is a submission ring,
+    a rejected notification is not delivered to ourselves either
+\*------------------------------------------------------------------------*/
+  if( ictx->submissions ) {
+    irc = _ickP2pSubmitMsg( ictx, uuid, targetServices, sourceService,
+                            iov, iovcnt, mSize, mFlags, buffer, priority );
+    if( loopback && !irc )
+      irc = _ickP2pSendLoopback( ictx, uuid, targetServices, sourceService,
+                                 iov, iovcnt, mSize, mFlags );
+    return irc;
+  }
 
 /*------------------------------------------------------------------------*\
-    Lock device list and find (first) device
+    Queue message with locked device list
 \*------------------------------------------------------------------------*/
   _ickLibDeviceListLock( ictx );
+  irc = _ickP2pQueueMsg( ictx, uuid, targetServices, sourceService,
+                         iov, iovcnt, mSize, mFlags, buffer, priority );
+  _ickLibDeviceListUnlock( ictx );
+
+/*------------------------------------------------------------------------*\
+    Break polling in main thread
+\*------------------------------------------------------------------------*/
+  if( irc!=ICKERR_NODEVICE && irc!=ICKERR_NOTCONNECTED )
+    _ickMainThreadBreak( ictx, 'm' );
+
+/*------------------------------------------------------------------------*\
+    Deliver notification to ourselves, keep first error, that's all
+\*------------------------------------------------------------------------*/
+  if( loopback ) {
+    lrc = _ickP2pSendLoopback( ictx, uuid, targetServices, sourceService,
+                               iov, iovcnt, mSize, mFlags );
+    if( !irc )
+      irc = lrc;
+  }
+  return irc;
+}
+
+
+/*=========================================================================*\
+  Queue an ickstream message for one or all devices
+    caller must lock the device list and break the main loop
+    ictx           - ickstream context
+    uuid           - uuid of target, if NULL all known ickstream devices are
+                     addressed
+    targetServices - services at target to address
+    sourceService  - sending service
+    iov            - the payload segments
+    iovcnt         - number of segments
+    mSize          - total size of payload
+    mFlags         - message flags
+    buffer         - zero-copy buffer containing the payload or NULL.
+                     If set, the payload is referenced for all devices
+                     sharing the preamble written to the buffer's headroom
+                     and copied for all others.
+    priority       - output queue lane
+    For notifications the payload is copied only once per preamble
+    (i.e. negotiated p2pLevel). All devices of such a group reference the
+    same immutable buffer, which is freed after the last write.
+\*=========================================================================*/
+static ickErrcode_t _ickP2pQueueMsg( ickP2pContext_t *ictx, const char *uuid,
+                                     ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                     const struct iovec *iov, int iovcnt, size_t mSize,
+                                     ickP2pMessageFlag_t mFlags, ickMsgBuffer_t *buffer,
+                                     ickP2pPriority_t priority )
+{
+  ickErrcode_t    irc = ICKERR_SUCCESS;
+  ickDevice_t    *device;
+  ickMsgBuffer_t *groups[ICKP2PLEVEL_SUPPORTED+1];
+  int             busyCnt = 0;
+  int             i;
+
+/*------------------------------------------------------------------------*\
+    No shared payloads per p2pLevel yet
+\*------------------------------------------------------------------------*/
+  memset( groups, 0, sizeof(groups) );
+
+/*------------------------------------------------------------------------*\
+    Find (first) device
+\*------------------------------------------------------------------------*/
   if( uuid ) {
     device = _ickLibDeviceFindByUuid( ictx, uuid );
 
     // Unknown device?
-    if( !device ) {
-      _ickLibDeviceListUnlock( ictx );
+    if( !device )
       return ICKERR_NODEVICE;
-    }
 
     // Not connected?
     if( (!device->wsi||device->connectionState==ICKDEVICE_NOTCONNECTED) &&
-        device->connectionState!=ICKDEVICE_LOOPBACK ) {
-      _ickLibDeviceListUnlock( ictx );
+        device->connectionState!=ICKDEVICE_LOOPBACK )
       return ICKERR_NOTCONNECTED;
-    }
   }
   else if( ictx->deviceList ) {
     mFlags |= ICKP2P_MESSAGEFLAG_NOTIFICATION;
     device  = ictx->deviceList;
   }
-  else {
-    _ickLibDeviceListUnlock( ictx );
+  else
     return ICKERR_SUCCESS;
-  }
 
 /*------------------------------------------------------------------------*\
     Loop over all devices
 \*------------------------------------------------------------------------*/
   do {
-    ickP2pLevel_t p2pLevel;
-    size_t        preambleLen = 1;  // p2pLevel
-    size_t        pSize;
-    size_t        cSize;
-    char         *container;
-    char         *ptr;
+    ickP2pLevel_t   p2pLevel;
+    size_t          preambleLen = 1;  // p2pLevel
+    size_t          pSize;
+    size_t          cSize;
+    char           *container;
+    char           *ptr;
+    ickMsgBuffer_t *msgBuffer = NULL;
+    int             drained;
+    int             busy;
 
 /*------------------------------------------------------------------------*\
     Ignore unconnected devices in broadcast mode
@@ -162,6 +1014,28 @@ ickErrcode_t ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
         device->connectionState!=ICKDEVICE_LOOPBACK )
       goto nextDevice;
 
+/*------------------------------------------------------------------------*\
+    Loopback device is served by the sending thread in direct mode
+\*------------------------------------------------------------------------*/
+    if( device->connectionState==ICKDEVICE_LOOPBACK && ictx->loopbackMode==ICKP2P_LOOPBACK_DIRECT )
+      goto nextDevice;
+
+/*------------------------------------------------------------------------*\
+    Flow control: skip busy devices unless the policy makes room
+\*------------------------------------------------------------------------*/
+    drained = 0;
+    _ickDeviceLock( device );
+    busy = _ickDeviceOutBusy( device, &drained ) &&
+           (ictx->overflowPolicy!=ICKP2P_OVERFLOW_DROPOLDESTNOTIFICATION ||
+            !_ickDeviceDropOldestNotification(device));
+    _ickDeviceUnlock( device );
+    _ickP2pComSignalDrained( ictx, device, drained );
+    if( busy ) {
+      debug( "ickP2pSendMsg (%s): output queue busy", device->uuid );
+      busyCnt++;
+      goto nextDevice;
+    }
+
 /*------------------------------------------------------------------------*\
     Determine preamble length and elements according to cross section of
     device and our local capabilities
@@ -173,47 +1047,79 @@ ickErrcode_t ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
       preambleLen++;
     if( p2pLevel&ICKP2PLEVEL_MESSAGEFLAGS )
       preambleLen++;
+    pSize = preambleLen + mSize;
 
 /*------------------------------------------------------------------------*\
-    Allocate payload container, include LWS padding
+    Zero-copy: use buffer headroom for the preamble, if still unused or
+    already holding the preamble needed for this device
 \*------------------------------------------------------------------------*/
-    pSize = preambleLen + mSize;
-    cSize = LWS_SEND_BUFFER_PRE_PADDING + pSize + LWS_SEND_BUFFER_POST_PADDING;
-    container = malloc( cSize );
-    if( !container ) {
-      logerr( "ickP2pSendMsg: out of memory (%ld bytes)", (long)cSize );
-      irc = ICKERR_NOMEM;
-      break;
+    if( buffer && (!buffer->preambleLen || buffer->p2pLevel==p2pLevel) ) {
+      ptr = (char *)buffer->payload - preambleLen;
+      if( !buffer->preambleLen ) {
+        _ickP2pWritePreamble( ptr, p2pLevel, targetServices, sourceService, mFlags );
+        buffer->preambleLen = preambleLen;
+        buffer->p2pLevel    = p2pLevel;
+        buffer->shared      = !uuid;
+      }
+      container = ptr - LWS_SEND_BUFFER_PRE_PADDING;
+      msgBuffer = buffer;
+      _ickMsgBufferRetain( msgBuffer );
     }
 
 /*------------------------------------------------------------------------*\
-    Collect actual preamble elements in container
+    Notification: reference the payload shared by all devices of this
+    p2pLevel, create it on first use (the sender holds one reference)
 \*------------------------------------------------------------------------*/
-    ptr = container + LWS_SEND_BUFFER_PRE_PADDING;
-    *ptr++ = p2pLevel;
-
-    if( p2pLevel&ICKP2PLEVEL_TARGETSERVICES )
-      *ptr++ = (unsigned char)targetServices;
-
-    if( p2pLevel&ICKP2PLEVEL_SOURCESERVICE )
-      *ptr++ = (unsigned char)sourceService;
-
-    if( p2pLevel&ICKP2PLEVEL_MESSAGEFLAGS )
-      *ptr++ = (unsigned char)mFlags;
+    else if( !uuid ) {
+      msgBuffer = groups[p2pLevel];
+      if( !msgBuffer ) {
+        msgBuffer = _ickMsgBufferAlloc( ictx, mSize );
+        if( !msgBuffer ) {
+          irc = ICKERR_NOMEM;
+          break;
+        }
+        _ickP2pGather( msgBuffer->payload, iov, iovcnt );
+        _ickP2pWritePreamble( (char *)msgBuffer->payload-preambleLen, p2pLevel,
+                              targetServices, sourceService, mFlags );
+        msgBuffer->preambleLen = preambleLen;
+        msgBuffer->p2pLevel    = p2pLevel;
+        msgBuffer->shared      = 1;
+        msgBuffer->refCnt      = 1;
+        groups[p2pLevel]       = msgBuffer;
+      }
+      container = (char *)msgBuffer->payload - preambleLen - LWS_SEND_BUFFER_PRE_PADDING;
+      _ickMsgBufferRetain( msgBuffer );
+    }
 
 /*------------------------------------------------------------------------*\
-    Copy payload to container
+    Allocate payload container, include LWS padding
 \*------------------------------------------------------------------------*/
-    memcpy( ptr, message, mSize );
+    else {
+      cSize = LWS_SEND_BUFFER_PRE_PADDING + pSize + LWS_SEND_BUFFER_POST_PADDING;
+      container = _ickPoolAlloc( ictx->messagePool, cSize );
+      if( !container ) {
+        logerr( "ickP2pSendMsg: out of memory (%ld bytes)", (long)cSize );
+        irc = ICKERR_NOMEM;
+        break;
+      }
+
+      // Collect actual preamble elements and copy payload to container
+      ptr = _ickP2pWritePreamble( container+LWS_SEND_BUFFER_PRE_PADDING, p2pLevel,
+                                  targetServices, sourceService, mFlags );
+      _ickP2pGather( ptr, iov, iovcnt );
+    }
 
 /*------------------------------------------------------------------------*\
     Try queue message for transmission
 \*------------------------------------------------------------------------*/
     _ickDeviceLock( device );
-    irc = _ickDeviceAddOutMessage( device, container, pSize );
+    irc = _ickDeviceAddOutMessage( device, container, pSize, msgBuffer, mFlags, priority );
     _ickDeviceUnlock( device );
     if( irc ) {
-      Sfree( container );
+      if( msgBuffer )
+        _ickMsgBufferRelease( msgBuffer );
+      else
+        _ickPoolFree( container );
       break;
     }
 
@@ -221,7 +1127,7 @@ ickErrcode_t ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
     Book a writable callback for the devices wsi
 \*------------------------------------------------------------------------*/
     if( device->wsi )
-      libwebsocket_callback_on_writable( ictx->lwsContext, device->wsi );
+      _ickShardBookWritable( ictx, device );
 
     // Loopback
     else if( device->connectionState==ICKDEVICE_LOOPBACK ) {
@@ -232,73 +1138,439 @@ ickErrcode_t ickP2pSendMsg( ickP2pContext_t *ictx, const char *uuid,
 
 
 /*------------------------------------------------------------------------*\
-    Handle next device in notification mode
+    Handle next device in notification mode
+\*------------------------------------------------------------------------*/
+nextDevice:
+    device = device->next;
+  } while( !uuid && device );
+
+/*------------------------------------------------------------------------*\
+    Drop senders references to shared payloads
+\*------------------------------------------------------------------------*/
+  for( i=0; i<=ICKP2PLEVEL_SUPPORTED; i++ )
+    if( groups[i] )
+      _ickMsgBufferRelease( groups[i] );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  if( !irc && busyCnt )
+    irc = ICKERR_BUSY;
+  return irc;
+}
+
+
+/*=========================================================================*\
+  Submit an ickstream message to the main thread via the submission ring
+    see _ickP2pQueueMsg() for parameters, the payload is referenced
+    (if buffer is set) or copied to a new buffer
+    Ring protocol: a slot is free for position p if its sequence is p.
+    Producers claim a position by advancing the tail, fill the slot and
+    publish it by setting the sequence to p+1. The main thread frees the
+    slot for the next round by setting the sequence to p+size.
+\*=========================================================================*/
+static ickErrcode_t _ickP2pSubmitMsg( ickP2pContext_t *ictx, const char *uuid,
+                                      ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                      const struct iovec *iov, int iovcnt, size_t mSize,
+                                      ickP2pMessageFlag_t mFlags, ickMsgBuffer_t *buffer,
+                                      ickP2pPriority_t priority )
+{
+  ickSubmission_t *slot;
+  char            *uuidCopy = NULL;
+  unsigned long    pos;
+  long             dif;
+  int              drained = 0;
+
+/*------------------------------------------------------------------------*\
+    Reject early if all output queues are busy
+\*------------------------------------------------------------------------*/
+  if( ictx->overflowPolicy==ICKP2P_OVERFLOW_REJECT && _ickDeviceContextOutBusy(ictx,&drained) ) {
+    debug( "_ickP2pSubmitMsg (%p): output queues busy", ictx );
+    return ICKERR_BUSY;
+  }
+  _ickP2pComSignalDrained( ictx, NULL, drained );
+
+/*------------------------------------------------------------------------*\
+    Copy target and reference or copy payload
+\*------------------------------------------------------------------------*/
+  if( uuid ) {
+    uuidCopy = strdup( uuid );
+    if( !uuidCopy ) {
+      logerr( "_ickP2pSubmitMsg: out of memory" );
+      return ICKERR_NOMEM;
+    }
+  }
+  if( buffer )
+    _ickMsgBufferRetain( buffer );
+  else {
+    buffer = _ickMsgBufferAlloc( ictx, mSize );
+    if( !buffer ) {
+      Sfree( uuidCopy );
+      return ICKERR_NOMEM;
+    }
+    _ickP2pGather( buffer->payload, iov, iovcnt );
+    buffer->refCnt = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Claim a slot
+\*------------------------------------------------------------------------*/
+  pos = ictx->submissionTail;
+  for(;;) {
+    slot = ictx->submissions + (pos&ictx->submissionMask);
+    dif  = (long)(slot->seq-pos);
+    if( !dif ) {
+      if( __sync_bool_compare_and_swap(&ictx->submissionTail,pos,pos+1) )
+        break;
+    }
+    else if( dif<0 ) {
+      debug( "_ickP2pSubmitMsg (%p): submission ring is full", ictx );
+      __sync_add_and_fetch( &ictx->nSubmitRejected, 1 );
+      _ickMsgBufferRelease( buffer );
+      Sfree( uuidCopy );
+      return ICKERR_BUSY;
+    }
+    pos = ictx->submissionTail;
+  }
+
+/*------------------------------------------------------------------------*\
+    Fill and publish slot
+\*------------------------------------------------------------------------*/
+  slot->uuid           = uuidCopy;
+  slot->buffer         = buffer;
+  slot->pSize          = mSize;
+  slot->targetServices = targetServices;
+  slot->sourceService  = sourceService;
+  slot->mFlags         = mFlags;
+  slot->priority       = priority;
+  __sync_synchronize();
+  slot->seq = pos + 1;
+  __sync_synchronize();
+
+/*------------------------------------------------------------------------*\
+    Break polling in main thread, that's all
+\*------------------------------------------------------------------------*/
+  _ickMainThreadBreak( ictx, 'm' );
+  return ICKERR_SUCCESS;
+}
+
+
+/*=========================================================================*\
+  Resolve and queue all messages from the submission ring
+    This is executed in the context of the main thread, after the break
+    request flag was reset (so no submission is missed).
+    The device list is locked once for all messages.
+    returns the number of processed submissions
+\*=========================================================================*/
+int _ickP2pProcessSubmissions( ickP2pContext_t *ictx )
+{
+  ickSubmission_t *slot;
+  ickErrcode_t     irc;
+  struct iovec     iov;
+  unsigned long    head;
+  int              cnt = 0;
+
+/*------------------------------------------------------------------------*\
+    Nothing to do?
+\*------------------------------------------------------------------------*/
+  if( !ictx->submissions )
+    return 0;
+  __sync_synchronize();
+  head = ictx->submissionHead;
+  slot = ictx->submissions + (head&ictx->submissionMask);
+  if( slot->seq!=head+1 )
+    return 0;
+
+/*------------------------------------------------------------------------*\
+    Queue all published slots
+\*------------------------------------------------------------------------*/
+  _ickLibDeviceListLock( ictx );
+  while( slot->seq==head+1 ) {
+    __sync_synchronize();
+    iov.iov_base = slot->buffer->payload;
+    iov.iov_len  = slot->pSize;
+    irc = _ickP2pQueueMsg( ictx, slot->uuid, slot->targetServices, slot->sourceService,
+                           &iov, 1, slot->pSize, slot->mFlags, slot->buffer, slot->priority );
+    if( irc ) {
+      logwarn( "_ickP2pProcessSubmissions: dropped message for \"%s\" (%s)",
+               slot->uuid?slot->uuid:"<Notification>", ickStrError(irc) );
+      ictx->nSubmitFailed++;
+    }
+
+    // Drop references and free slot for next round
+    _ickMsgBufferRelease( slot->buffer );
+    slot->buffer = NULL;
+    Sfree( slot->uuid );
+    __sync_synchronize();
+    slot->seq = head + ictx->submissionMask + 1;
+    head++;
+    cnt++;
+    slot = ictx->submissions + (head&ictx->submissionMask);
+  }
+  _ickLibDeviceListUnlock( ictx );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  ictx->submissionHead  = head;
+  ictx->nSubmitted     += cnt;
+  debug( "_ickP2pProcessSubmissions (%p): %d messages", ictx, cnt );
+  return cnt;
+}
+
+
+/*=========================================================================*\
+  Free submission ring and all messages not yet resolved
+    No producers must be active
+\*=========================================================================*/
+void _ickP2pFreeSubmissions( ickP2pContext_t *ictx )
+{
+  ickSubmission_t *slot;
+  unsigned long    head;
+
+  if( !ictx->submissions )
+    return;
+
+/*------------------------------------------------------------------------*\
+    Discard all published slots
+\*------------------------------------------------------------------------*/
+  head = ictx->submissionHead;
+  slot = ictx->submissions + (head&ictx->submissionMask);
+  while( slot->seq==head+1 ) {
+    _ickMsgBufferRelease( slot->buffer );
+    Sfree( slot->uuid );
+    slot->seq = head + ictx->submissionMask + 1;
+    head++;
+    slot = ictx->submissions + (head&ictx->submissionMask);
+  }
+
+/*------------------------------------------------------------------------*\
+    Free ring
+\*------------------------------------------------------------------------*/
+  Sfree( ictx->submissions );
+  ictx->submissionMask = 0;
+}
+
+
+/*=========================================================================*\
+  Write message preamble
+    ptr            - target position
+    returns pointer to first byte after preamble
+\*=========================================================================*/
+static char *_ickP2pWritePreamble( char *ptr, ickP2pLevel_t p2pLevel,
+                                   ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                   ickP2pMessageFlag_t mFlags )
+{
+  *ptr++ = p2pLevel;
+
+  if( p2pLevel&ICKP2PLEVEL_TARGETSERVICES )
+    *ptr++ = (unsigned char)targetServices;
+
+  if( p2pLevel&ICKP2PLEVEL_SOURCESERVICE )
+    *ptr++ = (unsigned char)sourceService;
+
+  if( p2pLevel&ICKP2PLEVEL_MESSAGEFLAGS )
+    *ptr++ = (unsigned char)mFlags;
+
+  return ptr;
+}
+
+
+/*=========================================================================*\
+  Deliver a message to ourselves in the context of the sending thread
+    (ICKP2P_LOOPBACK_DIRECT), no locks must be held by the caller.
+    The preamble is written to and read back from a local buffer, so the
+    callbacks see the same services and flags as for queued delivery.
+    Segmented payloads are gathered in a pooled buffer, all others are
+    passed as is.
+\*=========================================================================*/
+static ickErrcode_t _ickP2pSendLoopback( ickP2pContext_t *ictx, const char *uuid,
+                                         ickP2pServicetype_t targetServices, ickP2pServicetype_t sourceService,
+                                         const struct iovec *iov, int iovcnt, size_t mSize,
+                                         ickP2pMessageFlag_t mFlags )
+{
+  ickDevice_t    *device;
+  ickMsgBuffer_t *buffer = NULL;
+  ickP2pLevel_t   p2pLevel;
+  unsigned char   preamble[ICKP2P_MAXPREAMBLE];
+  size_t          preambleLen;
+  const void     *payload;
+  double          now;
+
+/*------------------------------------------------------------------------*\
+    Check loopback device and account message as sent and received
+\*------------------------------------------------------------------------*/
+  _ickLibDeviceListLock( ictx );
+  device = ictx->deviceLoopback;
+  if( !device || device->connectionState!=ICKDEVICE_LOOPBACK ) {
+    _ickLibDeviceListUnlock( ictx );
+    if( !uuid )
+      return ICKERR_SUCCESS;
+    return device ? ICKERR_NOTCONNECTED : ICKERR_NODEVICE;
+  }
+  p2pLevel        = device->ickP2pLevel & ICKP2PLEVEL_SUPPORTED;
+  now             = _ickTimeNow();
+  device->tLastTx = now;
+  device->tLastRx = now;
+  device->nTx++;
+  device->nRx++;
+  _ickLibDeviceListUnlock( ictx );
+
+/*------------------------------------------------------------------------*\
+    Apply preamble semantics
 \*------------------------------------------------------------------------*/
-nextDevice:
-    device = device->next;
-  } while( !uuid && device );
+  if( !uuid )
+    mFlags |= ICKP2P_MESSAGEFLAG_NOTIFICATION;
+  preambleLen = (unsigned char *)_ickP2pWritePreamble( (char *)preamble, p2pLevel,
+                                                       targetServices, sourceService, mFlags ) - preamble;
+  _ickP2pReadPreamble( preamble, preambleLen, &targetServices, &sourceService, &mFlags );
 
 /*------------------------------------------------------------------------*\
-    That's all - unlock device list and break polling in main thread
+    Get contiguous payload
 \*------------------------------------------------------------------------*/
-  _ickLibDeviceListUnlock( ictx );
-  _ickMainThreadBreak( ictx, 'm' );
+  if( iovcnt==1 )
+    payload = iov->iov_base;
+  else {
+    buffer = _ickMsgBufferAlloc( ictx, mSize );
+    if( !buffer )
+      return ICKERR_NOMEM;
+    _ickP2pGather( buffer->payload, iov, iovcnt );
+    buffer->refCnt = 1;
+    payload = buffer->payload;
+  }
 
 /*------------------------------------------------------------------------*\
-    That's all
+    Execute callbacks, that's all
 \*------------------------------------------------------------------------*/
-  return irc;
+  debug( "_ickP2pSendLoopback (%p): (0x%02x) -> 0x%02x, %ld bytes",
+         ictx, sourceService, targetServices, (long)mSize );
+  _ickP2pDeliverMessage( ictx, ictx->deviceUuid, sourceService, targetServices, payload, mSize, mFlags );
+  if( buffer )
+    _ickMsgBufferRelease( buffer );
+  return ICKERR_SUCCESS;
 }
 
 
 /*=========================================================================*\
-  Default ickstream connection matrix
+  Copy payload segments to a contiguous destination
 \*=========================================================================*/
-int ickP2pDefaultConnectMatrixCb( ickP2pContext_t *ictx, ickP2pServicetype_t localServices, ickP2pServicetype_t remoteServices )
+static void _ickP2pGather( void *dest, const struct iovec *iov, int iovcnt )
 {
-  debug( "ickP2pDefaultConnectMatrixCb (%p): local=0x%02x remote=0x%02x", ictx, localServices, remoteServices);
+  unsigned char *ptr = dest;
+  int            i;
 
-/*------------------------------------------------------------------------*\
-    Debug always connects
-\*------------------------------------------------------------------------*/
-  if( (localServices&ICKP2P_SERVICE_DEBUG) || (remoteServices&ICKP2P_SERVICE_DEBUG) )
-    return 1;
+  for( i=0; i<iovcnt; i++ ) {
+    memcpy( ptr, iov[i].iov_base, iov[i].iov_len );
+    ptr += iov[i].iov_len;
+  }
+}
+
+
+/*=========================================================================*\
+  Get offset of payload area within a zero-copy buffer
+    header, LWS pre padding and preamble headroom, aligned to 16 bytes
+\*=========================================================================*/
+static size_t _ickMsgBufferOffset( void )
+{
+  size_t offset = sizeof(ickMsgBuffer_t) + LWS_SEND_BUFFER_PRE_PADDING + ICKP2P_MAXPREAMBLE;
+  return (offset+15) & ~(size_t)15;
+}
+
+
+/*=========================================================================*\
+  Get zero-copy buffer header from payload area
+    returns NULL if payload is not the payload area of a buffer
+\*=========================================================================*/
+static ickMsgBuffer_t *_ickMsgBufferFromPayload( void *payload )
+{
+  ickMsgBuffer_t *buffer;
+
+  if( !payload )
+    return NULL;
+  buffer = (ickMsgBuffer_t*)((unsigned char*)payload - _ickMsgBufferOffset());
+  if( buffer->payload!=payload )
+    return NULL;
+
+  return buffer;
+}
+
+
+/*=========================================================================*\
+  Allocate a zero-copy buffer
+    ictx           - ickstream context
+    size           - capacity of payload area
+    the reference counter is initialized to 0
+  returns NULL on error
+\*=========================================================================*/
+static ickMsgBuffer_t *_ickMsgBufferAlloc( ickP2pContext_t *ictx, size_t size )
+{
+  ickMsgBuffer_t *buffer;
+  size_t          offset = _ickMsgBufferOffset();
+  size_t          bSize  = offset + size + LWS_SEND_BUFFER_POST_PADDING;
 
 /*------------------------------------------------------------------------*\
-    Servers connect to controllers and players
+    Allocate and init header
 \*------------------------------------------------------------------------*/
-  if( localServices&ICKP2P_SERVICE_SERVER_GENERIC ) {
-    if( (remoteServices&ICKP2P_SERVICE_CONTROLLER) || (remoteServices&ICKP2P_SERVICE_PLAYER) )
-      return 1;
+  buffer = malloc( bSize );
+  if( !buffer ) {
+    logerr( "_ickMsgBufferAlloc: out of memory (%ld bytes)", (long)bSize );
+    return NULL;
   }
+  memset( buffer, 0, sizeof(ickMsgBuffer_t) );
+  buffer->ictx    = ictx;
+  buffer->payload = (unsigned char*)buffer + offset;
+  buffer->size    = size;
 
 /*------------------------------------------------------------------------*\
-    Controller connect to servers and players
+    That's all
 \*------------------------------------------------------------------------*/
-  if( localServices&ICKP2P_SERVICE_CONTROLLER ) {
-    if( (remoteServices&ICKP2P_SERVICE_SERVER_GENERIC) || (remoteServices&ICKP2P_SERVICE_PLAYER) )
-      return 1;
-  }
+  return buffer;
+}
+
+
+/*=========================================================================*\
+  Add a reference to a zero-copy buffer
+\*=========================================================================*/
+void _ickMsgBufferRetain( ickMsgBuffer_t *buffer )
+{
+  __sync_add_and_fetch( &buffer->refCnt, 1 );
+}
+
+
+/*=========================================================================*\
+  Drop a reference to a zero-copy buffer
+    If this was the last one, the buffer is handed back to the owner by
+    executing the release callback or freed, if there is none.
+\*=========================================================================*/
+void _ickMsgBufferRelease( ickMsgBuffer_t *buffer )
+{
+  ickP2pMsgBufferReleaseCb_t  releaseCb;
+  void                       *userData;
+
+  if( __sync_sub_and_fetch(&buffer->refCnt,1) )
+    return;
+
+  debug( "_ickMsgBufferRelease (%p): releasing %p", buffer->ictx, buffer->payload );
 
 /*------------------------------------------------------------------------*\
-    Players connect to servers and controllers
+    No callback: just free the buffer
 \*------------------------------------------------------------------------*/
-  // I'm a player, so I want to connect to controllers and servers
-  if( localServices&ICKP2P_SERVICE_PLAYER ) {
-    if( (remoteServices&ICKP2P_SERVICE_SERVER_GENERIC) || (remoteServices&ICKP2P_SERVICE_CONTROLLER) )
-      return 1;
+  releaseCb = buffer->releaseCb;
+  userData  = buffer->userData;
+  if( !releaseCb ) {
+    Sfree( buffer );
+    return;
   }
 
 /*------------------------------------------------------------------------*\
-   No connection wanted
+    Hand back to owner
 \*------------------------------------------------------------------------*/
- return 0;
+  buffer->releaseCb = NULL;
+  buffer->userData  = NULL;
+  releaseCb( buffer->ictx, buffer->payload, userData );
 }
 
 
-#pragma mark -- internal functions
-
-
 /*=========================================================================*\
   Send a Null message (used for heart beat and syncing)
     ictx           - ickstream context
@@ -320,7 +1592,7 @@ ickErrcode_t _ickP2pSendNullMessage( ickP2pContext_t *ictx, ickDevice_t *device
     Allocate payload container, include LWS padding
 \*------------------------------------------------------------------------*/
   cSize = LWS_SEND_BUFFER_PRE_PADDING + 1 + LWS_SEND_BUFFER_POST_PADDING;
-  container = malloc( cSize );
+  container = _ickPoolAlloc( ictx->messagePool, cSize );
   if( !container ) {
     logerr( "_ickP2pSendNullMessage: out of memory (%ld bytes)", (long)cSize );
     return ICKERR_NOMEM;
@@ -334,9 +1606,11 @@ ickErrcode_t _ickP2pSendNullMessage( ickP2pContext_t *ictx, ickDevice_t *device
 /*------------------------------------------------------------------------*\
     Try to queue message for transmission
 \*------------------------------------------------------------------------*/
-  irc = _ickDeviceAddOutMessage( device, container, 1 );
+  _ickDeviceLock( device );
+  irc = _ickDeviceAddOutMessage( device, container, 1, NULL, ICKP2P_MESSAGEFLAG_NONE, ICKP2P_PRIORITY_HIGH );
+  _ickDeviceUnlock( device );
   if( irc ) {
-    Sfree( container );
+    _ickPoolFree( container );
     return irc;
   }
 
@@ -344,7 +1618,7 @@ ickErrcode_t _ickP2pSendNullMessage( ickP2pContext_t *ictx, ickDevice_t *device
     Book a writable callback for the devices wsi
 \*------------------------------------------------------------------------*/
   if( device->wsi )
-    libwebsocket_callback_on_writable( ictx->lwsContext, device->wsi );
+    _ickShardBookWritable( ictx, device );
   else
     debug( "_ickP2pSendNullMessage (%s): sending deferred, wsi not yet present.",
            device->uuid );
@@ -364,6 +1638,7 @@ ickErrcode_t _ickDeliverLoopbackMessage( ickP2pContext_t *ictx )
 {
   ickDevice_t     *device = ictx->deviceLoopback;
   ickMessage_t    *message;
+  int              drained;
 
   debug( "_ickDeliverLoopbackMessage: \"%s\"", device->uuid );
 
@@ -377,8 +1652,11 @@ ickErrcode_t _ickDeliverLoopbackMessage( ickP2pContext_t *ictx )
     logerr( "_ickDeliverLoopbackMessage: empty out queue for \"%s\"!", device->uuid  );
     return ICKERR_INVALID;
   }
+  _ickDeviceMessageSent( device, message );
   _ickDeviceUnlinkOutMessage( device, message );
+  drained = _ickDeviceCheckDrained( device );
   _ickDeviceUnlock( device );
+  _ickP2pComSignalDrained( ictx, device, drained );
 
 /*------------------------------------------------------------------------*\
     Deliver message locally, don't use LWS padding
@@ -398,8 +1676,9 @@ ickErrcode_t _ickDeliverLoopbackMessage( ickP2pContext_t *ictx )
 
 /*=========================================================================*\
   Initiate web socket connection to a device
-    caller should lock the device,
-    this must be called from the main thread
+    caller should lock the device list,
+    this must be called from the thread servicing the lws context
+    (use _ickShardConnect() from the main thread)
 \*=========================================================================*/
 ickErrcode_t _ickWebSocketOpen( struct libwebsocket_context *context, ickDevice_t *device )
 {
@@ -537,6 +1816,8 @@ int _lwsP2pCb( struct libwebsocket_context *context,
   ickDevice_t       *device;
   ickMessage_t      *message;
   int                remainder;
+  size_t             fragSize;
+  int                drained;
   size_t             rlen;
   unsigned char     *ptr;
   char              *dscrPath;
@@ -572,10 +1853,12 @@ int _lwsP2pCb( struct libwebsocket_context *context,
 
       // Execute discovery callback
       if( device ) {
+        _ickLibDeviceListLock( ictx );
         device->connectionState = ICKDEVICE_NOTCONNECTED;
         debug( "_lwsP2pCb (%s): device state now \"%s\"",
                device->uuid, _ickDeviceConnState2Str(device->connectionState) );
         _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
+        _ickLibDeviceListUnlock( ictx );
       }
 
       break;
@@ -612,25 +1895,32 @@ int _lwsP2pCb( struct libwebsocket_context *context,
       debug( "_lwsP2pCb %d: client connection established, %d messages pending",
              socket, _ickDevicePendingOutMessages(device) );
 
+      // Lock timer and device list, this might be executed by a reactor shard
+      _ickTimerListLock( ictx );
+      _ickLibDeviceListLock( ictx );
+
       // Drop this connection if already connected
       if( device->wsi ) {
         debug( "_lwsP2pCb %d: dropping client connection (already connected)", socket );
+        _ickLibDeviceListUnlock( ictx );
+        _ickTimerListUnlock( ictx );
         psd->kill = 1;
         libwebsocket_callback_on_writable( context, wsi );
         return -1;  // No effect for LWS_CALLBACK_CLIENT_ESTABLISHED
       }
 
       // Create heartbeat timer
-      _ickTimerListLock( ictx );
       if( device->doConnect ) {
         ickErrcode_t irc;
         debug( "_lwsP2pCb (%s): create heartbeat timer", device->uuid );
-        irc = _ickTimerAdd( ictx, device->lifetime*1000, 0, _ickHeartbeatTimerCb, device, 0 );
+        if( device->heartbeatTimer )
+          _ickTimerDelete( ictx, device->heartbeatTimer );
+        irc = _ickTimerAdd( ictx, device->lifetime*1000, 0, _ickHeartbeatTimerCb, device, 0,
+                            &device->heartbeatTimer );
         if( irc )
           logerr( "_lwsP2pCb (%s): could not create heartbeat timer (%s)",
                   device->uuid, ickStrError(irc) );
       }
-      _ickTimerListUnlock( ictx );
 
       // Book a write event if a message is already pending
       if( _ickDeviceOutQueue(device) )
@@ -640,13 +1930,16 @@ int _lwsP2pCb( struct libwebsocket_context *context,
       device->tConnect        = _ickTimeNow();
       device->connectionState = ICKDEVICE_ISCLIENT;
       device->wsi             = wsi;
-      debug( "_lwsP2pCb (%s): device state now \"%s\"",
-             device->uuid, _ickDeviceConnState2Str(device->connectionState) );
+      device->wsiShard        = _ickShardIndex( ictx, context );
+      debug( "_lwsP2pCb (%s): device state now \"%s\" (shard %d)",
+             device->uuid, _ickDeviceConnState2Str(device->connectionState), device->wsiShard );
 
 
       // Execute discovery callback
       _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_CONNECTED, device->services );
 
+      _ickLibDeviceListUnlock( ictx );
+      _ickTimerListUnlock( ictx );
       break;
 
 /*------------------------------------------------------------------------*\
@@ -794,6 +2087,12 @@ int _lwsP2pCb( struct libwebsocket_context *context,
         _ickLibDeviceAdd( ictx, device );
       }
 
+      // Store wsi and device while list is locked (devices might be
+      // connected concurrently by reactor shards)
+      device->wsi             = wsi;
+      device->wsiShard        = -1;
+      psd->device             = device;
+
       _ickLibDeviceListUnlock( ictx );
 
       // Start retrieval of UPnP descriptor if necessary
@@ -812,6 +2111,7 @@ int _lwsP2pCb( struct libwebsocket_context *context,
           if( !device->wget ) {
             logerr( "_lwsP2pCb (%s): could not start xml retriever \"%s\" (%s).",
                 psd->uuid, psd->host, ickStrError(irc) );
+            psd->device = NULL;
             _ickDeviceFree( device );
             _ickLibDeviceListUnlock( ictx );
             psd->kill = 1;
@@ -829,17 +2129,16 @@ int _lwsP2pCb( struct libwebsocket_context *context,
       if( device->doConnect ) {
         ickErrcode_t irc;
         debug( "_lwsP2pCb (%s): create heartbeat timer", device->uuid );
-        irc = _ickTimerAdd( ictx, device->lifetime*1000, 0, _ickHeartbeatTimerCb, device, 0 );
+        if( device->heartbeatTimer )
+          _ickTimerDelete( ictx, device->heartbeatTimer );
+        irc = _ickTimerAdd( ictx, device->lifetime*1000, 0, _ickHeartbeatTimerCb, device, 0,
+                            &device->heartbeatTimer );
         if( irc )
           logerr( "_lwsP2pCb (%s): could not create heartbeat timer (%s)",
                   device->uuid, ickStrError(irc) );
       }
       _ickTimerListUnlock( ictx );
 
-      // Store wsi and device
-      device->wsi             = wsi;
-      psd->device             = device;
-
       break;
 
 /*------------------------------------------------------------------------*\
@@ -871,40 +2170,48 @@ int _lwsP2pCb( struct libwebsocket_context *context,
         break;
       }
 
-      // Try to transmit the current message
-      remainder = _ickP2pComTransmit( wsi, message );
-
-      // Error handling
-      if( remainder<0 ) {
-        logerr( "_lwsP2pCb %d: error writing to \"%s\"", socket, device->uuid );
-        // Execute discovery callback
-        _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
-        _ickDeviceUnlinkOutMessage( device, message );
-        _ickDeviceFreeMessage( message );
-        if( _ickDeviceOutQueue(device) )
-          libwebsocket_callback_on_writable( context, wsi );
-        _ickDeviceUnlock( device );
-        break;;
-      }
+      // Write fragments of this and the following messages until the socket would block
+      fragSize = _ickP2pComFragmentSize( ictx, wsi );
+      while( message ) {
+
+        // Try to transmit the current message
+        remainder = _ickP2pComTransmit( wsi, device, message, fragSize );
+
+        // Error handling
+        if( remainder<0 ) {
+          logerr( "_lwsP2pCb %d: error writing to \"%s\"", socket, device->uuid );
+          // Execute discovery callback
+          _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
+          _ickDeviceUnlinkOutMessage( device, message );
+          _ickDeviceFreeMessage( message );
+          if( _ickDeviceOutQueue(device) )
+            libwebsocket_callback_on_writable( context, wsi );
+          break;
+        }
 
-      // Set timestamp for last successful (partial) submission
-      device->tLastTx = _ickTimeNow();
+        // Set timestamp for last successful (partial) submission
+        device->tLastTx = _ickTimeNow();
 
-      // If not complete book another write callback
-      if( remainder )
-        libwebsocket_callback_on_writable( context, wsi );
+        // If complete, delete message and get next one
+        if( !remainder ) {
+          _ickDeviceMessageSent( device, message );
+          _ickDeviceUnlinkOutMessage( device, message );
+          _ickDeviceFreeMessage( message );
+          device->nTx++;
+          message = _ickDeviceOutQueue( device );
+        }
 
-      // If complete, delete message and check for a next one
-      else {
-        _ickDeviceUnlinkOutMessage( device, message );
-        _ickDeviceFreeMessage( message );
-        device->nTx++;
-        if( _ickDeviceOutQueue(device) )
+        // Socket full? Book another write callback for the rest
+        if( message && _ickP2pComChoked(wsi) ) {
           libwebsocket_callback_on_writable( context, wsi );
+          break;
+        }
       }
 
-      // That's it
+      // That's it, signal drained queues outside the device lock
+      drained = _ickDeviceCheckDrained( device );
       _ickDeviceUnlock( device );
+      _ickP2pComSignalDrained( ictx, device, drained );
       break;
 
 /*------------------------------------------------------------------------*\
@@ -924,9 +2231,8 @@ int _lwsP2pCb( struct libwebsocket_context *context,
 
 #if 0
       // reset SSDP expiration timer
-      ickTimer_t *timer = _ickTimerFind( ictx, _ickDeviceExpireTimerCb, device, 0 );
-      if( timer )
-        _ickTimerUpdate( ictx, timer, device->lifetime*1000, 1 );
+      if( device->expireTimer )
+        _ickTimerUpdate( ictx, device->expireTimer, device->lifetime*1000, 1 );
       else
         logerr( "_lwsP2pCb (%s): could not find expiration timer.", psd->uuid );
 #endif
@@ -934,13 +2240,24 @@ int _lwsP2pCb( struct libwebsocket_context *context,
       // Set timestamp of last (partial) receive
       device->tLastRx = _ickTimeNow();
 
+      // Message is streamed: pass chunk on
+      if( psd->streaming ) {
+        _ickP2pExecStreamCallback( ictx, device, psd, in, len,
+                                   (!rlen&&final) ? ICKP2P_STREAM_END : ICKP2P_STREAM_CONTINUE );
+        if( !rlen && final ) {
+          psd->streaming = 0;
+          device->nRxSegmented++;
+        }
+        break;
+      }
+
       // No fragmentation? Process message directly
       if( !psd->inBuffer && !rlen && final) {
 
         // buffer messages for servers, which are not yet in connected state
         if( device->connectionState==ICKDEVICE_SERVERCONNECTING ) {
           ickErrcode_t irc;
-          ptr = malloc( len );
+          ptr = _ickPoolAlloc( ictx->messagePool, len );
           if( !ptr ) {
             logerr( "_lwsP2pCb (%s): out of memory", device->uuid );
             _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
@@ -951,6 +2268,7 @@ int _lwsP2pCb( struct libwebsocket_context *context,
           if( irc ) {
             logerr( "_lwsP2pCb (%s): could not add message to input queue (%s)",
                       device->uuid, ickStrError(irc) );
+            _ickPoolFree( ptr );
             _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
             return -1;
           }
@@ -965,14 +2283,29 @@ int _lwsP2pCb( struct libwebsocket_context *context,
         break;
       }
 
-      // Collecting chunks: (Re)allocate message buffer for new total size
-      ptr = realloc( psd->inBuffer, psd->inBufferSize+len );
-      if( !ptr ) {
-        logerr( "_lwsP2pCb: out of memory" );
-        _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
-        return -1;
+      // Incomplete message exceeds stream threshold? Start streaming
+      if( (rlen||!final) && ictx->streamCbs &&
+          device->connectionState!=ICKDEVICE_SERVERCONNECTING &&
+          psd->inBufferSize+len>ictx->streamThreshold &&
+          _ickP2pComStreamBegin(ictx,device,psd,in,len) )
+        break;
+
+      // Collecting chunks: grow message buffer if needed. Reserve the rest of
+      // the current frame, but at least double the capacity to avoid
+      // quadratic copying for messages consisting of many frames
+      if( psd->inBufferSize+len>psd->inBufferCapacity ) {
+        size_t capacity = psd->inBufferSize + len + rlen;
+        if( capacity<2*psd->inBufferCapacity )
+          capacity = 2*psd->inBufferCapacity;
+        ptr = _ickPoolRealloc( ictx->messagePool, psd->inBuffer, capacity );
+        if( !ptr ) {
+          logerr( "_lwsP2pCb: out of memory (%ld bytes)", (long)capacity );
+          _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_ERROR, device->services );
+          return -1;
+        }
+        psd->inBuffer         = ptr;
+        psd->inBufferCapacity = capacity;
       }
-      psd->inBuffer  = ptr;
 
       // Append data to buffer
       memcpy( psd->inBuffer + psd->inBufferSize, in, len );
@@ -980,7 +2313,8 @@ int _lwsP2pCb( struct libwebsocket_context *context,
 
       // If complete: execute callbacks and clean up
       if( !rlen && final ) {
-        // buffer messages for servers, which are not yet in connected state
+        // buffer messages for servers, which are not yet in connected state,
+        // the input queue takes over the reassembly buffer (no copy)
         if( device->connectionState==ICKDEVICE_SERVERCONNECTING ) {
           ickErrcode_t irc;
           irc = _ickDeviceAddInMessage( device, psd->inBuffer, psd->inBufferSize );
@@ -995,10 +2329,14 @@ int _lwsP2pCb( struct libwebsocket_context *context,
         // else deliver and free message
         else {
           _ickP2pExecMessageCallback( ictx, device, psd->inBuffer, psd->inBufferSize );
-          Sfree( psd->inBuffer );
-          psd->inBufferSize = 0;
+          _ickPoolFree( psd->inBuffer );
         }
 
+        // Buffer is owned by the input queue or freed
+        psd->inBuffer         = NULL;
+        psd->inBufferSize     = 0;
+        psd->inBufferCapacity = 0;
+
         // Count segmented message
         device->nRxSegmented++;
       }
@@ -1018,11 +2356,22 @@ int _lwsP2pCb( struct libwebsocket_context *context,
         debug( "_lwsP2pCb %d: connection killed (no device cleanup)", socket );
       }
 
+      // Incomplete streamed message?
+      if( device && !psd->kill && psd->streaming ) {
+        _ickP2pExecStreamCallback( ictx, device, psd, NULL, 0, ICKP2P_STREAM_ABORT );
+        psd->streaming = 0;
+      }
+
       // Mark and reset devices descriptor
       if( device && !psd->kill ) {
 
+        // Lock timer and device list, this might be executed by a reactor shard
+        _ickTimerListLock( ictx );
+        _ickLibDeviceListLock( ictx );
+
         // Remove heartbeat for this device
-        _ickTimerDeleteAll( ictx, _ickHeartbeatTimerCb, device, 0 );
+        if( device->heartbeatTimer )
+          _ickTimerDelete( ictx, device->heartbeatTimer );
 
         // Set timestamp
         device->tDisconnect = _ickTimeNow();
@@ -1040,22 +2389,28 @@ int _lwsP2pCb( struct libwebsocket_context *context,
         else
           device->wsi = NULL;
 
-        // Delete unsent messages
+        // Delete unsent messages, this might release the global busy state
         _ickDevicePurgeMessages( device );
+        _ickP2pComSignalDrained( ictx, device, _ickDeviceCheckDrained(device)&ICKDEVICE_DRAINED_GLOBAL );
 
         // Get rid of device descriptor if SSDP is not alive
         if( device->ssdpState!=ICKDEVICE_SSDPALIVE ) {
-          _ickTimerDeleteAll( ictx, _ickDeviceExpireTimerCb, device, 0 );
+          if( device->expireTimer )
+            _ickTimerDelete( ictx, device->expireTimer );
           _ickLibDeviceRemove( ictx, device );
           _ickDeviceFree( device );
         }
 
+        _ickLibDeviceListUnlock( ictx );
+        _ickTimerListUnlock( ictx );
       }
 
       // Free per session data
       Sfree( psd->uuid );
       Sfree( psd->host );
-      Sfree( psd->inBuffer );
+      _ickPoolFree( psd->inBuffer );
+      psd->inBuffer         = NULL;
+      psd->inBufferCapacity = 0;
       break;
 
 /*------------------------------------------------------------------------*\
@@ -1080,13 +2435,11 @@ int _lwsP2pCb( struct libwebsocket_context *context,
 void _ickP2pExecMessageCallback( ickP2pContext_t *ictx, const ickDevice_t *device,
                                  const void *message, size_t mSize )
 {
-  ickP2pLevel_t        p2pLevel;
-  ickP2pServicetype_t  targetServices = ICKP2P_SERVICE_GENERIC;
-  ickP2pServicetype_t  sourceService  = ICKP2P_SERVICE_GENERIC;
-  ickP2pMessageFlag_t  mFlags         = ICKP2P_MESSAGEFLAG_NONE;
+  ickP2pServicetype_t  targetServices;
+  ickP2pServicetype_t  sourceService;
+  ickP2pMessageFlag_t  mFlags;
   const unsigned char *payload = message;
-  struct _cblist      *walk;
-  int                  perr;
+  size_t               preambleLen;
 
 /*------------------------------------------------------------------------*\
   Ignore empty messages
@@ -1100,52 +2453,281 @@ void _ickP2pExecMessageCallback( ickP2pContext_t *ictx, const ickDevice_t *devic
 /*------------------------------------------------------------------------*\
   Interpret preamble and find start of payload
 \*------------------------------------------------------------------------*/
-  p2pLevel = *payload++;
+  preambleLen = _ickP2pReadPreamble( payload, mSize, &targetServices, &sourceService, &mFlags );
+  if( !preambleLen ) {
+    logerr( "_ickP2pExecMessageCallback: truncated message from \"%s\"", device->uuid );
+    return;
+  }
+  payload += preambleLen;
+  mSize   -= preambleLen;
+  debug( "_ickP2pExecMessageCallback (%p): (%s,0x%02x) -> 0x%02x, %ld bytes",
+         ictx, device->uuid, sourceService, targetServices, (long)mSize );
+
+/*------------------------------------------------------------------------*\
+   Hand over to dispatch workers, if enabled
+\*------------------------------------------------------------------------*/
+  if( !_ickDispatchSubmit(ictx,device->uuid,sourceService,targetServices,payload,mSize,mFlags) )
+    return;
+
+/*------------------------------------------------------------------------*\
+   Execute callbacks synchronously
+\*------------------------------------------------------------------------*/
+  _ickP2pDeliverMessage( ictx, device->uuid, sourceService, targetServices, payload, mSize, mFlags );
+}
+
+
+/*=========================================================================*\
+  Execute all registered message callbacks for a decoded message
+    payload is the message without preamble
+    This is called by the receiving thread or a dispatch worker.
+\*=========================================================================*/
+void _ickP2pDeliverMessage( ickP2pContext_t *ictx, const char *uuid,
+                            ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                            const void *payload, size_t pSize, ickP2pMessageFlag_t mFlags )
+{
+  const struct _cblist *cbs;
+  long                  epoch;
+  int                   i;
+
+/*------------------------------------------------------------------------*\
+   Execute all registered callbacks of current snapshot
+\*------------------------------------------------------------------------*/
+  epoch = _ickLibCbEnter( ictx );
+  cbs   = ictx->messageCbs;
+  for( i=0; cbs&&i<cbs->cnt; i++ )
+    ((ickP2pMessageCb_t)cbs->entries[i].callback)( ictx, uuid, sourceService, targetServices, (const char*)payload, pSize, mFlags );
+  _ickLibCbLeave( ictx, epoch );
+}
+
+
+/*=========================================================================*\
+  Execute the streaming message callbacks for a chunk
+    chunk is payload data (without preamble) at the current stream offset,
+    which is advanced by cSize
+\*=========================================================================*/
+static void _ickP2pExecStreamCallback( ickP2pContext_t *ictx, const ickDevice_t *device, _ickLwsP2pData_t *psd,
+                                       const void *chunk, size_t cSize, int mode )
+{
+  const struct _cblist *cbs;
+  long                  epoch;
+  int                   i;
+  debug( "_ickP2pExecStreamCallback (%p): (%s,0x%02x) -> 0x%02x, %ld bytes at %ld, mode 0x%02x",
+         ictx, device->uuid, psd->streamSourceService, psd->streamTargetServices,
+         (long)cSize, (long)psd->streamOffset, mode );
+
+/*------------------------------------------------------------------------*\
+   Execute all registered callbacks of current snapshot
+\*------------------------------------------------------------------------*/
+  epoch = _ickLibCbEnter( ictx );
+  cbs   = ictx->streamCbs;
+  for( i=0; cbs&&i<cbs->cnt; i++ )
+    ((ickP2pStreamCb_t)cbs->entries[i].callback)( ictx, device->uuid, psd->streamSourceService, psd->streamTargetServices,
+                                                  psd->streamFlags, (const char*)chunk, cSize, psd->streamOffset, mode );
+  _ickLibCbLeave( ictx, epoch );
+
+/*------------------------------------------------------------------------*\
+   Advance stream position
+\*------------------------------------------------------------------------*/
+  psd->streamOffset += cSize;
+}
+
+
+/*=========================================================================*\
+  Start streaming of a received message
+    in/len is the current chunk, psd->inBuffer might hold the data received
+    so far. Both are passed to the stream callbacks and the buffer is freed.
+    returns false if the preamble is not yet complete (caller should
+    continue buffering)
+\*=========================================================================*/
+static int _ickP2pComStreamBegin( ickP2pContext_t *ictx, ickDevice_t *device, _ickLwsP2pData_t *psd,
+                                  const unsigned char *in, size_t len )
+{
+  const unsigned char *head     = psd->inBufferSize ? psd->inBuffer : in;
+  size_t               headSize = psd->inBufferSize ? psd->inBufferSize : len;
+  size_t               preambleLen;
+
+/*------------------------------------------------------------------------*\
+    Decode preamble from first chunk, it must not be split
+\*------------------------------------------------------------------------*/
+  preambleLen = _ickP2pReadPreamble( head, headSize, &psd->streamTargetServices,
+                                     &psd->streamSourceService, &psd->streamFlags );
+  if( !preambleLen )
+    return 0;
+  debug( "_ickP2pComStreamBegin (%s): streaming message (%ld bytes so far)",
+         device->uuid, (long)(psd->inBufferSize+len) );
+
+/*------------------------------------------------------------------------*\
+    Pass on first chunk(s)
+\*------------------------------------------------------------------------*/
+  psd->streaming    = 1;
+  psd->streamOffset = 0;
+  _ickP2pExecStreamCallback( ictx, device, psd, head+preambleLen, headSize-preambleLen, ICKP2P_STREAM_BEGIN );
+  if( head!=in )
+    _ickP2pExecStreamCallback( ictx, device, psd, in, len, ICKP2P_STREAM_CONTINUE );
+
+/*------------------------------------------------------------------------*\
+    Get rid of reassembly buffer, that's all
+\*------------------------------------------------------------------------*/
+  _ickPoolFree( psd->inBuffer );
+  psd->inBuffer         = NULL;
+  psd->inBufferSize     = 0;
+  psd->inBufferCapacity = 0;
+  return 1;
+}
+
+
+/*=========================================================================*\
+  Decode message preamble
+    returns length of preamble or 0 if truncated
+\*=========================================================================*/
+static size_t _ickP2pReadPreamble( const unsigned char *ptr, size_t size, ickP2pServicetype_t *targetServices,
+                                   ickP2pServicetype_t *sourceService, ickP2pMessageFlag_t *mFlags )
+{
+  const unsigned char *walk = ptr;
+  ickP2pLevel_t        p2pLevel;
+
+/*------------------------------------------------------------------------*\
+    Defaults for elements not supported by sender
+\*------------------------------------------------------------------------*/
+  *targetServices = ICKP2P_SERVICE_GENERIC;
+  *sourceService  = ICKP2P_SERVICE_GENERIC;
+  *mFlags         = ICKP2P_MESSAGEFLAG_NONE;
+  if( !size )
+    return 0;
 
+/*------------------------------------------------------------------------*\
+    Check length of preamble
+\*------------------------------------------------------------------------*/
+  p2pLevel = *walk++;
+  if( 1 + !!(p2pLevel&ICKP2PLEVEL_TARGETSERVICES) + !!(p2pLevel&ICKP2PLEVEL_SOURCESERVICE) +
+      !!(p2pLevel&ICKP2PLEVEL_MESSAGEFLAGS) > size )
+    return 0;
+
+/*------------------------------------------------------------------------*\
+    Interpret preamble
+\*------------------------------------------------------------------------*/
   if( p2pLevel&ICKP2PLEVEL_TARGETSERVICES )
-    targetServices = *payload++;
+    *targetServices = *walk++;
 
   if( p2pLevel&ICKP2PLEVEL_SOURCESERVICE )
-    sourceService = *payload++;
+    *sourceService = *walk++;
 
   if( p2pLevel&ICKP2PLEVEL_MESSAGEFLAGS )
-    mFlags = *payload++;
+    *mFlags = *walk++;
 
-  if( payload-(const unsigned char*)message>mSize ) {
-    logerr( "_ickP2pExecMessageCallback: truncated message from \"%s\"", device->uuid );
-    return;
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return walk-ptr;
+}
+
+
+/*=========================================================================*\
+  Check consistency of watermarks
+\*=========================================================================*/
+static ickErrcode_t _ickP2pComCheckWatermarks( const ickP2pWatermarks_t *marks )
+{
+  if( marks->highMsgs<0 || marks->lowMsgs<0 ||
+      (marks->highMsgs && marks->lowMsgs>=marks->highMsgs) ||
+      (marks->highBytes && marks->lowBytes>=marks->highBytes) ) {
+    logwarn( "_ickP2pComCheckWatermarks: inconsistent watermarks (msgs %d/%d, bytes %ld/%ld)",
+             marks->lowMsgs, marks->highMsgs, (long)marks->lowBytes, (long)marks->highBytes );
+    return ICKERR_INVALID;
   }
+  return ICKERR_SUCCESS;
+}
 
-  mSize -= payload-(const unsigned char*)message;
-  debug( "_ickP2pExecMessageCallback (%p): (%s,0x%02x) -> 0x%02x, %ld bytes",
-         ictx, device->uuid, sourceService, targetServices, (long)mSize );
+
+/*=========================================================================*\
+  Signal drained output queues
+    drained        - result of _ickDeviceCheckDrained()
+    device should not be locked by caller
+\*=========================================================================*/
+static void _ickP2pComSignalDrained( ickP2pContext_t *ictx, ickDevice_t *device, int drained )
+{
+  if( drained&ICKDEVICE_DRAINED_DEVICE )
+    _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_DRAINED, device->services );
+  if( drained&ICKDEVICE_DRAINED_GLOBAL )
+    _ickLibExecDiscoveryCallback( ictx, NULL, ICKP2P_DRAINED, ICKP2P_SERVICE_NONE );
+}
+
+
+/*=========================================================================*\
+  Get fragment size for next transmissions on a connection
+    Use configured value or adapt to free space in socket send buffer
+\*=========================================================================*/
+static size_t _ickP2pComFragmentSize( ickP2pContext_t *ictx, struct libwebsocket *wsi )
+{
+  int       fd;
+  int       sndBuf;
+  socklen_t len = sizeof(sndBuf);
+  int       outQ = 0;
+  long      space;
+
+/*------------------------------------------------------------------------*\
+    Configured?
+\*------------------------------------------------------------------------*/
+  if( ictx->lwsFragmentSize )
+    return ictx->lwsFragmentSize;
+
+/*------------------------------------------------------------------------*\
+    Get send buffer size and pending bytes
+\*------------------------------------------------------------------------*/
+  fd = libwebsocket_get_socket_fd( wsi );
+  if( fd<0 || getsockopt(fd,SOL_SOCKET,SO_SNDBUF,&sndBuf,&len) )
+    return ICKP2P_MINFRAGMENTSIZE;
+#ifdef TIOCOUTQ
+  if( ioctl(fd,TIOCOUTQ,&outQ) )
+    outQ = 0;
+#endif
 
 /*------------------------------------------------------------------------*\
-   Lock list mutex and execute all registered callbacks
+    Use free space (minus framing overhead) within limits,
+    be conservative: Linux reports twice the usable buffer size
 \*------------------------------------------------------------------------*/
-  perr = pthread_mutex_lock( &ictx->messageCbsMutex );
-  if( perr )
-    logerr( "_ickP2pExecMessageCallback: cannot lock message callback list mutex (%s)",
-            strerror(perr) );
-  for( walk=ictx->messageCbs; walk; walk=walk->next )
-    ((ickP2pMessageCb_t)walk->callback)( ictx, device->uuid, sourceService, targetServices, (const char*)payload, mSize, mFlags );
-  perr = pthread_mutex_unlock( &ictx->messageCbsMutex );
-  if( perr )
-    logerr( "_ickP2pExecMessageCallback: cannot unlock message callback list mutex (%s)",
-            strerror(perr) );
+  space = (long)sndBuf/2 - outQ - LWS_SEND_BUFFER_PRE_PADDING;
+  if( space<ICKP2P_MINFRAGMENTSIZE )
+    return ICKP2P_MINFRAGMENTSIZE;
+  if( space>ICKP2P_MAXFRAGMENTSIZE )
+    return ICKP2P_MAXFRAGMENTSIZE;
+  return (size_t)space;
+}
+
+
+/*=========================================================================*\
+  Check if socket of a connection would block on writing
+\*=========================================================================*/
+static int _ickP2pComChoked( struct libwebsocket *wsi )
+{
+  struct pollfd pfd;
+
+  pfd.fd      = libwebsocket_get_socket_fd( wsi );
+  pfd.events  = POLLOUT;
+  pfd.revents = 0;
+  if( pfd.fd<0 )
+    return 0;
+  if( poll(&pfd,1,0)<0 )
+    return 1;
+
+  return !(pfd.revents&POLLOUT);
 }
 
 
 /*=========================================================================*\
   Transmit a message
+    caller should lock the device
     this will return the number of bytes left over (call again if>0 )
                      -1 on error
+    libwebsockets writes the frame header into the pre padding and masks
+    client payloads in place. So fragments of payloads shared with other
+    devices are sent from the devices bounce buffer.
 \*=========================================================================*/
-static int _ickP2pComTransmit( struct libwebsocket *wsi, ickMessage_t *message )
+static int _ickP2pComTransmit( struct libwebsocket *wsi, ickDevice_t *device, ickMessage_t *message, size_t fragSize )
 {
-  size_t left;
-  int    len;
-  int    wmode;
+  size_t         left;
+  int            len;
+  int            wmode;
+  unsigned char *ptr;
 
 /*------------------------------------------------------------------------*\
     Calculate remaining bytes
@@ -1160,17 +2742,40 @@ static int _ickP2pComTransmit( struct libwebsocket *wsi, ickMessage_t *message )
     Generate fragments.
 \*------------------------------------------------------------------------*/
   wmode =  message->issued ? LWS_WRITE_CONTINUATION : LWS_WRITE_BINARY;
-  if( left>1024 ) {
-    left = 1024;
+  if( left>fragSize ) {
+    left = fragSize;
     wmode |= LWS_WRITE_NO_FIN;
   }
   debug( "_ickP2pComTransmit (%p): sending %ld bytes, wmode 0x%02x",
          wsi, (long)left, wmode );
 
+/*------------------------------------------------------------------------*\
+    Payload is exclusive: send in place
+\*------------------------------------------------------------------------*/
+  ptr = message->payload + LWS_SEND_BUFFER_PRE_PADDING + message->issued;
+
+/*------------------------------------------------------------------------*\
+    Shared payload: copy fragment to bounce buffer
+\*------------------------------------------------------------------------*/
+  if( message->buffer && message->buffer->shared ) {
+    if( device->txBufferSize<left ) {
+      Sfree( device->txBuffer );
+      device->txBufferSize = 0;
+      device->txBuffer     = malloc( LWS_SEND_BUFFER_PRE_PADDING+fragSize+LWS_SEND_BUFFER_POST_PADDING );
+      if( !device->txBuffer ) {
+        logerr( "_ickP2pComTransmit (%p): out of memory", wsi );
+        return -1;
+      }
+      device->txBufferSize = fragSize;
+    }
+    memcpy( device->txBuffer+LWS_SEND_BUFFER_PRE_PADDING, ptr, left );
+    ptr = device->txBuffer + LWS_SEND_BUFFER_PRE_PADDING;
+  }
+
 /*------------------------------------------------------------------------*\
     Try to send
 \*------------------------------------------------------------------------*/
-  len = libwebsocket_write( wsi, message->payload+LWS_SEND_BUFFER_PRE_PADDING+message->issued, left, wmode );
+  len = libwebsocket_write( wsi, ptr, left, wmode );
   debug( "_ickP2pComTransmit (%p): libwebsocket_write returned %d", wsi, len );
   if( len<0 )
     return -1;
@@ -1197,20 +2802,59 @@ static int _ickP2pComTransmit( struct libwebsocket *wsi, ickMessage_t *message )
 /*=========================================================================*\
   Send heart bet on a LWS connection. This is done to reset the expiration
     timer in case a ws connection exists but SSDP is not routed.
-    timer list is already locked as this is a timer callback
+    executed without timer list lock as this is a timer callback
 \*=========================================================================*/
 void _ickHeartbeatTimerCb( const ickTimer_t *timer, void *data, int tag )
 {
   ickDevice_t     *device = data;
-  ickP2pContext_t *ictx   = device->ictx;
+  ickP2pContext_t *ictx   = _ickTimerGetContext( timer );
+  long             interval;
+  long             idle;
 
+/*------------------------------------------------------------------------*\
+    Device descriptors are freed and their timers deleted under the
+    device list lock, so this guards the device while sending.
+    The timer list is needed for rescheduling (lock order!)
+\*------------------------------------------------------------------------*/
+  _ickTimerListLock( ictx );
+  _ickLibDeviceListLock( ictx );
+  if( _ickTimerIsCancelled(timer) ) {
+    debug( "_ickDeviceHeartbeatTimerCb: timer was cancelled" );
+    _ickLibDeviceListUnlock( ictx );
+    _ickTimerListUnlock( ictx );
+    return;
+  }
   debug( "_ickDeviceHeartbeatTimerCb: %s", device->uuid );
 
 /*------------------------------------------------------------------------*\
-    Queue heartbeat message
+    Get time since last traffic on this link (in millisecs)
+\*------------------------------------------------------------------------*/
+  interval = device->lifetime*1000;
+  idle     = (long)( (_ickTimeNow()-(device->tLastTx>device->tLastRx?device->tLastTx:device->tLastRx))*1000 );
+
+/*------------------------------------------------------------------------*\
+    Link was active: suppress heartbeat and fire again one interval after
+    the last traffic
+\*------------------------------------------------------------------------*/
+  if( idle>=0 && idle<interval ) {
+    debug( "_ickDeviceHeartbeatTimerCb (%s): suppressed, link idle for %ldms",
+           device->uuid, idle );
+    device->nHeartbeatsSuppressed++;
+    _ickTimerUpdate( ictx, device->heartbeatTimer, interval-idle, 0 );
+  }
+
+/*------------------------------------------------------------------------*\
+    Queue heartbeat message, restore regular interval if shortened
 \*------------------------------------------------------------------------*/
-  _ickP2pSendNullMessage( ictx, device );
+  else {
+    if( _ickP2pSendNullMessage(ictx,device)==ICKERR_SUCCESS )
+      device->nHeartbeats++;
+    if( _ickTimerGetInterval(device->heartbeatTimer)!=interval )
+      _ickTimerUpdate( ictx, device->heartbeatTimer, interval, 0 );
+  }
 
+  _ickLibDeviceListUnlock( ictx );
+  _ickTimerListUnlock( ictx );
 }
 
 
@@ -55,7 +55,10 @@ Remarks         : -
 /*=========================================================================*\
   Definition of constants
 \*=========================================================================*/
-// none
+#define ICKP2P_MAXPREAMBLE   4    // p2pLevel, target, source, flags
+#define ICKP2P_MINFRAGMENTSIZE   1024    // websocket fragment sizes for transmissions
+#define ICKP2P_MAXFRAGMENTSIZE   65536
+#define ICKP2P_MAXSUBMISSIONS    65536   // max. size of submission ring
 
 /*=========================================================================*\
   Macro and type definitions
@@ -72,8 +75,45 @@ typedef struct {
   ickDevice_t     *device;       // weak
   unsigned char   *inBuffer;     // strong;
   size_t           inBufferSize;
+  size_t           inBufferCapacity;
+  int              streaming;     // current message is passed to stream callbacks
+  size_t           streamOffset;
+  ickP2pServicetype_t streamSourceService;
+  ickP2pServicetype_t streamTargetServices;
+  ickP2pMessageFlag_t streamFlags;
 } _ickLwsP2pData_t;
 
+//
+// Header of a zero-copy message buffer (see ickP2pAllocMsgBuffer()),
+// followed by LWS pre padding, preamble headroom, payload and LWS post padding
+//
+struct _ickMsgBuffer {
+  ickP2pContext_t            *ictx;        // weak
+  unsigned char              *payload;     // points into this allocation
+  size_t                      size;        // capacity of payload area
+  int                         refCnt;      // one per queued message + sender
+  int                         preambleLen; // 0, if no preamble written yet
+  int                         shared;      // referenced by several devices, don't write in place
+  ickP2pLevel_t               p2pLevel;    // level of written preamble
+  ickP2pMsgBufferReleaseCb_t  releaseCb;
+  void                       *userData;
+};
+
+//
+// A message submitted by an application thread, resolved and queued by
+// the main thread (see ickP2pSetSubmissionRing())
+//
+struct _ickSubmission {
+  volatile unsigned long      seq;         // slot state, see _ickP2pSubmitMsg()
+  char                       *uuid;        // strong, NULL: notification
+  ickMsgBuffer_t             *buffer;      // one reference
+  size_t                      pSize;
+  ickP2pServicetype_t         targetServices;
+  ickP2pServicetype_t         sourceService;
+  ickP2pMessageFlag_t         mFlags;
+  ickP2pPriority_t            priority;
+};
+
 
 /*------------------------------------------------------------------------*\
   Macros
@@ -95,9 +135,16 @@ typedef struct {
 \*=========================================================================*/
 ickErrcode_t _ickP2pSendNullMessage( ickP2pContext_t *ictx, ickDevice_t *device );
 ickErrcode_t _ickDeliverLoopbackMessage( ickP2pContext_t *ictx );
+int          _ickP2pProcessSubmissions( ickP2pContext_t *ictx );
+void         _ickP2pFreeSubmissions( ickP2pContext_t *ictx );
+void         _ickMsgBufferRetain( ickMsgBuffer_t *buffer );
+void         _ickMsgBufferRelease( ickMsgBuffer_t *buffer );
 ickErrcode_t _ickWebSocketOpen( struct libwebsocket_context *context, ickDevice_t *device );
 void         _ickP2pExecMessageCallback( ickP2pContext_t *ictx, const ickDevice_t *device,
                                          const void *message, size_t mSize );
+void         _ickP2pDeliverMessage( ickP2pContext_t *ictx, const char *uuid,
+                                    ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                                    const void *payload, size_t pSize, ickP2pMessageFlag_t mFlags );
 
 int    _lwsP2pCb( struct libwebsocket_context *context,
                   struct libwebsocket *wsi,
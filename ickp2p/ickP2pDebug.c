@@ -66,6 +66,8 @@ Remarks         : Library needs to be compiled with ICK_P2PENABLEDEBUGAPI
 #include "ickDescription.h"
 #include "ickP2pCom.h"
 #include "ickP2pDebug.h"
+#include "ickMainThread.h"
+#include "ickPool.h"
 
 
 /*=========================================================================*\
@@ -91,6 +93,7 @@ Remarks         : Library needs to be compiled with ICK_P2PENABLEDEBUGAPI
 \*=========================================================================*/
 #ifdef ICK_P2PENABLEDEBUGAPI
 static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent );
+static char *_ickPoolStateJson( ickPool_t *pool, int indent );
 static char *_ickInterfaceStateJson( ickInterface_t *interface, int indent );
 static char *_ickDeviceStateJson( ickDevice_t *device, int indent );
 static char *_ickMessageStateJson( ickMessage_t *message, int indent );
@@ -313,9 +316,13 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
   char           *devices    = NULL;
   ickInterface_t *interface;
   char           *interfaces = NULL;
+  char           *pools;
   int             i;
   int             rc;
   char           *result;
+  long            lockCnt;
+  double          lockAvg, lockMax;
+  ickP2pDispatchStats_t dispatchStats;
   debug( "_ickContextStateJson (%p): %s", ictx, ictx->deviceUuid );
   indent += JSON_INDENT;
 
@@ -401,6 +408,27 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
     return NULL;
   }
 
+/*------------------------------------------------------------------------*\
+    Get timer list lock statistics
+\*------------------------------------------------------------------------*/
+  _ickTimerListLockStats( ictx, &lockCnt, &lockAvg, &lockMax );
+
+/*------------------------------------------------------------------------*\
+    Get message dispatcher statistics
+\*------------------------------------------------------------------------*/
+  ickP2pGetDispatchStats( ictx, &dispatchStats );
+
+/*------------------------------------------------------------------------*\
+    Get message pool statistics
+\*------------------------------------------------------------------------*/
+  pools = _ickPoolStateJson( ictx->messagePool, indent );
+  if( !pools ) {
+    Sfree( devices );
+    Sfree( interfaces );
+    logerr( "_ickContextStateJson: out of memory" );
+    return NULL;
+  }
+
 /*------------------------------------------------------------------------*\
     Compile all context debug info
 \*------------------------------------------------------------------------*/
@@ -412,10 +440,12 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
                   "%*s\"services\": %d,\n"
                   "%*s\"upnpListenerPort\": %d,\n"
                   "%*s\"wsPort\": %d,\n"
+                  "%*s\"reactorShards\": %d,\n"
                   "%*s\"folder\": \"%s\",\n"
                   "%*s\"lifetime\": %d,\n"
                   "%*s\"state\": \"%s\",\n"
                   "%*s\"loopback\": %s,\n"
+                  "%*s\"loopbackDirect\": %s,\n"
                   "%*s\"customConnectMatrix\": %s,\n"
                   "%*s\"tCreation\": %f,\n"
                   "%*s\"tResume\": %f,\n"
@@ -425,6 +455,22 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
                   "%*s\"lwsVersion\": \"%s\",\n"
                   "%*s\"bootId\": %ld,\n"
                   "%*s\"configId\": %ld,\n"
+                  "%*s\"timerLockCount\": %ld,\n"
+                  "%*s\"timerLockHoldAvg\": %f,\n"
+                  "%*s\"timerLockHoldMax\": %f,\n"
+                  "%*s\"submissionRing\": %d,\n"
+                  "%*s\"submitted\": %ld,\n"
+                  "%*s\"submitRejected\": %ld,\n"
+                  "%*s\"submitFailed\": %ld,\n"
+                  "%*s\"dispatchWorkers\": %d,\n"
+                  "%*s\"dispatchQueued\": %d,\n"
+                  "%*s\"dispatchHighWater\": %d,\n"
+                  "%*s\"dispatched\": %ld,\n"
+                  "%*s\"dispatchWaitAvg\": %f,\n"
+                  "%*s\"dispatchWaitMax\": %f,\n"
+                  "%*s\"dispatchLatencyAvg\": %f,\n"
+                  "%*s\"dispatchLatencyMax\": %f,\n"
+                  "%*s\"messagePools\": %s,\n"
                   "%*s\"interfaces\": %s\n"
                   "%*s\"devices\": %s\n"
                         "%*s}\n",
@@ -434,10 +480,12 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
                   indent, "", JSON_INTEGER( ictx->ickServices ),
                   indent, "", JSON_INTEGER( ictx->upnpListenerPort ),
                   indent, "", JSON_INTEGER( ictx->lwsPort ),
+                  indent, "", JSON_INTEGER( ictx->shardCnt ),
                   indent, "", JSON_STRING( ictx->upnpFolder),
                   indent, "", JSON_INTEGER( ictx->lifetime ),
                   indent, "", JSON_STRING( ickLibState2Str(ictx->state) ),
                   indent, "", JSON_BOOL( ictx->upnpLoopback ),
+                  indent, "", JSON_BOOL( ictx->loopbackMode==ICKP2P_LOOPBACK_DIRECT ),
                   indent, "", JSON_BOOL( ictx->lwsConnectMatrixCb==ickP2pDefaultConnectMatrixCb ),
                   indent, "", JSON_REAL( ictx->tCreation ),
                   indent, "", JSON_REAL( ictx->tResume ),
@@ -447,12 +495,29 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
                   indent, "", JSON_STRING( lws_get_library_version() ),
                   indent, "", JSON_LONG( ictx->upnpBootId ),
                   indent, "", JSON_LONG( ictx->upnpConfigId ),
+                  indent, "", JSON_LONG( lockCnt ),
+                  indent, "", JSON_REAL( lockAvg ),
+                  indent, "", JSON_REAL( lockMax ),
+                  indent, "", JSON_INTEGER( ickP2pGetSubmissionRing(ictx) ),
+                  indent, "", JSON_LONG( ictx->nSubmitted ),
+                  indent, "", JSON_LONG( ictx->nSubmitRejected ),
+                  indent, "", JSON_LONG( ictx->nSubmitFailed ),
+                  indent, "", JSON_INTEGER( dispatchStats.workers ),
+                  indent, "", JSON_INTEGER( dispatchStats.queued ),
+                  indent, "", JSON_INTEGER( dispatchStats.highWater ),
+                  indent, "", JSON_LONG( dispatchStats.dispatched ),
+                  indent, "", JSON_REAL( dispatchStats.waitAvg ),
+                  indent, "", JSON_REAL( dispatchStats.waitMax ),
+                  indent, "", JSON_REAL( dispatchStats.latencyAvg ),
+                  indent, "", JSON_REAL( dispatchStats.latencyMax ),
+                  indent, "", JSON_OBJECT( pools ),
                   indent, "", JSON_OBJECT( interfaces ),
                   indent, "", JSON_OBJECT( devices ),
                   indent-JSON_INDENT, ""
                 );
   Sfree( devices );
   Sfree( interfaces );
+  Sfree( pools );
 
 /*------------------------------------------------------------------------*\
     Error
@@ -468,6 +533,55 @@ static char *_ickContextStateJson( ickP2pContext_t *ictx, int indent )
   return result;
 }
 
+/*=========================================================================*\
+  Get message pool statistics as allocated JSON array string
+    one object per size class, size 0 is used for oversized blocks
+    caller must free result
+    returns NULL on error
+\*=========================================================================*/
+static char *_ickPoolStateJson( ickPool_t *pool, int indent )
+{
+  ickPoolStats_t  stats;
+  char           *pools;
+  char           *result;
+  int             i;
+  int             rc;
+
+/*------------------------------------------------------------------------*\
+    Compile array of size classes
+\*------------------------------------------------------------------------*/
+  pools = strdup( "[" );
+  for( i=0; i<=ICKPOOL_CLASSES&&pools; i++ ) {
+    _ickPoolStats( pool, i, &stats );
+    rc = asprintf( &result, "%s%s\n%*s{ \"size\": %ld, \"hits\": %ld, \"misses\": %ld, "
+                   "\"inUse\": %d, \"highWater\": %d, \"cached\": %d }",
+                   pools, i?",":"", indent+JSON_INDENT, "",
+                   JSON_LONG( (long)stats.size ), JSON_LONG( stats.hits ), JSON_LONG( stats.misses ),
+                   JSON_INTEGER( stats.inUse ), JSON_INTEGER( stats.highWater ),
+                   JSON_INTEGER( stats.cached ) );
+    Sfree( pools );
+    if( rc<0 )
+      break;
+    pools = result;
+  }
+
+/*------------------------------------------------------------------------*\
+    Close list
+\*------------------------------------------------------------------------*/
+  if( pools ) {
+    rc = asprintf( &result, "%s\n%*s]", pools, indent, "" );
+    Sfree( pools );
+    if( rc>0 )
+      pools = result;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return pools;
+}
+
+
 /*=========================================================================*\
   Get interface info as allocated JSON object string
     (no unicode escaping of strings)
@@ -563,7 +677,7 @@ static char *_ickDeviceStateJson( ickDevice_t *device, int indent )
 /*------------------------------------------------------------------------*\
     Create message information (if any)
 \*------------------------------------------------------------------------*/
-  message = _ickMessageStateJson( device->outQueue, indent+JSON_INDENT );
+  message = _ickMessageStateJson( _ickDeviceOutQueue(device), indent+JSON_INDENT );
   if( !message ) {
     Sfree( wsi );
     logerr( "_ickDeviceStateJson: out of memory" );
@@ -589,6 +703,7 @@ static char *_ickDeviceStateJson( ickDevice_t *device, int indent )
                   "%*s\"bootId\": \"%ld\",\n"
                   "%*s\"configId\": \"%ld\",\n"
                   "%*s\"connectionState\": \"%s\",\n"
+                  "%*s\"shard\": %d,\n"
                   "%*s\"tXmlComplete\": %f,\n"
                   "%*s\"tConnect\": %f,\n"
                   "%*s\"tDisconnect\": %f,\n"
@@ -597,6 +712,8 @@ static char *_ickDeviceStateJson( ickDevice_t *device, int indent )
                   "%*s\"rxPending\": %d,\n"
                   "%*s\"tx\": %d,\n"
                   "%*s\"txPending\": %d,\n"
+                  "%*s\"heartbeats\": %d,\n"
+                  "%*s\"heartbeatsSuppressed\": %d,\n"
                   "%*s\"rxLast\": %f,\n"
                   "%*s\"txLast\": %f,\n"
                   "%*s\"wsi\": %s,\n"
@@ -616,6 +733,7 @@ static char *_ickDeviceStateJson( ickDevice_t *device, int indent )
                   indent, "", JSON_LONG( device->ssdpBootId ),
                   indent, "", JSON_LONG( device->ssdpConfigId ),
                   indent, "", JSON_STRING( _ickDeviceConnState2Str(device->connectionState) ),
+                  indent, "", JSON_INTEGER( device->wsi ? device->wsiShard : device->shard ),
                   indent, "", JSON_REAL( device->tXmlComplete ),
                   indent, "", JSON_REAL( device->tConnect ),
                   indent, "", JSON_REAL( device->tDisconnect ),
@@ -624,6 +742,8 @@ static char *_ickDeviceStateJson( ickDevice_t *device, int indent )
                   indent, "", JSON_INTEGER( _ickDevicePendingInMessages(device) ),
                   indent, "", JSON_INTEGER( device->nTx ),
                   indent, "", JSON_INTEGER( _ickDevicePendingOutMessages(device) ),
+                  indent, "", JSON_INTEGER( device->nHeartbeats ),
+                  indent, "", JSON_INTEGER( device->nHeartbeatsSuppressed ),
                   indent, "", JSON_REAL( device->tLastRx ),
                   indent, "", JSON_REAL( device->tLastTx ),
                   indent, "", JSON_OBJECT( wsi ),
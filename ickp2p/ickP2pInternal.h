@@ -64,6 +64,16 @@ Remarks         : -
 #define ICK_VERSION_MAJOR 1
 #define ICK_VERSION_MINOR 0
 
+// Use epoll reactor in main thread (define ICK_NOEPOLL to force poll())
+#if defined(__linux__) && !defined(ICK_NOEPOLL)
+#define ICK_USEEPOLL
+#endif
+
+// Use eventfd for wakeups and timerfd for timers (define ICK_NOEVENTFD to force a pipe)
+#if defined(__linux__) && !defined(ICK_NOEVENTFD)
+#define ICK_USEEVENTFD
+#endif
+
 
 /*=========================================================================*\
   Macro and type definitions
@@ -90,21 +100,42 @@ struct  _ickInterface {
   ickInterfaceShutdown_t shutdownMode;
   int                    upnpComSocket;
   int                    upnpComPort;
+#ifdef ICK_USEEPOLL
+  int                    epollRegistered;
+#endif
 };
 
 // A timer managed by ickp2p (from ickMainThread.c)
 struct _ickTimer;
 typedef struct _ickTimer ickTimer_t;
 
+// A reactor shard for web socket connections (from ickMainThread.c)
+struct _ickShard;
+typedef struct _ickShard ickShard_t;
+
 // List of polling descriptors (from ickMainThread.c)
 typedef struct  {
   struct pollfd *fds;
   nfds_t         nfds;
   nfds_t         size;
   nfds_t         increment;
+  int           *index;         // fd -> slot in fds or -1, strong
+  int            indexSize;
 } ickPolllist_t;
 
 
+// A pool of message memory blocks (from ickPool.c)
+struct _ickPool;
+typedef struct _ickPool ickPool_t;
+
+// A message submitted by an application thread (from ickP2pCom.c)
+struct _ickSubmission;
+typedef struct _ickSubmission ickSubmission_t;
+
+// A message dispatch worker (from ickDispatch.c)
+struct _ickDispatcher;
+typedef struct _ickDispatcher ickDispatcher_t;
+
 // A wget instance (from ickWGet.c)
 struct _ickWGetContext;
 typedef struct _ickWGetContext ickWGetContext_t;
@@ -113,12 +144,21 @@ typedef struct _ickWGetContext ickWGetContext_t;
 struct _ickDevice;
 typedef struct _ickDevice ickDevice_t;
 
-// Elements in linked list of callbacks
-struct _cblist {
-  struct _cblist  *next;
-  struct _cblist  *prev;
-  int              isNew;
+// Entry of a callback list
+struct _cbentry {
   void            *callback;
+  int              isNew;        // discovery: inventory not yet sent
+};
+
+// Snapshot of a callback list. Snapshots are never modified (except for
+// isNew of the live one, under callbacksMutex) but replaced as a whole,
+// readers need to enter a callback epoch instead of locking (see
+// _ickLibCbEnter())
+struct _cblist {
+  struct _cblist  *retired;      // next replaced snapshot waiting for reclamation
+  long             epoch;        // callback epoch of replacement
+  int              cnt;
+  struct _cbentry  entries[];
 };
 
 // The context descriptor
@@ -137,17 +177,42 @@ struct _ickP2pContext {
   char                          *osName;             // strong
   char                          *deviceName;         // strong
 
-  struct _cblist                *discoveryCbs;       // strong
-  pthread_mutex_t                discoveryCbsMutex;
-  struct _cblist                *messageCbs;         // strong
-  pthread_mutex_t                messageCbsMutex;
+  struct _cblist       *volatile discoveryCbs;       // strong, NULL: empty
+  struct _cblist       *volatile messageCbs;         // strong, NULL: empty
+  struct _cblist       *volatile streamCbs;          // strong, NULL: empty
+  pthread_mutex_t                callbacksMutex;     // writers and reclamation only
+  volatile long                  cbEpoch;
+  volatile int                   cbReaders[2];       // by parity of epoch
+  struct _cblist                *cbRetired;          // strong
+  volatile int                   cbInventoryPending; // new discovery callbacks
+  size_t                         streamThreshold;
 
   // Main thread and timer
   pthread_t                      thread;
   pthread_cond_t                 condIsReady;
-  int                            pollBreakPipe[2];
-  ickTimer_t                    *timers;            // strong
+  int                            pollBreakPipe[2];  // eventfd: both are the same descriptor
+  volatile int                   breakPending;      // a wakeup is outstanding
+  pthread_mutex_t                endMutex;          // publication of termination (own thread)
+#ifdef ICK_USEEVENTFD
+  int                            timerFd;           // -1: use poll timeouts
+#endif
+  long long                      timerWakeup;       // planned (or armed) timer wakeup, 0: none
+#ifdef ICK_USEEPOLL
+  int                            epollFd;           // -1: use poll()
+#endif
+  ickPolllist_t                  pollList;          // result of last wait
+  char                          *ssdpBuffer;        // strong
+  ickP2pLoop_t                  *loop;              // weak, NULL: own thread
+  ickP2pContext_t               *loopNext;
+  ickTimer_t                   **timers;            // strong, 4-ary min heap by expiry
+  int                            timerCnt;
+  int                            timerSize;
+  ickTimer_t                    *timersDue;         // detached for execution
   pthread_mutex_t                timersMutex;
+  long long                      timersLockStart;   // lock statistics, usecs (ICK_DEBUG only)
+  long long                      timersLockTotal;
+  long long                      timersLockMax;
+  long                           timersLockCnt;
 
   // Networking
   ickInterface_t                *interfaces;        // strong
@@ -167,8 +232,30 @@ struct _ickP2pContext {
   // List of remote devices seen by this interface
   ickDevice_t                   *deviceList;        // strong
   ickDevice_t                   *deviceLoopback;
+  ickP2pLoopbackMode_t           loopbackMode;
   pthread_mutex_t                deviceListMutex;
 
+  // Message descriptors and containers
+  ickPool_t                     *messagePool;       // strong
+
+  // Output flow control
+  ickP2pWatermarks_t             deviceWatermarks;  // default for all devices
+  ickP2pWatermarks_t             globalWatermarks;  // sum of all output queues
+  ickP2pOverflowPolicy_t         overflowPolicy;
+  int                            priorityWeight;    // 0: strict priority
+  volatile int                   outQueueCnt;       // sum of all output queues
+  volatile size_t                outQueueBytes;
+  volatile int                   outBusy;
+
+  // Submission ring (application threads -> main thread), NULL: disabled
+  ickSubmission_t               *submissions;       // strong, array of submissionMask+1
+  unsigned long                  submissionMask;
+  volatile unsigned long         submissionTail;    // next slot to claim (producers)
+  unsigned long                  submissionHead;    // next slot to resolve (main thread)
+  long                           nSubmitted;        // resolved by main thread
+  volatile long                  nSubmitRejected;   // ring was full
+  long                           nSubmitFailed;     // dropped on resolution
+
   // List of local services offered to the world
   ickP2pServicetype_t            ickServices;
 
@@ -177,7 +264,15 @@ struct _ickP2pContext {
   struct libwebsocket_context   *lwsContext;        // strong
   struct libwebsocket_protocols *lwsProtocols;      // strong
   int                            lwsPort;
+  size_t                         lwsFragmentSize;   // 0: adaptive
   ickPolllist_t                  lwsPolllist;
+  int                            shardCnt;          // 0: main thread only
+  ickShard_t                    *shards;            // strong, array of shardCnt
+
+  // Message dispatch workers
+  int                            dispatcherCnt;     // 0: synchronous dispatch
+  ickDispatcher_t               *dispatchers;       // strong, array of dispatcherCnt
+  pthread_mutex_t                dispatchMutex;     // publication of dispatchers
 
   ickWGetContext_t              *wGetters;          // strong
   pthread_mutex_t                wGettersMutex;
@@ -242,6 +337,10 @@ ickDevice_t *_ickLibDeviceFindByUuid( const ickP2pContext_t *ictx, const char *u
 ickDevice_t *_ickLibDeviceFindByWsi( const ickP2pContext_t *ictx,struct libwebsocket *wsi );
 
 
+long _ickLibCbEnter( ickP2pContext_t *ictx );
+void _ickLibCbLeave( ickP2pContext_t *ictx, long epoch );
+void _ickLibCbReclaim( ickP2pContext_t *ictx );
+void _ickLibExecDiscoveryInventory( ickP2pContext_t *ictx );
 void _ickLibExecDiscoveryCallback( ickP2pContext_t *ictx,
              const ickDevice_t *dev, ickP2pDeviceState_t change, ickP2pServicetype_t type );
 
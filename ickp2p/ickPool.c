@@ -0,0 +1,360 @@
+/*$*********************************************************************\
+
+Source File     : ickPool.c
+
+Description     : free list pools for message descriptors and containers
+
+Comments        : -
+
+Called by       : message queue and communication functions
+
+Calls           : standard memory management
+
+Date            : 17.10.2026
+
+Updates         : -
+
+Author          : //MAF
+
+Remarks         : Blocks are preceded by a small header linking them to
+                  their pool and size class, so they can be freed without
+                  knowing the context. Requests larger than the biggest
+                  class are served by malloc with the same header.
+
+*************************************************************************
+ * Copyright (c) 2013, ickStream GmbH
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright 
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright 
+ *     notice, this list of conditions and the following disclaimer in the 
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of ickStream nor the names of its contributors 
+ *     may be used to endorse or promote products derived from this software 
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. 
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, 
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, 
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ickP2p.h"
+#include "ickP2pInternal.h"
+#include "logutils.h"
+#include "ickPool.h"
+
+
+/*=========================================================================*\
+  Global symbols
+\*=========================================================================*/
+// none
+
+
+/*=========================================================================*\
+  Private definitions and symbols
+\*=========================================================================*/
+
+// Header of a block
+struct _ickPoolBlock;
+typedef struct _ickPoolBlock ickPoolBlock_t;
+struct _ickPoolBlock {
+  ickPool_t       *pool;       // weak
+  ickPoolBlock_t  *next;       // free list
+  int              sizeClass;  // -1: not pooled
+};
+
+// Header size, keep payload aligned
+#define ICKPOOL_HDRSIZE  ((sizeof(ickPoolBlock_t)+15) & ~(size_t)15)
+
+// Get header from payload pointer and vice versa
+#define ICKPOOL_HDR(p)   ((ickPoolBlock_t *)((char *)(p)-ICKPOOL_HDRSIZE))
+#define ICKPOOL_PTR(b)   ((void *)((char *)(b)+ICKPOOL_HDRSIZE))
+
+// A size class
+typedef struct {
+  ickPoolBlock_t  *freeList;
+  int              cached;
+  int              inUse;
+  int              highWater;
+  long             hits;
+  long             misses;
+} ickPoolClass_t;
+
+// A pool
+struct _ickPool {
+  pthread_mutex_t  mutex;
+  ickPoolClass_t   classes[ICKPOOL_CLASSES+1];   // last one is for oversized blocks
+};
+
+
+/*=========================================================================*\
+  Private prototypes
+\*=========================================================================*/
+static int    _ickPoolSizeClass( size_t size );
+static size_t _ickPoolClassSize( int sizeClass );
+
+
+/*=========================================================================*\
+  Create a pool
+    returns NULL on error
+\*=========================================================================*/
+ickPool_t *_ickPoolCreate( void )
+{
+  ickPool_t *pool;
+  debug( "_ickPoolCreate: %d classes", ICKPOOL_CLASSES );
+
+/*------------------------------------------------------------------------*\
+    Allocate and init descriptor
+\*------------------------------------------------------------------------*/
+  pool = calloc( 1, sizeof(ickPool_t) );
+  if( !pool ) {
+    logerr( "_ickPoolCreate: out of memory" );
+    return NULL;
+  }
+  pthread_mutex_init( &pool->mutex, NULL );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return pool;
+}
+
+
+/*=========================================================================*\
+  Destroy a pool
+    all blocks need to be freed before
+\*=========================================================================*/
+void _ickPoolDestroy( ickPool_t *pool )
+{
+  ickPoolBlock_t *block, *next;
+  int             i;
+  debug( "_ickPoolDestroy: %p", pool );
+
+/*------------------------------------------------------------------------*\
+    Free cached blocks
+\*------------------------------------------------------------------------*/
+  for( i=0; i<=ICKPOOL_CLASSES; i++ ) {
+    if( pool->classes[i].inUse )
+      logwarn( "_ickPoolDestroy: %d blocks of class %d still in use",
+               pool->classes[i].inUse, i );
+    for( block=pool->classes[i].freeList; block; block=next ) {
+      next = block->next;
+      Sfree( block );
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Free descriptor
+\*------------------------------------------------------------------------*/
+  pthread_mutex_destroy( &pool->mutex );
+  Sfree( pool );
+}
+
+
+/*=========================================================================*\
+  Allocate a block
+    content is not initialized
+    returns NULL on error
+\*=========================================================================*/
+void *_ickPoolAlloc( ickPool_t *pool, size_t size )
+{
+  int              sizeClass = _ickPoolSizeClass( size );
+  ickPoolClass_t  *cls;
+  ickPoolBlock_t  *block;
+
+/*------------------------------------------------------------------------*\
+    Try to get block from free list
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &pool->mutex );
+  cls   = sizeClass<0 ? &pool->classes[ICKPOOL_CLASSES] : &pool->classes[sizeClass];
+  block = cls->freeList;
+  if( block ) {
+    cls->freeList = block->next;
+    cls->cached--;
+    cls->hits++;
+  }
+  else
+    cls->misses++;
+  if( ++cls->inUse>cls->highWater )
+    cls->highWater = cls->inUse;
+  pthread_mutex_unlock( &pool->mutex );
+
+/*------------------------------------------------------------------------*\
+    Need to allocate a new one?
+\*------------------------------------------------------------------------*/
+  if( !block ) {
+    block = malloc( ICKPOOL_HDRSIZE + (sizeClass<0?size:_ickPoolClassSize(sizeClass)) );
+    if( !block ) {
+      logerr( "_ickPoolAlloc: out of memory (%ld bytes)", (long)size );
+      pthread_mutex_lock( &pool->mutex );
+      cls->inUse--;
+      pthread_mutex_unlock( &pool->mutex );
+      return NULL;
+    }
+    block->pool      = pool;
+    block->sizeClass = sizeClass;
+  }
+  block->next = NULL;
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return ICKPOOL_PTR( block );
+}
+
+
+/*=========================================================================*\
+  Resize a block
+    content is preserved up to the smaller size, ptr might be NULL
+    returns NULL on error, the original block is unchanged in this case
+\*=========================================================================*/
+void *_ickPoolRealloc( ickPool_t *pool, void *ptr, size_t size )
+{
+  ickPoolBlock_t *block;
+  size_t          oldSize;
+  void           *new;
+
+/*------------------------------------------------------------------------*\
+    Nothing to resize?
+\*------------------------------------------------------------------------*/
+  if( !ptr )
+    return _ickPoolAlloc( pool, size );
+
+/*------------------------------------------------------------------------*\
+    Still fits in class?
+\*------------------------------------------------------------------------*/
+  block = ICKPOOL_HDR( ptr );
+  if( block->sizeClass>=0 && size<=_ickPoolClassSize(block->sizeClass) )
+    return ptr;
+
+/*------------------------------------------------------------------------*\
+    Oversized to oversized: use realloc
+\*------------------------------------------------------------------------*/
+  if( block->sizeClass<0 && _ickPoolSizeClass(size)<0 ) {
+    block = realloc( block, ICKPOOL_HDRSIZE+size );
+    if( !block ) {
+      logerr( "_ickPoolRealloc: out of memory (%ld bytes)", (long)size );
+      return NULL;
+    }
+    return ICKPOOL_PTR( block );
+  }
+
+/*------------------------------------------------------------------------*\
+    Move to block of other class. Oversized blocks don't record their size,
+    but are only shrunk to a class here.
+\*------------------------------------------------------------------------*/
+  oldSize = block->sizeClass<0 ? size : _ickPoolClassSize( block->sizeClass );
+  new = _ickPoolAlloc( block->pool, size );
+  if( !new )
+    return NULL;
+  memcpy( new, ptr, oldSize<size?oldSize:size );
+  _ickPoolFree( ptr );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return new;
+}
+
+
+/*=========================================================================*\
+  Free a block, ptr might be NULL
+\*=========================================================================*/
+void _ickPoolFree( void *ptr )
+{
+  ickPoolBlock_t *block;
+  ickPool_t      *pool;
+  ickPoolClass_t *cls;
+
+  if( !ptr )
+    return;
+  block = ICKPOOL_HDR( ptr );
+  pool  = block->pool;
+
+/*------------------------------------------------------------------------*\
+    Keep pooled blocks in free list up to limit
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &pool->mutex );
+  cls = block->sizeClass<0 ? &pool->classes[ICKPOOL_CLASSES] : &pool->classes[block->sizeClass];
+  cls->inUse--;
+  if( block->sizeClass>=0 && cls->cached<ICKPOOL_MAXCACHED ) {
+    block->next   = cls->freeList;
+    cls->freeList = block;
+    cls->cached++;
+    block = NULL;
+  }
+  pthread_mutex_unlock( &pool->mutex );
+
+/*------------------------------------------------------------------------*\
+    Free block if not cached
+\*------------------------------------------------------------------------*/
+  Sfree( block );
+}
+
+
+/*=========================================================================*\
+  Get statistics of a size class
+    sizeClass      - 0..ICKPOOL_CLASSES-1, ICKPOOL_CLASSES for oversized blocks
+\*=========================================================================*/
+ickErrcode_t _ickPoolStats( ickPool_t *pool, int sizeClass, ickPoolStats_t *stats )
+{
+  ickPoolClass_t *cls;
+
+  if( sizeClass<0 || sizeClass>ICKPOOL_CLASSES )
+    return ICKERR_INVALID;
+
+  pthread_mutex_lock( &pool->mutex );
+  cls = &pool->classes[sizeClass];
+  stats->size      = sizeClass<ICKPOOL_CLASSES ? _ickPoolClassSize(sizeClass) : 0;
+  stats->hits      = cls->hits;
+  stats->misses    = cls->misses;
+  stats->inUse     = cls->inUse;
+  stats->highWater = cls->highWater;
+  stats->cached    = cls->cached;
+  pthread_mutex_unlock( &pool->mutex );
+
+  return ICKERR_SUCCESS;
+}
+
+
+#pragma mark -- internal functions
+
+
+/*=========================================================================*\
+  Get size class for a requested size
+    returns -1 if too large for pooling
+\*=========================================================================*/
+static int _ickPoolSizeClass( size_t size )
+{
+  int sizeClass;
+
+  for( sizeClass=0; sizeClass<ICKPOOL_CLASSES; sizeClass++ )
+    if( size<=_ickPoolClassSize(sizeClass) )
+      return sizeClass;
+
+  return -1;
+}
+
+
+/*=========================================================================*\
+  Get usable size of blocks in a class
+\*=========================================================================*/
+static size_t _ickPoolClassSize( int sizeClass )
+{
+  return (size_t)64 << sizeClass;
+}
@@ -0,0 +1,97 @@
+/*$*********************************************************************\
+
+Header File     : ickPool.h
+
+Description     : Internal include file for message memory pools
+
+Comments        : -
+
+Date            : 17.10.2026
+
+Updates         : -
+
+Author          : //MAF
+
+Remarks         : -
+
+*************************************************************************
+ * Copyright (c) 2013, ickStream GmbH
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright 
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright 
+ *     notice, this list of conditions and the following disclaimer in the 
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of ickStream nor the names of its contributors 
+ *     may be used to endorse or promote products derived from this software 
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. 
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, 
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, 
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\************************************************************************/
+
+#ifndef __ICKPOOL_H
+#define __ICKPOOL_H
+
+
+/*=========================================================================*\
+  Includes required by definitions from this file
+\*=========================================================================*/
+#include <stddef.h>
+#include "ickP2p.h"
+
+
+/*=========================================================================*\
+  Definition of constants
+\*=========================================================================*/
+#define ICKPOOL_CLASSES     7     // 64, 128, ..., 4096 bytes
+#define ICKPOOL_MAXCACHED   32    // max. number of free blocks kept per class
+
+
+/*=========================================================================*\
+  Macro and type definitions
+\*=========================================================================*/
+
+//
+// Statistics of a size class
+//
+typedef struct {
+  size_t  size;         // usable block size, 0: larger blocks (not pooled)
+  long    hits;         // served from free list
+  long    misses;       // served by malloc
+  int     inUse;
+  int     highWater;    // max. inUse
+  int     cached;       // blocks in free list
+} ickPoolStats_t;
+
+
+/*=========================================================================*\
+  Global symbols
+\*=========================================================================*/
+// none
+
+
+/*=========================================================================*\
+  Internal prototypes
+\*=========================================================================*/
+ickPool_t    *_ickPoolCreate( void );
+void          _ickPoolDestroy( ickPool_t *pool );
+void         *_ickPoolAlloc( ickPool_t *pool, size_t size );
+void         *_ickPoolRealloc( ickPool_t *pool, void *ptr, size_t size );
+void          _ickPoolFree( void *ptr );
+ickErrcode_t  _ickPoolStats( ickPool_t *pool, int sizeClass, ickPoolStats_t *stats );
+
+
+#endif /* __ICKPOOL_H */
@@ -579,7 +579,6 @@ static int _ickDeviceAlive( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
 {
   int                  retval = 0;
   ickDevice_t         *device;
-  ickTimer_t          *timer;
   const char          *peer;
   ickErrcode_t         irc;
 
@@ -609,10 +608,11 @@ static int _ickDeviceAlive( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
   }
 
 /*------------------------------------------------------------------------*\
-    Lock device list and inhibit notifications sender
+    Inhibit notifications sender and lock device list
+    (always in this order, timer callbacks lock the device list)
 \*------------------------------------------------------------------------*/
-  _ickLibDeviceListLock( ictx );
   _ickTimerListLock( ictx );
+  _ickLibDeviceListLock( ictx );
 
 /*------------------------------------------------------------------------*\
     Known device?
@@ -643,7 +643,7 @@ static int _ickDeviceAlive( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
           device->connectionState==ICKDEVICE_ISSERVER */ ) {
 
         // Trigger wsi destruction, detach wsi from device
-        libwebsocket_callback_on_writable( ictx->lwsContext, device->wsi );
+        _ickShardBookWritable( ictx, device );
         device->wsi = NULL;
 
         // Reset device state and notify delegates
@@ -758,11 +758,11 @@ static int _ickDeviceAlive( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
     Crate or update expiration timer
 \*------------------------------------------------------------------------*/
   device->lifetime = ssdp->lifetime;
-  timer = _ickTimerFind( ictx, _ickDeviceExpireTimerCb, device, 0 );
-  if( timer )
-    _ickTimerUpdate( ictx, timer, device->lifetime*1000, 1 );
+  if( device->expireTimer )
+    _ickTimerUpdate( ictx, device->expireTimer, device->lifetime*1000, 1 );
   else {
-    irc = _ickTimerAdd( ictx, device->lifetime*1000, 1, _ickDeviceExpireTimerCb, device, 0 );
+    irc = _ickTimerAdd( ictx, device->lifetime*1000, 1, _ickDeviceExpireTimerCb, device, 0,
+                        &device->expireTimer );
     if( irc ) {
       logerr( "_ickDeviceUpdate (%s): could not create expiration timer (%s)",
           device->uuid, ickStrError(irc) );
@@ -811,7 +811,7 @@ static int _ickDeviceAlive( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
     }
 
     // This might be rejected if a connection was initiated by peer
-    _ickWebSocketOpen( ictx->lwsContext, device );
+    _ickShardConnect( ictx, device );
   }
 
 /*------------------------------------------------------------------------*\
@@ -853,10 +853,10 @@ static int _ickDeviceRemove( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
     return 0;
 
 /*------------------------------------------------------------------------*\
-    Lock device list and inhibit timer handling.
+    Inhibit timer handling and lock device list.
 \*------------------------------------------------------------------------*/
-  _ickLibDeviceListLock( ictx );
   _ickTimerListLock( ictx );
+  _ickLibDeviceListLock( ictx );
 
 /*------------------------------------------------------------------------*\
     Find matching device entry
@@ -893,10 +893,12 @@ static int _ickDeviceRemove( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
   _ickLibDeviceRemove( ictx, device );
 
   // Remove expiration handler for this device
-  _ickTimerDeleteAll( ictx, _ickDeviceExpireTimerCb, device, 0 );
+  if( device->expireTimer )
+    _ickTimerDelete( ictx, device->expireTimer );
 
   // Remove heartbeat handler for this device
-  _ickTimerDeleteAll( ictx, _ickHeartbeatTimerCb, device, 0 );
+  if( device->heartbeatTimer )
+    _ickTimerDelete( ictx, device->heartbeatTimer );
 
   // Find and remove HTTP clients for this device
   _ickLibWGettersLock( ictx );
@@ -969,12 +971,12 @@ ickErrcode_t _ickSsdpNewDiscovery( ickP2pContext_t *ictx )
   long interval = ictx->lifetime/ICKSSDP_ANNOUNCEDIVIDOR;
   if( interval<=0 )
     interval = ICKSSDP_DEFAULTLIFETIME/ICKSSDP_ANNOUNCEDIVIDOR;
-  _ickTimerAdd( ictx, interval*1000, 0, _ickSsdpAnnounceCb, (void*)ictx, 0 );
+  _ickTimerAddWithSlack( ictx, interval*1000, ICKSSDP_PERIODICSLACK, 0, _ickSsdpAnnounceCb, (void*)ictx, 0, NULL );
 
 /*------------------------------------------------------------------------*\
     Setup periodic search timer
 \*------------------------------------------------------------------------*/
-  _ickTimerAdd( ictx, ICKSSDP_SEARCHINTERVAL*1000, 0, _ickSsdpSearchCb, (void*)ictx, 0 );
+  _ickTimerAddWithSlack( ictx, ICKSSDP_SEARCHINTERVAL*1000, ICKSSDP_PERIODICSLACK, 0, _ickSsdpSearchCb, (void*)ictx, 0, NULL );
 
 /*------------------------------------------------------------------------*\
     Unlock timer list, that's all
@@ -1021,6 +1023,10 @@ void _ickSsdpEndDiscovery( ickP2pContext_t *ictx )
     if( device->connectionState==ICKDEVICE_LOOPBACK )
       _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_DISCONNECTED, device->services );
     _ickLibExecDiscoveryCallback( ictx, device, ICKP2P_TERMINATE, device->services );
+    if( device->expireTimer )
+      _ickTimerDelete( ictx, device->expireTimer );
+    if( device->heartbeatTimer )
+      _ickTimerDelete( ictx, device->heartbeatTimer );
     _ickLibDeviceRemove( ictx, device );
     _ickDeviceFree( device );
   }
@@ -1034,7 +1040,7 @@ void _ickSsdpEndDiscovery( ickP2pContext_t *ictx )
 
 /*=========================================================================*\
   Execute frequent announcements of offered services
-    timer list is already locked for callbacks
+    timer callbacks are executed without timer list lock
 \*=========================================================================*/
 static void _ickSsdpAnnounceCb( const ickTimer_t *timer, void *data, int tag )
 {
@@ -1046,7 +1052,11 @@ static void _ickSsdpAnnounceCb( const ickTimer_t *timer, void *data, int tag )
 /*------------------------------------------------------------------------*\
     Schedule advertisements
 \*------------------------------------------------------------------------*/
+  _ickTimerListLock( ictx );
+  _ickLibInterfaceListLock( ictx );
   irc = _ssdpSendInitialDiscoveryMsg( ictx, NULL, SSDPMSGTYPE_ALIVE, 0 );
+  _ickLibInterfaceListUnlock( ictx );
+  _ickTimerListUnlock( ictx );
   if( irc ) {
     logerr( "_ickSsdpAnnounceCb: could not send alive announcements (%s).",
         ickStrError(irc) );
@@ -1060,7 +1070,7 @@ static void _ickSsdpAnnounceCb( const ickTimer_t *timer, void *data, int tag )
 
 /*=========================================================================*\
   Execute frequent searches for ickstream devices
-    timer list is already locked for callbacks
+    timer callbacks are executed without timer list lock
 \*=========================================================================*/
 static void _ickSsdpSearchCb( const ickTimer_t *timer, void *data, int tag )
 {
@@ -1072,10 +1082,12 @@ static void _ickSsdpSearchCb( const ickTimer_t *timer, void *data, int tag )
 /*------------------------------------------------------------------------*\
     Schedule an M-Search for ickstream root devices
 \*------------------------------------------------------------------------*/
+  _ickTimerListLock( ictx );
   _ickLibInterfaceListLock( ictx );
   irc = _ssdpSendDiscoveryMsg( ictx, NULL, SSDPMSGTYPE_MSEARCH, SSDPMSGLEVEL_DEVICEORSERVICE,
                                1 /*ICKSSDP_REPEATS*/, 0 );
   _ickLibInterfaceListUnlock( ictx );
+  _ickTimerListUnlock( ictx );
   if( irc ) {
     logerr( "_ickSsdpSearchCb: could not send alive announcements (%s).",
         ickStrError(irc) );
@@ -1169,7 +1181,7 @@ static int _ssdpProcessMSearch( ickP2pContext_t *ictx, const ickSsdp_t *ssdp )
               else unicast target in network byte order (for M-Search responses)
     type    - message type (alive or m-search response)
               don't use for updates, use _ssdpNewInterface() instead!
-    Caller should lock timer list (which is already the case in timer callbacks)
+    Caller should lock timer list
     Caller should lock interface list
 \*=========================================================================*/
 static ickErrcode_t _ssdpSendInitialDiscoveryMsg( ickP2pContext_t *ictx,
@@ -1214,7 +1226,7 @@ static ickErrcode_t _ssdpSendInitialDiscoveryMsg( ickP2pContext_t *ictx,
   Send update messages (if an interface was added)
     See "UPnP Device Architecture 1.1": chapter 1.2.4
     ictx    - the ickstream context
-    Caller should lock timer list (which is already the case in timer callbacks)
+    Caller should lock timer list
     Caller should lock interface list
 \*=========================================================================*/
 ickErrcode_t _ssdpNewInterface( ickP2pContext_t *ictx )
@@ -1315,7 +1327,7 @@ ickErrcode_t _ssdpByebyeInterface( ickP2pContext_t *ictx, ickInterface_t *interf
               if <=0 one message is sent immediately
     delay   - initial delay of first message (in ms), if repeat>0
     returns -1 on error, 0 on success
-    Caller should lock timer list (which is already the case in timer callbacks)
+    Caller should lock timer list
     Caller should lock interface list
 \*=========================================================================*/
 static ickErrcode_t _ssdpSendDiscoveryMsg( ickP2pContext_t *ictx,
@@ -1620,11 +1632,12 @@ static ickErrcode_t __ssdpSendDiscoveryMsg( ickP2pContext_t *ictx,
   memcpy( &note->sockname, addr, addr_len );
 
 /*------------------------------------------------------------------------*\
-    Queue instances, randomly delay transmissions after initial delay
+    Queue instances, randomly delay transmissions after initial delay.
+    Transmissions within the slack window are sent in one batch.
 \*------------------------------------------------------------------------*/
   while( repeat-- ) {
     delay += random() % ICKSSDP_RNDDELAY;
-    irc = _ickTimerAdd( ictx, delay, 1, _ickSsdpNotifyCb, note, 0 );
+    irc = _ickTimerAddWithSlack( ictx, delay, ICKSSDP_NOTIFYSLACK, 1, _ickSsdpNotifyCb, note, 0, NULL );
     if( irc ) {
       _ickTimerDeleteAll( ictx, _ickSsdpNotifyCb, note, 0 );
       Sfree( note->message );
@@ -1649,7 +1662,8 @@ static ickErrcode_t __ssdpSendDiscoveryMsg( ickP2pContext_t *ictx,
 
 /*=========================================================================*\
   Send a notification: remove from a discovery context
-    timer list is already locked
+    executed without timer list lock, notifications are only freed by
+    the main thread
 \*=========================================================================*/
 static void _ickSsdpNotifyCb( const ickTimer_t *timer, void *data, int tag )
 {
@@ -1692,19 +1706,25 @@ static void _ickSsdpNotifyCb( const ickTimer_t *timer, void *data, int tag )
 
 /*=========================================================================*\
   A device has expired: remove from a discovery context
-    timer list is already locked as this is a timer callback
+    executed without timer list lock as this is a timer callback
 \*=========================================================================*/
 void _ickDeviceExpireTimerCb( const ickTimer_t *timer, void *data, int tag )
 {
   ickDevice_t     *device = data;
-  ickP2pContext_t *ictx   = device->ictx;
-
-  debug( "_ickDeviceExpireCb: %s", device->uuid );
+  ickP2pContext_t *ictx   = _ickTimerGetContext( timer );
 
 /*------------------------------------------------------------------------*\
-    Lock device list
+    Lock timer and device list, device is gone if timer was deleted meanwhile
 \*------------------------------------------------------------------------*/
+  _ickTimerListLock( ictx );
   _ickLibDeviceListLock( ictx );
+  if( _ickTimerIsCancelled(timer) ) {
+    debug( "_ickDeviceExpireCb: timer was cancelled" );
+    _ickLibDeviceListUnlock( ictx );
+    _ickTimerListUnlock( ictx );
+    return;
+  }
+  debug( "_ickDeviceExpireCb: %s", device->uuid );
   device->ssdpState = ICKDEVICE_SSDPEXPIRED;
 
 /*------------------------------------------------------------------------*\
@@ -1717,8 +1737,11 @@ void _ickDeviceExpireTimerCb( const ickTimer_t *timer, void *data, int tag )
 \*------------------------------------------------------------------------*/
   if( device->connectionState==ICKDEVICE_NOTCONNECTED ) {
 
-    // Remove heartbeat handler for this device
-    _ickTimerDeleteAll( ictx, _ickHeartbeatTimerCb, device, 0 );
+    // Remove timers for this device (this also resets the handles)
+    if( device->expireTimer )
+      _ickTimerDelete( ictx, device->expireTimer );
+    if( device->heartbeatTimer )
+      _ickTimerDelete( ictx, device->heartbeatTimer );
 
     // Unlink from device list and free instance
     _ickLibDeviceRemove( ictx, device );
@@ -1726,9 +1749,10 @@ void _ickDeviceExpireTimerCb( const ickTimer_t *timer, void *data, int tag )
   }
 
 /*------------------------------------------------------------------------*\
-    Release device list locks
+    Release device and timer list locks
 \*------------------------------------------------------------------------*/
   _ickLibDeviceListUnlock( ictx );
+  _ickTimerListUnlock( ictx );
 }
 
 
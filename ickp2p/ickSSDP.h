@@ -67,6 +67,8 @@ Remarks         : -
 #define ICKSSDP_MCASTADDR       "239.255.255.250"
 #define ICKSSDP_MCASTPORT       1900
 #define ICKSSDP_INITIALDELAY    500
+#define ICKSSDP_NOTIFYSLACK     (ICKSSDP_RNDDELAY/2)   // ms, coalescing of notification bursts
+#define ICKSSDP_PERIODICSLACK   1000                   // ms, coalescing of announcements and searches
 
 /*=========================================================================*\
   Macro and type definitions
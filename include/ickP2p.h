@@ -0,0 +1 @@
+../ickp2p/ickP2p.h
\ No newline at end of file
@@ -54,10 +54,13 @@ Remarks         : -
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "ickP2p.h"
 #include "config.h"
@@ -77,14 +80,61 @@ Remarks         : -
 #define DEVICENAME  "ickp2plibtester"
 #define IFNAME      "wlan0"
 
+#define SMOKE_TIMEOUT   10000
+#define SMOKE_NODEVICE  "00000000-0000-0000-0000-000000000000"
+#define SMOKE_MESSAGES  500
+#define SMOKE_THRESHOLD 1024
+#define SMOKE_FRAGMENT  1024
+
+// A smoke test sender thread
+typedef struct {
+  ickP2pContext_t *ictx;
+  int              id;
+  int              count;
+  int              waitDrained;   // wait for ICKP2P_DRAINED on ICKERR_BUSY
+  int              busy;
+  int              failed;
+} smokeSender_t;
+
 static volatile int stop_signal;
 
+// Smoke test state, counters are protected by smokeMutex
+static pthread_mutex_t smokeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  smokeCond  = PTHREAD_COND_INITIALIZER;
+static int             smokeConnected;
+static int             smokeReceived;
+static int             smokeCorrupt;
+static int             smokeDrained;
+static int             smokeChunks;
+static int             smokeStreamed;
+static size_t          smokeStreamOffset;
+static int             smokePeerConnected;
+static const char     *smokePeerTarget;
+
 
 /*=========================================================================*\
   Private prototypes
 \*=========================================================================*/
 static void sigHandler( int sig, siginfo_t *siginfo, void *context );
 
+static int  smokeRun( ickP2pContext_t *ictx, const char *peerIfname, int port );
+static int  smokeBatch( ickP2pContext_t *ictx );
+static int  smokeWatermarks( ickP2pContext_t *ictx );
+static int  smokeSenders( ickP2pContext_t *ictx, const char *name, int waitDrained );
+static void *smokeSenderThread( void *arg );
+static int  smokeStream( ickP2pContext_t *ictx );
+static int  smokeDispatch( ickP2pContext_t *ictx );
+static int  smokeSubmissions( ickP2pContext_t *ictx );
+static int  smokeLoopback( ickP2pContext_t *ictx );
+static int  smokeFragments( ickP2pContext_t *ictx, const char *ifname, int port );
+static void smokeStreamCb( ickP2pContext_t *ictx, const char *sourceUuid, ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices, ickP2pMessageFlag_t mFlags, const char *chunk, size_t cSize, size_t offset, int mode );
+static void smokeDiscoverCb( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t change, ickP2pServicetype_t type );
+static void smokePeerDiscoverCb( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t change, ickP2pServicetype_t type );
+static void smokeMessageCb( ickP2pContext_t *ictx, const char *sourceUuid, ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices, const char* message, size_t mSize, ickP2pMessageFlag_t mFlags );
+static void smokeCount( int *counter );
+static int  smokeGet( const int *counter );
+static int  smokeWait( const int *counter, int value, int timeout );
+
 
 /*=========================================================================*\
   main
@@ -94,6 +144,9 @@ int main( int argc, char *argv[] )
   int                  help_flag   = 0;
   int                  vers_flag   = 0;
   int                  loop_flag   = 0;
+  int                  smoke_flag  = 0;
+  int                  direct_flag = 0;
+  int                  peer_flag   = 0;
   const char          *cfg_fname   = NULL;
   char                *uuidStr     = NULL;
   const char          *name        = DEVICENAME;
@@ -102,6 +155,9 @@ int main( int argc, char *argv[] )
   const char          *verb_arg    = "4";
   const char          *wait_arg    = "10000";
   const char          *service_arg = NULL;
+  const char          *stream_arg  = NULL;
+  const char          *workers_arg = NULL;
+  const char          *ring_arg    = NULL;
 
   ickErrcode_t         irc;
   ickP2pContext_t     *ictx;
@@ -109,7 +165,11 @@ int main( int argc, char *argv[] )
   ickP2pServicetype_t  service;
   int                  port        = 1900;
   int                  waitspan    = 10000;
+  size_t               threshold   = 0;
+  int                  workers     = 0;
+  int                  ringsize    = 0;
   int                  cntr;
+  int                  failed      = 0;
   char                *vlp;
 
 /*-------------------------------------------------------------------------*\
@@ -124,8 +184,14 @@ int main( int argc, char *argv[] )
   addarg( "*port",     "-p",  &port_arg,    "port",      "SSDP listener port" );
   addarg( "*idev",     "-i",  &ifname,      "interface", "Main network interface" );
   addarg( "*loopback", "-l",  &loop_flag,   NULL,        "Enable UPnP self discovery" );
+  addarg( "smoke",     "-S",  &smoke_flag,  NULL,        "Run smoke tests against ourselves and quit" );
+  addarg( "peer",      "-P",  &peer_flag,   NULL,        "Smoke test fragmented messages with a second device" );
   addarg( "*services", "-s",  &service_arg, "bitvector", "Announce services (default: random)" );
   addarg( "*wait",     "-w",  &wait_arg,    "millisecs", "Maximum wait time between two messages" );
+  addarg( "*stream",   "-T",  &stream_arg,  "bytes",     "Stream received messages larger than this (main loop only)" );
+  addarg( "*workers",  "-D",  &workers_arg, "count",     "Number of message dispatch workers (default: 0)" );
+  addarg( "*ring",     "-R",  &ring_arg,    "slots",     "Size of submission ring (default: 0)" );
+  addarg( "*direct",   "-L",  &direct_flag, NULL,        "Deliver messages to ourselves synchronously" );
   addarg( "*verbose",  "-v",  &verb_arg,    "level",     "Set ickp2p logging level (0-7)" );
 
 /*-------------------------------------------------------------------------*\
@@ -188,7 +254,7 @@ int main( int argc, char *argv[] )
   }
 
 /*------------------------------------------------------------------------*\
-    Use random service?
+    Use random service? (smoke tests need services that connect to themselves)
 \*------------------------------------------------------------------------*/
   if( service_arg ) {
     char *eptr;
@@ -200,6 +266,8 @@ int main( int argc, char *argv[] )
       return 1;
     }
   }
+  else if( smoke_flag )
+    service = ICKP2P_SERVICE_PLAYER|ICKP2P_SERVICE_CONTROLLER;
   else
     service = 1<<random()%4;
 
@@ -231,6 +299,49 @@ int main( int argc, char *argv[] )
     }
   }
 
+/*------------------------------------------------------------------------*\
+    Get stream threshold
+\*------------------------------------------------------------------------*/
+  if( stream_arg ) {
+    char *eptr;
+    long  val = strtol( stream_arg, &eptr, 0 );
+    while( isspace(*eptr) )
+      eptr++;
+    if( *eptr || val<=0 ) {
+      fprintf( stderr, "Bad stream threshold: '%s'\n", stream_arg );
+      return 1;
+    }
+    threshold = (size_t)val;
+  }
+
+/*------------------------------------------------------------------------*\
+    Get number of dispatch workers
+\*------------------------------------------------------------------------*/
+  if( workers_arg ) {
+    char *eptr;
+    workers = (int)strtol( workers_arg, &eptr, 0 );
+    while( isspace(*eptr) )
+      eptr++;
+    if( *eptr || workers<0 ) {
+      fprintf( stderr, "Bad number of workers: '%s'\n", workers_arg );
+      return 1;
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Get size of submission ring
+\*------------------------------------------------------------------------*/
+  if( ring_arg ) {
+    char *eptr;
+    ringsize = (int)strtol( ring_arg, &eptr, 0 );
+    while( isspace(*eptr) )
+      eptr++;
+    if( *eptr || ringsize<0 ) {
+      fprintf( stderr, "Bad submission ring size: '%s'\n", ring_arg );
+      return 1;
+    }
+  }
+
 /*------------------------------------------------------------------------*\
     Create a very large payload message
 \*------------------------------------------------------------------------*/
@@ -258,18 +369,26 @@ int main( int argc, char *argv[] )
   }
 
 /*------------------------------------------------------------------------*\
-    Add callbacks
+    Add callbacks (smoke tests count instead of responding)
 \*------------------------------------------------------------------------*/
-  irc = ickP2pRegisterDiscoveryCallback( ictx, ickDiscoverCb );
+  irc = ickP2pRegisterDiscoveryCallback( ictx, smoke_flag?smokeDiscoverCb:ickDiscoverCb );
   if( irc ) {
     printf( "ickP2pRegisterDiscoveryCallback: %s\n", ickStrError(irc) );
     goto end;
   }
-  irc = ickP2pRegisterMessageCallback( ictx, ickMessageCb );
+  irc = ickP2pRegisterMessageCallback( ictx, smoke_flag?smokeMessageCb:ickMessageCb );
   if( irc ) {
     printf( "ickP2pRegisterMessageCallback: %s\n", ickStrError(irc) );
     goto end;
   }
+  if( threshold && !smoke_flag ) {
+    ickP2pSetStreamThreshold( ictx, threshold );
+    irc = ickP2pRegisterStreamCallback( ictx, ickStreamCb );
+    if( irc ) {
+      printf( "ickP2pRegisterStreamCallback: %s\n", ickStrError(irc) );
+      goto end;
+    }
+  }
 
 /*------------------------------------------------------------------------*\
     Add interfaces
@@ -297,9 +416,9 @@ int main( int argc, char *argv[] )
   }
 
 /*------------------------------------------------------------------------*\
-    Set loopback mode
+    Set loopback mode (smoke tests talk to ourselves)
 \*------------------------------------------------------------------------*/
-  if( loop_flag ) {
+  if( loop_flag || smoke_flag ) {
     irc = ickP2pUpnpLoopback( ictx, 1 );
     if( irc ) {
       printf( "ickP2pUpnpLoopback: %s\n", ickStrError(irc) );
@@ -307,6 +426,39 @@ int main( int argc, char *argv[] )
     }
   }
 
+/*------------------------------------------------------------------------*\
+    Set up message dispatching
+\*------------------------------------------------------------------------*/
+  if( workers ) {
+    irc = ickP2pSetDispatchWorkers( ictx, workers );
+    if( irc ) {
+      printf( "ickP2pSetDispatchWorkers: %s\n", ickStrError(irc) );
+      goto end;
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Set up submission ring
+\*------------------------------------------------------------------------*/
+  if( ringsize ) {
+    irc = ickP2pSetSubmissionRing( ictx, ringsize );
+    if( irc ) {
+      printf( "ickP2pSetSubmissionRing: %s\n", ickStrError(irc) );
+      goto end;
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Set delivery mode for messages to ourselves
+\*------------------------------------------------------------------------*/
+  if( direct_flag ) {
+    irc = ickP2pSetLoopbackMode( ictx, ICKP2P_LOOPBACK_DIRECT );
+    if( irc ) {
+      printf( "ickP2pSetLoopbackMode: %s\n", ickStrError(irc) );
+      goto end;
+    }
+  }
+
 /*------------------------------------------------------------------------*\
     Startup
 \*------------------------------------------------------------------------*/
@@ -330,6 +482,17 @@ int main( int argc, char *argv[] )
   printf( "ickP2pGetLwsPort:       %d\n",     ickP2pGetLwsPort(ictx) );
   printf( "ickP2pGetServices:      0x%02x\n", ickP2pGetServices(ictx) );
   printf( "ickP2pGetUpnpLoopback:  %d\n",     ickP2pGetUpnpLoopback(ictx) );
+  printf( "ickP2pGetDispatchWorkers: %d\n",   ickP2pGetDispatchWorkers(ictx) );
+  printf( "ickP2pGetSubmissionRing: %d\n",    ickP2pGetSubmissionRing(ictx) );
+  printf( "ickP2pGetLoopbackMode:  %d\n",     ickP2pGetLoopbackMode(ictx) );
+
+/*------------------------------------------------------------------------*\
+    Run smoke tests instead of main loop?
+\*------------------------------------------------------------------------*/
+  if( smoke_flag ) {
+    failed = smokeRun( ictx, peer_flag?ifname:NULL, port );
+    goto end;
+  }
 
 /*------------------------------------------------------------------------*\
     Main loop: wait for termination
@@ -383,7 +546,7 @@ end:
     That's all
 \*------------------------------------------------------------------------*/
   printf( "%s: main thread terminated\n", argv[0] );
-  return 0;
+  return failed ? 1 : 0;
 }
 
 
@@ -419,6 +582,807 @@ static void sigHandler( int sig, siginfo_t *siginfo, void *context )
 }
 
 
+/*=========================================================================*\
+        Run smoke tests against ourselves
+          peerIfname is the interface for a second device (NULL to skip
+          tests of fragmented messages)
+          returns the number of failed tests
+\*=========================================================================*/
+static int smokeRun( ickP2pContext_t *ictx, const char *peerIfname, int port )
+{
+  int failed = 0;
+
+/*------------------------------------------------------------------------*\
+    Wait for UPnP self discovery
+\*------------------------------------------------------------------------*/
+  printf( "Smoke: waiting for connection to ourselves...\n" );
+  if( smokeWait(&smokeConnected,1,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: loopback device did not connect\n" );
+    return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Run tests
+\*------------------------------------------------------------------------*/
+  failed += smokeBatch( ictx );
+  failed += smokeWatermarks( ictx );
+  failed += smokeStream( ictx );
+  failed += smokeDispatch( ictx );
+  failed += smokeSubmissions( ictx );
+  failed += smokeLoopback( ictx );
+  if( peerIfname )
+    failed += smokeFragments( ictx, peerIfname, port );
+
+/*------------------------------------------------------------------------*\
+    Report
+\*------------------------------------------------------------------------*/
+  if( smokeGet(&smokeCorrupt) ) {
+    printf( "Smoke: %d corrupt messages received\n", smokeGet(&smokeCorrupt) );
+    failed++;
+  }
+  printf( "Smoke: %d test(s) failed\n", failed );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test: batched sending
+          Two messages to ourselves, a notification (that includes us)
+          and a message to an unknown device
+\*=========================================================================*/
+static int smokeBatch( ickP2pContext_t *ictx )
+{
+  ickP2pBatchEntry_t  entries[4];
+  ickErrcode_t        irc;
+  ickErrcode_t        expected;
+  int                 received;
+  int                 failed = 0;
+  int                 i;
+
+/*------------------------------------------------------------------------*\
+    Set up entries
+\*------------------------------------------------------------------------*/
+  memset( entries, 0, sizeof(entries) );
+  for( i=0; i<4; i++ ) {
+    entries[i].uuid           = ickP2pGetDeviceUuid( ictx );
+    entries[i].targetServices = ICKP2P_SERVICE_ANY;
+    entries[i].sourceService  = ickP2pGetServices( ictx );
+    entries[i].payload        = "Smoke #batch - hello ickstream world!";
+  }
+  entries[1].uuid  = NULL;
+  entries[2].uuid  = SMOKE_NODEVICE;
+  entries[3].pSize = strlen( entries[3].payload ) + 1;
+
+/*------------------------------------------------------------------------*\
+    Send batch, unknown targets are detected late with a submission ring
+\*------------------------------------------------------------------------*/
+  expected = ickP2pGetSubmissionRing(ictx) ? ICKERR_SUCCESS : ICKERR_NODEVICE;
+  received = smokeGet( &smokeReceived );
+  irc = ickP2pSendBatch( ictx, entries, 4 );
+  if( irc!=expected ) {
+    printf( "Smoke: ickP2pSendBatch returned \"%s\"\n", ickStrError(irc) );
+    failed = 1;
+  }
+  for( i=0; i<4; i++ ) {
+    if( entries[i].result!=(i==2?expected:ICKERR_SUCCESS) ) {
+      printf( "Smoke: ickP2pSendBatch entry %d: \"%s\"\n", i, ickStrError(entries[i].result) );
+      failed = 1;
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Wait for delivery
+\*------------------------------------------------------------------------*/
+  if( smokeWait(&smokeReceived,received+3,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: ickP2pSendBatch delivered %d of 3 messages\n",
+            smokeGet(&smokeReceived)-received );
+    failed = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  printf( "Smoke: ickP2pSendBatch %s\n", failed?"FAILED":"ok" );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test: flow control
+          Two threads send to ourselves with low device and global
+          watermarks and retry after ICKP2P_DRAINED if rejected
+\*=========================================================================*/
+static int smokeWatermarks( ickP2pContext_t *ictx )
+{
+  ickP2pWatermarks_t  deviceMarks = { 0, 0, 8, 4 };
+  ickP2pWatermarks_t  globalMarks = { 0, 0, 16, 8 };
+  ickP2pWatermarks_t  badMarks    = { 0, 0, 4, 8 };
+  ickErrcode_t        irc;
+  int                 failed = 0;
+
+/*------------------------------------------------------------------------*\
+    Busy output queues are detected late with a submission ring
+\*------------------------------------------------------------------------*/
+  if( ickP2pGetSubmissionRing(ictx) ) {
+    printf( "Smoke: watermarks skipped (submission ring is active)\n" );
+    return 0;
+  }
+
+/*------------------------------------------------------------------------*\
+    Set watermarks, inconsistent ones are rejected
+\*------------------------------------------------------------------------*/
+  irc = ickP2pSetWatermarks( ictx, NULL, &badMarks );
+  if( irc!=ICKERR_INVALID ) {
+    printf( "Smoke: ickP2pSetWatermarks accepted low>high (\"%s\")\n", ickStrError(irc) );
+    failed = 1;
+  }
+  irc = ickP2pSetWatermarks( ictx, NULL, &deviceMarks );
+  if( !irc )
+    irc = ickP2pSetGlobalWatermarks( ictx, &globalMarks );
+  if( !irc )
+    irc = ickP2pSetOverflowPolicy( ictx, ICKP2P_OVERFLOW_REJECT );
+  if( irc ) {
+    printf( "Smoke: setting watermarks: %s\n", ickStrError(irc) );
+    return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Send and receive
+\*------------------------------------------------------------------------*/
+  failed |= smokeSenders( ictx, "watermarks", 1 );
+
+/*------------------------------------------------------------------------*\
+    Reset watermarks
+\*------------------------------------------------------------------------*/
+  ickP2pSetWatermarks( ictx, NULL, NULL );
+  ickP2pSetGlobalWatermarks( ictx, NULL );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  printf( "Smoke: watermarks %s (%d ICKP2P_DRAINED events)\n",
+          failed?"FAILED":"ok", smokeGet(&smokeDrained) );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Send messages to ourselves from two threads
+          waitDrained - rejected messages are retried after ICKP2P_DRAINED,
+                        otherwise after a millisecond
+          returns 0 if all messages were received, 1 otherwise
+\*=========================================================================*/
+static int smokeSenders( ickP2pContext_t *ictx, const char *name, int waitDrained )
+{
+  smokeSender_t  senders[2];
+  pthread_t      threads[2];
+  int            received;
+  int            failed = 0;
+  int            i;
+
+/*------------------------------------------------------------------------*\
+    Start senders
+\*------------------------------------------------------------------------*/
+  received = smokeGet( &smokeReceived );
+  for( i=0; i<2; i++ ) {
+    memset( senders+i, 0, sizeof(smokeSender_t) );
+    senders[i].ictx        = ictx;
+    senders[i].id          = i;
+    senders[i].count       = SMOKE_MESSAGES;
+    senders[i].waitDrained = waitDrained;
+    if( pthread_create(threads+i,NULL,smokeSenderThread,senders+i) ) {
+      printf( "Smoke: %s: could not start sender thread\n", name );
+      senders[i].failed = 1;
+      senders[i].count  = 0;
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    Collect senders
+\*------------------------------------------------------------------------*/
+  for( i=0; i<2; i++ ) {
+    if( senders[i].count )
+      pthread_join( threads[i], NULL );
+    failed |= senders[i].failed;
+    printf( "Smoke: %s: sender %d got %d times ICKERR_BUSY\n", name, i, senders[i].busy );
+  }
+  if( failed )
+    return 1;
+
+/*------------------------------------------------------------------------*\
+    Wait for delivery
+\*------------------------------------------------------------------------*/
+  if( smokeWait(&smokeReceived,received+2*SMOKE_MESSAGES,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: %s: delivered %d of %d messages\n", name,
+            smokeGet(&smokeReceived)-received, 2*SMOKE_MESSAGES );
+    return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  return 0;
+}
+
+
+/*=========================================================================*\
+        Smoke test sender thread
+\*=========================================================================*/
+static void *smokeSenderThread( void *arg )
+{
+  smokeSender_t   *sender = arg;
+  ickErrcode_t     irc;
+  char             buffer[64];
+  int              drained;
+  int              i;
+
+  for( i=0; i<sender->count; i++ ) {
+    sprintf( buffer, "Smoke #%d.%04d", sender->id, i );
+
+    // Get event count before sending, so no ICKP2P_DRAINED is missed
+    drained = smokeGet( &smokeDrained );
+    irc = ickP2pSendMsg( sender->ictx, ickP2pGetDeviceUuid(sender->ictx),
+                         ICKP2P_SERVICE_ANY, ickP2pGetServices(sender->ictx), buffer, 0 );
+
+    // Busy: retry after queues drained (or a short while)
+    if( irc==ICKERR_BUSY ) {
+      sender->busy++;
+      i--;
+      if( smokeWait(&smokeDrained,drained+1,sender->waitDrained?SMOKE_TIMEOUT:1) &&
+          sender->waitDrained ) {
+        printf( "Smoke: sender %d stalled, no ICKP2P_DRAINED after ICKERR_BUSY\n", sender->id );
+        sender->failed = 1;
+        break;
+      }
+      continue;
+    }
+    if( irc ) {
+      printf( "Smoke: sender %d: ickP2pSendMsg: %s\n", sender->id, ickStrError(irc) );
+      sender->failed = 1;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*=========================================================================*\
+        Smoke test: streaming callbacks
+          Messages to ourselves are never fragmented, so a large payload
+          still has to arrive in one piece at the message callbacks
+\*=========================================================================*/
+static int smokeStream( ickP2pContext_t *ictx )
+{
+  ickErrcode_t  irc;
+  char         *vlp;
+  int           received;
+  int           corrupt;
+  int           failed = 0;
+
+/*------------------------------------------------------------------------*\
+    Set threshold and register callback
+\*------------------------------------------------------------------------*/
+  vlp = createVlp();
+  if( !vlp )
+    return 1;
+  ickP2pSetStreamThreshold( ictx, SMOKE_THRESHOLD );
+  irc = ickP2pRegisterStreamCallback( ictx, smokeStreamCb );
+  if( irc ) {
+    printf( "Smoke: ickP2pRegisterStreamCallback: %s\n", ickStrError(irc) );
+    free( vlp );
+    return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Send very large payload to ourselves
+\*------------------------------------------------------------------------*/
+  received = smokeGet( &smokeReceived );
+  corrupt  = smokeGet( &smokeCorrupt );
+  irc = ickP2pSendMsg( ictx, ickP2pGetDeviceUuid(ictx), ICKP2P_SERVICE_ANY,
+                       ickP2pGetServices(ictx), vlp, VLP_SIZE );
+  if( irc ) {
+    printf( "Smoke: stream: ickP2pSendMsg: %s\n", ickStrError(irc) );
+    failed = 1;
+  }
+  else if( smokeWait(&smokeReceived,received+1,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: stream: very large payload was not delivered\n" );
+    failed = 1;
+  }
+  else if( smokeGet(&smokeCorrupt)!=corrupt )
+    failed = 1;
+
+/*------------------------------------------------------------------------*\
+    Remove callback, a second removal has to fail
+\*------------------------------------------------------------------------*/
+  irc = ickP2pRemoveStreamCallback( ictx, smokeStreamCb );
+  if( irc ) {
+    printf( "Smoke: ickP2pRemoveStreamCallback: %s\n", ickStrError(irc) );
+    failed = 1;
+  }
+  irc = ickP2pRemoveStreamCallback( ictx, smokeStreamCb );
+  if( irc!=ICKERR_NOMEMBER ) {
+    printf( "Smoke: ickP2pRemoveStreamCallback removed twice (\"%s\")\n", ickStrError(irc) );
+    failed = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  free( vlp );
+  printf( "Smoke: stream %s (%d chunks streamed)\n", failed?"FAILED":"ok", smokeGet(&smokeChunks) );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test: message dispatching
+          Messages to ourselves are dispatched by the workers (if any)
+\*=========================================================================*/
+static int smokeDispatch( ickP2pContext_t *ictx )
+{
+  ickP2pDispatchStats_t  before;
+  ickP2pDispatchStats_t  after;
+  ickErrcode_t           irc;
+  long                   expected;
+  int                    failed = 0;
+  int                    i;
+
+/*------------------------------------------------------------------------*\
+    Workers can only be configured before startup
+\*------------------------------------------------------------------------*/
+  irc = ickP2pSetDispatchWorkers( ictx, 1 );
+  if( irc!=ICKERR_WRONGSTATE ) {
+    printf( "Smoke: ickP2pSetDispatchWorkers accepted in running state (\"%s\")\n", ickStrError(irc) );
+    failed = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Send and receive
+\*------------------------------------------------------------------------*/
+  ickP2pGetDispatchStats( ictx, &before );
+  failed |= smokeSenders( ictx, "dispatch", 0 );
+
+/*------------------------------------------------------------------------*\
+    Direct loopback delivery bypasses the workers
+\*------------------------------------------------------------------------*/
+  expected = 0;
+  if( ickP2pGetDispatchWorkers(ictx) && ickP2pGetLoopbackMode(ictx)==ICKP2P_LOOPBACK_QUEUED )
+    expected = 2*SMOKE_MESSAGES;
+
+/*------------------------------------------------------------------------*\
+    Get statistics, workers count messages after the callbacks returned
+\*------------------------------------------------------------------------*/
+  for( i=0; i<SMOKE_TIMEOUT/10; i++ ) {
+    struct timeval timeout;
+    ickP2pGetDispatchStats( ictx, &after );
+    if( after.dispatched-before.dispatched>=expected )
+      break;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 10000;
+    select( 0, NULL, NULL, NULL, &timeout );
+  }
+  if( after.workers!=ickP2pGetDispatchWorkers(ictx) ) {
+    printf( "Smoke: ickP2pGetDispatchStats reports %d workers, ickP2pGetDispatchWorkers %d\n",
+            after.workers, ickP2pGetDispatchWorkers(ictx) );
+    failed = 1;
+  }
+
+  if( after.dispatched-before.dispatched<expected ||
+      (!expected && after.dispatched!=before.dispatched) ) {
+    printf( "Smoke: dispatch: %ld messages dispatched by workers, expected %ld\n",
+            after.dispatched-before.dispatched, expected );
+    failed = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  printf( "Smoke: dispatch %s (%d workers, max. queue %d, latency avg %.6fs)\n",
+          failed?"FAILED":"ok", after.workers, after.highWater, after.latencyAvg );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test: submission ring
+          Two threads send to ourselves and retry if the ring is full
+\*=========================================================================*/
+static int smokeSubmissions( ickP2pContext_t *ictx )
+{
+  ickErrcode_t  irc;
+  int           slots;
+  int           failed = 0;
+
+/*------------------------------------------------------------------------*\
+    Ring can only be configured before startup, size is a power of 2
+\*------------------------------------------------------------------------*/
+  irc = ickP2pSetSubmissionRing( ictx, 16 );
+  if( irc!=ICKERR_WRONGSTATE ) {
+    printf( "Smoke: ickP2pSetSubmissionRing accepted in running state (\"%s\")\n", ickStrError(irc) );
+    failed = 1;
+  }
+  slots = ickP2pGetSubmissionRing( ictx );
+  if( slots<0 || (slots&(slots-1)) ) {
+    printf( "Smoke: ickP2pGetSubmissionRing: bad size %d\n", slots );
+    failed = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Send and receive
+\*------------------------------------------------------------------------*/
+  failed |= smokeSenders( ictx, "submissions", 0 );
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  printf( "Smoke: submissions %s (%d slots)\n", failed?"FAILED":"ok", slots );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test: loopback delivery
+          Messages to ourselves sent by all send functions. In direct
+          mode they have to be delivered before the functions return.
+\*=========================================================================*/
+static int smokeLoopback( ickP2pContext_t *ictx )
+{
+  const char          *uuid    = ickP2pGetDeviceUuid( ictx );
+  ickP2pServicetype_t  service = ickP2pGetServices( ictx );
+  const char          *message = "Smoke #loopback - hello ickstream world!";
+  const char          *names[] = { "ickP2pSendMsg", "ickP2pSendMsgV", "ickP2pSendBatch", "ickP2pSendMsgBuffer" };
+  ickP2pLoopbackMode_t mode    = ickP2pGetLoopbackMode( ictx );
+  ickP2pBatchEntry_t   entry;
+  struct iovec         iov[2];
+  ickErrcode_t         irc;
+  char                *buffer;
+  int                  received;
+  int                  failed = 0;
+  int                  i;
+
+/*------------------------------------------------------------------------*\
+    Mode can only be configured before startup
+\*------------------------------------------------------------------------*/
+  irc = ickP2pSetLoopbackMode( ictx, ICKP2P_LOOPBACK_QUEUED );
+  if( irc!=ICKERR_WRONGSTATE ) {
+    printf( "Smoke: ickP2pSetLoopbackMode accepted in running state (\"%s\")\n", ickStrError(irc) );
+    failed = 1;
+  }
+  if( mode!=ICKP2P_LOOPBACK_QUEUED && mode!=ICKP2P_LOOPBACK_DIRECT ) {
+    printf( "Smoke: ickP2pGetLoopbackMode: bad mode %d\n", mode );
+    return 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Send one message with every function
+\*------------------------------------------------------------------------*/
+  for( i=0; i<4; i++ ) {
+    received = smokeGet( &smokeReceived );
+    switch( i ) {
+      case 0:
+        irc = ickP2pSendMsg( ictx, uuid, ICKP2P_SERVICE_ANY, service, message, 0 );
+        break;
+      case 1:
+        iov[0].iov_base = (void*)message;
+        iov[0].iov_len  = 7;
+        iov[1].iov_base = (void*)(message+7);
+        iov[1].iov_len  = strlen( message ) + 1 - 7;
+        irc = ickP2pSendMsgV( ictx, uuid, ICKP2P_SERVICE_ANY, service, iov, 2 );
+        break;
+      case 2:
+        memset( &entry, 0, sizeof(entry) );
+        entry.uuid           = uuid;
+        entry.targetServices = ICKP2P_SERVICE_ANY;
+        entry.sourceService  = service;
+        entry.payload        = message;
+        irc = ickP2pSendBatch( ictx, &entry, 1 );
+        break;
+      default:
+        buffer = ickP2pAllocMsgBuffer( ictx, strlen(message)+1 );
+        if( !buffer ) {
+          irc = ICKERR_NOMEM;
+          break;
+        }
+        strcpy( buffer, message );
+        irc = ickP2pSendMsgBuffer( ictx, uuid, ICKP2P_SERVICE_ANY, service, buffer, 0, NULL, NULL );
+        break;
+    }
+
+    // Check result and delivery
+    if( irc ) {
+      printf( "Smoke: loopback: %s: %s\n", names[i], ickStrError(irc) );
+      failed = 1;
+    }
+    else if( mode==ICKP2P_LOOPBACK_DIRECT && smokeGet(&smokeReceived)!=received+1 ) {
+      printf( "Smoke: loopback: %s returned before delivery\n", names[i] );
+      failed = 1;
+    }
+    else if( smokeWait(&smokeReceived,received+1,SMOKE_TIMEOUT) ) {
+      printf( "Smoke: loopback: %s message was not delivered\n", names[i] );
+      failed = 1;
+    }
+  }
+
+/*------------------------------------------------------------------------*\
+    That's all
+\*------------------------------------------------------------------------*/
+  printf( "Smoke: loopback %s (%s mode)\n", failed?"FAILED":"ok",
+          mode==ICKP2P_LOOPBACK_DIRECT?"direct":"queued" );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test: fragmented messages
+          A second device sends very large payloads in small websocket
+          fragments, they have to be streamed (with stream callback) or
+          reassembled (without) by us. This needs a working network
+          connection between the two devices.
+\*=========================================================================*/
+static int smokeFragments( ickP2pContext_t *ictx, const char *ifname, int port )
+{
+  ickP2pContext_t *peer;
+  ickErrcode_t     irc;
+  uuid_t           uuid;
+  char             uuidStr[37];
+  char            *vlp;
+  int              chunks;
+  int              streamed;
+  int              received;
+  int              corrupt;
+  int              failed = 0;
+
+/*------------------------------------------------------------------------*\
+    Create and start peer device
+\*------------------------------------------------------------------------*/
+  vlp = createVlp();
+  if( !vlp )
+    return 1;
+  uuid_generate( uuid );
+  uuid_unparse( uuid, uuidStr );
+  smokePeerTarget = ickP2pGetDeviceUuid( ictx );
+  peer = ickP2pCreate( "ickp2plibtester peer", uuidStr, "./httpFolder", 100, port,
+                       ICKP2P_SERVICE_PLAYER|ICKP2P_SERVICE_CONTROLLER, &irc );
+  if( !peer ) {
+    printf( "Smoke: fragments: ickP2pCreate: %s\n", ickStrError(irc) );
+    free( vlp );
+    return 1;
+  }
+  irc = ickP2pRegisterDiscoveryCallback( peer, smokePeerDiscoverCb );
+  if( !irc )
+    irc = ickP2pSetFragmentSize( peer, SMOKE_FRAGMENT );
+  if( !irc )
+    irc = ickP2pAddInterface( peer, ifname, NULL );
+  if( !irc )
+    irc = ickP2pUpnpLoopback( peer, 1 );
+  if( !irc )
+    irc = ickP2pResume( peer );
+  if( irc ) {
+    printf( "Smoke: fragments: could not start peer (%s)\n", ickStrError(irc) );
+    failed = 1;
+    goto end;
+  }
+  if( smokeWait(&smokePeerConnected,1,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: fragments: peer did not connect to us\n" );
+    failed = 1;
+    goto end;
+  }
+
+/*------------------------------------------------------------------------*\
+    Streaming: payload has to arrive in more than one chunk
+\*------------------------------------------------------------------------*/
+  ickP2pSetStreamThreshold( ictx, SMOKE_THRESHOLD );
+  irc = ickP2pRegisterStreamCallback( ictx, smokeStreamCb );
+  if( irc ) {
+    printf( "Smoke: ickP2pRegisterStreamCallback: %s\n", ickStrError(irc) );
+    failed = 1;
+    goto end;
+  }
+  chunks   = smokeGet( &smokeChunks );
+  streamed = smokeGet( &smokeStreamed );
+  corrupt  = smokeGet( &smokeCorrupt );
+  irc = ickP2pSendMsg( peer, smokePeerTarget, ICKP2P_SERVICE_ANY,
+                       ickP2pGetServices(peer), vlp, VLP_SIZE );
+  if( irc ) {
+    printf( "Smoke: fragments: ickP2pSendMsg: %s\n", ickStrError(irc) );
+    failed = 1;
+  }
+  else if( smokeWait(&smokeStreamed,streamed+1,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: fragments: very large payload was not streamed\n" );
+    failed = 1;
+  }
+  else if( smokeGet(&smokeChunks)-chunks<2 ) {
+    printf( "Smoke: fragments: very large payload was not fragmented\n" );
+    failed = 1;
+  }
+  else if( smokeGet(&smokeCorrupt)!=corrupt )
+    failed = 1;
+  irc = ickP2pRemoveStreamCallback( ictx, smokeStreamCb );
+  if( irc ) {
+    printf( "Smoke: ickP2pRemoveStreamCallback: %s\n", ickStrError(irc) );
+    failed = 1;
+  }
+
+/*------------------------------------------------------------------------*\
+    Reassembly: payload has to arrive in one piece
+\*------------------------------------------------------------------------*/
+  received = smokeGet( &smokeReceived );
+  corrupt  = smokeGet( &smokeCorrupt );
+  irc = ickP2pSendMsg( peer, smokePeerTarget, ICKP2P_SERVICE_ANY,
+                       ickP2pGetServices(peer), vlp, VLP_SIZE );
+  if( irc ) {
+    printf( "Smoke: fragments: ickP2pSendMsg: %s\n", ickStrError(irc) );
+    failed = 1;
+  }
+  else if( smokeWait(&smokeReceived,received+1,SMOKE_TIMEOUT) ) {
+    printf( "Smoke: fragments: very large payload was not reassembled\n" );
+    failed = 1;
+  }
+  else if( smokeGet(&smokeCorrupt)!=corrupt )
+    failed = 1;
+
+/*------------------------------------------------------------------------*\
+    Shut down peer, that's all
+\*------------------------------------------------------------------------*/
+end:
+  irc = ickP2pEnd( peer, NULL );
+  if( irc )
+    printf( "Smoke: fragments: ickP2pEnd: %s\n", ickStrError(irc) );
+  free( vlp );
+  printf( "Smoke: fragments %s (%d chunks streamed)\n", failed?"FAILED":"ok", smokeGet(&smokeChunks) );
+  return failed;
+}
+
+
+/*=========================================================================*\
+        Smoke test stream callback: check and count chunks
+\*=========================================================================*/
+static void smokeStreamCb( ickP2pContext_t *ictx, const char *sourceUuid,
+                           ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                           ickP2pMessageFlag_t mFlags, const char *chunk, size_t cSize,
+                           size_t offset, int mode )
+{
+  size_t i;
+
+  ickStreamCb( ictx, sourceUuid, sourceService, targetServices, mFlags, chunk, cSize, offset, mode );
+
+/*------------------------------------------------------------------------*\
+    Check integrity of very large payload chunks
+\*------------------------------------------------------------------------*/
+  for( i=0; i<cSize; i++ )
+    if( chunk[i]!=(char)((offset+i)%VLP_MODUL) )
+      break;
+
+/*------------------------------------------------------------------------*\
+    Check continuity, count chunks and complete streams
+\*------------------------------------------------------------------------*/
+  pthread_mutex_lock( &smokeMutex );
+  if( mode&ICKP2P_STREAM_BEGIN )
+    smokeStreamOffset = 0;
+  if( i<cSize || offset!=smokeStreamOffset || (mode&ICKP2P_STREAM_ABORT) ||
+      ((mode&ICKP2P_STREAM_END) && offset+cSize!=VLP_SIZE) ) {
+    printf( "Smoke: corrupt stream chunk (%ld bytes at %ld, mode 0x%02x)\n",
+            (long)cSize, (long)offset, mode );
+    smokeCorrupt++;
+  }
+  smokeStreamOffset = offset + cSize;
+  smokeChunks++;
+  if( mode&ICKP2P_STREAM_END )
+    smokeStreamed++;
+  pthread_cond_broadcast( &smokeCond );
+  pthread_mutex_unlock( &smokeMutex );
+}
+
+
+/*=========================================================================*\
+        Smoke test discovery callback: count connection to ourselves
+          and drained output queues
+\*=========================================================================*/
+static void smokeDiscoverCb( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t change, ickP2pServicetype_t type )
+{
+  if( change==ICKP2P_CONNECTED && uuid && !strcmp(uuid,ickP2pGetDeviceUuid(ictx)) )
+    smokeCount( &smokeConnected );
+  else if( change==ICKP2P_DRAINED )
+    smokeCount( &smokeDrained );
+}
+
+
+/*=========================================================================*\
+        Smoke test discovery callback of peer device: count connection to us
+\*=========================================================================*/
+static void smokePeerDiscoverCb( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t change, ickP2pServicetype_t type )
+{
+  if( change==ICKP2P_CONNECTED && uuid && !strcmp(uuid,smokePeerTarget) )
+    smokeCount( &smokePeerConnected );
+}
+
+
+/*=========================================================================*\
+        Smoke test message callback: count and check messages
+\*=========================================================================*/
+static void smokeMessageCb( ickP2pContext_t *ictx, const char *sourceUuid,
+                            ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                            const char* message, size_t mSize, ickP2pMessageFlag_t mFlags )
+{
+
+/*------------------------------------------------------------------------*\
+    Check integrity of very large payloads and strings
+\*------------------------------------------------------------------------*/
+  if( mSize==VLP_SIZE ) {
+    if( checkVlp(message,mSize) )
+      smokeCount( &smokeCorrupt );
+  }
+  else if( strncmp(message,"Smoke #",strlen("Smoke #")) )
+    return;
+  else if( (mFlags&ICKP2P_MESSAGEFLAG_STRING) && mSize!=strlen(message)+1 ) {
+    printf( "Smoke: corrupt message \"%.30s\" (%ld bytes, flags 0x%02x)\n",
+            message, (long)mSize, mFlags );
+    smokeCount( &smokeCorrupt );
+  }
+
+/*------------------------------------------------------------------------*\
+    Count
+\*------------------------------------------------------------------------*/
+  smokeCount( &smokeReceived );
+}
+
+
+/*=========================================================================*\
+        Increment a smoke test counter
+\*=========================================================================*/
+static void smokeCount( int *counter )
+{
+  pthread_mutex_lock( &smokeMutex );
+  (*counter)++;
+  pthread_cond_broadcast( &smokeCond );
+  pthread_mutex_unlock( &smokeMutex );
+}
+
+
+/*=========================================================================*\
+        Get a smoke test counter
+\*=========================================================================*/
+static int smokeGet( const int *counter )
+{
+  int value;
+
+  pthread_mutex_lock( &smokeMutex );
+  value = *counter;
+  pthread_mutex_unlock( &smokeMutex );
+
+  return value;
+}
+
+
+/*=========================================================================*\
+        Wait for a smoke test counter to reach a value
+          timeout is in millisecs
+          returns 0 on success and -1 on timeout
+\*=========================================================================*/
+static int smokeWait( const int *counter, int value, int timeout )
+{
+  struct timespec abstime;
+  int             rc = 0;
+
+  clock_gettime( CLOCK_REALTIME, &abstime );
+  abstime.tv_sec  += timeout/1000;
+  abstime.tv_nsec += (timeout%1000)*1000000L;
+  if( abstime.tv_nsec>=1000000000L ) {
+    abstime.tv_sec++;
+    abstime.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock( &smokeMutex );
+  while( *counter<value && rc!=ETIMEDOUT )
+    rc = pthread_cond_timedwait( &smokeCond, &smokeMutex, &abstime );
+  rc = *counter<value ? -1 : 0;
+  pthread_mutex_unlock( &smokeMutex );
+
+  return rc;
+}
+
+
 /*=========================================================================*\
                                     END OF FILE
 \*=========================================================================*/
@@ -133,6 +133,13 @@ void ickDiscoverCb( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t
       strcat( tstr, " debugging" );
   }
 
+  // Context wide events (global output queues drained) have no device
+  if( !uuid ) {
+    printf( "+++ %s: all devices -- %s\n", ickP2pGetDeviceUuid(ictx),
+             ickLibDeviceState2Str(change) );
+    return;
+  }
+
   // Print discovery event
   printf( "+++ %s: %s -- %s -- %s\n", ickP2pGetDeviceUuid(ictx),
            uuid, ickLibDeviceState2Str(change), tstr );
@@ -206,6 +213,44 @@ void ickMessageCb( ickP2pContext_t *ictx, const char *sourceUuid,
 }
 
 
+/*=========================================================================*\
+    Called for chunks of incoming messages exceeding the stream threshold
+\*=========================================================================*/
+void ickStreamCb( ickP2pContext_t *ictx, const char *sourceUuid,
+                  ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices,
+                  ickP2pMessageFlag_t mFlags, const char *chunk, size_t cSize,
+                  size_t offset, int mode )
+{
+  size_t i;
+
+/*------------------------------------------------------------------------*\
+    Print meta data at start of stream
+\*------------------------------------------------------------------------*/
+  if( mode&ICKP2P_STREAM_BEGIN )
+    printf( ">>> %s: stream from %s,0x%02x -> 0x%02x started (flags 0x%02x)\n",
+        ickP2pGetDeviceUuid(ictx), sourceUuid, sourceService, targetServices, mFlags );
+
+/*------------------------------------------------------------------------*\
+    Check integrity of VLP chunks
+\*------------------------------------------------------------------------*/
+  for( i=0; i<cSize&&offset+i<VLP_SIZE; i++ )
+    if( chunk[i] != (char)((offset+i)%VLP_MODUL) )
+      break;
+  if( i<cSize && offset+i<VLP_SIZE )
+    printf( "VLP stream is corrupt at position %ld\n", (long)(offset+i) );
+
+/*------------------------------------------------------------------------*\
+    Print size at end of stream
+\*------------------------------------------------------------------------*/
+  if( mode&ICKP2P_STREAM_END )
+    printf( ">>> %s: stream from %s complete (%ld bytes)\n",
+        ickP2pGetDeviceUuid(ictx), sourceUuid, (long)(offset+cSize) );
+  if( mode&ICKP2P_STREAM_ABORT )
+    printf( ">>> %s: stream from %s aborted (%ld bytes)\n",
+        ickP2pGetDeviceUuid(ictx), sourceUuid, (long)(offset+cSize) );
+}
+
+
 /*=========================================================================*\
                                     END OF FILE
 \*=========================================================================*/
@@ -70,6 +70,7 @@ int   checkVlp( const char *msg, size_t len );
 \*------------------------------------------------------------------------*/
 void ickDiscoverCb( ickP2pContext_t *ictx, const char *uuid, ickP2pDeviceState_t change, ickP2pServicetype_t type );
 void ickMessageCb( ickP2pContext_t *ictx, const char *sourceUuid, ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices, const char* message, size_t mSize, ickP2pMessageFlag_t mFlags );
+void ickStreamCb( ickP2pContext_t *ictx, const char *sourceUuid, ickP2pServicetype_t sourceService, ickP2pServicetype_t targetServices, ickP2pMessageFlag_t mFlags, const char *chunk, size_t cSize, size_t offset, int mode );
 
 
 #endif  /* __TESTMISC_H */